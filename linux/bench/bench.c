@@ -0,0 +1,451 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file    bench.c
+ *
+ * @brief   End-to-end benchmark of libcometa against the loopback mock server.
+ *
+ * The mock runs in the benchmark process and the device runs in a child process, started by
+ * executing the benchmark again with --device, so that the CPU time of the library is measured
+ * apart from the mock. The child is driven with commands on its standard input:
+ *
+ *    mark          start measuring the CPU time and clear the latency histograms
+ *    cpu           print the CPU time since the mark
+ *    lat WHICH     print the percentiles of the COMETA_LAT_* histogram WHICH
+ *    up N SIZE     send N upstream messages of SIZE bytes and print the elapsed and CPU time
+ *    quit
+ *
+ * The benchmark measures:
+ *
+ *  - subscribe latency, with a new device process for each subscription
+ *  - downstream request to reply round trip time, and device CPU time per message
+ *  - device decode, callback, reply write and turnaround time per message
+ *  - upstream messages/s and bytes/s received by the mock, and device CPU time per message
+ *
+ * The transport is TLS when built with TLS=1 (the library is built with -DUSE_SSL).
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "cometa.h"
+#include "mock.h"
+
+#define APP_NAME    "bench"
+#define APP_KEY     "bench-app-key"
+#define SECRET      "secret"
+#define DEVICE_KEY  "bench-device-key"
+#define CERT_NAME   "mock.cometa.io"
+
+/* auth modes */
+#define AUTH_NONE   0   /* one-way */
+#define AUTH_APP    1   /* two-way with the application server */
+#define AUTH_LOCAL  2   /* two-way with the challenge signed in the device */
+
+static const char *auth_names[] = { "none", "app", "local" };
+
+/* labels of the COMETA_LAT_* histograms */
+/* labels of the COMETA_PHASE_* subscription phases */
+static const char *phase_names[] = { "setup", "dns", "probe", "connect", "tls", "challenge", "auth", "status" };
+
+static const char *lat_names[] = { "device decode", "device callback", "device reply write", "device turnaround" };
+
+/*
+ * A device process.
+ */
+struct device {
+	pid_t pid;
+	FILE *in;       /* commands */
+	FILE *out;      /* results */
+};
+
+static uint64_t
+now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t
+cpu_ns(void) {
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ((uint64_t)ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+			((uint64_t)ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+static int
+cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static int
+cmp_ull(const void *a, const void *b) {
+	unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Print the percentiles of the @n samples in @v in microseconds.
+ *
+ */
+static void
+print_percentiles(const char *label, uint64_t *v, int n) {
+	if (n == 0) {
+		printf("%-28s no samples\n", label);
+		return;
+	}
+	qsort(v, n, sizeof(uint64_t), cmp_u64);
+	printf("%-28s p50 %9.1f  p90 %9.1f  p99 %9.1f  p99.9 %9.1f  max %9.1f us\n", label,
+			v[(int)(0.5 * (n - 1))] / 1e3, v[(int)(0.9 * (n - 1))] / 1e3, v[(int)(0.99 * (n - 1))] / 1e3,
+			v[(int)(0.999 * (n - 1))] / 1e3, v[n - 1] / 1e3);
+}
+
+/** Device process **/
+
+static char *
+device_cb(const int data_size, void *data) {
+	static char reply[] = "{\"status\":\"ok\"}";
+
+	return reply;
+}
+
+static int
+device_main(int argc, char *argv[]) {
+	struct cometa *conn;
+	struct cometa_hist hist;
+	struct cometa_subscribe_timing timing;
+	char line[128], *msg;
+	uint64_t t0, c0 = 0;
+	int auth, sub_only, n, size, i, errors;
+
+	/* --device <port> <app_port> <auth> <ca_file> <sub|run> */
+	if (argc < 7)
+		return -1;
+	auth = atoi(argv[4]);
+	sub_only = strcmp(argv[6], "sub") == 0;
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	cometa_set_server("127.0.0.1", argv[2], CERT_NAME, argv[5]);
+	if (cometa_init("bench-device", "linux", DEVICE_KEY) != COMEATAR_OK)
+		return -1;
+	if (auth == AUTH_LOCAL)
+		cometa_set_auth_key(SECRET, strlen(SECRET));
+
+	t0 = now_ns();
+	if (auth == AUTH_APP)
+		conn = cometa_subscribe(APP_NAME, APP_KEY, "127.0.0.1", argv[3], "auth");
+	else
+		conn = cometa_subscribe(APP_NAME, APP_KEY, NULL, NULL, NULL);
+	if (conn == NULL) {
+		printf("err\n");
+		return -1;
+	}
+	cometa_get_subscribe_timing(conn, &timing);
+	printf("sub %llu", (unsigned long long)(now_ns() - t0));
+	for (i = 0; i < COMETA_PHASE_NUM; i++)
+		printf(" %llu", (unsigned long long)timing.phase[i]);
+	printf("\n");
+	if (sub_only)
+		return 0;
+	cometa_bind_cb(conn, device_cb);
+
+	while (fgets(line, sizeof(line), stdin) != NULL) {
+		if (strncmp(line, "mark", 4) == 0) {
+			cometa_reset_latency(conn);
+			c0 = cpu_ns();
+			printf("ok\n");
+		} else if (sscanf(line, "lat %d", &n) == 1) {
+			if (cometa_get_latency(conn, n, &hist) != COMEATAR_OK) {
+				printf("err\n");
+				continue;
+			}
+			printf("lat %llu %llu %llu %llu %llu\n", (unsigned long long)cometa_hist_percentile(&hist, 50),
+					(unsigned long long)cometa_hist_percentile(&hist, 90), (unsigned long long)cometa_hist_percentile(&hist, 99),
+					(unsigned long long)cometa_hist_percentile(&hist, 99.9), (unsigned long long)hist.max);
+		} else if (strncmp(line, "cpu", 3) == 0) {
+			printf("cpu %llu\n", (unsigned long long)(cpu_ns() - c0));
+		} else if (sscanf(line, "up %d %d", &n, &size) == 2) {
+			if (size < 1 || size > MESSAGE_LEN - 12 || (msg = malloc(size)) == NULL) {
+				printf("err\n");
+				continue;
+			}
+			for (i = 0; i < size; i++)
+				msg[i] = 'a' + i % 26;
+			errors = 0;
+			c0 = cpu_ns();
+			t0 = now_ns();
+			for (i = 0; i < n; i++) {
+				if (cometa_send(conn, msg, size) != COMEATAR_OK)
+					errors++;
+			}
+			printf("up %llu %llu %d\n", (unsigned long long)(now_ns() - t0), (unsigned long long)(cpu_ns() - c0), errors);
+			free(msg);
+		} else if (strncmp(line, "quit", 4) == 0)
+			break;
+	}
+	return 0;
+}	/* device_main */
+
+/** Benchmark driver **/
+
+/*
+ * Start a device process.
+ *
+ */
+static int
+device_start(struct device *d, const char *self, struct mock *m, int auth, const char *ca_file, const char *mode, int verbose) {
+	char port[16], app_port[16], auth_str[4];
+	char *args[] = { (char *)self, "--device", port, app_port, auth_str, (char *)ca_file, (char *)mode, NULL };
+	int in[2], out[2], fd;
+
+	sprintf(port, "%d", mock_port(m));
+	sprintf(app_port, "%d", mock_app_port(m));
+	sprintf(auth_str, "%d", auth);
+	if (pipe2(in, O_CLOEXEC) < 0 || pipe2(out, O_CLOEXEC) < 0)
+		return -1;
+	if ((d->pid = fork()) < 0)
+		return -1;
+	if (d->pid == 0) {
+		dup2(in[0], 0);
+		dup2(out[1], 1);
+		close(in[0]);
+		close(in[1]);
+		close(out[0]);
+		close(out[1]);
+		if (!verbose && (fd = open("/dev/null", O_WRONLY)) >= 0)
+			dup2(fd, 2);
+		execv("/proc/self/exe", args);
+		_exit(127);
+	}
+	close(in[0]);
+	close(out[1]);
+	d->in = fdopen(in[1], "w");
+	d->out = fdopen(out[0], "r");
+	setvbuf(d->in, NULL, _IOLBF, 0);
+	return 0;
+}	/* device_start */
+
+static void
+device_stop(struct device *d) {
+	fprintf(d->in, "quit\n");
+	fclose(d->in);
+	fclose(d->out);
+	waitpid(d->pid, NULL, 0);
+}
+
+/*
+ * Read a result line from the device.
+ *
+ */
+static int
+device_read(struct device *d, char *line, int cap) {
+	if (fgets(line, cap, d->out) == NULL) {
+		fprintf(stderr, "ERROR: the device process exited.\n");
+		return -1;
+	}
+	return 0;
+}
+
+static void
+usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-n requests] [-u messages] [-s size] [-S subscribes] [-a none|app|local] [-v]\n"
+			"  -n requests    downstream requests (default 10000)\n"
+			"  -u messages    upstream messages (default 100000)\n"
+			"  -s size        message size in bytes (default 64)\n"
+			"  -S subscribes  subscriptions for the latency (default 20)\n"
+			"  -a auth        authentication: none (one-way), app (application server) or local key (default app)\n"
+			"  -v             show the library and mock output\n", name);
+	exit(-1);
+}
+
+int
+main(int argc, char *argv[]) {
+	struct mock_config cfg;
+	struct mock *m;
+	struct mock_stats st;
+	struct device dev;
+	char line[256], ca_file[64] = "", *msg, *reply, *p;
+	uint64_t *samples, t0, elapsed, cpu;
+	unsigned long long ull, lat[5], *phases[COMETA_PHASE_NUM];
+	unsigned long base;
+	int nreq = 10000, nup = 100000, size = 64, nsub = 20, auth = AUTH_APP, verbose = 0;
+	int opt, i, j, k, n, errors, fd;
+
+	if (argc > 1 && strcmp(argv[1], "--device") == 0)
+		return device_main(argc, argv);
+
+	while ((opt = getopt(argc, argv, "n:u:s:S:a:v")) != -1) {
+		switch (opt) {
+		case 'n': nreq = atoi(optarg); break;
+		case 'u': nup = atoi(optarg); break;
+		case 's': size = atoi(optarg); break;
+		case 'S': nsub = atoi(optarg); break;
+		case 'a':
+			for (auth = 0; auth < 3 && strcmp(optarg, auth_names[auth]) != 0; auth++)
+				;
+			if (auth == 3)
+				usage(argv[0]);
+			break;
+		case 'v': verbose = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (nreq < 1 || nup < 1 || size < 1 || size > MESSAGE_LEN - 12 || nsub < 1)
+		usage(argv[0]);
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.app_key = APP_KEY;
+	cfg.secret = SECRET;
+	cfg.verbose = verbose;
+#ifdef USE_SSL
+	strcpy(ca_file, "/tmp/cometa-bench-XXXXXX");
+	if ((fd = mkstemp(ca_file)) < 0) {
+		fprintf(stderr, "ERROR: cannot create the certificate file.\n");
+		exit(-1);
+	}
+	close(fd);
+	cfg.cert_file = ca_file;
+	cfg.cert_name = CERT_NAME;
+#else
+	(void)fd;
+	strcpy(ca_file, "/dev/null");
+#endif
+	if ((m = mock_start(&cfg)) == NULL)
+		exit(-1);
+
+	printf("cometa bench: %s, auth %s, %d bytes messages\n",
+			cfg.cert_file ? "TLS" : "plaintext", auth_names[auth], size);
+
+	/* subscribe latency */
+	samples = calloc(nreq > nsub ? nreq : nsub, sizeof(uint64_t));
+	for (j = 0; j < COMETA_PHASE_NUM; j++)
+		phases[j] = calloc(nsub, sizeof(unsigned long long));
+	for (i = 0, n = 0; i < nsub; i++) {
+		if (device_start(&dev, argv[0], m, auth, ca_file, "sub", verbose) < 0 || device_read(&dev, line, sizeof(line)) < 0)
+			exit(-1);
+		if (sscanf(line, "sub %llu%n", &ull, &k) == 1) {
+			/* phase durations */
+			for (j = 0, p = line + k; j < COMETA_PHASE_NUM && sscanf(p, " %llu%n", &phases[j][n], &k) == 1; j++)
+				p += k;
+			samples[n++] = ull;
+		}
+		device_stop(&dev);
+	}
+	print_percentiles("subscribe latency", samples, n);
+	if (n > 0) {
+		printf("%-28s", "subscribe phases p50");
+		for (j = 0; j < COMETA_PHASE_NUM; j++) {
+			qsort(phases[j], n, sizeof(phases[j][0]), cmp_ull);
+			printf(" %s %.1f", phase_names[j], phases[j][(n - 1) / 2] / 1e3);
+		}
+		printf(" us\n");
+	}
+	if (n < nsub)
+		printf("%-28s %d\n", "subscribe failures", nsub - n);
+
+	/* downstream round trip */
+	mock_get_stats(m, &st);
+	if (device_start(&dev, argv[0], m, auth, ca_file, "run", verbose) < 0 || device_read(&dev, line, sizeof(line)) < 0 ||
+			strncmp(line, "sub", 3) != 0 || mock_wait_subscribed(m, st.subscribes + 1, 5000) < 0) {
+		fprintf(stderr, "ERROR: the device did not subscribe.\n");
+		exit(-1);
+	}
+	msg = malloc(size);
+	reply = malloc(MESSAGE_LEN);
+	for (i = 0; i < size; i++)
+		msg[i] = 'A' + i % 26;
+	/* warm up */
+	for (i = 0; i < 100; i++)
+		mock_request(m, msg, size, reply, MESSAGE_LEN, 5000);
+
+	fprintf(dev.in, "mark\n");
+	device_read(&dev, line, sizeof(line));
+	for (i = 0, n = 0, errors = 0; i < nreq; i++) {
+		t0 = now_ns();
+		if (mock_request(m, msg, size, reply, MESSAGE_LEN, 5000) < 0)
+			errors++;
+		else
+			samples[n++] = now_ns() - t0;
+	}
+	fprintf(dev.in, "cpu\n");
+	if (device_read(&dev, line, sizeof(line)) < 0 || sscanf(line, "cpu %llu", &ull) != 1)
+		ull = 0;
+	cpu = ull;
+	print_percentiles("downstream round trip", samples, n);
+	printf("%-28s %.2f us/msg\n", "downstream device cpu", n ? cpu / 1e3 / n : 0);
+	for (i = 0; i < COMETA_LAT_NUM; i++) {
+		fprintf(dev.in, "lat %d\n", i);
+		if (device_read(&dev, line, sizeof(line)) == 0 &&
+				sscanf(line, "lat %llu %llu %llu %llu %llu", &lat[0], &lat[1], &lat[2], &lat[3], &lat[4]) == 5)
+			printf("%-28s p50 %9.1f  p90 %9.1f  p99 %9.1f  p99.9 %9.1f  max %9.1f us\n", lat_names[i],
+					lat[0] / 1e3, lat[1] / 1e3, lat[2] / 1e3, lat[3] / 1e3, lat[4] / 1e3);
+	}
+	if (errors)
+		printf("%-28s %d\n", "downstream failures", errors);
+
+	/* upstream throughput */
+	mock_get_stats(m, &st);
+	base = st.upstream;
+	t0 = now_ns();
+	fprintf(dev.in, "up %d %d\n", nup, size);
+	if (mock_wait_upstream(m, base + nup, 60000) < 0)
+		fprintf(stderr, "ERROR: upstream messages lost.\n");
+	elapsed = now_ns() - t0;
+	if (device_read(&dev, line, sizeof(line)) < 0 || sscanf(line, "up %*u %llu %d", &ull, &errors) != 2) {
+		ull = 0;
+		errors = 0;
+	}
+	cpu = ull;
+	mock_get_stats(m, &st);
+	printf("%-28s %.0f msg/s  %.2f MB/s\n", "upstream throughput",
+			(st.upstream - base) / (elapsed / 1e9), (st.upstream - base) * (double)size / (elapsed / 1e9) / 1e6);
+	printf("%-28s %.2f us/msg\n", "upstream device cpu", cpu / 1e3 / nup);
+	if (errors || st.upstream - base < (unsigned long)nup)
+		printf("%-28s %d send errors, %lu received\n", "upstream failures", errors, st.upstream - base);
+
+	device_stop(&dev);
+	mock_stop(m);
+	free(samples);
+	free(msg);
+	free(reply);
+	if (cfg.cert_file)
+		unlink(ca_file);
+	return 0;
+}
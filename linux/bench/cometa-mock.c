@@ -0,0 +1,103 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file    cometa-mock.c
+ *
+ * @brief   Standalone loopback Cometa server for testing devices.
+ *
+ * Each line read from the standard input is sent as a message to the last device subscribed
+ * and the reply is printed. A device is pointed to the mock with cometa_set_server().
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "mock.h"
+
+static void
+usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-p port] [-a app_port] [-k app_key] [-s secret] [-d] [-b heartbeat] [-c cert_file] [-n cert_name] [-v]\n"
+			"  -p port       Cometa server port (default 8080)\n"
+			"  -a app_port   application server port (default 8081, -1 for none)\n"
+			"  -k app_key    application key checked at subscription\n"
+			"  -s secret     application secret (default \"secret\")\n"
+			"  -d            sign with per-device keys\n"
+			"  -b heartbeat  heartbeat period in seconds (default 60)\n"
+			"  -c cert_file  use TLS and write the self-signed certificate in cert_file\n"
+			"  -n cert_name  name in the certificate (default service.cometa.io)\n"
+			"  -v            verbose\n", name);
+	exit(-1);
+}
+
+int
+main(int argc, char *argv[]) {
+	struct mock_config cfg;
+	struct mock_stats st;
+	struct mock *m;
+	char line[4096], reply[4096];
+	int opt, n;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.port = 8080;
+	cfg.app_port = 8081;
+	while ((opt = getopt(argc, argv, "p:a:k:s:db:c:n:v")) != -1) {
+		switch (opt) {
+		case 'p': cfg.port = atoi(optarg); break;
+		case 'a': cfg.app_port = atoi(optarg); break;
+		case 'k': cfg.app_key = optarg; break;
+		case 's': cfg.secret = optarg; break;
+		case 'd': cfg.per_device = 1; break;
+		case 'b': cfg.heartbeat = atoi(optarg); break;
+		case 'c': cfg.cert_file = optarg; break;
+		case 'n': cfg.cert_name = optarg; break;
+		case 'v': cfg.verbose = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	signal(SIGPIPE, SIG_IGN);
+	if ((m = mock_start(&cfg)) == NULL)
+		exit(-1);
+	fprintf(stderr, "Cometa mock on 127.0.0.1:%d%s", mock_port(m), cfg.cert_file ? " (TLS)" : "");
+	if (cfg.app_port >= 0)
+		fprintf(stderr, ", application server on 127.0.0.1:%d", mock_app_port(m));
+	fprintf(stderr, "\n");
+
+	while (fgets(line, sizeof(line), stdin) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if ((n = mock_request(m, line, strlen(line), reply, sizeof(reply), 5000)) < 0)
+			printf("no device or no reply\n");
+		else
+			printf("reply (%d): %s\n", n, reply);
+		fflush(stdout);
+	}
+	/* no input, serve until killed */
+	while (1) {
+		sleep(10);
+		mock_get_stats(m, &st);
+		fprintf(stderr, "subscribes %lu (failed %lu), heartbeats %lu, upstream %lu (%lu bytes), replies %lu, app requests %lu\n",
+				st.subscribes, st.auth_failures, st.heartbeats, st.upstream, st.upstream_bytes, st.replies, st.app_requests);
+	}
+	mock_stop(m);
+	return 0;
+}
@@ -0,0 +1,742 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file    fault.c
+ *
+ * @brief   Fault injection harness for the reconnection of libcometa.
+ *
+ * A device process (the harness executed again with --device) connects to the mock server through
+ * a proxy that injects the faults, while sending sequence-numbered upstream messages at a steady
+ * rate. The faults are:
+ *
+ *    rst        connection reset in both directions
+ *    blackhole  the traffic stops for the fault duration, in both directions and for new connections
+ *    partial    the next downstream chunk is cut in half and the connection is reset
+ *    slow       the upstream traffic is read at about 1 KB/s for the fault duration
+ *    dns        connection reset while the server name does not resolve for the fault duration
+ *    stall      connection reset while the new connections, and the TLS handshakes, stall for the
+ *               fault duration; the stalled connections never complete
+ *    syn        connection reset while the SYNs of the new connections are dropped for the fault
+ *               duration, with the accept queue of the proxy kept full
+ *
+ * For each trial the harness measures the time to detect (the first reconnection attempt seen by
+ * the proxy), the time to recover (the first downstream request answered by the device) and the
+ * upstream messages lost (accepted by cometa_send() and never received by the mock).
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "cometa.h"
+#include "mock.h"
+
+#define APP_NAME    "fault"
+#define APP_KEY     "fault-app-key"
+#define SECRET      "secret"
+#define CERT_NAME   "mock.cometa.io"
+#define BAD_NAME    "fault.invalid"
+
+/* proxy modes */
+#define MODE_NONE       0
+#define MODE_BLACKHOLE  1
+#define MODE_SLOW       2
+#define MODE_STALL      3
+#define MODE_SYN        4
+
+/* connections filling the accept queue of the proxy */
+#define MAX_FILLERS     64
+
+/* faults */
+enum { FAULT_RST, FAULT_BLACKHOLE, FAULT_PARTIAL, FAULT_SLOW, FAULT_DNS, FAULT_STALL, FAULT_SYN, NFAULTS };
+static const char *fault_names[] = { "rst", "blackhole", "partial", "slow", "dns", "stall", "syn" };
+
+/*
+ * A proxied connection.
+ */
+struct pconn {
+	struct proxy *p;
+	int dfd;                /* device side */
+	int sfd;                /* server side */
+	int held;               /* stalled connection, never forwarded */
+	int dead;
+	pthread_t up;
+	pthread_t down;
+	struct pconn *next;
+};
+
+struct proxy {
+	int fd;
+	int port;
+	int target;             /* mock port */
+	int mode;
+	int partial;            /* cut the next downstream read */
+	unsigned long accepts;
+	uint64_t last_accept;   /* time of the last connection */
+	int fillers[MAX_FILLERS];
+	int nfillers;
+	pthread_t tid;
+	pthread_mutex_t lock;
+	struct pconn *conns;
+};
+
+static uint64_t
+now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+sleep_ms(int ms) {
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+/** Proxy **/
+
+/*
+ * Reset a TCP connection: connect() with AF_UNSPEC aborts the connection with a RST.
+ */
+static void
+reset_fd(int fd) {
+	struct sockaddr sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_family = AF_UNSPEC;
+	connect(fd, &sa, sizeof(sa));
+	shutdown(fd, SHUT_RDWR);
+}
+
+static int
+write_all(int fd, const char *buf, int len) {
+	int n;
+
+	while (len > 0) {
+		if ((n = write(fd, buf, len)) <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Forward the traffic in one direction, applying the faults.
+ */
+static void
+forward(struct pconn *c, int from, int to, int upstream) {
+	struct proxy *p = c->p;
+	char buf[16384];
+	int n, mode, cut;
+
+	while (!c->dead) {
+		mode = p->mode;
+		if (c->held || mode == MODE_BLACKHOLE) {
+			/* leave the data in the socket buffers */
+			sleep_ms(10);
+			continue;
+		}
+		if (upstream && mode == MODE_SLOW) {
+			if ((n = read(from, buf, 64)) <= 0)
+				break;
+			sleep_ms(50);
+		} else if ((n = read(from, buf, sizeof(buf))) <= 0)
+			break;
+
+		cut = 0;
+		if (!upstream) {
+			pthread_mutex_lock(&p->lock);
+			if (p->partial) {
+				p->partial = 0;
+				cut = 1;
+			}
+			pthread_mutex_unlock(&p->lock);
+		}
+		if (cut) {
+			write_all(to, buf, n > 1 ? n / 2 : 1);
+			break;
+		}
+		if (write_all(to, buf, n) < 0)
+			break;
+	}
+	/* terminate both directions */
+	c->dead = 1;
+	reset_fd(c->dfd);
+	if (c->sfd >= 0)
+		reset_fd(c->sfd);
+}
+
+static void *
+up_thread(void *arg) {
+	struct pconn *c = (struct pconn *)arg;
+
+	forward(c, c->dfd, c->sfd, 1);
+	return NULL;
+}
+
+static void *
+down_thread(void *arg) {
+	struct pconn *c = (struct pconn *)arg;
+
+	forward(c, c->sfd, c->dfd, 0);
+	return NULL;
+}
+
+static void *
+proxy_accept(void *arg) {
+	struct proxy *p = (struct proxy *)arg;
+	struct sockaddr_in addr;
+	struct pconn *c;
+	struct pollfd pfd;
+	int fd, one = 1;
+
+	pfd.fd = p->fd;
+	pfd.events = POLLIN;
+	while (1) {
+		/* the queue is left full to drop the SYNs */
+		if (p->mode == MODE_SYN) {
+			sleep_ms(10);
+			continue;
+		}
+		if (poll(&pfd, 1, 10) <= 0)
+			continue;
+		if ((fd = accept4(p->fd, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		c = calloc(1, sizeof(struct pconn));
+		c->p = p;
+		c->dfd = fd;
+		c->sfd = -1;
+		pthread_mutex_lock(&p->lock);
+		p->accepts++;
+		p->last_accept = now_ns();
+		c->held = (p->mode == MODE_STALL || p->mode == MODE_BLACKHOLE);
+		pthread_mutex_unlock(&p->lock);
+		if (!c->held) {
+			memset(&addr, 0, sizeof(addr));
+			addr.sin_family = AF_INET;
+			addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			addr.sin_port = htons(p->target);
+			if ((c->sfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+					connect(c->sfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+				reset_fd(fd);
+				c->dead = 1;
+			} else
+				setsockopt(c->sfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		}
+		if (!c->dead) {
+			pthread_create(&c->up, NULL, up_thread, c);
+			pthread_create(&c->down, NULL, down_thread, c);
+		}
+		pthread_mutex_lock(&p->lock);
+		c->next = p->conns;
+		p->conns = c;
+		pthread_mutex_unlock(&p->lock);
+	}
+	return NULL;
+}
+
+static int
+proxy_start(struct proxy *p, int target) {
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int one = 1;
+
+	memset(p, 0, sizeof(*p));
+	p->target = target;
+	pthread_mutex_init(&p->lock, NULL);
+	if ((p->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	setsockopt(p->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(p->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(p->fd, 16) < 0 ||
+			getsockname(p->fd, (struct sockaddr *)&addr, &len) < 0)
+		return -1;
+	p->port = ntohs(addr.sin_port);
+	return pthread_create(&p->tid, NULL, proxy_accept, p);
+}
+
+/*
+ * Fill the accept queue of the proxy with connections never accepted: the kernel then drops
+ * the SYNs of the new connections, as a server behind a firewall dropping them.
+ */
+static void
+syn_fill(struct proxy *p) {
+	struct sockaddr_in addr;
+	struct pollfd pfd;
+	int fd;
+
+	/* the accept thread sees the mode */
+	sleep_ms(20);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(p->port);
+	while (p->nfillers < MAX_FILLERS) {
+		if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+			break;
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 &&
+				(errno != EINPROGRESS || poll(&pfd, 1, 100) <= 0)) {
+			/* SYN dropped, the queue is full */
+			close(fd);
+			break;
+		}
+		p->fillers[p->nfillers++] = fd;
+	}
+}
+
+/*
+ * Release the connections filling the accept queue, before the accept thread resumes.
+ */
+static void
+syn_release(struct proxy *p) {
+	struct pollfd pfd;
+	int fd;
+
+	pfd.fd = p->fd;
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, 0) > 0 && (fd = accept4(p->fd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+		close(fd);
+	while (p->nfillers > 0)
+		close(p->fillers[--p->nfillers]);
+}
+
+/*
+ * Reset the connections, all of them or only the stalled ones, and release the terminated ones.
+ */
+static void
+proxy_reset(struct proxy *p, int held_only) {
+	struct pconn *c, **pc;
+
+	pthread_mutex_lock(&p->lock);
+	for (c = p->conns; c; c = c->next) {
+		if (!c->dead && (!held_only || c->held)) {
+			c->dead = 1;
+			reset_fd(c->dfd);
+			if (c->sfd >= 0)
+				reset_fd(c->sfd);
+		}
+	}
+	/* release the terminated connections */
+	for (pc = &p->conns; (c = *pc) != NULL; ) {
+		if (c->dead && c->up) {
+			*pc = c->next;
+			pthread_mutex_unlock(&p->lock);
+			pthread_join(c->up, NULL);
+			pthread_join(c->down, NULL);
+			close(c->dfd);
+			if (c->sfd >= 0)
+				close(c->sfd);
+			free(c);
+			pthread_mutex_lock(&p->lock);
+			pc = &p->conns;
+		} else
+			pc = &c->next;
+	}
+	pthread_mutex_unlock(&p->lock);
+}
+
+/** Device process **/
+
+static struct cometa *dev_conn;
+static int dev_rate;
+static unsigned long dev_ok, dev_fail;
+static pthread_mutex_t dev_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *
+device_cb(const int data_size, void *data) {
+	static char reply[] = "pong";
+
+	return reply;
+}
+
+/*
+ * Send the sequence-numbered upstream messages.
+ */
+static void *
+device_sender(void *arg) {
+	char msg[64];
+	unsigned long seq = 0;
+	int n;
+
+	while (1) {
+		n = sprintf(msg, "{\"seq\":%lu}", seq++);
+		if (cometa_send(dev_conn, msg, n) == COMEATAR_OK) {
+			pthread_mutex_lock(&dev_lock);
+			dev_ok++;
+			pthread_mutex_unlock(&dev_lock);
+		} else {
+			pthread_mutex_lock(&dev_lock);
+			dev_fail++;
+			pthread_mutex_unlock(&dev_lock);
+		}
+		sleep_ms(1000 / dev_rate);
+	}
+	return NULL;
+}
+
+static int
+device_main(int argc, char *argv[]) {
+	pthread_t tid;
+	char line[128];
+
+	/* --device <port> <ca_file> <rate> */
+	if (argc < 5)
+		return -1;
+	dev_rate = atoi(argv[4]) > 0 ? atoi(argv[4]) : 100;
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	cometa_set_server("127.0.0.1", argv[2], CERT_NAME, argv[3]);
+	if (cometa_init("fault-device", "linux", "fault-device-key") != COMEATAR_OK ||
+			(dev_conn = cometa_subscribe(APP_NAME, APP_KEY, NULL, NULL, NULL)) == NULL) {
+		printf("err\n");
+		return -1;
+	}
+	cometa_bind_cb(dev_conn, device_cb);
+	pthread_create(&tid, NULL, device_sender, NULL);
+	printf("ok\n");
+
+	while (fgets(line, sizeof(line), stdin) != NULL) {
+		if (strncmp(line, "reset", 5) == 0) {
+			pthread_mutex_lock(&dev_lock);
+			dev_ok = dev_fail = 0;
+			pthread_mutex_unlock(&dev_lock);
+			printf("ok\n");
+		} else if (strncmp(line, "count", 5) == 0) {
+			pthread_mutex_lock(&dev_lock);
+			printf("count %lu %lu\n", dev_ok, dev_fail);
+			pthread_mutex_unlock(&dev_lock);
+		} else if (strncmp(line, "dns bad", 7) == 0) {
+			cometa_set_server(BAD_NAME, NULL, NULL, NULL);
+			printf("ok\n");
+		} else if (strncmp(line, "dns ok", 6) == 0) {
+			cometa_set_server("127.0.0.1", NULL, NULL, NULL);
+			printf("ok\n");
+		} else if (strncmp(line, "quit", 4) == 0)
+			break;
+	}
+	return 0;
+}
+
+/** Harness **/
+
+struct device {
+	pid_t pid;
+	FILE *in;
+	FILE *out;
+};
+
+static int
+device_cmd(struct device *d, const char *cmd, char *line, int cap) {
+	fprintf(d->in, "%s\n", cmd);
+	return fgets(line, cap, d->out) ? 0 : -1;
+}
+
+static int
+device_start(struct device *d, const char *self, int port, const char *ca_file, int rate, int verbose) {
+	char port_str[16], rate_str[16], line[64];
+	char *args[] = { (char *)self, "--device", port_str, (char *)ca_file, rate_str, NULL };
+	int in[2], out[2], fd;
+
+	sprintf(port_str, "%d", port);
+	sprintf(rate_str, "%d", rate);
+	if (pipe2(in, O_CLOEXEC) < 0 || pipe2(out, O_CLOEXEC) < 0 || (d->pid = fork()) < 0)
+		return -1;
+	if (d->pid == 0) {
+		dup2(in[0], 0);
+		dup2(out[1], 1);
+		if (!verbose && (fd = open("/dev/null", O_WRONLY)) >= 0)
+			dup2(fd, 2);
+		execv("/proc/self/exe", args);
+		_exit(127);
+	}
+	close(in[0]);
+	close(out[1]);
+	d->in = fdopen(in[1], "w");
+	d->out = fdopen(out[0], "r");
+	setvbuf(d->in, NULL, _IOLBF, 0);
+	return (fgets(line, sizeof(line), d->out) && strncmp(line, "ok", 2) == 0) ? 0 : -1;
+}
+
+/*
+ * Results of the trials of a fault.
+ */
+struct result {
+	uint64_t detect[64];
+	int ndetect;
+	uint64_t recover[64];
+	int nrecover;
+	int timeouts;
+	long lost;
+	long failed;
+};
+
+static int
+cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+print_dist(uint64_t *v, int n) {
+	if (n == 0) {
+		printf("  %8s %8s %8s", "-", "-", "-");
+		return;
+	}
+	qsort(v, n, sizeof(uint64_t), cmp_u64);
+	printf("  %8.0f %8.0f %8.0f", v[(n - 1) / 2] / 1e6, v[(int)(0.9 * (n - 1))] / 1e6, v[n - 1] / 1e6);
+}
+
+/*
+ * Run a trial of the @fault and add the measures to @r.
+ */
+static void
+run_trial(struct mock *m, struct proxy *p, struct device *d, int fault, int duration, int timeout, struct result *r) {
+	struct mock_stats st;
+	char line[128], reply[64];
+	unsigned long base_up, base_acc, ok, fail;
+	uint64_t t0, now, detect = 0, recover = 0;
+	int active = 1;
+
+	/* steady state */
+	while (mock_request(m, "ping", 4, reply, sizeof(reply), 500) < 0)
+		sleep_ms(100);
+	device_cmd(d, "reset", line, sizeof(line));
+	mock_get_stats(m, &st);
+	base_up = st.upstream;
+	pthread_mutex_lock(&p->lock);
+	base_acc = p->accepts;
+	pthread_mutex_unlock(&p->lock);
+
+	t0 = now_ns();
+	switch (fault) {
+	case FAULT_RST:
+		proxy_reset(p, 0);
+		active = 0;
+		break;
+	case FAULT_BLACKHOLE:
+		p->mode = MODE_BLACKHOLE;
+		break;
+	case FAULT_PARTIAL:
+		p->partial = 1;
+		mock_request(m, "partial chunk", 13, reply, sizeof(reply), 100);
+		active = 0;
+		break;
+	case FAULT_SLOW:
+		p->mode = MODE_SLOW;
+		break;
+	case FAULT_DNS:
+		device_cmd(d, "dns bad", line, sizeof(line));
+		proxy_reset(p, 0);
+		break;
+	case FAULT_STALL:
+		p->mode = MODE_STALL;
+		proxy_reset(p, 0);
+		break;
+	case FAULT_SYN:
+		p->mode = MODE_SYN;
+		syn_fill(p);
+		proxy_reset(p, 0);
+		break;
+	}
+
+	while ((now = now_ns()) - t0 < (uint64_t)timeout * 1000000ULL) {
+		if (active && now - t0 >= (uint64_t)duration * 1000000ULL) {
+			/* end of the fault */
+			if (fault == FAULT_DNS)
+				device_cmd(d, "dns ok", line, sizeof(line));
+			if (fault == FAULT_SYN)
+				syn_release(p);
+			p->mode = MODE_NONE;
+			active = 0;
+		}
+		pthread_mutex_lock(&p->lock);
+		if (detect == 0 && p->accepts > base_acc)
+			detect = p->last_accept - t0;
+		pthread_mutex_unlock(&p->lock);
+		if (!active && mock_request(m, "ping", 4, reply, sizeof(reply), 200) >= 0) {
+			recover = now_ns() - t0;
+			break;
+		}
+		sleep_ms(20);
+	}
+	if (active) {
+		if (fault == FAULT_DNS)
+			device_cmd(d, "dns ok", line, sizeof(line));
+		if (fault == FAULT_SYN)
+			syn_release(p);
+		p->mode = MODE_NONE;
+	}
+
+	if (detect)
+		r->detect[r->ndetect++] = detect;
+	if (recover)
+		r->recover[r->nrecover++] = recover;
+	else
+		r->timeouts++;
+
+	/* wait for the messages in flight */
+	sleep_ms(1000);
+	if (device_cmd(d, "count", line, sizeof(line)) == 0 && sscanf(line, "count %lu %lu", &ok, &fail) == 2) {
+		mock_get_stats(m, &st);
+		if (ok > st.upstream - base_up)
+			r->lost += ok - (st.upstream - base_up);
+		r->failed += fail;
+	}
+	/* release the stalled connections */
+	proxy_reset(p, 1);
+}
+
+static void
+usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-t trials] [-d duration] [-b heartbeat] [-r rate] [-T timeout] [-v] [fault ...]\n"
+			"  -t trials     trials for each fault (default 5)\n"
+			"  -d duration   fault duration in ms (default 3000)\n"
+			"  -b heartbeat  heartbeat period in seconds sent by the server (default 5)\n"
+			"  -r rate       upstream messages per second (default 100)\n"
+			"  -T timeout    recovery timeout in ms (default 60000)\n"
+			"  -v            show the library and mock output\n"
+			"  fault         rst, blackhole, partial, slow, dns, stall, syn (default all)\n", name);
+	exit(-1);
+}
+
+int
+main(int argc, char *argv[]) {
+	struct mock_config cfg;
+	struct mock *m;
+	struct proxy p;
+	struct device dev;
+	struct result r;
+	char ca_file[64] = "/dev/null";
+	int faults[NFAULTS], nfaults = 0;
+	int trials = 5, duration = 3000, rate = 100, timeout = 60000, verbose = 0;
+	int opt, i, f, fd;
+
+	if (argc > 1 && strcmp(argv[1], "--device") == 0)
+		return device_main(argc, argv);
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.heartbeat = 5;
+	cfg.app_port = -1;
+	while ((opt = getopt(argc, argv, "t:d:b:r:T:v")) != -1) {
+		switch (opt) {
+		case 't': trials = atoi(optarg); break;
+		case 'd': duration = atoi(optarg); break;
+		case 'b': cfg.heartbeat = atoi(optarg); break;
+		case 'r': rate = atoi(optarg); break;
+		case 'T': timeout = atoi(optarg); break;
+		case 'v': verbose = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (trials < 1 || trials > 64 || duration < 0 || rate < 1 || rate > 1000)
+		usage(argv[0]);
+	for (i = optind; i < argc; i++) {
+		for (f = 0; f < NFAULTS && strcmp(argv[i], fault_names[f]) != 0; f++)
+			;
+		if (f == NFAULTS || nfaults == NFAULTS)
+			usage(argv[0]);
+		faults[nfaults++] = f;
+	}
+	if (nfaults == 0) {
+		for (f = 0; f < NFAULTS; f++)
+			faults[nfaults++] = f;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	cfg.app_key = APP_KEY;
+	cfg.verbose = verbose;
+#ifdef USE_SSL
+	strcpy(ca_file, "/tmp/cometa-fault-XXXXXX");
+	if ((fd = mkstemp(ca_file)) < 0)
+		exit(-1);
+	close(fd);
+	cfg.cert_file = ca_file;
+	cfg.cert_name = CERT_NAME;
+#else
+	(void)fd;
+#endif
+	if ((m = mock_start(&cfg)) == NULL || proxy_start(&p, mock_port(m)) != 0) {
+		fprintf(stderr, "ERROR: cannot start the mock server.\n");
+		exit(-1);
+	}
+	if (device_start(&dev, argv[0], p.port, ca_file, rate, verbose) < 0) {
+		fprintf(stderr, "ERROR: the device did not subscribe.\n");
+		exit(-1);
+	}
+
+	printf("cometa fault injection: %s, heartbeat %d s, fault duration %d ms, %d msg/s upstream, %d trials\n",
+			cfg.cert_file ? "TLS" : "plaintext", cfg.heartbeat, duration, rate, trials);
+	printf("%-10s  %26s  %26s  %8s  %8s  %8s\n", "", "detect (ms)", "recover (ms)", "", "lost", "failed");
+	printf("%-10s  %8s %8s %8s  %8s %8s %8s  %8s  %8s  %8s\n", "fault", "p50", "p90", "max", "p50", "p90", "max", "timeouts", "/trial", "/trial");
+	for (i = 0; i < nfaults; i++) {
+		memset(&r, 0, sizeof(r));
+		for (f = 0; f < trials; f++)
+			run_trial(m, &p, &dev, faults[i], duration, timeout, &r);
+		printf("%-10s", fault_names[faults[i]]);
+		print_dist(r.detect, r.ndetect);
+		print_dist(r.recover, r.nrecover);
+		printf("  %8d  %8.1f  %8.1f\n", r.timeouts, (double)r.lost / trials, (double)r.failed / trials);
+		fflush(stdout);
+	}
+
+	fprintf(dev.in, "quit\n");
+	fclose(dev.in);
+	fclose(dev.out);
+	kill(dev.pid, SIGTERM);
+	waitpid(dev.pid, NULL, 0);
+	proxy_reset(&p, 0);
+	mock_stop(m);
+	if (cfg.cert_file)
+		unlink(ca_file);
+	return 0;
+}
@@ -0,0 +1,844 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file    mock.c
+ *
+ * @brief   Loopback mock of the Cometa server and of an application server.
+ *
+ * The mock speaks the device side of the Cometa protocol:
+ *
+ *  - GET /subscribe with Cometa-Authentication YES or NO, answered with an endless chunked response
+ *  - with two-way authentication a challenge chunk, the signature chunk from the device and its check
+ *  - the status chunk {"status":"200","heartbeat":"60","epoch":"..."} or {"status":"403"}
+ *  - downstream messages as chunks, each one answered by a reply chunk from the device
+ *  - heartbeat (0x06) and upstream (0x07) chunks from the device
+ *
+ * The application server answers GET /<endpoint>?device_id=&device_key=&app_key=&challenge= on
+ * keep-alive connections with {"response":200,"signature":"<app_key>:<HMAC SHA256(challenge, secret)>"}.
+ *
+ * Every connection has a thread. With TLS the Cometa server uses a self-signed certificate that is
+ * written to a file for the devices to trust.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/x509v3.h>
+
+#include "mock.h"
+
+/* buffer for a chunk from a device */
+#define MOCK_MSG_LEN    65536
+/* read buffer of a connection */
+#define MOCK_READ_LEN   16384
+
+/* response headers of the subscribe request */
+#define STREAM_HEADERS  "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nTransfer-Encoding: chunked\r\n\r\n"
+
+#define MSG_HEARTBEAT   0x06
+#define MSG_UPSTREAM    0x07
+
+#define mock_log(m, ...) \
+            do { if ((m)->cfg.verbose) fprintf(stderr, ##__VA_ARGS__); } while (0)
+
+/*
+ * A connection from a device or to the application server.
+ */
+struct mock_conn {
+	struct mock *m;
+	int fd;
+	SSL *ssl;
+	pthread_t tid;
+	pthread_mutex_t lock;			/* serializes the writes, and the SSL object */
+	pthread_cond_t cond;			/* signaled when a reply is received */
+	char rbuf[MOCK_READ_LEN];
+	int rpos;
+	int rlen;
+	char device_id[64];
+	char data[MOCK_MSG_LEN];		/* last chunk received */
+	char reply[MOCK_MSG_LEN];		/* last reply received */
+	int reply_len;
+	int replied;					/* reply received flag */
+	int closed;
+	struct mock_conn *next;
+};
+
+struct mock {
+	struct mock_config cfg;
+	int fd;							/* Cometa server socket */
+	int app_fd;						/* application server socket */
+	int port;
+	int app_port;
+	SSL_CTX *ctx;
+	pthread_t tid;
+	pthread_t app_tid;
+	pthread_mutex_t lock;			/* protects the connections list and the counters */
+	pthread_cond_t cond;			/* signaled when the counters change */
+	struct mock_conn *conns;
+	struct mock_conn *dev;			/* last device subscribed */
+	struct mock_stats stats;
+	int stop;
+};
+
+/** Connection I/O **/
+
+/*
+ * Read from the connection in the read buffer.
+ *
+ * @result the bytes read or -1
+ *
+ */
+static int
+conn_fill(struct mock_conn *c) {
+	struct pollfd pfd;
+	int n, err;
+
+	if (c->rpos == c->rlen)
+		c->rpos = c->rlen = 0;
+	if (c->rlen == sizeof(c->rbuf)) {
+		/* compact */
+		memmove(c->rbuf, c->rbuf + c->rpos, c->rlen - c->rpos);
+		c->rlen -= c->rpos;
+		c->rpos = 0;
+	}
+	if (c->ssl == NULL) {
+		do
+			n = read(c->fd, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen);
+		while (n < 0 && errno == EINTR);
+		if (n <= 0)
+			return -1;
+		c->rlen += n;
+		return n;
+	}
+	/* the socket is non-blocking and the lock is not held while waiting */
+	while (1) {
+		pthread_mutex_lock(&c->lock);
+		n = SSL_read(c->ssl, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen);
+		err = (n > 0) ? SSL_ERROR_NONE : SSL_get_error(c->ssl, n);
+		pthread_mutex_unlock(&c->lock);
+		if (n > 0) {
+			c->rlen += n;
+			return n;
+		}
+		if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+			return -1;
+		pfd.fd = c->fd;
+		pfd.events = (err == SSL_ERROR_WANT_READ) ? POLLIN : POLLOUT;
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			return -1;
+	}
+}	/* conn_fill */
+
+/*
+ * Write @buf of @len bytes in the connection. Called with the lock held.
+ *
+ * @result 0 or -1
+ *
+ */
+static int
+conn_write(struct mock_conn *c, const char *buf, int len) {
+	struct pollfd pfd;
+	int n, err;
+
+	while (len > 0) {
+		if (c->ssl == NULL) {
+			n = write(c->fd, buf, len);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return -1;
+		} else {
+			n = SSL_write(c->ssl, buf, len);
+			if (n <= 0) {
+				err = SSL_get_error(c->ssl, n);
+				if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+					return -1;
+				pfd.fd = c->fd;
+				pfd.events = (err == SSL_ERROR_WANT_READ) ? POLLIN : POLLOUT;
+				pthread_mutex_unlock(&c->lock);
+				poll(&pfd, 1, -1);
+				pthread_mutex_lock(&c->lock);
+				continue;
+			}
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}	/* conn_write */
+
+/*
+ * Write a chunk with @buf of @len bytes.
+ *
+ */
+static int
+conn_write_chunk(struct mock_conn *c, const char *buf, int len) {
+	char hdr[16];
+	int ret;
+
+	sprintf(hdr, "%x\r\n", len);
+	pthread_mutex_lock(&c->lock);
+	ret = (conn_write(c, hdr, strlen(hdr)) == 0 && conn_write(c, buf, len) == 0 && conn_write(c, "\r\n", 2) == 0) ? 0 : -1;
+	pthread_mutex_unlock(&c->lock);
+	return ret;
+}	/* conn_write_chunk */
+
+/*
+ * Read a line, without the line terminator, in @line of @cap bytes.
+ *
+ * @result the line length or -1
+ *
+ */
+static int
+conn_read_line(struct mock_conn *c, char *line, int cap) {
+	char *nl;
+	int n;
+
+	while ((nl = memchr(c->rbuf + c->rpos, '\n', c->rlen - c->rpos)) == NULL) {
+		if (c->rlen - c->rpos >= cap || conn_fill(c) < 0)
+			return -1;
+	}
+	n = nl - (c->rbuf + c->rpos);
+	if (n >= cap)
+		return -1;
+	memcpy(line, c->rbuf + c->rpos, n);
+	c->rpos += n + 1;
+	if (n > 0 && line[n - 1] == '\r')
+		n--;
+	line[n] = '\0';
+	return n;
+}	/* conn_read_line */
+
+/*
+ * Read exactly @len bytes in @buf.
+ *
+ */
+static int
+conn_read_exact(struct mock_conn *c, char *buf, int len) {
+	int n;
+
+	while (len > 0) {
+		if (c->rpos == c->rlen && conn_fill(c) < 0)
+			return -1;
+		n = c->rlen - c->rpos;
+		if (n > len)
+			n = len;
+		memcpy(buf, c->rbuf + c->rpos, n);
+		c->rpos += n;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}	/* conn_read_exact */
+
+/*
+ * Read a chunk from a device in the data buffer. The device chunk length includes the trailing
+ * line terminator, that is removed.
+ *
+ * @result the chunk data length or -1
+ *
+ */
+static int
+read_device_chunk(struct mock_conn *c) {
+	char line[64];
+	char *end;
+	long len;
+	int n;
+
+	/* skip the empty lines, as the one after the subscribe request */
+	while ((n = conn_read_line(c, line, sizeof(line))) == 0)
+		;
+	if (n < 0)
+		return -1;
+	len = strtol(line, &end, 16);
+	if (end == line || len < 0 || len >= (long)sizeof(c->data))
+		return -1;
+	if (conn_read_exact(c, c->data, len) < 0)
+		return -1;
+	n = len;
+	if (n > 0 && c->data[n - 1] == '\n')
+		n--;
+	if (n > 0 && c->data[n - 1] == '\r')
+		n--;
+	c->data[n] = '\0';
+	return n;
+}	/* read_device_chunk */
+
+/** Protocol helpers **/
+
+/*
+ * Copy the value of the query parameter @key in the request line @req in @val of @cap bytes.
+ *
+ * @result 0 or -1 if not found
+ *
+ */
+static int
+query_get(const char *req, const char *key, char *val, int cap) {
+	const char *p, *end;
+	int klen = strlen(key), n;
+
+	if ((p = strchr(req, '?')) == NULL)
+		return -1;
+	while (p && *p != ' ') {
+		p++;
+		if (strncmp(p, key, klen) == 0 && p[klen] == '=') {
+			p += klen + 1;
+			end = p + strcspn(p, "& ");
+			n = end - p;
+			if (n >= cap)
+				return -1;
+			memcpy(val, p, n);
+			val[n] = '\0';
+			return 0;
+		}
+		p = p + strcspn(p, "& ");
+		if (*p != '&')
+			break;
+	}
+	return -1;
+}	/* query_get */
+
+/*
+ * Compute the signature of @challenge for the device @device_id in @sig of @cap bytes.
+ *
+ */
+static int
+sign(struct mock *m, const char *app_key, const char *device_id, const char *challenge, char *sig, int cap) {
+	unsigned char key[EVP_MAX_MD_SIZE], md[EVP_MAX_MD_SIZE];
+	unsigned int key_len, md_len, i;
+	const char *secret = m->cfg.secret ? m->cfg.secret : "secret";
+	int n;
+
+	if (m->cfg.per_device) {
+		HMAC(EVP_sha256(), secret, strlen(secret), (const unsigned char *)device_id, strlen(device_id), key, &key_len);
+		HMAC(EVP_sha256(), key, key_len, (const unsigned char *)challenge, strlen(challenge), md, &md_len);
+	} else
+		HMAC(EVP_sha256(), secret, strlen(secret), (const unsigned char *)challenge, strlen(challenge), md, &md_len);
+	n = snprintf(sig, cap, "%s:", app_key);
+	if (n + 2 * (int)md_len >= cap)
+		return -1;
+	for (i = 0; i < md_len; i++, n += 2)
+		sprintf(sig + n, "%02x", md[i]);
+	return 0;
+}	/* sign */
+
+static void
+stats_add(struct mock *m, unsigned long *counter, unsigned long n) {
+	pthread_mutex_lock(&m->lock);
+	*counter += n;
+	pthread_cond_broadcast(&m->cond);
+	pthread_mutex_unlock(&m->lock);
+}
+
+/** Cometa server **/
+
+/*
+ * The thread of a device connection.
+ *
+ */
+static void *
+device_thread(void *arg) {
+	struct mock_conn *c = (struct mock_conn *)arg;
+	struct mock *m = c->m;
+	char req[512], line[512], app_key[64], challenge[40], expected[256];
+	unsigned char rnd[16];
+	int two_way = 0, n, i;
+
+	if (m->ctx) {
+		if ((c->ssl = SSL_new(m->ctx)) == NULL || SSL_set_fd(c->ssl, c->fd) != 1 || SSL_accept(c->ssl) != 1) {
+			mock_log(m, "mock: TLS handshake failed.\n");
+			goto done;
+		}
+		fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+	}
+
+	/* subscribe request and headers */
+	if (conn_read_line(c, req, sizeof(req)) < 0 || strncmp(req, "GET /subscribe?", 15) != 0)
+		goto done;
+	while ((n = conn_read_line(c, line, sizeof(line))) > 0) {
+		if (strncasecmp(line, "Cometa-Authentication:", 22) == 0)
+			two_way = strstr(line + 22, "YES") != NULL;
+	}
+	if (n < 0)
+		goto done;
+	if (query_get(req, "device_id", c->device_id, sizeof(c->device_id)) < 0 ||
+			query_get(req, "app_key", app_key, sizeof(app_key)) < 0)
+		goto done;
+	mock_log(m, "mock: subscribe from %s (%s)\n", c->device_id, two_way ? "two-way" : "one-way");
+
+	pthread_mutex_lock(&c->lock);
+	n = conn_write(c, STREAM_HEADERS, strlen(STREAM_HEADERS));
+	pthread_mutex_unlock(&c->lock);
+	if (n < 0)
+		goto done;
+
+	n = (m->cfg.app_key == NULL || strcmp(app_key, m->cfg.app_key) == 0);
+	if (two_way) {
+		RAND_bytes(rnd, sizeof(rnd));
+		for (i = 0; i < (int)sizeof(rnd); i++)
+			sprintf(challenge + 2 * i, "%02x", rnd[i]);
+		if (conn_write_chunk(c, challenge, strlen(challenge)) < 0 || read_device_chunk(c) < 0)
+			goto done;
+		sign(m, app_key, c->device_id, challenge, expected, sizeof(expected));
+		if (strcmp(c->data, expected) != 0) {
+			mock_log(m, "mock: bad signature from %s\n", c->device_id);
+			n = 0;
+		}
+	}
+	if (!n) {
+		conn_write_chunk(c, "{\"status\":\"403\"}", 16);
+		stats_add(m, &m->stats.auth_failures, 1);
+		goto done;
+	}
+	n = snprintf(line, sizeof(line), "{\"status\":\"200\",\"heartbeat\":\"%d\",\"epoch\":\"%ld\"}",
+			m->cfg.heartbeat > 0 ? m->cfg.heartbeat : 60, (long)time(NULL));
+	if (conn_write_chunk(c, line, n) < 0)
+		goto done;
+
+	pthread_mutex_lock(&m->lock);
+	m->dev = c;
+	m->stats.subscribes++;
+	pthread_cond_broadcast(&m->cond);
+	pthread_mutex_unlock(&m->lock);
+
+	/* messages from the device */
+	while ((n = read_device_chunk(c)) >= 0) {
+		if (n == 1 && c->data[0] == MSG_HEARTBEAT) {
+			mock_log(m, "mock: heartbeat from %s\n", c->device_id);
+			stats_add(m, &m->stats.heartbeats, 1);
+		} else if (n > 0 && c->data[0] == MSG_UPSTREAM) {
+			pthread_mutex_lock(&m->lock);
+			m->stats.upstream++;
+			m->stats.upstream_bytes += n - 1;
+			pthread_cond_broadcast(&m->cond);
+			pthread_mutex_unlock(&m->lock);
+		} else {
+			pthread_mutex_lock(&c->lock);
+			memcpy(c->reply, c->data, n);
+			c->reply_len = n;
+			c->replied = 1;
+			pthread_cond_signal(&c->cond);
+			pthread_mutex_unlock(&c->lock);
+			stats_add(m, &m->stats.replies, 1);
+		}
+	}
+	mock_log(m, "mock: device %s disconnected\n", c->device_id);
+
+done:
+	pthread_mutex_lock(&m->lock);
+	if (m->dev == c)
+		m->dev = NULL;
+	pthread_mutex_unlock(&m->lock);
+	pthread_mutex_lock(&c->lock);
+	c->closed = 1;
+	shutdown(c->fd, SHUT_RDWR);
+	pthread_cond_signal(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+	return NULL;
+}	/* device_thread */
+
+/*
+ * The thread of an application server connection.
+ *
+ */
+static void *
+app_thread(void *arg) {
+	struct mock_conn *c = (struct mock_conn *)arg;
+	struct mock *m = c->m;
+	char req[1024], line[512], app_key[64], challenge[128], body[256], resp[512];
+	int n;
+
+	stats_add(m, &m->stats.app_connections, 1);
+	/* keep-alive requests */
+	while (conn_read_line(c, req, sizeof(req)) >= 0) {
+		if (req[0] == '\0')
+			continue;
+		while ((n = conn_read_line(c, line, sizeof(line))) > 0)
+			;
+		if (n < 0)
+			break;
+		stats_add(m, &m->stats.app_requests, 1);
+		if (query_get(req, "device_id", c->device_id, sizeof(c->device_id)) < 0 ||
+				query_get(req, "app_key", app_key, sizeof(app_key)) < 0 ||
+				query_get(req, "challenge", challenge, sizeof(challenge)) < 0)
+			n = sprintf(body, "{\"response\":400,\"error\":\"Missing parameters.\"}");
+		else if (m->cfg.app_key && strcmp(app_key, m->cfg.app_key) != 0)
+			n = sprintf(body, "{\"response\":400,\"error\":\"Application key mismatch.\"}");
+		else {
+			n = sprintf(body, "{\"response\":200,\"signature\":\"");
+			sign(m, app_key, c->device_id, challenge, body + n, sizeof(body) - n - 2);
+			strcat(body, "\"}");
+			n = strlen(body);
+		}
+		n = snprintf(resp, sizeof(resp), "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %d\r\nConnection: keep-alive\r\n\r\n%s", n, body);
+		pthread_mutex_lock(&c->lock);
+		n = conn_write(c, resp, n);
+		pthread_mutex_unlock(&c->lock);
+		if (n < 0)
+			break;
+	}
+	pthread_mutex_lock(&c->lock);
+	c->closed = 1;
+	shutdown(c->fd, SHUT_RDWR);
+	pthread_mutex_unlock(&c->lock);
+	return NULL;
+}	/* app_thread */
+
+/*
+ * The accept thread of the Cometa server and of the application server.
+ *
+ */
+static void *
+accept_thread(void *arg) {
+	struct mock *m = ((void **)arg)[0];
+	int app = ((void **)arg)[1] != NULL;
+	struct mock_conn *c;
+	int fd, one = 1;
+
+	free(arg);
+	while ((fd = accept4(app ? m->app_fd : m->fd, NULL, NULL, SOCK_CLOEXEC)) >= 0 || errno == EINTR || errno == ECONNABORTED) {
+		if (fd < 0)
+			continue;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if ((c = calloc(1, sizeof(struct mock_conn))) == NULL) {
+			close(fd);
+			continue;
+		}
+		c->m = m;
+		c->fd = fd;
+		pthread_mutex_init(&c->lock, NULL);
+		pthread_cond_init(&c->cond, NULL);
+		pthread_mutex_lock(&m->lock);
+		if (m->stop || pthread_create(&c->tid, NULL, app ? app_thread : device_thread, c) != 0) {
+			pthread_mutex_unlock(&m->lock);
+			close(fd);
+			free(c);
+			continue;
+		}
+		c->next = m->conns;
+		m->conns = c;
+		pthread_mutex_unlock(&m->lock);
+	}
+	return NULL;
+}	/* accept_thread */
+
+/*
+ * Open a listening socket on the loopback interface.
+ *
+ */
+static int
+listen_on(int port, int *bound) {
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int fd, one = 1;
+
+	if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 128) < 0 ||
+			getsockname(fd, (struct sockaddr *)&addr, &len) < 0) {
+		close(fd);
+		return -1;
+	}
+	*bound = ntohs(addr.sin_port);
+	return fd;
+}	/* listen_on */
+
+/*
+ * Create the server TLS context with a self-signed certificate for @name, written in @cert_file.
+ *
+ */
+static SSL_CTX *
+setup_server_ctx(const char *cert_file, const char *name) {
+	EVP_PKEY_CTX *kctx;
+	EVP_PKEY *pkey = NULL;
+	X509 *x = NULL;
+	X509V3_CTX v3;
+	X509_EXTENSION *ext;
+	SSL_CTX *ctx = NULL;
+	FILE *f;
+	char san[300];
+
+	/* EC P-256 key */
+	if ((kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL)) == NULL || EVP_PKEY_keygen_init(kctx) <= 0 ||
+			EVP_PKEY_CTX_set_ec_paramgen_curve_nid(kctx, NID_X9_62_prime256v1) <= 0 || EVP_PKEY_keygen(kctx, &pkey) <= 0)
+		goto err;
+
+	/* self-signed certificate valid for one day */
+	if ((x = X509_new()) == NULL)
+		goto err;
+	X509_set_version(x, 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(x), (long)time(NULL));
+	X509_gmtime_adj(X509_getm_notBefore(x), -60);
+	X509_gmtime_adj(X509_getm_notAfter(x), 86400);
+	X509_set_pubkey(x, pkey);
+	X509_NAME_add_entry_by_txt(X509_get_subject_name(x), "CN", MBSTRING_ASC, (const unsigned char *)name, -1, -1, 0);
+	X509_set_issuer_name(x, X509_get_subject_name(x));
+	X509V3_set_ctx(&v3, x, x, NULL, NULL, 0);
+	snprintf(san, sizeof(san), "DNS:%s", name);
+	if ((ext = X509V3_EXT_conf_nid(NULL, &v3, NID_subject_alt_name, san)) != NULL) {
+		X509_add_ext(x, ext, -1);
+		X509_EXTENSION_free(ext);
+	}
+	if ((ext = X509V3_EXT_conf_nid(NULL, &v3, NID_basic_constraints, "critical,CA:TRUE")) != NULL) {
+		X509_add_ext(x, ext, -1);
+		X509_EXTENSION_free(ext);
+	}
+	if (X509_sign(x, pkey, EVP_sha256()) == 0)
+		goto err;
+
+	if ((f = fopen(cert_file, "w")) == NULL) {
+		fprintf(stderr, "ERROR: cannot write the certificate in %s.\n", cert_file);
+		goto err;
+	}
+	PEM_write_X509(f, x);
+	fclose(f);
+
+	if ((ctx = SSL_CTX_new(SSLv23_server_method())) == NULL ||
+			SSL_CTX_use_certificate(ctx, x) != 1 || SSL_CTX_use_PrivateKey(ctx, pkey) != 1) {
+		SSL_CTX_free(ctx);
+		ctx = NULL;
+		goto err;
+	}
+	SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#if (OPENSSL_VERSION_NUMBER >= 0x10101000L)
+	/* no session tickets: the devices read and write the SSL object from different threads */
+	SSL_CTX_set_num_tickets(ctx, 0);
+#endif
+
+err:
+	if (ctx == NULL)
+		ERR_print_errors_fp(stderr);
+	X509_free(x);
+	EVP_PKEY_free(pkey);
+	EVP_PKEY_CTX_free(kctx);
+	return ctx;
+}	/* setup_server_ctx */
+
+static int
+start_accept(struct mock *m, pthread_t *tid, int app) {
+	void **arg = malloc(2 * sizeof(void *));
+
+	if (arg == NULL)
+		return -1;
+	arg[0] = m;
+	arg[1] = app ? m : NULL;
+	if (pthread_create(tid, NULL, accept_thread, arg) != 0) {
+		free(arg);
+		return -1;
+	}
+	return 0;
+}
+
+/** Public functions **/
+
+struct mock *
+mock_start(const struct mock_config *cfg) {
+	struct mock *m;
+
+	if ((m = calloc(1, sizeof(struct mock))) == NULL)
+		return NULL;
+	m->cfg = *cfg;
+	m->fd = m->app_fd = -1;
+	pthread_mutex_init(&m->lock, NULL);
+	pthread_cond_init(&m->cond, NULL);
+
+	if (cfg->cert_file &&
+			(m->ctx = setup_server_ctx(cfg->cert_file, cfg->cert_name ? cfg->cert_name : "service.cometa.io")) == NULL)
+		goto err;
+	if ((m->fd = listen_on(cfg->port, &m->port)) < 0) {
+		fprintf(stderr, "ERROR: cannot listen on port %d.\n", cfg->port);
+		goto err;
+	}
+	if (cfg->app_port >= 0 && (m->app_fd = listen_on(cfg->app_port, &m->app_port)) < 0) {
+		fprintf(stderr, "ERROR: cannot listen on port %d.\n", cfg->app_port);
+		goto err;
+	}
+	if (start_accept(m, &m->tid, 0) < 0) {
+		m->tid = 0;
+		goto err;
+	}
+	if (m->app_fd >= 0 && start_accept(m, &m->app_tid, 1) < 0) {
+		m->app_tid = 0;
+		goto err;
+	}
+	return m;
+
+err:
+	mock_stop(m);
+	return NULL;
+}	/* mock_start */
+
+void
+mock_stop(struct mock *m) {
+	struct mock_conn *c;
+
+	if (m == NULL)
+		return;
+	pthread_mutex_lock(&m->lock);
+	m->stop = 1;
+	pthread_mutex_unlock(&m->lock);
+	/* wake up the accept threads */
+	if (m->fd >= 0)
+		shutdown(m->fd, SHUT_RDWR);
+	if (m->app_fd >= 0)
+		shutdown(m->app_fd, SHUT_RDWR);
+	if (m->tid)
+		pthread_join(m->tid, NULL);
+	if (m->app_tid)
+		pthread_join(m->app_tid, NULL);
+	/* close the connections */
+	for (c = m->conns; c; c = c->next)
+		shutdown(c->fd, SHUT_RDWR);
+	while ((c = m->conns) != NULL) {
+		m->conns = c->next;
+		pthread_join(c->tid, NULL);
+		if (c->ssl)
+			SSL_free(c->ssl);
+		close(c->fd);
+		pthread_cond_destroy(&c->cond);
+		pthread_mutex_destroy(&c->lock);
+		free(c);
+	}
+	if (m->fd >= 0)
+		close(m->fd);
+	if (m->app_fd >= 0)
+		close(m->app_fd);
+	if (m->ctx)
+		SSL_CTX_free(m->ctx);
+	pthread_cond_destroy(&m->cond);
+	pthread_mutex_destroy(&m->lock);
+	free(m);
+}	/* mock_stop */
+
+int
+mock_port(struct mock *m) {
+	return m->port;
+}
+
+int
+mock_app_port(struct mock *m) {
+	return m->app_port;
+}
+
+static void
+deadline_after(struct timespec *ts, int timeout_ms) {
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += timeout_ms / 1000;
+	ts->tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+/*
+ * Wait until a counter reaches @count.
+ *
+ */
+static int
+wait_counter(struct mock *m, unsigned long *counter, unsigned long count, int timeout_ms) {
+	struct timespec ts;
+	int ret = 0;
+
+	deadline_after(&ts, timeout_ms);
+	pthread_mutex_lock(&m->lock);
+	while (*counter < count && ret == 0)
+		ret = pthread_cond_timedwait(&m->cond, &m->lock, &ts);
+	ret = (*counter >= count) ? 0 : -1;
+	pthread_mutex_unlock(&m->lock);
+	return ret;
+}	/* wait_counter */
+
+int
+mock_wait_subscribed(struct mock *m, unsigned long count, int timeout_ms) {
+	return wait_counter(m, &m->stats.subscribes, count, timeout_ms);
+}
+
+int
+mock_wait_upstream(struct mock *m, unsigned long count, int timeout_ms) {
+	return wait_counter(m, &m->stats.upstream, count, timeout_ms);
+}
+
+int
+mock_request(struct mock *m, const char *msg, int len, char *reply, int reply_cap, int timeout_ms) {
+	struct mock_conn *c;
+	struct timespec ts;
+	char hdr[16];
+	int ret = 0;
+
+	/* the connections are released only by mock_stop() */
+	pthread_mutex_lock(&m->lock);
+	c = m->dev;
+	pthread_mutex_unlock(&m->lock);
+	if (c == NULL)
+		return -1;
+
+	sprintf(hdr, "%x\r\n", len);
+	pthread_mutex_lock(&c->lock);
+	c->replied = 0;
+	if (c->closed || conn_write(c, hdr, strlen(hdr)) < 0 || conn_write(c, msg, len) < 0 || conn_write(c, "\r\n", 2) < 0) {
+		pthread_mutex_unlock(&c->lock);
+		return -1;
+	}
+	deadline_after(&ts, timeout_ms);
+	while (!c->replied && !c->closed && ret == 0)
+		ret = pthread_cond_timedwait(&c->cond, &c->lock, &ts);
+	if (c->replied) {
+		ret = (c->reply_len < reply_cap) ? c->reply_len : reply_cap - 1;
+		memcpy(reply, c->reply, ret);
+		reply[ret] = '\0';
+	} else
+		ret = -1;
+	pthread_mutex_unlock(&c->lock);
+	return ret;
+}	/* mock_request */
+
+void
+mock_get_stats(struct mock *m, struct mock_stats *stats) {
+	pthread_mutex_lock(&m->lock);
+	*stats = m->stats;
+	pthread_mutex_unlock(&m->lock);
+}
@@ -0,0 +1,100 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* @file
+ * Loopback stand-in for the Cometa server and for an application server authentication
+ * endpoint, used by the benchmarks and for testing devices without ensemble.cometa.io.
+ *
+ */
+
+/*
+ * Mock configuration. Zero values select the defaults.
+ */
+struct mock_config {
+	int port;					/* Cometa server port, 0 for an ephemeral port */
+	int app_port;				/* application server port, 0 for an ephemeral port, -1 for none */
+	int heartbeat;				/* heartbeat period sent to the devices in seconds (60) */
+	const char *app_key;		/* application key checked at subscription, NULL to accept any */
+	const char *secret;			/* application secret for the signatures ("secret") */
+	int per_device;				/* sign with the per-device keys derived from the secret */
+	const char *cert_file;		/* TLS: file where the self-signed certificate is written, NULL for plaintext */
+	const char *cert_name;		/* TLS: name in the certificate ("service.cometa.io") */
+	int verbose;				/* print the protocol events on stderr */
+};
+
+/*
+ * Mock counters.
+ */
+struct mock_stats {
+	unsigned long subscribes;		/* devices subscribed */
+	unsigned long auth_failures;	/* subscriptions refused */
+	unsigned long heartbeats;		/* heartbeats received */
+	unsigned long upstream;			/* upstream messages received */
+	unsigned long upstream_bytes;	/* upstream payload bytes received */
+	unsigned long replies;			/* replies to downstream messages received */
+	unsigned long app_requests;		/* requests to the application server */
+	unsigned long app_connections;	/* connections to the application server */
+};
+
+struct mock;
+
+/*
+ * Start the mock server threads.
+ *
+ * @return - the mock or NULL in case of error
+ */
+struct mock *mock_start(const struct mock_config *cfg);
+
+/*
+ * Stop the mock, close all the connections and release it.
+ */
+void mock_stop(struct mock *m);
+
+/*
+ * Return the port of the Cometa server and of the application server.
+ */
+int mock_port(struct mock *m);
+int mock_app_port(struct mock *m);
+
+/*
+ * Wait until at least @count devices have subscribed, for at most @timeout_ms milliseconds.
+ *
+ * @return - 0 or -1 on timeout
+ */
+int mock_wait_subscribed(struct mock *m, unsigned long count, int timeout_ms);
+
+/*
+ * Wait until at least @count upstream messages have been received, for at most @timeout_ms milliseconds.
+ *
+ * @return - 0 or -1 on timeout
+ */
+int mock_wait_upstream(struct mock *m, unsigned long count, int timeout_ms);
+
+/*
+ * Send the message @msg of @len bytes to the last device subscribed and wait for its reply,
+ * for at most @timeout_ms milliseconds. The reply is copied in @reply of @reply_cap bytes.
+ *
+ * @return - the reply length or -1 in case of error or timeout
+ */
+int mock_request(struct mock *m, const char *msg, int len, char *reply, int reply_cap, int timeout_ms);
+
+/*
+ * Copy the counters in @stats.
+ */
+void mock_get_stats(struct mock *m, struct mock_stats *stats);
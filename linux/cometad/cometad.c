@@ -0,0 +1,487 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file    cometad.c
+ *
+ * @brief   Local daemon sharing one Cometa connection among several processes.
+ *
+ * The daemon subscribes to Cometa with the credentials of the device and serves the local clients,
+ * linked with the client shim, on a unix socket. The upstream messages of the clients are merged in
+ * the connection, and a downstream message is passed to the client with the longest route matching
+ * it, whose reply is the reply of the device. See proto.h for the protocol.
+ *
+ * The main thread accepts the clients and drains their upstream rings. The receive thread of the
+ * library waits for the reply of a client in the message callback, so the upstream messages are
+ * queued with cometa_send_async() and never block the main thread on the connection.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "cometa.h"
+#include "cometad.h"
+#include "proto.h"
+
+#define MAX_CLIENTS     32
+/* seconds waiting for the reply of a client to a downstream message */
+#define REPLY_TIMEOUT   10
+/* seconds between the attempts to subscribe */
+#define RETRY_DELAY     5
+
+struct client {
+	int fd;                     /* -1 if the slot is free */
+	struct rings *rings;
+	char route[64];
+	size_t route_len;
+};
+
+static struct client clients[MAX_CLIENTS];
+static int nclients = 0;
+
+/* the downstream message waiting for a reply, protected by lock */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct {
+	uint32_t id;                /* 0 if none */
+	int client;
+	int done;
+	int len;                    /* length of the reply or -1 */
+} pending;
+static uint32_t next_id = 0;
+static char reply[MESSAGE_LEN];
+
+static struct cometa *conn;
+static const char *app_name, *app_key;
+static volatile sig_atomic_t quit = 0;
+
+/*
+ * Callback of the downstream messages: pass the message to the client of its route and wait for
+ * the reply.
+ */
+static char *
+message_handler(const int data_size, void *data) {
+	struct timespec deadline;
+	struct client *c;
+	char *result = NULL;
+	size_t best = 0;
+	int i, sel = -1;
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		c = &clients[i];
+		if (c->fd < 0 || c->route_len > (size_t)data_size)
+			continue;
+		if (memcmp(data, c->route, c->route_len) != 0)
+			continue;
+		if (sel < 0 || c->route_len > best) {
+			sel = i;
+			best = c->route_len;
+		}
+	}
+	if (sel < 0) {
+		pthread_mutex_unlock(&lock);
+		fprintf(stderr, "cometad: no client for a message of %d bytes\n", data_size);
+		return NULL;
+	}
+	c = &clients[sel];
+	if (++next_id == 0)
+		next_id = 1;
+	if (ring_push(&c->rings->down, REC_DOWN, next_id, data, data_size) < 0) {
+		pthread_mutex_unlock(&lock);
+		fprintf(stderr, "cometad: downstream ring of the client full\n");
+		return NULL;
+	}
+	pending.id = next_id;
+	pending.client = sel;
+	pending.done = 0;
+	if (ring_doorbell(&c->rings->down))
+		send(c->fd, "D", 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += REPLY_TIMEOUT;
+	while (!pending.done)
+		if (pthread_cond_timedwait(&cond, &lock, &deadline) == ETIMEDOUT)
+			break;
+	if (pending.done && pending.len >= 0) {
+		reply[pending.len] = '\0';
+		result = reply;
+	} else if (!pending.done)
+		fprintf(stderr, "cometad: no reply from the client\n");
+	pending.id = 0;
+	pthread_mutex_unlock(&lock);
+	return result;
+}	/* message_handler */
+
+static void
+sent(void *ctx, cometa_reply result) {
+	if (result != COMEATAR_OK)
+		fprintf(stderr, "cometad: upstream message lost (%d)\n", result);
+	free(ctx);
+}
+
+/*
+ * Receive the hello message of a new client on @fd, map its rings and answer.
+ *
+ * @return the slot of the client or -1
+ */
+static int
+client_hello(int fd) {
+	struct proto_hello hello;
+	struct proto_welcome welcome;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} ctrl;
+	struct timeval tv = { 2, 0 };
+	struct stat st;
+	void *rings = MAP_FAILED;
+	int memfd = -1, slot = -1, seals, i;
+	ssize_t n;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &hello;
+	iov.iov_len = sizeof(hello);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl.buf;
+	msg.msg_controllen = sizeof(ctrl.buf);
+	n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	for (cmsg = CMSG_FIRSTHDR(&msg); n > 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+
+	memset(&welcome, 0, sizeof(welcome));
+	welcome.status = WELCOME_ERROR;
+	if (n != sizeof(hello) || memfd < 0)
+		goto done;
+	if (hello.version != PROTO_VERSION) {
+		welcome.status = WELCOME_VERSION;
+		goto done;
+	}
+	hello.app_name[APP_NAME_LEN] = hello.app_key[APP_KEY_LEN] = hello.route[sizeof(hello.route) - 1] = '\0';
+	if (strcmp(hello.app_name, app_name) != 0 || strcmp(hello.app_key, app_key) != 0) {
+		welcome.status = WELCOME_AUTH;
+		goto done;
+	}
+	/* a memory that can shrink under the mapping would fault the daemon */
+	if ((seals = fcntl(memfd, F_GET_SEALS)) < 0 || !(seals & F_SEAL_SHRINK) ||
+			fstat(memfd, &st) < 0 || st.st_size < (off_t)sizeof(struct rings))
+		goto done;
+	rings = mmap(NULL, sizeof(struct rings), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (rings == MAP_FAILED)
+		goto done;
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < MAX_CLIENTS; i++)
+		if (clients[i].fd < 0)
+			break;
+	if (i < MAX_CLIENTS) {
+		slot = i;
+		clients[i].fd = fd;
+		clients[i].rings = rings;
+		strcpy(clients[i].route, hello.route);
+		clients[i].route_len = strlen(hello.route);
+		nclients++;
+	}
+	pthread_mutex_unlock(&lock);
+	if (slot < 0) {
+		welcome.status = WELCOME_FULL;
+		goto done;
+	}
+	welcome.status = WELCOME_OK;
+	welcome.epoch = cometa_epoch(conn);
+	strncpy(welcome.device_id, cometa_device_id(), DEVICE_ID_LEN);
+	fprintf(stderr, "cometad: client %d connected, route \"%s\"\n", slot, hello.route);
+
+done:
+	if (memfd >= 0)
+		close(memfd);
+	if (slot < 0 && rings != MAP_FAILED)
+		munmap(rings, sizeof(struct rings));
+	send(fd, &welcome, sizeof(welcome), MSG_NOSIGNAL);
+	if (slot < 0)
+		close(fd);
+	return slot;
+}	/* client_hello */
+
+/*
+ * Disconnect the client in @slot and release the downstream message waiting for its reply.
+ */
+static void
+client_drop(int slot) {
+	struct client *c = &clients[slot];
+
+	pthread_mutex_lock(&lock);
+	if (pending.id && pending.client == slot && !pending.done) {
+		pending.done = 1;
+		pending.len = -1;
+		pthread_cond_signal(&cond);
+	}
+	close(c->fd);
+	munmap(c->rings, sizeof(struct rings));
+	c->fd = -1;
+	c->rings = NULL;
+	nclients--;
+	pthread_mutex_unlock(&lock);
+	fprintf(stderr, "cometad: client %d disconnected\n", slot);
+}	/* client_drop */
+
+/*
+ * Process the records of the upstream ring of the client in @slot.
+ *
+ * @return the number of records or -1 if the ring is corrupt
+ */
+static int
+client_drain(int slot) {
+	struct ring *up = &clients[slot].rings->up;
+	struct rec rec;
+	const char *data;
+	char *buf;
+	int n = 0;
+
+	/* only the copy of the header is used, the client can write the ring at any time */
+	while ((data = ring_peek(up, &rec)) != NULL) {
+		if (rec.len >= (uint32_t)(up->data + RING_SIZE - data))
+			return -1;
+		if (rec.type == REC_UP && rec.len <= MESSAGE_LEN - 12) {
+			/* the ring record is released now, the message is sent later */
+			if ((buf = malloc(rec.len > 0 ? rec.len : 1)) != NULL) {
+				memcpy(buf, data, rec.len);
+				if (cometa_send_async(conn, buf, rec.len, sent, buf) != COMEATAR_OK) {
+					fprintf(stderr, "cometad: upstream message lost\n");
+					free(buf);
+				}
+			}
+		} else if (rec.type == REC_REPLY) {
+			pthread_mutex_lock(&lock);
+			if (pending.id == rec.id && pending.client == slot && !pending.done) {
+				pending.len = rec.len < MESSAGE_LEN ? rec.len : MESSAGE_LEN - 1;
+				memcpy(reply, data, pending.len);
+				pending.done = 1;
+				pthread_cond_signal(&cond);
+			}
+			pthread_mutex_unlock(&lock);
+		}
+		ring_pop(up, rec.len);
+		n++;
+	}
+	return n;
+}	/* client_drain */
+
+/*
+ * Create the listening socket at @path, readable and writable by the group.
+ */
+static int
+listen_socket(const char *path) {
+	struct sockaddr_un addr;
+	char dir[sizeof(addr.sun_path)];
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "cometad: socket path too long\n");
+		return -1;
+	}
+	strcpy(dir, path);
+	mkdir(dirname(dir), 0755);
+	unlink(path);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0 ||
+			bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+			chmod(path, 0660) < 0 || listen(fd, 16) < 0) {
+		perror("cometad: socket");
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	return fd;
+}	/* listen_socket */
+
+/*
+ * Accept the clients and forward their upstream messages until a signal.
+ */
+static void
+serve(int lfd) {
+	struct pollfd fds[MAX_CLIENTS + 1];
+	int slots[MAX_CLIENTS + 1];
+	char buf[64];
+	int i, n, fd, ret, busy, timeout = -1;
+
+	while (!quit) {
+		fds[0].fd = lfd;
+		fds[0].events = POLLIN;
+		for (i = 0, n = 1; i < MAX_CLIENTS; i++)
+			if (clients[i].fd >= 0) {
+				fds[n].fd = clients[i].fd;
+				fds[n].events = POLLIN;
+				slots[n++] = i;
+			}
+		if (poll(fds, n, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("cometad: poll");
+			return;
+		}
+		/* a new client is polled and drained in the next round */
+		busy = 0;
+		if (fds[0].revents & POLLIN) {
+			if ((fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC)) >= 0 && client_hello(fd) >= 0)
+				busy++;
+		}
+		for (i = 1; i < n; i++) {
+			if (fds[i].revents == 0)
+				continue;
+			/* the doorbells carry no data */
+			while (recv(fds[i].fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+				;
+			if (fds[i].revents & (POLLHUP | POLLERR)) {
+				client_drain(slots[i]);
+				client_drop(slots[i]);
+				slots[i] = -1;
+			}
+		}
+		/* drain all the rings, then wait for a doorbell only if they are still empty */
+		for (i = 1; i < n; i++) {
+			if (slots[i] < 0)
+				continue;
+			if ((ret = client_drain(slots[i])) < 0) {
+				fprintf(stderr, "cometad: corrupt ring of client %d\n", slots[i]);
+				client_drop(slots[i]);
+				slots[i] = -1;
+			} else
+				busy += ret;
+		}
+		timeout = 0;
+		if (busy == 0) {
+			timeout = -1;
+			for (i = 1; i < n; i++)
+				if (slots[i] >= 0 && !ring_wait(&clients[slots[i]].rings->up))
+					timeout = 0;
+		}
+	}
+}	/* serve */
+
+static void
+on_signal(int sig) {
+	quit = 1;
+}
+
+static void
+usage(const char *name) {
+	fprintf(stderr, "Usage: %s -i device_id -k device_key -a app_name -K app_key [-s app_server -p app_port -e endpoint] [-H server -P port] [-c ca_file] [-n verify_name] [-l socket]\n"
+			"  -i device_id    device id\n"
+			"  -k device_key   device key\n"
+			"  -a app_name     application name, also required of the clients\n"
+			"  -K app_key      application key, also required of the clients\n"
+			"  -s app_server   application server authenticating the device\n"
+			"  -p app_port     application server port\n"
+			"  -e endpoint     authentication endpoint of the application server\n"
+			"  -H server       Cometa server (default the library default)\n"
+			"  -P port         Cometa server port\n"
+			"  -c ca_file      CA certificates to verify the server with TLS\n"
+			"  -n verify_name  name in the server certificate\n"
+			"  -l socket       socket of the clients (default " COMETAD_SOCKET ")\n", name);
+	exit(-1);
+}
+
+int
+main(int argc, char *argv[]) {
+	const char *device_id = NULL, *device_key = NULL;
+	const char *app_server = NULL, *app_port = NULL, *endpoint = NULL;
+	const char *server = NULL, *port = NULL, *ca_file = NULL, *verify_name = NULL;
+	const char *path = COMETAD_SOCKET;
+	struct sigaction sa;
+	int opt, lfd, i;
+
+	while ((opt = getopt(argc, argv, "i:k:a:K:s:p:e:H:P:c:n:l:")) != -1) {
+		switch (opt) {
+		case 'i': device_id = optarg; break;
+		case 'k': device_key = optarg; break;
+		case 'a': app_name = optarg; break;
+		case 'K': app_key = optarg; break;
+		case 's': app_server = optarg; break;
+		case 'p': app_port = optarg; break;
+		case 'e': endpoint = optarg; break;
+		case 'H': server = optarg; break;
+		case 'P': port = optarg; break;
+		case 'c': ca_file = optarg; break;
+		case 'n': verify_name = optarg; break;
+		case 'l': path = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (device_id == NULL || device_key == NULL || app_name == NULL || app_key == NULL)
+		usage(argv[0]);
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+		clients[i].fd = -1;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (cometa_init(device_id, "cometad", device_key) != COMEATAR_OK) {
+		fprintf(stderr, "cometad: invalid device id or key\n");
+		exit(-1);
+	}
+	if (server && cometa_set_server(server, port, verify_name, ca_file) != COMEATAR_OK) {
+		fprintf(stderr, "cometad: invalid server\n");
+		exit(-1);
+	}
+	while ((conn = cometa_subscribe(app_name, app_key, app_server, app_port, endpoint)) == NULL) {
+		fprintf(stderr, "cometad: subscription failed, retrying in %d seconds\n", RETRY_DELAY);
+		sleep(RETRY_DELAY);
+		if (quit)
+			exit(-1);
+	}
+	cometa_bind_cb(conn, message_handler);
+
+	if ((lfd = listen_socket(path)) < 0)
+		exit(-1);
+	fprintf(stderr, "cometad: device %s serving clients on %s\n", cometa_device_id(), path);
+	serve(lfd);
+
+	close(lfd);
+	unlink(path);
+	return 0;
+}
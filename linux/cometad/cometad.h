@@ -0,0 +1,61 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* @file
+ * Extensions of the Cometa API for the clients of cometad.
+ *
+ * The clients of cometad link the client library (libcometa-shim) instead of libcometa and use
+ * the functions of cometa.h: cometa_init(), cometa_set_server(), cometa_subscribe(), cometa_send(),
+ * cometa_send_async(), cometa_bind_cb(), cometa_bind_cb_ctx(), cometa_error(), cometa_epoch() and
+ * cometa_device_id(). The daemon holds the device credentials and the connection to Cometa:
+ * the credentials of cometa_init() and the server of cometa_set_server() are not used, and the
+ * application name and key of cometa_subscribe() must be the ones of the daemon.
+ *
+ */
+
+#ifndef COMETAD_H
+#define COMETAD_H
+
+#include "cometa.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* default socket of the daemon */
+#define COMETAD_SOCKET  "/run/cometa/cometad.sock"
+
+/*
+ * Receive only the downstream messages starting with @route, for instance "lights/". A message
+ * goes to the client with the longest matching route, and the clients without a route receive the
+ * messages not matching any route. To be called before cometa_subscribe().
+ */
+COMETA_API cometa_reply cometad_set_route(const char *route);
+
+/*
+ * Connect to the daemon at the socket @path instead of COMETAD_SOCKET or of the COMETAD_SOCKET
+ * environment variable. To be called before cometa_subscribe().
+ */
+COMETA_API cometa_reply cometad_set_socket(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* COMETAD_H */
@@ -0,0 +1,108 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file    proto.h
+ *
+ * @brief   Protocol between cometad and the client shim.
+ *
+ * A client connects to the unix socket of the daemon (SOCK_SEQPACKET) and sends a hello message with
+ * the file descriptor of a shared memory of two rings: the upstream ring written by the client and
+ * read by the daemon, and the downstream ring written by the daemon and read by the client. The
+ * memory is sealed against shrinking, which would fault the daemon. The daemon answers with a
+ * welcome message. The payloads are then exchanged in the rings, and the socket
+ * only carries the doorbells, sent when the reader of a ring is waiting.
+ *
+ * The downstream messages are routed to the client with the longest route matching the beginning of
+ * the message, and the reply of the client is the reply of the device.
+ *
+ */
+
+#define PROTO_VERSION       1
+
+/* size of the data of a ring, a power of two larger than twice a message */
+#define RING_SIZE           (128 * 1024)
+
+/* record types */
+#define REC_PAD             0       /* padding to the end of the ring */
+#define REC_UP              1       /* upstream message */
+#define REC_REPLY           2       /* reply to the downstream message with the same id */
+#define REC_DOWN            3       /* downstream message */
+
+/* status of the welcome message */
+#define WELCOME_OK          0
+#define WELCOME_AUTH        1       /* application name or key not matching the subscription of the daemon */
+#define WELCOME_VERSION     2
+#define WELCOME_FULL        3       /* too many clients */
+#define WELCOME_ERROR       4
+
+/*
+ * Hello message of a client, with the file descriptor of the rings.
+ */
+struct proto_hello {
+    uint32_t version;
+    char app_name[APP_NAME_LEN + 1];
+    char app_key[APP_KEY_LEN + 1];
+    char route[64];                 /* beginning of the downstream messages for the client, "" for all */
+};
+
+/*
+ * Welcome message of the daemon.
+ */
+struct proto_welcome {
+    uint32_t status;                /* WELCOME_* */
+    int64_t epoch;                  /* server time at the subscription */
+    char device_id[DEVICE_ID_LEN + 1];
+};
+
+/*
+ * A record in a ring, the data follows with a nul byte and the record is padded to 16 bytes.
+ */
+struct rec {
+    uint32_t len;                   /* length of the data */
+    uint32_t type;                  /* REC_* */
+    uint32_t id;                    /* downstream message id */
+    uint32_t pad;
+};
+
+/*
+ * A single producer, single consumer ring in shared memory. The records do not wrap.
+ */
+struct ring {
+    uint32_t head;                  /* read position, written by the consumer */
+    uint32_t waiting;               /* the consumer waits for a doorbell */
+    char pad1[56];
+    uint32_t tail;                  /* write position, written by the producer */
+    char pad2[60];
+    char data[RING_SIZE];
+};
+
+/*
+ * The shared memory of a client.
+ */
+struct rings {
+    struct ring up;
+    struct ring down;
+};
+
+int ring_push(struct ring *r, int type, uint32_t id, const void *data, int len);
+const char *ring_peek(struct ring *r, struct rec *rec);
+void ring_pop(struct ring *r, uint32_t len);
+int ring_wait(struct ring *r);
+int ring_doorbell(struct ring *r);
@@ -0,0 +1,138 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file    ring.c
+ *
+ * @brief   Shared memory rings of cometad and of the client shim.
+ *
+ * The producer and the consumer publish their positions with release stores and read the other
+ * one with acquire loads. A consumer about to wait sets the waiting flag and looks at the ring
+ * again, and a producer looks at the flag after publishing a record: with sequentially consistent
+ * accesses either the consumer sees the record or the producer sees the flag and rings the doorbell.
+ *
+ */
+
+#include <string.h>
+#include <stdint.h>
+
+#include "cometa.h"
+#include "proto.h"
+
+/* size of a record of @len bytes, with the nul byte after the data */
+#define REC_SIZE(len)   ((sizeof(struct rec) + (len) + 1 + 15) & ~15u)
+
+/*
+ * Append a record of @type with @len bytes of @data.
+ *
+ * @return 0 or -1 if the ring is full
+ *
+ */
+int
+ring_push(struct ring *r, int type, uint32_t id, const void *data, int len) {
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = r->tail;
+    uint32_t need = REC_SIZE(len);
+    uint32_t off = tail & (RING_SIZE - 1);
+    uint32_t pad = 0;
+    struct rec *rec;
+
+    if (len < 0 || need > RING_SIZE / 2)
+        return -1;
+    /* a record does not wrap: pad to the end of the ring */
+    if (off + need > RING_SIZE)
+        pad = RING_SIZE - off;
+    if (tail + pad + need - head > RING_SIZE)
+        return -1;
+    if (pad) {
+        rec = (struct rec *)(r->data + off);
+        rec->len = pad - sizeof(struct rec);
+        rec->type = REC_PAD;
+        tail += pad;
+        off = 0;
+    }
+    rec = (struct rec *)(r->data + off);
+    rec->len = len;
+    rec->type = type;
+    rec->id = id;
+    memcpy(rec + 1, data, len);
+    ((char *)(rec + 1))[len] = '\0';
+    __atomic_store_n(&r->tail, tail + need, __ATOMIC_SEQ_CST);
+    return 0;
+}   /* ring_push */
+
+/*
+ * Copy in @rec the header of the first record, read once from the shared memory so that the
+ * other side cannot change it after the caller validated it.
+ *
+ * @return the data of the record, or NULL if the ring is empty
+ *
+ */
+const char *
+ring_peek(struct ring *r, struct rec *rec) {
+    const struct rec *p;
+
+    while (r->head != __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) {
+        p = (const struct rec *)(r->data + (r->head & (RING_SIZE - 1)));
+        rec->len = __atomic_load_n(&p->len, __ATOMIC_RELAXED);
+        rec->type = __atomic_load_n(&p->type, __ATOMIC_RELAXED);
+        rec->id = __atomic_load_n(&p->id, __ATOMIC_RELAXED);
+        if (rec->type != REC_PAD)
+            return (const char *)(p + 1);
+        /* skip to the beginning of the ring */
+        __atomic_store_n(&r->head, (r->head | (RING_SIZE - 1)) + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}   /* ring_peek */
+
+/*
+ * Remove the first record, of @len bytes as returned by ring_peek() and validated.
+ *
+ */
+void
+ring_pop(struct ring *r, uint32_t len) {
+    __atomic_store_n(&r->head, r->head + REC_SIZE(len), __ATOMIC_RELEASE);
+}   /* ring_pop */
+
+/*
+ * The consumer is about to wait for a doorbell.
+ *
+ * @return 1 if it can wait, 0 if a record arrived in the meantime
+ *
+ */
+int
+ring_wait(struct ring *r) {
+    __atomic_store_n(&r->waiting, 1, __ATOMIC_SEQ_CST);
+    if (r->head != __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&r->waiting, 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}   /* ring_wait */
+
+/*
+ * The producer published a record.
+ *
+ * @return 1 if the consumer waits and the doorbell must be sent
+ *
+ */
+int
+ring_doorbell(struct ring *r) {
+    return __atomic_exchange_n(&r->waiting, 0, __ATOMIC_SEQ_CST) != 0;
+}   /* ring_doorbell */
@@ -0,0 +1,384 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file    shim.c
+ *
+ * @brief   Client library of cometad, implementing the Cometa API over the daemon.
+ *
+ * A process linked with the shim instead of libcometa shares the connection of cometad with the
+ * other clients of the daemon. The upstream messages and the replies are written in the upstream
+ * ring, and a thread of the shim reads the downstream ring and calls the message callback. The
+ * shim reconnects to a restarted daemon.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "cometa.h"
+#include "cometad.h"
+#include "proto.h"
+
+/* attempts to write in a full ring, PUSH_DELAY microseconds apart */
+#define PUSH_RETRIES        1000
+#define PUSH_DELAY          1000
+/* seconds between the attempts to reconnect to the daemon */
+#define RECONNECT_DELAY     1
+
+/*
+ * The connection to the daemon.
+ */
+struct cometa {
+    int fd;                             /* socket of the daemon, -1 if disconnected */
+    struct rings *rings;
+    pthread_mutex_t plock;              /* producer of the upstream ring, fd and rings */
+    pthread_mutex_t cblock;             /* callback */
+    cometa_message_cb user_cb;
+    cometa_message_ctx_cb ctx_cb;
+    void *cb_ctx;
+    pthread_t tid;                      /* reader of the downstream ring */
+    cometa_reply reply;
+    long epoch;
+};
+
+static struct cometa shim = {
+    .fd = -1,
+    .plock = PTHREAD_MUTEX_INITIALIZER,
+    .cblock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static struct proto_hello hello;
+static char route[sizeof(hello.route)];
+static char sock_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static char device_id[DEVICE_ID_LEN + 1];
+
+/*
+ * Initialize the library. The device is the one of the daemon and the parameters are not used.
+ *
+ */
+cometa_reply
+cometa_init(const char *id, const char *platform, const char *key) {
+    if (id == NULL || platform == NULL || key == NULL)
+        return COMETAR_PAR_ERROR;
+    return COMEATAR_OK;
+}   /* cometa_init */
+
+/*
+ * The daemon connects to the server: nothing to do.
+ *
+ */
+cometa_reply
+cometa_set_server(const char *name, const char *port, const char *verify_name, const char *ca_file) {
+    return COMEATAR_OK;
+}   /* cometa_set_server */
+
+cometa_reply
+cometad_set_route(const char *prefix) {
+    if (prefix == NULL || strlen(prefix) >= sizeof(route))
+        return COMETAR_PAR_ERROR;
+    strcpy(route, prefix);
+    return COMEATAR_OK;
+}   /* cometad_set_route */
+
+cometa_reply
+cometad_set_socket(const char *path) {
+    if (path == NULL || strlen(path) >= sizeof(sock_path))
+        return COMETAR_PAR_ERROR;
+    strcpy(sock_path, path);
+    return COMEATAR_OK;
+}   /* cometad_set_socket */
+
+/*
+ * Connect to the daemon with the hello message and the rings in a new shared memory.
+ *
+ * @return COMEATAR_OK, COMEATAR_NET_ERROR without daemon or the error of the daemon
+ *
+ */
+static cometa_reply
+shim_connect(struct cometa *h) {
+    struct sockaddr_un addr;
+    struct proto_welcome welcome;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctrl;
+    struct timeval tv = { 5, 0 };
+    struct rings *rings, *old;
+    const char *path;
+    cometa_reply ret = COMEATAR_NET_ERROR;
+    int fd, memfd = -1;
+
+    if ((path = sock_path[0] ? sock_path : getenv("COMETAD_SOCKET")) == NULL)
+        path = COMETAD_SOCKET;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return COMETAR_PAR_ERROR;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+        return COMEATAR_NET_ERROR;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        goto fail;
+
+    ret = COMETAR_ERROR;
+    if ((memfd = memfd_create("cometa-shim", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0 ||
+            ftruncate(memfd, sizeof(struct rings)) < 0 || fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) < 0)
+        goto fail;
+    rings = mmap(NULL, sizeof(struct rings), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (rings == MAP_FAILED)
+        goto fail;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &hello;
+    iov.iov_len = sizeof(hello);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(hello) ||
+            recv(fd, &welcome, sizeof(welcome), 0) != sizeof(welcome)) {
+        ret = COMEATAR_NET_ERROR;
+        goto unmap;
+    }
+    switch (welcome.status) {
+    case WELCOME_OK:
+        break;
+    case WELCOME_AUTH:
+        ret = COMETAR_AUTH_ERROR;
+        goto unmap;
+    default:
+        goto unmap;
+    }
+    close(memfd);
+
+    /* the doorbells are waited for without timeout */
+    tv.tv_sec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    welcome.device_id[DEVICE_ID_LEN] = '\0';
+    strcpy(device_id, welcome.device_id);
+
+    pthread_mutex_lock(&h->plock);
+    old = h->rings;
+    h->rings = rings;
+    h->fd = fd;
+    h->epoch = welcome.epoch;
+    pthread_mutex_unlock(&h->plock);
+    if (old)
+        munmap(old, sizeof(struct rings));
+    return COMEATAR_OK;
+
+unmap:
+    munmap(rings, sizeof(struct rings));
+fail:
+    if (memfd >= 0)
+        close(memfd);
+    close(fd);
+    return ret;
+}   /* shim_connect */
+
+/*
+ * Write a record in the upstream ring, waiting if full, and ring the doorbell of the daemon.
+ *
+ */
+static cometa_reply
+shim_push(struct cometa *h, int type, uint32_t id, const char *buf, int size) {
+    int i, ret;
+
+    for (i = 0; i < PUSH_RETRIES; i++) {
+        pthread_mutex_lock(&h->plock);
+        if (h->fd < 0) {
+            pthread_mutex_unlock(&h->plock);
+            return COMEATAR_NET_ERROR;
+        }
+        if ((ret = ring_push(&h->rings->up, type, id, buf, size)) == 0 && ring_doorbell(&h->rings->up))
+            send(h->fd, "U", 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+        pthread_mutex_unlock(&h->plock);
+        if (ret == 0)
+            return COMEATAR_OK;
+        usleep(PUSH_DELAY);
+    }
+    return COMEATAR_NET_ERROR;
+}   /* shim_push */
+
+/*
+ * Reader of the downstream ring, calling the message callback and writing its reply.
+ *
+ */
+static void *
+shim_loop(void *arg) {
+    struct cometa *h = (struct cometa *)arg;
+    struct ring *down = &h->rings->down;
+    struct rec rec;
+    char *data;
+    cometa_message_cb user_cb;
+    cometa_message_ctx_cb ctx_cb;
+    void *cb_ctx;
+    char buf[64], *response;
+    ssize_t n;
+    int fd;
+
+    for (;;) {
+        while ((data = (char *)ring_peek(down, &rec)) != NULL) {
+            if (rec.type == REC_DOWN) {
+                pthread_mutex_lock(&h->cblock);
+                user_cb = h->user_cb;
+                ctx_cb = h->ctx_cb;
+                cb_ctx = h->cb_ctx;
+                pthread_mutex_unlock(&h->cblock);
+                if (user_cb)
+                    response = user_cb(rec.len, data);
+                else
+                    response = ctx_cb ? ctx_cb(cb_ctx, rec.len, data) : NULL;
+                shim_push(h, REC_REPLY, rec.id, response ? response : "", response ? strlen(response) : 0);
+            }
+            ring_pop(down, rec.len);
+        }
+        if (!ring_wait(down))
+            continue;
+        if ((n = recv(h->fd, buf, sizeof(buf), 0)) > 0 || (n < 0 && errno == EINTR))
+            continue;
+
+        /* the daemon is gone: reconnect with new rings */
+        pthread_mutex_lock(&h->plock);
+        fd = h->fd;
+        h->fd = -1;
+        pthread_mutex_unlock(&h->plock);
+        close(fd);
+        while ((h->reply = shim_connect(h)) != COMEATAR_OK)
+            sleep(RECONNECT_DELAY);
+        down = &h->rings->down;
+    }
+    return NULL;
+}   /* shim_loop */
+
+/*
+ * Connect to the daemon, with the application name and key of its subscription. The application
+ * server parameters are not used.
+ *
+ * @return the connection handle or NULL, with the error in cometa_error(NULL)
+ *
+ */
+struct cometa *
+cometa_subscribe(const char *app_name, const char *app_key, const char *app_server_name, const char *app_server_port, const char *auth_endpoint) {
+    struct cometa *h = &shim;
+
+    if (app_name == NULL || app_key == NULL || strlen(app_name) > APP_NAME_LEN || strlen(app_key) > APP_KEY_LEN) {
+        h->reply = COMETAR_PAR_ERROR;
+        return NULL;
+    }
+    if (h->fd >= 0)
+        return h;
+    memset(&hello, 0, sizeof(hello));
+    hello.version = PROTO_VERSION;
+    strcpy(hello.app_name, app_name);
+    strcpy(hello.app_key, app_key);
+    strcpy(hello.route, route);
+
+    if ((h->reply = shim_connect(h)) != COMEATAR_OK)
+        return NULL;
+    if (pthread_create(&h->tid, NULL, shim_loop, h) != 0) {
+        h->reply = COMETAR_ERROR;
+        return NULL;
+    }
+    pthread_detach(h->tid);
+    return h;
+}   /* cometa_subscribe */
+
+/*
+ * Send a message upstream through the daemon.
+ *
+ */
+cometa_reply
+cometa_send(struct cometa *handle, const char *buf, const int size) {
+    if (handle == NULL || buf == NULL || size < 0 || MESSAGE_LEN - 12 < size)
+        return COMETAR_PAR_ERROR;
+    return shim_push(handle, REC_UP, 0, buf, size);
+}   /* cometa_send */
+
+/*
+ * The message is copied in the ring: sent at once and completed before returning.
+ *
+ */
+cometa_reply
+cometa_send_async(struct cometa *handle, const char *buf, int size, cometa_send_cb cb, void *ctx) {
+    cometa_reply ret = cometa_send(handle, buf, size);
+
+    if (ret == COMETAR_PAR_ERROR)
+        return ret;
+    if (cb)
+        cb(ctx, ret);
+    return COMEATAR_OK;
+}   /* cometa_send_async */
+
+cometa_reply
+cometa_bind_cb(struct cometa *handle, cometa_message_cb cb) {
+    if (handle == NULL)
+        return COMETAR_PAR_ERROR;
+    pthread_mutex_lock(&handle->cblock);
+    handle->user_cb = cb;
+    pthread_mutex_unlock(&handle->cblock);
+    return COMEATAR_OK;
+}   /* cometa_bind_cb */
+
+cometa_reply
+cometa_bind_cb_ctx(struct cometa *handle, cometa_message_ctx_cb cb, void *ctx) {
+    if (handle == NULL)
+        return COMETAR_PAR_ERROR;
+    pthread_mutex_lock(&handle->cblock);
+    handle->user_cb = NULL;
+    handle->ctx_cb = cb;
+    handle->cb_ctx = ctx;
+    pthread_mutex_unlock(&handle->cblock);
+    return COMEATAR_OK;
+}   /* cometa_bind_cb_ctx */
+
+cometa_reply
+cometa_error(struct cometa *handle) {
+    return handle ? handle->reply : shim.reply;
+}
+
+long
+cometa_epoch(struct cometa *handle) {
+    return handle->epoch;
+}
+
+const char *
+cometa_device_id(void) {
+    return device_id;
+}
@@ -0,0 +1,109 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected 
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+ 
+/*
+ *
+ * @file    cometa-coro.cpp
+ * @brief   Cometa client example with the C++20 interface and coroutines.
+ *
+ * A coroutine subscribes, then answers the messages received and sends a timestamp upstream every
+ * ten messages. Change the credentials as in cometa-client.c.
+ *
+ * Build and install the libcometa library before building this example.
+ *
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <exception>
+#include <string>
+#include <thread>
+
+#include <cometa.hpp>
+
+#define COMETA_APP_NAME "YOUR_COMETA_APP_NAME"
+#define COMETA_APP_KEY "YOUR_COMETA_APP_KEY"
+#define DEVICE_ID "YOUR_DEVICE_ID"
+#define DEVICE_KEY  "YOUR_DEVICE_KEY"
+#define APP_SERVERNAME "YOUR_APP_SERVERNAME"
+#define APP_SERVERPORT  "YOUR_APP_SERVERPORT"
+#define APP_ENDPOINT "YOUR_APP_ENDPOINT"
+
+/*
+ * A coroutine started eagerly and not awaited. A real application uses the task type of its
+ * executor.
+ */
+struct task {
+    struct promise_type {
+        task get_return_object() { return {}; }
+        std::suspend_never initial_suspend() { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+static task
+device(cometa_cpp::session &s)
+{
+    std::string up;
+    cometa_reply r;
+    int n = 0;
+
+    auto [session, result] = co_await cometa_cpp::subscribe_async(COMETA_APP_NAME, COMETA_APP_KEY, APP_SERVERNAME, APP_SERVERPORT, APP_ENDPOINT);
+    if (!session) {
+        fprintf(stderr, "Error in subscribe: %d\n", result);
+        co_return;
+    }
+    s = std::move(session);
+
+    while (s) {
+        /* the message is a view of the buffer of the library, valid until the next co_await */
+        cometa_cpp::message msg = co_await s.receive();
+        if (msg.empty())
+            continue;
+        printf("Received %zu bytes:\n%.*s\n", msg.size(), (int)msg.text().size(), msg.text().data());
+        msg.reply("Pong!");
+
+        if (++n % 10 == 0) {
+            up = "{\"time\":" + std::to_string(time(NULL)) + "}";
+            /* the upstream message stays in the coroutine frame until the send completes */
+            if ((r = co_await s.send_async(up)) != COMEATAR_OK)
+                fprintf(stderr, "Error in send: %d\n", r);
+        }
+    }
+}
+
+int
+main(void)
+{
+    cometa_cpp::session s;
+    cometa_reply r;
+
+    if ((r = cometa_cpp::init(DEVICE_ID, "linux", DEVICE_KEY)) != COMEATAR_OK) {
+        fprintf(stderr, "Error in init: %d\n", r);
+        return 1;
+    }
+    device(s);
+    /* the coroutine runs in the threads of the library */
+    while (1)
+        std::this_thread::sleep_for(std::chrono::seconds(60));
+    return 0;
+}
@@ -0,0 +1,270 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ *
+ * @file    cometa-top.c
+ * @brief   Monitor of the connections publishing their statistics with cometa_publish_stats().
+ *
+ * Usage: cometa-top [-i seconds] [-1] [page ...]
+ *
+ * With -1 the pages are shown once, after one interval.
+ *
+ * Without pages, all the pages in COMETA_STATS_DIR are shown. The pages are mapped read-only and
+ * copied with the sequence lock of the publisher, the monitored processes are not involved.
+ * The rates are computed between two refreshes, the latencies are of the last publishing period.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <cometa.h>
+
+#define MAX_PAGES   64
+
+struct monitor {
+    char *path;
+    const struct cometa_stats_page *page;   /* mapped page */
+    struct cometa_stats_page cur;           /* last copy */
+    struct cometa_stats_page prev;          /* copy at the previous refresh */
+    int valid;
+};
+
+static struct monitor monitors[MAX_PAGES];
+static int nmonitors;
+
+static const char *disc_names[] = { "none", "closed", "read", "write", "protocol" };
+
+/*
+ * Map the page in @path.
+ */
+static int
+monitor_open(const char *path) {
+    struct monitor *m;
+    struct stat st;
+    void *page;
+    int fd;
+
+    if (nmonitors == MAX_PAGES)
+        return -1;
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "cometa-top: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct cometa_stats_page)) {
+        fprintf(stderr, "cometa-top: %s: not a stats page\n", path);
+        close(fd);
+        return -1;
+    }
+    page = mmap(NULL, sizeof(struct cometa_stats_page), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        fprintf(stderr, "cometa-top: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    m = &monitors[nmonitors++];
+    m->path = strdup(path);
+    m->page = page;
+    return 0;
+}   /* monitor_open */
+
+/*
+ * Copy the page of @m with the sequence lock. Return 0 if the copy is consistent.
+ */
+static int
+monitor_read(struct monitor *m) {
+    const struct cometa_stats_page *page = m->page;
+    uint32_t s1, s2;
+    int tries;
+
+    if (__atomic_load_n(&page->magic, __ATOMIC_ACQUIRE) != COMETA_STATS_MAGIC
+            || page->version != COMETA_STATS_VERSION || page->size < sizeof(*page))
+        return -1;
+    for (tries = 0; tries < 1000; tries++) {
+        s1 = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+        if (s1 & 1)
+            continue;
+        memcpy(&m->cur, page, sizeof(m->cur));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        s2 = __atomic_load_n(&page->seq, __ATOMIC_RELAXED);
+        if (s1 == s2)
+            return 0;
+    }
+    return -1;
+}   /* monitor_read */
+
+/*
+ * Open the pages in COMETA_STATS_DIR.
+ */
+static void
+scan_dir(void) {
+    char path[512];
+    struct dirent *d;
+    DIR *dir;
+    size_t len;
+
+    dir = opendir(COMETA_STATS_DIR);
+    if (dir == NULL)
+        return;
+    while ((d = readdir(dir)) != NULL) {
+        len = strlen(d->d_name);
+        if (len < 7 || strcmp(d->d_name + len - 6, ".stats") != 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", COMETA_STATS_DIR, d->d_name);
+        monitor_open(path);
+    }
+    closedir(dir);
+}   /* scan_dir */
+
+/*
+ * Format the rate of @delta in @interval seconds.
+ */
+static const char *
+rate(char *buf, size_t len, uint64_t delta, double interval) {
+    double r = interval > 0 ? delta / interval : 0;
+
+    if (r >= 1e6)
+        snprintf(buf, len, "%.1fM", r / 1e6);
+    else if (r >= 1e4)
+        snprintf(buf, len, "%.1fk", r / 1e3);
+    else
+        snprintf(buf, len, "%.0f", r);
+    return buf;
+}   /* rate */
+
+/*
+ * Print one line for each page.
+ */
+static void
+show(double interval, int clear) {
+    char b[6][16];
+    struct timeval tv;
+    int64_t now;
+    int i;
+
+    gettimeofday(&tv, NULL);
+    now = (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+
+    if (clear)
+        printf("\033[H\033[2J");
+    printf("%-20s %6s %8s %7s %8s %7s %8s %5s %6s %6s %9s %9s %9s %-9s\n", "DEVICE", "PID", "UPTIME",
+            "MSG/s^", "B/s^", "MSG/s_", "B/s_", "RECON", "SNDQ", "RCVQ", "TURN p50", "TURN p99", "SHAPE", "LAST DISC");
+    for (i = 0; i < nmonitors; i++) {
+        struct monitor *m = &monitors[i];
+        const struct cometa_stats *s = &m->cur.stats, *p = &m->prev.stats;
+        const uint64_t *turn = m->cur.latency[COMETA_LAT_TURNAROUND];
+        double dt = m->valid ? interval : 0;
+        uint64_t shaped;
+        int disc;
+
+        if (monitor_read(m) < 0) {
+            printf("%-20s (no data)\n", m->path);
+            continue;
+        }
+        if (now - m->cur.updated > 3 * (int64_t)m->cur.period + 1000) {
+            printf("%-20.20s %6d (stale, last update %lld s ago)\n", m->cur.device_id, m->cur.pid,
+                    (long long)(now - m->cur.updated) / 1000);
+            m->valid = 0;
+            continue;
+        }
+        disc = s->last_disconnect;
+        /* mean delay of the messages shaped in the interval */
+        shaped = s->shaped - p->shaped;
+        if (dt > 0 && shaped > 0)
+            snprintf(b[5], sizeof(b[5]), "%.1fms", (double)(s->shape_delay_ns - p->shape_delay_ns) / shaped / 1e6);
+        else
+            strcpy(b[5], "-");
+        if (s->connected)
+            snprintf(b[4], sizeof(b[4]), "%llds", (long long)s->uptime);
+        else
+            strcpy(b[4], "down");
+        printf("%-20.20s %6d %8s %7s %8s %7s %8s %5llu %6d %6d %7.1fus %7.1fus %9s %-9s\n",
+                m->cur.device_id, m->cur.pid,
+                b[4],
+                rate(b[0], sizeof(b[0]), s->messages_up - p->messages_up, dt),
+                rate(b[1], sizeof(b[1]), s->bytes_up - p->bytes_up, dt),
+                rate(b[2], sizeof(b[2]), s->messages_down - p->messages_down, dt),
+                rate(b[3], sizeof(b[3]), s->bytes_down - p->bytes_down, dt),
+                (unsigned long long)s->reconnects, s->send_queue, s->recv_queue,
+                turn[COMETA_PCT_50] / 1e3, turn[COMETA_PCT_99] / 1e3, b[5],
+                disc >= 0 && disc < (int)(sizeof(disc_names) / sizeof(disc_names[0])) ? disc_names[disc] : "?");
+        m->prev = m->cur;
+        m->valid = 1;
+    }
+    fflush(stdout);
+}   /* show */
+
+int
+main(int argc, char *argv[]) {
+    double interval = 1;
+    int once = 0, opt, i;
+
+    while ((opt = getopt(argc, argv, "i:1")) != -1) {
+        switch (opt) {
+        case 'i':
+            interval = atof(optarg);
+            if (interval <= 0)
+                interval = 1;
+            break;
+        case '1':
+            once = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-i seconds] [-1] [page ...]\n", argv[0]);
+            exit(1);
+        }
+    }
+    for (i = optind; i < argc; i++)
+        monitor_open(argv[i]);
+    if (optind == argc)
+        scan_dir();
+    if (nmonitors == 0) {
+        fprintf(stderr, "cometa-top: no stats pages found in %s\n", COMETA_STATS_DIR);
+        exit(1);
+    }
+
+    if (once) {
+        /* the rates need two samples */
+        for (i = 0; i < nmonitors; i++)
+            if (monitor_read(&monitors[i]) == 0) {
+                monitors[i].prev = monitors[i].cur;
+                monitors[i].valid = 1;
+            }
+        usleep((useconds_t)(interval * 1e6));
+        show(interval, 0);
+        return 0;
+    }
+    for (;;) {
+        show(interval, 1);
+        usleep((useconds_t)(interval * 1e6));
+    }
+    return 0;
+}
@@ -0,0 +1,355 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file    aggregate.c
+ *
+ * @brief   Aggregation and deadband of the samples sent upstream.
+ *
+ * The samples of each channel are aggregated in a window that a scheduler thread sends with
+ * cometa_send() at the end of the period, or earlier when the pending report exceeds the byte
+ * limit or a report-on-change channel leaves its deadband. A report is a JSON object:
+ *
+ *    {"t":1379030944000,"temp":{"min":21.5,"max":23,"mean":22.1,"last":22,"count":60},...}
+ *
+ * with "t" the time of the report in milliseconds. Channels without samples, or with a last
+ * value within the deadband of the last value reported, are left out.
+ *
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+#include "cometa.h"
+#include "logger.h"
+#include "alloc.h"
+#include "realtime.h"
+
+#define AGG_NAME_LEN    32
+/* upper bound of the JSON length of a statistic: ,"mean":-1.23456789012345e+308 */
+#define AGG_STAT_LEN    32
+
+/*
+ * Aggregation window of a channel.
+ */
+struct channel {
+    char name[AGG_NAME_LEN + 1];
+    int stats;              /* COMETA_AGG_* flags */
+    double deadband;        /* < 0 to report every window */
+    double min;
+    double max;
+    double sum;
+    double last;
+    long count;
+    double reported;        /* last value reported */
+    int has_reported;
+};
+
+struct cometa_agg {
+    struct cometa *handle;
+    int nchannels;
+    int period;             /* report period in milliseconds */
+    int max_bytes;          /* byte limit of a report */
+    int pending;            /* upper bound of the length of the pending report */
+    int trigger;            /* send the report before the end of the period */
+    int stop;
+    pthread_t tid;
+    pthread_mutex_t lock;   /* protects the windows */
+    pthread_cond_t cond;
+    pthread_mutex_t send_lock;
+    struct channel *channels;
+    char *buf;              /* report */
+};
+
+static int
+stat_count(int stats) {
+    return __builtin_popcount(stats & (COMETA_AGG_MIN | COMETA_AGG_MAX | COMETA_AGG_MEAN | COMETA_AGG_LAST | COMETA_AGG_COUNT));
+}
+
+/*
+ * Length upper bound of the report entry of a channel.
+ */
+static int
+entry_len(struct channel *c) {
+    return strlen(c->name) + 6 + stat_count(c->stats) * AGG_STAT_LEN;
+}
+
+/*
+ * Check if the last value of a channel is out of the deadband.
+ */
+static int
+out_of_band(struct channel *c) {
+    if (c->count == 0)
+        return 0;
+    if (c->deadband < 0 || !c->has_reported)
+        return 1;
+    return (c->last > c->reported ? c->last - c->reported : c->reported - c->last) > c->deadband;
+}
+
+/*
+ * Build the report in the buffer and reset the windows. Called with the lock held.
+ *
+ * @result the report length, 0 if there is nothing to report
+ *
+ */
+static int
+build_report(struct cometa_agg *agg) {
+    struct channel *c;
+    struct timeval now;
+    int i, n, len, nreport = 0;
+    char *p;
+
+    gettimeofday(&now, NULL);
+    p = agg->buf;
+    len = agg->max_bytes;
+    n = snprintf(p, len, "{\"t\":%lld", (long long)now.tv_sec * 1000 + now.tv_usec / 1000);
+    p += n;
+    len -= n;
+    for (i = 0; i < agg->nchannels; i++) {
+        c = &agg->channels[i];
+        if (!out_of_band(c)) {
+            c->count = 0;
+            continue;
+        }
+        /* leave room for the closing braces */
+        if (entry_len(c) + 2 > len) {
+            log_error("ERROR: in build_report. Channel %s does not fit in the report.\r\n", c->name);
+            continue;
+        }
+        n = snprintf(p, len, ",\"%s\":{", c->name);
+        if (c->stats & COMETA_AGG_MIN)
+            n += snprintf(p + n, len - n, "\"min\":%.15g,", c->min);
+        if (c->stats & COMETA_AGG_MAX)
+            n += snprintf(p + n, len - n, "\"max\":%.15g,", c->max);
+        if (c->stats & COMETA_AGG_MEAN)
+            n += snprintf(p + n, len - n, "\"mean\":%.15g,", c->sum / c->count);
+        if (c->stats & COMETA_AGG_LAST)
+            n += snprintf(p + n, len - n, "\"last\":%.15g,", c->last);
+        if (c->stats & COMETA_AGG_COUNT)
+            n += snprintf(p + n, len - n, "\"count\":%ld,", c->count);
+        /* replace the trailing comma, or close the empty object */
+        if (p[n - 1] == ',')
+            p[n - 1] = '}';
+        else
+            p[n++] = '}';
+        p += n;
+        len -= n;
+        c->reported = c->last;
+        c->has_reported = 1;
+        c->count = 0;
+        nreport++;
+    }
+    agg->pending = 0;
+    agg->trigger = 0;
+    if (nreport == 0)
+        return 0;
+    *p++ = '}';
+    *p = '\0';
+    return p - agg->buf;
+}   /* build_report */
+
+/*
+ * The scheduler thread.
+ *
+ * The thread sends the report at the end of each period or when triggered by a new sample.
+ *
+ */
+static void *
+agg_scheduler(void *a) {
+    struct cometa_agg *agg = (struct cometa_agg *)a;
+    struct timespec deadline;
+    int stop;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    do {
+        deadline.tv_sec += agg->period / 1000;
+        deadline.tv_nsec += (agg->period % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&agg->lock);
+        while (!agg->stop && !agg->trigger) {
+            if (pthread_cond_timedwait(&agg->cond, &agg->lock, &deadline) == ETIMEDOUT)
+                break;
+        }
+        /* a triggered report starts a new period */
+        if (agg->trigger)
+            clock_gettime(CLOCK_REALTIME, &deadline);
+        stop = agg->stop;
+        pthread_mutex_unlock(&agg->lock);
+        cometa_agg_flush(agg);
+    } while (!stop);
+    return NULL;
+}   /* agg_scheduler */
+
+/*
+ * Create an aggregator with @nchannels channels for the connection @handle, reporting every
+ * @period milliseconds or earlier when the report would exceed @max_bytes.
+ *
+ */
+struct cometa_agg *
+cometa_agg_new(struct cometa *handle, int nchannels, int period, int max_bytes) {
+    struct cometa_agg *agg;
+    int i;
+
+    if (handle == NULL || nchannels <= 0 || period <= 0 || max_bytes < 64 || max_bytes > MESSAGE_LEN - 12)
+        return NULL;
+    if ((agg = cometa_calloc(1, sizeof(struct cometa_agg))) == NULL)
+        return NULL;
+    agg->handle = handle;
+    agg->nchannels = nchannels;
+    agg->period = period;
+    agg->max_bytes = max_bytes;
+    agg->channels = cometa_calloc(nchannels, sizeof(struct channel));
+    agg->buf = cometa_malloc(max_bytes);
+    if (agg->channels == NULL || agg->buf == NULL) {
+        cometa_free(agg->channels);
+        cometa_free(agg->buf);
+        cometa_free(agg);
+        return NULL;
+    }
+    for (i = 0; i < nchannels; i++) {
+        snprintf(agg->channels[i].name, AGG_NAME_LEN + 1, "ch%d", i);
+        agg->channels[i].stats = COMETA_AGG_LAST;
+        agg->channels[i].deadband = -1;
+    }
+    pthread_mutex_init(&agg->lock, NULL);
+    pthread_mutex_init(&agg->send_lock, NULL);
+    pthread_cond_init(&agg->cond, NULL);
+    if (rt_thread_start(&agg->tid, COMETA_THREAD_TIMER, 0, agg_scheduler, (void *)agg)) {
+        log_error("ERROR: in cometa_agg_new. Failed to create the scheduler thread.\r\n");
+        pthread_cond_destroy(&agg->cond);
+        pthread_mutex_destroy(&agg->send_lock);
+        pthread_mutex_destroy(&agg->lock);
+        cometa_free(agg->channels);
+        cometa_free(agg->buf);
+        cometa_free(agg);
+        return NULL;
+    }
+    return agg;
+}   /* cometa_agg_new */
+
+/*
+ * Stop the scheduler, send the pending report and release the aggregator.
+ *
+ */
+void
+cometa_agg_free(struct cometa_agg *agg) {
+    if (agg == NULL)
+        return;
+    pthread_mutex_lock(&agg->lock);
+    agg->stop = 1;
+    pthread_cond_signal(&agg->cond);
+    pthread_mutex_unlock(&agg->lock);
+    pthread_join(agg->tid, NULL);
+    pthread_cond_destroy(&agg->cond);
+    pthread_mutex_destroy(&agg->send_lock);
+    pthread_mutex_destroy(&agg->lock);
+    cometa_free(agg->channels);
+    cometa_free(agg->buf);
+    cometa_free(agg);
+}   /* cometa_agg_free */
+
+/*
+ * Set the @name, the statistics and the @deadband of the channel @ch.
+ *
+ */
+cometa_reply
+cometa_agg_channel(struct cometa_agg *agg, int ch, const char *name, int stats, double deadband) {
+    struct channel *c;
+
+    if (agg == NULL || ch < 0 || ch >= agg->nchannels || name == NULL || strlen(name) > AGG_NAME_LEN ||
+            strpbrk(name, "\"\\") != NULL || stat_count(stats) == 0)
+        return COMETAR_PAR_ERROR;
+    pthread_mutex_lock(&agg->lock);
+    c = &agg->channels[ch];
+    if (c->count > 0)
+        agg->pending -= entry_len(c);
+    strcpy(c->name, name);
+    c->stats = stats;
+    c->deadband = deadband;
+    c->has_reported = 0;
+    if (c->count > 0)
+        agg->pending += entry_len(c);
+    pthread_mutex_unlock(&agg->lock);
+    return COMEATAR_OK;
+}   /* cometa_agg_channel */
+
+/*
+ * Add the sample @value to the window of the channel @ch.
+ *
+ */
+cometa_reply
+cometa_agg_sample(struct cometa_agg *agg, int ch, double value) {
+    struct channel *c;
+
+    if (agg == NULL || ch < 0 || ch >= agg->nchannels || value != value)
+        return COMETAR_PAR_ERROR;
+    pthread_mutex_lock(&agg->lock);
+    c = &agg->channels[ch];
+    if (c->count == 0) {
+        c->min = c->max = c->sum = value;
+        agg->pending += entry_len(c);
+    } else {
+        if (value < c->min)
+            c->min = value;
+        if (value > c->max)
+            c->max = value;
+        c->sum += value;
+    }
+    c->last = value;
+    c->count++;
+
+    /* byte and change triggers */
+    if (!agg->trigger && (agg->pending + 24 > agg->max_bytes ||
+            ((c->stats & COMETA_AGG_ON_CHANGE) && c->has_reported && out_of_band(c)))) {
+        agg->trigger = 1;
+        pthread_cond_signal(&agg->cond);
+    }
+    pthread_mutex_unlock(&agg->lock);
+    return COMEATAR_OK;
+}   /* cometa_agg_sample */
+
+/*
+ * Send the pending report, if any.
+ *
+ */
+cometa_reply
+cometa_agg_flush(struct cometa_agg *agg) {
+    cometa_reply ret = COMEATAR_OK;
+    int n;
+
+    if (agg == NULL)
+        return COMETAR_PAR_ERROR;
+    /* the windows are released before sending */
+    pthread_mutex_lock(&agg->send_lock);
+    pthread_mutex_lock(&agg->lock);
+    n = build_report(agg);
+    pthread_mutex_unlock(&agg->lock);
+    if (n > 0)
+        ret = cometa_send(agg->handle, agg->buf, n);
+    pthread_mutex_unlock(&agg->send_lock);
+    return ret;
+}   /* cometa_agg_flush */
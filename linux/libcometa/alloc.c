@@ -0,0 +1,179 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file    alloc.c
+ *
+ * @brief   Memory allocation of the library.
+ *
+ * The library allocates its memory with the functions set by cometa_set_allocator(), by default
+ * the C library allocator. With cometa_set_arena() the memory comes from an arena supplied by the
+ * application: the blocks are taken in sequence, without locks, and they are never returned. The
+ * library allocates once for a connection and not when reconnecting, so that an arena of
+ * cometa_arena_size() bytes holds one connection for its lifetime.
+ *
+ * The rings of the asynchronous logging follow the lifetime of the threads and are allocated
+ * with the C library allocator.
+ *
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "cometa.h"
+#include "alloc.h"
+
+/* alignment of the blocks in the arena */
+#define ARENA_ALIGN     16
+
+static void *libc_alloc(void *ctx, size_t size);
+static void libc_free(void *ctx, void *ptr);
+
+/* current allocator */
+static cometa_alloc_fn alloc_fn = libc_alloc;
+static cometa_free_fn free_fn = libc_free;
+static void *alloc_ctx;
+
+/* arena */
+static struct {
+    char *mem;
+    size_t size;
+    size_t used;
+} arena;
+
+/*
+ * The C library allocator.
+ */
+static void *
+libc_alloc(void *ctx, size_t size) {
+    return malloc(size);
+}
+
+static void
+libc_free(void *ctx, void *ptr) {
+    free(ptr);
+}
+
+/*
+ * Take a block of @size bytes from the arena.
+ */
+static void *
+arena_alloc(void *ctx, size_t size) {
+    size_t used, next;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    used = __atomic_load_n(&arena.used, __ATOMIC_RELAXED);
+    do {
+        if (size > arena.size - used)
+            return NULL;
+        next = used + size;
+    } while (!__atomic_compare_exchange_n(&arena.used, &used, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return arena.mem + used;
+}   /* arena_alloc */
+
+/*
+ * The blocks are not returned to the arena.
+ */
+static void
+arena_free(void *ctx, void *ptr) {
+}
+
+void *
+cometa_malloc(size_t size) {
+    return alloc_fn(alloc_ctx, size);
+}
+
+void *
+cometa_calloc(size_t n, size_t size) {
+    void *p;
+
+    if (size != 0 && n > SIZE_MAX / size)
+        return NULL;
+    if ((p = alloc_fn(alloc_ctx, n * size)) != NULL)
+        memset(p, 0, n * size);
+    return p;
+}   /* cometa_calloc */
+
+char *
+cometa_strdup(const char *s) {
+    size_t len = strlen(s) + 1;
+    char *p;
+
+    if ((p = alloc_fn(alloc_ctx, len)) != NULL)
+        memcpy(p, s, len);
+    return p;
+}   /* cometa_strdup */
+
+void
+cometa_free(void *ptr) {
+    if (ptr != NULL)
+        free_fn(alloc_ctx, ptr);
+}
+
+/*
+ * Return 1 if the memory released is reused, that is the allocator is not the arena.
+ */
+int
+cometa_alloc_reclaims(void) {
+    return free_fn != arena_free;
+}
+
+/*
+ * Set the allocator of the library.
+ *
+ */
+cometa_reply
+cometa_set_allocator(cometa_alloc_fn alloc, cometa_free_fn free, void *ctx) {
+    if ((alloc == NULL) != (free == NULL))
+        return COMETAR_PAR_ERROR;
+    alloc_ctx = ctx;
+    alloc_fn = alloc ? alloc : libc_alloc;
+    free_fn = free ? free : libc_free;
+    return COMEATAR_OK;
+}   /* cometa_set_allocator */
+
+/*
+ * Allocate from the arena @mem.
+ *
+ */
+cometa_reply
+cometa_set_arena(void *mem, size_t size) {
+    uintptr_t start, end;
+
+    if (mem == NULL || size < ARENA_ALIGN)
+        return COMETAR_PAR_ERROR;
+    /* align the start of the arena */
+    start = ((uintptr_t)mem + ARENA_ALIGN - 1) & ~(uintptr_t)(ARENA_ALIGN - 1);
+    end = (uintptr_t)mem + size;
+    arena.mem = (char *)start;
+    arena.size = end - start;
+    arena.used = 0;
+    return cometa_set_allocator(arena_alloc, arena_free, NULL);
+}   /* cometa_set_arena */
+
+/*
+ * Return the bytes taken from the arena.
+ *
+ */
+size_t
+cometa_arena_used(void) {
+    return __atomic_load_n(&arena.used, __ATOMIC_RELAXED);
+}   /* cometa_arena_used */
@@ -0,0 +1,31 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file    alloc.h
+ *
+ * @brief   Internal memory allocation of the library, see alloc.c.
+ *
+ */
+
+void *cometa_malloc(size_t size);
+void *cometa_calloc(size_t n, size_t size);
+char *cometa_strdup(const char *s);
+void cometa_free(void *ptr);
+int cometa_alloc_reclaims(void);
@@ -37,6 +37,12 @@
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <linux/sockios.h>
+#endif
 
 #include <netinet/in.h>
 #include <netdb.h>
@@ -53,8 +59,18 @@
 #include <pthread.h>
 #include <sys/queue.h>
 
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
 #include "http_parser.h"
 #include "cometa.h"
+#include "probes.h"
+#include "logger.h"
+#include "flight.h"
+#include "alloc.h"
+#include "pool.h"
+#include "realtime.h"
 
 /** Public structures and constants **/
 
@@ -70,14 +86,91 @@
 // used to verify the certificate -- TODO: the certificate should accept *.cometa.io
 #define VERIFY_SERVERNAME "service.cometa.io"
 
+/* CA certificates to verify the server certificate */
+#define CAFILE "rootcert.pem"
+#define CADIR NULL
+
 /* special one byte chunk-data line from devices */
 #define MSG_HEARTBEAT   0x06
 /* special one byte chunk-data line from devices */
 #define MSG_UPSTREAM    0x07
 
-/* print debugging details on stderr */
-#define debug_print(...) \
-            do { if (DEBUG) fprintf(stderr, ##__VA_ARGS__); } while (0)
+/* timeout in seconds of the socket operations while subscribing */
+#define SUBSCRIBE_TIMEOUT   10
+
+/* size of the buffer for reading the stream from the server */
+#define READ_LEN    2048
+/* size of the buffer of a connection for the small messages */
+#define RECV_INLINE 256
+/* size of the buffers for the requests and the application server response during a subscription */
+#define REQUEST_LEN 2048
+#define APP_RESPONSE_LEN    8192
+
+/*
+ * Update and read the statistics counters of a connection without locks, and record in its latency
+ * histograms. Compiled with COMETA_NO_STATS the counters, the histograms and the flight recorder are left out.
+ */
+#ifndef COMETA_NO_STATS
+#define STAT_ADD(conn, field, val)  __atomic_fetch_add(&(conn)->stats.field, (val), __ATOMIC_RELAXED)
+#define STAT_SET(conn, field, val)  __atomic_store_n(&(conn)->stats.field, (val), __ATOMIC_RELAXED)
+#define STAT_GET(conn, field)       __atomic_load_n(&(conn)->stats.field, __ATOMIC_RELAXED)
+#define STAT_MAX(conn, field, val)  stat_max(&(conn)->stats.field, (val))
+#define LAT_RECORD(conn, which, ns) cometa_hist_record(&(conn)->lat[which], (ns))
+#define LAT_NOW()                   now_ns()
+#else
+#define STAT_ADD(conn, field, val)  ((void)0)
+#define STAT_SET(conn, field, val)  ((void)0)
+#define STAT_GET(conn, field)       0
+#define STAT_MAX(conn, field, val)  ((void)0)
+#define LAT_RECORD(conn, which, ns) ((void)(ns))
+#define LAT_NOW()                   0
+#endif
+
+
+/*
+ * A message queued by cometa_send_async().
+ *
+ */
+struct send_req {
+    STAILQ_ENTRY(send_req) next;
+    const char *buf;                /* message, owned by the caller until the completion */
+    int size;
+    cometa_send_cb cb;              /* completion callback */
+    void *ctx;
+};
+
+/* token buckets of the shaper */
+#define SHAPE_MSGS      0
+#define SHAPE_BYTES     1
+
+/*
+ * Token buckets of the upstream messages, see cometa_set_rate_limit(). A sender takes its tokens at
+ * once, leaving a bucket in debt if short of tokens, and waits until the debt is repaid: the senders
+ * are served in the order of their calls without a queue.
+ *
+ */
+struct shaper {
+    pthread_mutex_t lock;
+    int on;                         /* a rate is set */
+    double rate[2];                 /* tokens per second, 0 if not limited */
+    double burst[2];
+    double tokens[2];               /* negative while senders wait */
+    uint64_t last;                  /* time of the last refill */
+};
+
+/*
+ * A subscription in progress started by cometa_subscribe_async().
+ *
+ */
+struct subscribe_req {
+    const char *app_name;
+    const char *app_key;
+    const char *app_server_name;
+    const char *app_server_port;
+    const char *auth_endpoint;
+    cometa_subscribed_cb cb;        /* completion callback */
+    void *ctx;
+};
 
 /*
  * The cometa structure contains the connection socket and buffers.
@@ -85,33 +178,62 @@
  */
 struct cometa {
     int    sockfd;						/* socket to Cometa server */
-	char recvBuff[MESSAGE_LEN];		/* received buffer */
-    char sendBuff[MESSAGE_LEN];		/* send buffer */
-	int	app_sockfd;					/* socket to the application server */
+	char *recvBuff;					/* received message, in rinline or in a pooled buffer */
+    char *sendBuff;					/* pooled buffer for the requests during a subscription */
+	struct app_server *app_srv;		/* pooled connections to the application server */
 	char *app_name;					/* application name */
 	char *app_key;					/* application key */
 	char *app_server_name;			/* application server IP */
 	char *app_server_port;			/* application server port */
 	char *auth_endpoint;			/* application server authentication endpoint */
 	cometa_message_cb user_cb;		/* message callback */
+	cometa_message_ctx_cb ctx_cb;	/* message callback with a context */
+	void *cb_ctx;					/* context of ctx_cb */
+	STAILQ_HEAD(, send_req) sendq;	/* messages of cometa_send_async() */
+	pthread_mutex_t qlock;			/* lock for the send queue */
+	pthread_cond_t qcond;			/* signaled when a message is queued */
+	pthread_t	tsend;				/* thread for the send queue, started at the first message */
 	pthread_t	tloop;				/* thread for the receive loop */
 	pthread_t	tbeat;				/* thread for the heartbeat */
 	pthread_rwlock_t hlock;     	/* lock for heartbeat */
+	pthread_mutex_t rlock;			/* lock for the disconnection flag */
+	pthread_cond_t rcond;			/* signaled on disconnection to wake up the heartbeat thread */
 	int	hz;							/* heartbeat period in sec */	
+	long epoch;						/* server epoch time at subscription */
 	cometa_reply reply;				/* last reply code */
     int flag;                       /* disconnection flag */
+    http_parser parser;             /* parser of the HTTP stream from the server */
+    char *readBuff;                 /* pooled read buffer for the stream, held while data is pending */
+    int rtimeout;                   /* read timeout in seconds, or 0 */
+    int busy_poll;                  /* blocking reads busy polling the socket, holding readBuff */
+    int rpos;                       /* position of the data not yet parsed in readBuff */
+    int rlen;                       /* length of the data in readBuff */
+    int chunk_len;                  /* length of the chunk received in recvBuff */
+    int chunk_complete;             /* chunk complete flag */
+    int chunk_overflow;             /* chunk larger than recvBuff flag */
+    int stream_end;                 /* end of the stream flag */
+    int codec;                      /* codec for upstream messages or 0, also enables the decompression */
+    int dict;                       /* dictionary for upstream messages or 0 */
+    int zmin;                       /* minimum size of compressed upstream messages */
+    int cause;                      /* COMETA_DISC_* cause of the last read_chunk() error */
+    uint64_t rtime;                 /* time of the last read from the server */
+    uint64_t decode_ns;             /* time spent parsing the last chunk */
+    struct cometa_subscribe_timing sub_timing; /* timing of the last subscription attempt */
+    struct shaper shaper;           /* rate limit of the upstream messages */
+    char rinline[RECV_INLINE];      /* buffer for the small messages */
+#ifndef COMETA_NO_STATS
+    struct cometa_stats stats;      /* connection statistics */
+    struct cometa_hist lat[COMETA_LAT_NUM];    /* latency histograms */
+    struct flight flight;           /* flight recorder */
+#endif
 #ifdef USE_SSL
     BIO     *bconn;
     SSL     *ssl;
-    SSL_CTX *ctx;
 #endif    
 };
 
-http_parser parser;
+/* parser settings for the stream from the server, shared by all the connections */
 http_parser_settings settings;
-int header_complete;
-int body_complete;
-char *body_at;
 
 /*
  * Structure used during the connection process to track connections to all
@@ -122,11 +244,45 @@ struct ensemble {
     long    delay;      /* connection delay */
     int     sockfd;     /* socket used for this server */
     pthread_t tid;      /* thread id */
-    TAILQ_ENTRY(ensemble) next;
 };
 
-/* ensamble servers list */
-TAILQ_HEAD(,ensemble) servers;
+/* maximum number of servers of the ensemble probed */
+#define ENSEMBLE_LEN    8
+
+#ifndef COMETA_NO_APP_AUTH
+/* maximum number of idle keep-alive connections kept for an application server */
+#define APP_POOL_LEN    4
+
+/*
+ * Structure used to keep a pool of persistent connections to an application server
+ * authentication endpoint. The pool is shared by all the connections to the same
+ * server and it is reused across reconnections.
+ */
+struct app_server {
+    char    *name;                  /* application server name */
+    char    *port;                  /* application server port */
+    struct addrinfo *addr;          /* cached DNS lookup result */
+    int     idle[APP_POOL_LEN];     /* idle keep-alive sockets */
+    int     nidle;                  /* number of idle sockets */
+    int     pending;                /* connections being opened in background */
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    TAILQ_ENTRY(app_server) next;
+};
+
+/* application servers list */
+TAILQ_HEAD(,app_server) app_servers = TAILQ_HEAD_INITIALIZER(app_servers);
+pthread_mutex_t app_servers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Structure used to collect the body of a response from the application server.
+ */
+struct app_response {
+    char    *body;          /* body start in the receive buffer */
+    size_t  len;            /* body length */
+    int     complete;       /* message complete flag */
+};
+#endif
 
 /** Library global variables **/
 
@@ -135,36 +291,332 @@ struct {
 	char *id;     	/* device id */
 	char *key;		/* device key */
 	char *info;		/* device platform information */
+	unsigned char *auth_key;	/* key for signing the challenge locally */
+	int auth_key_len;			/* length of the signing key */
 } device;
 
+/* global variable holding the Cometa server to connect to */
+struct {
+	char name[256];			/* server FQ name */
+	char port[8];			/* server port */
+	char verify_name[256];	/* name in the server certificate */
+	char ca_file[256];		/* CA certificates file */
+} server = { SERVERNAME, SERVERPORT, VERIFY_SERVERNAME, CAFILE };
+
 /* last used connection */
 struct cometa *conn_save = NULL;
 
+#ifdef USE_SSL
+/* TLS context shared by the connections, created at the first subscription */
+static SSL_CTX *tls_ctx = NULL;
+static pthread_mutex_t tls_lock = PTHREAD_MUTEX_INITIALIZER;
+/* maximum fragment length requested to the server, 0 for the default */
+static int tls_fragment = 0;
+#endif
+
+/* callback at the end of the subscription attempts */
+cometa_subscribe_cb subscribe_cb = NULL;
+void *subscribe_ctx = NULL;
+
+/*
+ * Timing of the subscription in progress.
+ */
+struct sub_timer {
+    struct cometa_subscribe_timing t;
+    struct cometa *conn;    /* connection subscribing, for the probes */
+    int phase;          /* current phase */
+    uint64_t mark;      /* start of the current phase */
+};
+
 /** Functions definitions **/
 
-int on_headers_complete(http_parser* _) {
-  (void)_;
-  printf("\n***HEADERS COMPLETE***\n\n");
-  header_complete = 1;
-  return 0;
+/*
+ * Monotonic time in nanoseconds for the latency measures.
+ */
+static inline uint64_t
+now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#ifndef COMETA_NO_STATS
+/*
+ * Raise the counter at @p to @val if larger.
+ */
+static inline void
+stat_max(uint64_t *p, uint64_t val) {
+    uint64_t cur = __atomic_load_n(p, __ATOMIC_RELAXED);
+
+    while (val > cur && !__atomic_compare_exchange_n(p, &cur, val, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+#endif
+
+/*
+ * Return the buffer of the received message to the pool, if not the inline buffer.
+ */
+static void
+recv_release(struct cometa *conn) {
+    if (conn->recvBuff != conn->rinline) {
+        pool_put(conn->recvBuff);
+        conn->recvBuff = conn->rinline;
+    }
+}
+
+/*
+ * Answer with an empty reply a message that is not passed to the callback, so that the server
+ * does not wait for the reply, and release the message.
+ */
+static void
+reply_error(struct cometa *handle) {
+    static const char empty[] = "2\r\n\r\n";
+    ssize_t n;
+
+    if (pthread_rwlock_wrlock(&(handle->hlock)) != 0) {
+        log_error("ERROR: in message receive loop. Failed to get wrlock. Exiting.\r\n");
+        flight_dump(&handle->flight, COMETA_FR_DUMP_FATAL);
+        exit (-1);
+    }
+#ifdef USE_SSL
+    n = SSL_write(handle->ssl, empty, sizeof(empty) - 1);
+#else
+    n = write(handle->sockfd, empty, sizeof(empty) - 1);
+#endif
+    pthread_rwlock_unlock(&(handle->hlock));
+    recv_release(handle);
+    STAT_ADD(handle, recv_errors, 1);
+    flight_record(&handle->flight, COMETA_FR_REPLY, n, n <= 0 ? errno : 0, 0, 0);
+    if (n > 0) {
+        STAT_ADD(handle, replies, 1);
+        STAT_ADD(handle, bytes_up, n);
+    } else
+        STAT_SET(handle, last_errno, errno);
+}   /* reply_error */
+
+/*
+ * Parser callbacks for the stream from the server. The server response to the subscribe
+ * request is an endless chunked body and every chunk is a message.
+ */
+static int
+on_chunk_header(http_parser *p) {
+    struct cometa *conn = (struct cometa *)p->data;
+
+    /* a buffer for the message from the pool, unless it fits inline */
+    recv_release(conn);
+    conn->chunk_len = 0;
+    conn->chunk_overflow = (p->content_length > MESSAGE_LEN - 1);
+    if (!conn->chunk_overflow && p->content_length >= RECV_INLINE) {
+        if ((conn->recvBuff = pool_get(p->content_length + 1)) == NULL) {
+            conn->recvBuff = conn->rinline;
+            conn->chunk_overflow = 1;
+        }
+    }
+    return 0;
+}
+
+static int
+on_body(http_parser *p, const char *at, size_t length) {
+    struct cometa *conn = (struct cometa *)p->data;
+
+    /* the body of a chunk may be received in pieces */
+    if (!conn->chunk_overflow) {
+        memcpy(conn->recvBuff + conn->chunk_len, at, length);
+        conn->chunk_len += length;
+    }
+    return 0;
+}
+
+static int
+on_chunk_complete(http_parser *p) {
+    struct cometa *conn = (struct cometa *)p->data;
+
+    conn->chunk_complete = 1;
+    /* stop parsing after a chunk and leave the rest in the read buffer */
+    http_parser_pause(p, 1);
+    return 0;
+}
+
+static int
+on_message_complete(http_parser *p) {
+    struct cometa *conn = (struct cometa *)p->data;
+
+    /* the server terminated the chunked body */
+    conn->stream_end = 1;
+    return 0;
 }
 
-int on_body(http_parser* _, const char* at, size_t length) {
-  (void)_;
-  printf("\n*** BODY ***\n\n");
-  printf("Body: %.*s\n", (int)length, at);
-  body_complete = 1;
-  body_at = (char *)at;
-  *(body_at + length) = '\0';
-  return 0;
+/*
+ * End the current phase of the subscription timer @st and start the phase @next.
+ *
+ */
+static void
+phase_next(struct sub_timer *st, int next) {
+    uint64_t now = now_ns();
+
+    st->t.phase[st->phase] = now - st->mark;
+    COMETA_PROBE3(subscribe__phase, st->conn, st->phase, st->t.phase[st->phase]);
+    if (st->conn)
+        flight_record(&st->conn->flight, COMETA_FR_PHASE, st->phase, (int)(st->t.phase[st->phase] / 1000), 0, 0);
+    st->mark = now;
+    st->phase = next;
+}   /* phase_next */
+
+#ifdef USE_SSL
+/*
+ * Record in the flight recorder the TLS error of the operation @op (0 connect, 1 read, 2 write) that returned @ret.
+ *
+ */
+static void
+tls_error(struct cometa *conn, int ret, int op) {
+    flight_record(&conn->flight, COMETA_FR_TLS_ERROR, SSL_get_error(conn->ssl, ret), (int)ERR_peek_last_error(), op, 0);
 }
+#endif
 
-int on_message_complete(http_parser* _) {
-  (void)_;
-  printf("\n***MESSAGE COMPLETE***\n\n");
-  return 0;
+/*
+ * Reset the stream parser of the connection @conn for a new subscribe request.
+ *
+ */
+static void
+stream_reset(struct cometa *conn) {
+    http_parser_init(&conn->parser, HTTP_RESPONSE);
+    conn->parser.data = conn;
+    conn->rpos = conn->rlen = 0;
+    conn->stream_end = 0;
+    if (conn->readBuff) {
+        pool_put(conn->readBuff);
+        conn->readBuff = NULL;
+    }
 }
 
+/*
+ * Read from the server in the pooled read buffer. The buffer is held while the data arrives and
+ * it is returned before waiting for more: an idle connection waits without a buffer. With busy
+ * polling the buffer is kept and the read blocks.
+ *
+ * @result the bytes read, 0 if the connection was closed or -1 in case of error
+ *
+ */
+static int
+read_stream(struct cometa *conn) {
+    struct pollfd pfd;
+    int n;
+
+    if (conn->busy_poll) {
+        /* low latency: the read busy polls the socket before blocking, SO_RCVTIMEO is the timeout */
+        if (conn->readBuff == NULL && (conn->readBuff = pool_get(READ_LEN)) == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+#ifdef USE_SSL
+        return SSL_read(conn->ssl, conn->readBuff, READ_LEN);
+#else
+        return read(conn->sockfd, conn->readBuff, READ_LEN);
+#endif
+    }
+    pfd.fd = conn->sockfd;
+    pfd.events = POLLIN;
+    if (conn->readBuff) {
+        /* more data while busy, in the TLS buffers or in the socket */
+#ifdef USE_SSL
+        if (SSL_pending(conn->ssl) > 0 || poll(&pfd, 1, 0) > 0)
+            return SSL_read(conn->ssl, conn->readBuff, READ_LEN);
+#else
+        n = recv(conn->sockfd, conn->readBuff, READ_LEN, MSG_DONTWAIT);
+        if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            return n;
+#endif
+        /* idle: wait for data without the buffer */
+        pool_put(conn->readBuff);
+        conn->readBuff = NULL;
+    }
+    do {
+        n = poll(&pfd, 1, conn->rtimeout ? conn->rtimeout * 1000 : -1);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        if (n == 0)
+            errno = EAGAIN;
+        return -1;
+    }
+    if ((conn->readBuff = pool_get(READ_LEN)) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+#ifdef USE_SSL
+    return SSL_read(conn->ssl, conn->readBuff, READ_LEN);
+#else
+    return read(conn->sockfd, conn->readBuff, READ_LEN);
+#endif
+}   /* read_stream */
+
+/*
+ * Read from the server until a chunk is received. The chunk body is copied in the connection
+ * recvBuff and it is zero-terminated.
+ *
+ * @result the chunk length or -1 in case of error or closed connection - @errno is set
+ * to EMSGSIZE if the chunk is larger than the buffer, and the cause of the error is in @conn->cause.
+ *
+ */
+static int
+read_chunk(struct cometa *conn) {
+    size_t parsed;
+    uint64_t start;
+    int n;
+
+    conn->chunk_len = 0;
+    conn->chunk_complete = 0;
+    conn->chunk_overflow = 0;
+    conn->decode_ns = 0;
+    while (!conn->chunk_complete) {
+        if (conn->stream_end) {
+            conn->cause = COMETA_DISC_CLOSED;
+            return -1;
+        }
+        if (conn->rpos == conn->rlen) {
+            n = read_stream(conn);
+            if (n <= 0) {
+                conn->cause = (n == 0) ? COMETA_DISC_CLOSED : COMETA_DISC_READ;
+                if (n < 0)
+                    STAT_SET(conn, last_errno, errno);
+                flight_record(&conn->flight, COMETA_FR_READ_ERROR, n, n < 0 ? errno : 0, conn->cause, 0);
+#ifdef USE_SSL
+                tls_error(conn, n, 1);
+#endif
+                return -1;
+            }
+            STAT_ADD(conn, bytes_down, n);
+            conn->rtime = LAT_NOW();
+            conn->rpos = 0;
+            conn->rlen = n;
+        }
+        start = LAT_NOW();
+        parsed = http_parser_execute(&conn->parser, &settings, conn->readBuff + conn->rpos, conn->rlen - conn->rpos);
+        conn->rpos += parsed;
+        conn->decode_ns += LAT_NOW() - start;
+        if (HTTP_PARSER_ERRNO(&conn->parser) == HPE_PAUSED) {
+            http_parser_pause(&conn->parser, 0);
+        } else if (HTTP_PARSER_ERRNO(&conn->parser) != HPE_OK) {
+            debug_print("DEBUG: error parsing the stream from the server: %s\r\n", http_errno_name(HTTP_PARSER_ERRNO(&conn->parser)));
+            conn->cause = COMETA_DISC_PROTOCOL;
+            flight_record(&conn->flight, COMETA_FR_READ_ERROR, -1, 0, conn->cause, 0);
+            return -1;
+        }
+    }
+    if (conn->parser.status_code != 200) {
+        debug_print("DEBUG: HTTP status %d from the server.\r\n", conn->parser.status_code);
+        conn->cause = COMETA_DISC_PROTOCOL;
+        flight_record(&conn->flight, COMETA_FR_READ_ERROR, -1, conn->parser.status_code, conn->cause, 0);
+        return -1;
+    }
+    if (conn->chunk_overflow) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    conn->recvBuff[conn->chunk_len] = '\0';
+    return conn->chunk_len;
+}   /* read_chunk */
+
 #ifdef USE_SSL
 static int 
 verify_callback(int ok, X509_STORE_CTX *store)
@@ -177,12 +629,12 @@ verify_callback(int ok, X509_STORE_CTX *store)
         int  depth = X509_STORE_CTX_get_error_depth(store);
         int  err = X509_STORE_CTX_get_error(store);
  
-        fprintf(stderr, "-Error with certificate at depth: %i\n", depth);
+        log_error("-Error with certificate at depth: %i\n", depth);
         X509_NAME_oneline(X509_get_issuer_name(cert), data, 256);
-        fprintf(stderr, "  issuer   = %s\n", data);
+        log_error("  issuer   = %s\n", data);
         X509_NAME_oneline(X509_get_subject_name(cert), data, 256);
-        fprintf(stderr, "  subject  = %s\n", data);
-        fprintf(stderr, "  err %i:%s\n", err, X509_verify_cert_error_string(err));
+        log_error("  subject  = %s\n", data);
+        log_error("  err %i:%s\n", err, X509_verify_cert_error_string(err));
     }
  
     return ok;
@@ -194,7 +646,7 @@ post_connection_check(SSL *ssl, char *host)
     X509      *cert;
     X509_NAME *subj;
     char      data[256];
-    int       extcount;
+    GENERAL_NAMES *names;
     int       ok = 0;
  
     /* Checking the return from SSL_get_peer_certificate here is not strictly
@@ -205,63 +657,41 @@ post_connection_check(SSL *ssl, char *host)
      */
     if (!(cert = SSL_get_peer_certificate(ssl)) || !host)
         goto err_occured;
-    if ((extcount = X509_get_ext_count(cert)) > 0)
+    /* the extension structures are opaque since OpenSSL 1.1, decode the subjectAltName with the API */
+    if ((names = X509_get_ext_d2i(cert, NID_subject_alt_name, NULL, NULL)) != NULL)
     {
-        int i;
- 
-        for (i = 0;  i < extcount;  i++)
+        int                  j;
+        const GENERAL_NAME   *name;
+        const unsigned char  *dns;
+
+        for (j = 0;  j < sk_GENERAL_NAME_num(names);  j++)
         {
-            char              *extstr;
-            X509_EXTENSION    *ext;
- 
-            ext = X509_get_ext(cert, i);
-            extstr = (char*) OBJ_nid2sn(OBJ_obj2nid(X509_EXTENSION_get_object(ext)));
- 
-            if (!strcmp(extstr, "subjectAltName"))
-            {
-                int                  j;
-                unsigned char        *data;
-                STACK_OF(CONF_VALUE) *val;
-                CONF_VALUE           *nval;
-                X509V3_EXT_METHOD    *meth;
-                void                 *ext_str = NULL;
- 
-                if (!(meth = X509V3_EXT_get(ext)))
-                    break;
-                data = ext->value->data;
-
-#if (OPENSSL_VERSION_NUMBER > 0x00907000L)
-                if (meth->it)
-                  ext_str = ASN1_item_d2i(NULL, &data, ext->value->length,
-                                          ASN1_ITEM_ptr(meth->it));
-                else
-                  ext_str = meth->d2i(NULL, &data, ext->value->length);
+            name = sk_GENERAL_NAME_value(names, j);
+            if (name->type != GEN_DNS)
+                continue;
+#if (OPENSSL_VERSION_NUMBER >= 0x10100000L)
+            dns = ASN1_STRING_get0_data(name->d.dNSName);
 #else
-                ext_str = meth->d2i(NULL, &data, ext->value->length);
+            dns = ASN1_STRING_data(name->d.dNSName);
 #endif
-                val = meth->i2v(meth, ext_str, NULL);
-                for (j = 0;  j < sk_CONF_VALUE_num(val);  j++)
-                {
-                    nval = sk_CONF_VALUE_value(val, j);
-                    if (!strcmp(nval->name, "DNS") && !strcmp(nval->value, host))
-                    {
-                        ok = 1;
-                        break;
-                    }
-                }
-            }
-            if (ok)
+            if (ASN1_STRING_length(name->d.dNSName) == (int)strlen(host) && !strncasecmp((const char *)dns, host, strlen(host)))
+            {
+                ok = 1;
                 break;
+            }
         }
+        GENERAL_NAMES_free(names);
     }
  
     if (!ok && (subj = X509_get_subject_name(cert)) &&
         X509_NAME_get_text_by_NID(subj, NID_commonName, data, 256) > 0)
     {
         data[255] = 0;
-        if (strcasecmp(data, host) != 0)
-            goto err_occured;
+        if (strcasecmp(data, host) == 0)
+            ok = 1;
     }
+    if (!ok)
+        goto err_occured;
  
     X509_free(cert);
     return SSL_get_verify_result(ssl);
@@ -272,30 +702,176 @@ err_occured:
     return X509_V_ERR_APPLICATION_VERIFICATION;
 }
 
-#define CAFILE "rootcert.pem"
-#define CADIR NULL
-
 static SSL_CTX *
 setup_client_ctx(void)
 {
     SSL_CTX *ctx;
  
-    ctx = SSL_CTX_new(SSLv23_method());
-    if (SSL_CTX_load_verify_locations(ctx, CAFILE, CADIR) != 1)
-        fprintf(stderr, "ERROR: Error loading CA file and/or directory (verify_locations).\n");
+    if ((ctx = SSL_CTX_new(SSLv23_method())) == NULL)
+        return NULL;
+    if (SSL_CTX_load_verify_locations(ctx, server.ca_file, CADIR) != 1)
+        log_error("ERROR: Error loading CA file and/or directory (verify_locations).\n");
     if (SSL_CTX_set_default_verify_paths(ctx) != 1)
-        fprintf(stderr, "Error loading default CA file and/or directory (verify_path).\n");
+        log_error("Error loading default CA file and/or directory (verify_path).\n");
 
     SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, verify_callback);
     SSL_CTX_set_verify_depth(ctx, 4);
+    /* the record buffers are released while the connection is idle */
+    SSL_CTX_set_mode(ctx, SSL_MODE_AUTO_RETRY | SSL_MODE_RELEASE_BUFFERS);
+#if (OPENSSL_VERSION_NUMBER >= 0x10101000L)
+    /* smaller records and record buffers, if the server accepts the extension */
+    if (tls_fragment) {
+        uint8_t mode = tls_fragment == 512 ? TLSEXT_max_fragment_length_512 :
+                       tls_fragment == 1024 ? TLSEXT_max_fragment_length_1024 :
+                       tls_fragment == 2048 ? TLSEXT_max_fragment_length_2048 : TLSEXT_max_fragment_length_4096;
+        SSL_CTX_set_tlsext_max_fragment_length(ctx, mode);
+    }
+#endif
     return ctx;
 }
+
+/*
+ * A new TLS session with the context shared by the connections. The context and its CA store are
+ * set up once and they are not modified afterwards: a change of the settings replaces the context
+ * for the next sessions, and a session keeps a reference to the context it was created with.
+ *
+ * @return the SSL object or NULL in case of error
+ *
+ */
+static SSL *
+tls_session(void)
+{
+    SSL *ssl = NULL;
+
+    pthread_mutex_lock(&tls_lock);
+    if (tls_ctx == NULL)
+        tls_ctx = setup_client_ctx();
+    if (tls_ctx)
+        ssl = SSL_new(tls_ctx);
+    pthread_mutex_unlock(&tls_lock);
+    return ssl;
+}   /* tls_session */
+
+/*
+ * Release the shared TLS context after a change of its settings.
+ *
+ */
+static void
+tls_reset(void)
+{
+    pthread_mutex_lock(&tls_lock);
+    SSL_CTX_free(tls_ctx);
+    tls_ctx = NULL;
+    pthread_mutex_unlock(&tls_lock);
+}   /* tls_reset */
 #endif
 
+/*
+ * Set the timeout of the blocking operations on the socket @fd of the connection, or no timeout
+ * with @sec 0. The timeout also applies to the wait for data in read_stream().
+ *
+ */
+static void
+set_timeout(struct cometa *conn, int fd, int sec) {
+    struct timeval tv;
+
+    conn->rtimeout = sec;
+
+    tv.tv_sec = sec;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}   /* set_timeout */
+
+/*
+ * Connect the socket @fd to the address @addr of @len bytes in at most @sec seconds. A server
+ * dropping the SYNs would otherwise stall a blocking connect() for the retries of the kernel.
+ *
+ * @result 0 or -1 with errno set, the socket is left blocking
+ *
+ */
+static int
+connect_timeout(int fd, const struct sockaddr *addr, socklen_t len, int sec) {
+    struct pollfd pfd;
+    socklen_t elen = sizeof(int);
+    int flags, err = 0, n;
+
+    if ((flags = fcntl(fd, F_GETFL)) < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        return -1;
+    if (connect(fd, addr, len) < 0) {
+        if (errno != EINPROGRESS)
+            err = errno;
+        else {
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            while ((n = poll(&pfd, 1, sec * 1000)) < 0 && errno == EINTR)
+                ;
+            if (n == 0)
+                err = ETIMEDOUT;
+            else if (n < 0)
+                err = errno;
+            else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &elen) < 0)
+                err = errno;
+        }
+    }
+    fcntl(fd, F_SETFL, flags);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}   /* connect_timeout */
+
+/*
+ * Signal the disconnection to the heartbeat thread, and record the COMETA_DISC_* @cause unless zero.
+ *
+ */
+static void
+set_disconnected(struct cometa *handle, int cause) {
+	int connected;
+
+	if (cause)
+		STAT_SET(handle, last_disconnect, cause);
+	pthread_mutex_lock(&handle->rlock);
+	connected = (handle->flag == 0);
+	handle->flag = 1;
+	pthread_cond_signal(&handle->rcond);
+	pthread_mutex_unlock(&handle->rlock);
+	if (connected) {
+		/* dump the events that led to the disconnection */
+		flight_record(&handle->flight, COMETA_FR_STATE, 0, cause, 0, 0);
+		flight_dump(&handle->flight, COMETA_FR_DUMP_DISCONNECT);
+	}
+}	/* set_disconnected */
+
+/*
+ * Wait for @msec milliseconds, or until a disconnection if @wake is set.
+ *
+ */
+static void
+heartbeat_wait(struct cometa *handle, long msec, int wake) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += msec / 1000;
+	ts.tv_nsec += (msec % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	pthread_mutex_lock(&handle->rlock);
+	while (!(wake && handle->flag == 1)) {
+		if (pthread_cond_timedwait(&handle->rcond, &handle->rlock, &ts) == ETIMEDOUT)
+			break;
+	}
+	pthread_mutex_unlock(&handle->rlock);
+}	/* heartbeat_wait */
+
 /*
  * The heartbeat thread.
  *
  * This thread detects a server disconnection and attempts to reconnect to a server in the Cometa ensemble.
+ * It is woken up by the receive loop as soon as the connection is lost.
  *
  */
 static void *
@@ -303,40 +879,68 @@ send_heartbeat(void *h) {
 	struct cometa *handle, *ret_sub;
     int ret;
     ssize_t n;
+    long backoff = 0;
+    char beat[8];
 	
 	handle = (struct cometa *)h;
-	usleep(handle->hz * 1000000);
+	heartbeat_wait(handle, handle->hz * 1000L, 1);
 	do {
-		if ((ret = pthread_rwlock_wrlock(&handle->hlock)) != 0) {
-	        fprintf(stderr, "ERROR: in send_heartbeat. Failed to get wrlock. ret = %d. Exiting.\r\n", ret);
-	        exit (-1);
-	    }
-		debug_print("DEBUG: sending heartbeat.\r\n");
-		/* send a heartbeat */
-		sprintf(handle->sendBuff, "2\n%c\n", MSG_HEARTBEAT);    // "2\n\x06\n"	
+		if (handle->flag == 0) {
+			if ((ret = pthread_rwlock_wrlock(&handle->hlock)) != 0) {
+		        log_error("ERROR: in send_heartbeat. Failed to get wrlock. ret = %d. Exiting.\r\n", ret);
+		        flight_dump(&handle->flight, COMETA_FR_DUMP_FATAL);
+		        exit (-1);
+		    }
+			debug_print("DEBUG: sending heartbeat.\r\n");
+			/* send a heartbeat */
+			sprintf(beat, "2\n%c\n", MSG_HEARTBEAT);    // "2\n\x06\n"	
 #ifdef USE_SSL
-    	n = SSL_write(handle->ssl, handle->sendBuff, strlen(handle->sendBuff));
+	    	n = handle->ssl ? SSL_write(handle->ssl, beat, strlen(beat)) : -1;
 #else
-		n = write(handle->sockfd, handle->sendBuff, strlen(handle->sendBuff));
+			n = write(handle->sockfd, beat, strlen(beat));
 #endif
 
-	    pthread_rwlock_unlock(&(handle->hlock));
-        /* check for SIGPIPE broken pipe */
-        if (n <= 0 || handle->flag == 1) { //&& (errno == EPIPE)) {
-            /* connection lost */
-            debug_print("in send_heartbeat: n = %d, errno = %d\n", (int)n, (int)errno);
-            /* attempt to reconnect */
-            /* TODO: add a random delay to avoid server flooding when many devices disconnect at the same time */
+		    pthread_rwlock_unlock(&(handle->hlock));
+		    COMETA_PROBE2(heartbeat, handle, (int)n);
+		    flight_record(&handle->flight, COMETA_FR_HEARTBEAT, (int)n, n <= 0 ? errno : 0, 0, 0);
+#ifdef USE_SSL
+		    if (n <= 0 && handle->ssl)
+		        tls_error(handle, (int)n, 2);
+#endif
+	        /* check for SIGPIPE broken pipe */
+	        if (n <= 0) {
+	            debug_print("in send_heartbeat: n = %d, errno = %d\n", (int)n, (int)errno);
+	            STAT_SET(handle, last_errno, errno);
+	            STAT_SET(handle, last_error, COMEATAR_NET_ERROR);
+	            set_disconnected(handle, COMETA_DISC_WRITE);
+	        } else {
+	            STAT_ADD(handle, heartbeats, 1);
+	            STAT_ADD(handle, bytes_up, n);
+	        }
+		}
+        if (handle->flag == 1) {
+            /* connection lost: attempt to reconnect */
+            COMETA_PROBE3(reconnect, handle, STAT_GET(handle, last_disconnect), backoff);
+            flight_record(&handle->flight, COMETA_FR_RECONNECT, (int)backoff, 0, 0, 0);
             ret_sub = cometa_subscribe(conn_save->app_name, conn_save->app_key, conn_save->app_server_name, conn_save->app_server_port, conn_save->auth_endpoint);
             if (ret_sub == NULL) {
                 debug_print("ERROR: attempt to reconnect to the server failed.\n");
+                STAT_ADD(handle, reconnect_failures, 1);
+                STAT_SET(handle, last_error, handle->reply);
+                set_disconnected(handle, 0);
+                /* retry with an exponential backoff up to the heartbeat period, and a random delay to avoid
+                   flooding the servers when many devices disconnect at the same time */
+                backoff = backoff ? backoff * 2 : 500;
+                if (backoff > handle->hz * 1000L)
+                    backoff = handle->hz * 1000L;
+                heartbeat_wait(handle, backoff / 2 + random() % (backoff / 2 + 1), 0);
+                continue;
             }
+            backoff = 0;
         }
-		
-		while (usleep(handle->hz * 1000000) == -1 && (errno == EINTR))
-			/* interrupted by a SIGNAL */
-			continue;
+		heartbeat_wait(handle, handle->hz * 1000L, 1);
 	} while (1);
+	return NULL;
 }	/* send_heartbeat */
 
 /* 
@@ -344,10 +948,11 @@ send_heartbeat(void *h) {
  */
 static void *
 recv_loop(void *h) {
-	char *response;
+	char *response, *reply, *zbuf;
+	char rbuf[RECV_INLINE];
 	struct cometa *handle;
-	int n;
-    int ret, ch, len;
+	int n, len;
+	uint64_t t0, t1;
 	
 	handle = (struct cometa *)h;
     /* 
@@ -355,114 +960,102 @@ recv_loop(void *h) {
 	 */
     while (1) {
 
-        /* read the first line of the chuck containing the body length */
-        n = 0;
-        do {
-#ifdef USE_SSL
-            ret = SSL_read(handle->ssl, handle->recvBuff + n, 1);
-#else
-            ret = read(handle->sockfd, handle->recvBuff + n, 1);
-#endif
-            ch = *(handle->recvBuff + n);
-            // printf("--- %d %d\n", n, ch);
-            n++;
-        } while (ch != 10);
-        handle->recvBuff[n] = '\0';
-        
-        /* convert from hex string to int */
-        len = (int)strtol(handle->recvBuff, NULL, 16);
-        debug_print("DEBUG: ret = %d - len = %d - n = %d - errno = %d - first line:\r\n%s", ret, len, n, errno, handle->recvBuff);
-        /* read the chunk */
-        n = 0;
-        while (n < len) {
-#ifdef  USE_SSL
-            ret = SSL_read(handle->ssl, handle->recvBuff + n, len); // sizeof(handle->recvBuff) -  1);
-#else
-            ret = read(handle->sockfd, handle->recvBuff + n, len);
-#endif
-            n += ret;
-        }
-        
-        if (n <= 0) {
-            debug_print("DEBUG: in message receive loop. Socket read: %d errno: %d.\r\n", n, errno);       
-            /* Possibly the server closed the connection. Nothing to recover really. The next heartbeat will attempt a new connection. */
-            /* Let the heartbeat thread to attempt a reconnection when the server has closed the socket (keep-alive) */
-            handle->flag = 1;
-            sleep(1);
-            continue;            
-        }
- 
-        /* read a closing new line */
-        do {
-#ifdef USE_SSL
-            ret = SSL_read(handle->ssl, handle->recvBuff + n, 1);
-#else
-            ret = read(handle->sockfd, handle->recvBuff + n, 1);
-#endif
-            ch = *(handle->recvBuff + n);
-            // printf("... %d %d\n", n, ch);
-            n++;    
-        } while (ch != 10);
-        
-        handle->recvBuff[n] = '\0';  
-        
-        if ((MESSAGE_LEN - 1) < n) {
-            fprintf(stderr, "ERROR: in message receive loop. Message too large. nbytes: %d, errno: %d.\r\n", n, errno);
+        /* read a chunk with a message */
+        n = read_chunk(handle);
+
+        if (n < 0 && errno == EMSGSIZE) {
+            log_error("ERROR: in message receive loop. Message too large.\r\n");
+            reply_error(handle);
             continue;
-            /* Receiving a large  message works well up to 2 times MESSAGE LEN because sendBuff 
-             * is allocated after the recvBuff. 
-             * TODO: handle a message larger than 2 x MESSAGE_LEN by reading the first line
-             * containing the lenght of the body (in hex).
-             */
         }
-        /* on STREAMS-based systems read() from a socket returns 0 when the connection is closed */
-        if (n == 0) {
-            debug_print("DEBUG: in message receive loop. Socket read: %d errno: %d.\r\n", n, errno);
-            /* Nothing to recover really. The next heartbeat will attempt a new connection. */
-            /* Let the heartbeat thread to attempt a reconnection when the server has closed the socket (keep-alive) */
-            handle->flag = 1;
-            sleep(1);
-            continue;            
-        }
-        /* check if the connection has been terminated by the server with a SIGPIPE */
-        if (n == -1 && errno == EINTR) {
+        if (n < 0) {
             debug_print("DEBUG: in message receive loop. Socket read: %d errno: %d.\r\n", n, errno);       
-            /* Nothing to recover really. The next heartbeat will attempt a new connection. */
-            handle->flag = 1;
-            sleep(1);
-            continue;
+            /* Possibly the server closed the connection. Nothing to recover really. */
+            /* Wake up the heartbeat thread to attempt a reconnection and terminate, a new receive loop is started with the new connection */
+            STAT_SET(handle, last_error, COMEATAR_NET_ERROR);
+            set_disconnected(handle, handle->cause);
+            return NULL;
         }
-        if (n < 0) {
-            fprintf(stderr, "ERROR: in message receive loop. Socket read error. nbytes: %d, errno: %d.\r\n", n, errno);
-            handle->flag = 1;
-            sleep(1);
-            continue;
+
+        STAT_ADD(handle, messages_down, 1);
+        COMETA_PROBE2(frame__receive, handle, n);
+        flight_record(&handle->flight, COMETA_FR_RECV, n, n > 0 ? (unsigned char)handle->recvBuff[0] : -1, 0, 0);
+
+        /* decompress the message in a pooled buffer, which replaces the received one */
+        t0 = LAT_NOW();
+        if (handle->codec && n >= COMETA_COMPRESS_HDR && handle->recvBuff[0] == MSG_COMPRESSED) {
+            if ((zbuf = pool_get(MESSAGE_LEN)) == NULL) {
+                log_error("ERROR: in message receive loop. Out of memory.\r\n");
+                reply_error(handle);
+                continue;
+            }
+            if ((n = cometa_decompress(handle->recvBuff, n, zbuf, MESSAGE_LEN - 1)) < 0) {
+                log_error("ERROR: in message receive loop. Cannot decompress message.\r\n");
+                pool_put(zbuf);
+                reply_error(handle);
+                continue;
+            }
+            zbuf[n] = '\0';
+            recv_release(handle);
+            handle->recvBuff = zbuf;
         }
+        LAT_RECORD(handle, COMETA_LAT_DECODE, handle->decode_ns + LAT_NOW() - t0);
 
         /* received a command */
         debug_print("DEBUG: received from server:\r\n%s\n", handle->recvBuff);
 
 		/* invoke the user callback */
         if (pthread_rwlock_wrlock(&(handle->hlock)) != 0) {
-            fprintf(stderr, "ERROR: in message receive loop. Failed to get wrlock. Exiting.\r\n");
+            log_error("ERROR: in message receive loop. Failed to get wrlock. Exiting.\r\n");
+            flight_dump(&handle->flight, COMETA_FR_DUMP_FATAL);
             exit (-1);
         } 
-		if (handle->user_cb) {
+		t0 = LAT_NOW();
+		COMETA_PROBE2(callback__entry, handle, n);
+		if (handle->user_cb)
 			response = handle->user_cb(n, handle->recvBuff);
+		else
+			response = handle->ctx_cb ? handle->ctx_cb(handle->cb_ctx, n, handle->recvBuff) : NULL;
+		COMETA_PROBE2(callback__return, handle, response);
+		t1 = LAT_NOW();
+		LAT_RECORD(handle, COMETA_LAT_CALLBACK, t1 - t0);
+		flight_record(&handle->flight, COMETA_FR_CALLBACK, (int)((t1 - t0) / 1000), response ? (int)strlen(response) : -1, 0, 0);
+		/* the reply in a local buffer, or in a pooled buffer if larger */
+		reply = rbuf;
+		len = response ? (int)strlen(response) : 0;
+		if (len + 16 > sizeof(rbuf) && (reply = pool_get(len + 16)) == NULL) {
+			log_error("ERROR: in message receive loop. Out of memory for the response.\r\n");
+			reply = rbuf;
+			len = 0;
+		}
+		if (response) {
 			/* assume to receive a zero-terminated string from the application */
-			sprintf(handle->sendBuff, "%x\r\n%s\r\n", (int)strlen(response) + 2, response);
-		    debug_print("DEBUG: sending response:\r\n%s\n", handle->sendBuff);
+			sprintf(reply, "%x\r\n%.*s\r\n", len + 2, len, response);
+		    debug_print("DEBUG: sending response:\r\n%s\n", reply);
 		} else {
-			sprintf(handle->sendBuff, "%x\r\n\r\n", 2);
+			sprintf(reply, "%x\r\n\r\n", 2);
 			debug_print("DEBUG: sending empty response.\r\n");
 		}
         /* send the response back */
 #ifdef USE_SSL
-        n = SSL_write(handle->ssl, handle->sendBuff, strlen(handle->sendBuff));
+        n = SSL_write(handle->ssl, reply, strlen(reply));
 #else
-        n = write(handle->sockfd, handle->sendBuff, strlen(handle->sendBuff));
+        n = write(handle->sockfd, reply, strlen(reply));
 #endif
         pthread_rwlock_unlock(&(handle->hlock));
+        if (reply != rbuf)
+            pool_put(reply);
+        recv_release(handle);
+        COMETA_PROBE2(reply__write, handle, n);
+        flight_record(&handle->flight, COMETA_FR_REPLY, n, n <= 0 ? errno : 0, 0, 0);
+        t0 = LAT_NOW();
+        LAT_RECORD(handle, COMETA_LAT_REPLY, t0 - t1);
+        LAT_RECORD(handle, COMETA_LAT_TURNAROUND, t0 - handle->rtime);
+        if (n > 0) {
+            STAT_ADD(handle, replies, 1);
+            STAT_ADD(handle, bytes_up, n);
+        } else
+            STAT_SET(handle, last_errno, errno);
     }
 	return NULL;
 }	/* recv_loop */
@@ -491,7 +1084,8 @@ void *server_connect(void *ptr) {
     /* get start time */
     gettimeofday(&start, NULL);        
     /* connect to the server */
-    if (connect(sp->sockfd, rp->ai_addr, rp->ai_addrlen) == -1) {
+    if (connect_timeout(sp->sockfd, rp->ai_addr, rp->ai_addrlen, SUBSCRIBE_TIMEOUT) == -1) {
+        close(sp->sockfd);
         sp->sockfd = -1;
         return NULL;
     }
@@ -509,146 +1103,522 @@ void *server_connect(void *ptr) {
 /*
  * Connect to the server of the Cometa ensemble with the shortest connection delay.
  *
- * @result the connection socket or -1 - the server name when using SSL
+ * @params  st - the timer of the subscription, with the selected server and its delay
+ *
+ * @result the connection socket or -1
  *
  */
-
-#ifdef USE_SSL
 static
-char * ensemble_connect(void) 
-#else
-static
-int ensemble_connect(void) 
-#endif
+int ensemble_connect(struct sub_timer *st)
 	{
     struct addrinfo hints;
 	struct addrinfo *result, *rp;
-    struct ensemble *sp;
+    struct ensemble probes[ENSEMBLE_LEN];
     struct ensemble *sp_min = NULL;
-    int n;
-    int sockfd;
+    int n, i, nprobes;
     long    min = 0x7FFFFFFF;
     struct sockaddr_in *addr;
     char str[INET_ADDRSTRLEN];
-	char *ptr;
+    int sockfd;
 	    
+    phase_next(st, COMETA_PHASE_DNS);
     /* DNS lookup for Cometa servers in the ensemble */	
 	memset(&hints, 0, sizeof hints); // make sure the struct is empty
 	hints.ai_family = AF_INET;     // don't care IPv4 or IPv6
 	hints.ai_socktype = SOCK_STREAM; // TCP stream sockets
 	hints.ai_flags = AI_CANONNAME | AI_ADDRCONFIG;     // fill in IP list
 
-	if ((n = getaddrinfo(SERVERNAME, SERVERPORT, &hints, &result)) != 0) {
-		fprintf(stderr, "ERROR : getaddrinfo() could not get server name %s resolved (%s).\r\n", SERVERNAME, gai_strerror(n));
-#ifdef 	USE_SSL
-		return NULL;
-#else
+	if ((n = getaddrinfo(server.name, server.port, &hints, &result)) != 0) {
+		log_error("ERROR : getaddrinfo() could not get server name %s resolved (%s).\r\n", server.name, gai_strerror(n));
 	    return -1;
-#endif
 	}
+    phase_next(st, COMETA_PHASE_PROBE);
     
-    /* start a thread to connect to each server in the ensemble */
-	for (rp = result; rp != NULL; rp = rp->ai_next) { 
+    /* start a thread to connect to each server in the ensemble, up to ENSEMBLE_LEN */
+    nprobes = 0;
+	for (rp = result; rp != NULL && nprobes < ENSEMBLE_LEN; rp = rp->ai_next) { 
         addr = (struct sockaddr_in *)rp->ai_addr;
         inet_ntop(AF_INET, &addr->sin_addr, str, sizeof str);
         debug_print("DEBUG: ensemble connect. Found IP %s\n", str);
         
-        sp = calloc(1, sizeof (struct ensemble));
-        /* add the entry to the list */
-        TAILQ_INSERT_TAIL(&servers, sp, next);
+        memset(&probes[nprobes], 0, sizeof(struct ensemble));
         /* save the server addrinfo */
-        sp->ap = rp;
+        probes[nprobes].ap = rp;
         /* start a thread to open a connection to the associated server */
-        pthread_create(&sp->tid, NULL, server_connect, (void *)sp);
+        if (rt_thread_start(&probes[nprobes].tid, COMETA_THREAD_AUX, 0, server_connect, (void *)&probes[nprobes]) == 0)
+            nprobes++;
 	}
     /* wait for all threads to complete the connection */
-    for (sp = TAILQ_FIRST(&servers); sp; sp = sp->next.tqe_next) {
-        pthread_join(sp->tid, NULL);
+    for (i = 0; i < nprobes; i++) {
+        pthread_join(probes[i].tid, NULL);
     }
     
     /* find the server with the shortest delay */
-    for (sp = TAILQ_FIRST(&servers); sp; sp = sp->next.tqe_next) {
-        addr = (struct sockaddr_in *)sp->ap->ai_addr;
+    for (i = 0; i < nprobes; i++) {
+        addr = (struct sockaddr_in *)probes[i].ap->ai_addr;
         inet_ntop(AF_INET, &addr->sin_addr, str, sizeof str);
-        debug_print("DEBUG: connecting delay for %s: %ld\n", str, sp->delay);
+        debug_print("DEBUG: connecting delay for %s: %ld\n", str, probes[i].delay);
         
-        if (sp->sockfd == -1)
+        if (probes[i].sockfd == -1)
             continue;
-        if (sp->delay < min) {
-            min = sp->delay;
-            sp_min = sp;
+        if (probes[i].delay < min) {
+            min = probes[i].delay;
+            sp_min = &probes[i];
         }
     }
-
-#ifdef USE_SSL
-	/* return only the name of the selected server */
-	ptr = NULL;
-   	if (sp_min != NULL) {
+    if (sp_min != NULL) {
         addr = (struct sockaddr_in *)sp_min->ap->ai_addr;
-        inet_ntop(AF_INET, &addr->sin_addr, str, sizeof str);
-		ptr = (char *)malloc(strlen(str) + 1);
-		strcpy(ptr, str);  
-		fprintf(stderr, "Connecting to server %s (%ld usec)\n", ptr, sp_min->delay);
+        inet_ntop(AF_INET, &addr->sin_addr, st->t.server, sizeof(st->t.server));
+        st->t.probe_rtt = sp_min->delay;
     }
+    phase_next(st, COMETA_PHASE_CONNECT);
 
-	return ptr;
-#else
- 	/* proceed with connecting with the selected server */
+    /* proceed with connecting with the selected server */
     sockfd = -1;
     if (sp_min != NULL) {
         addr = (struct sockaddr_in *)sp_min->ap->ai_addr;
         inet_ntop(AF_INET, &addr->sin_addr, str, sizeof str);
         /* open a socket with the selected server */
-        if ((sockfd = socket(sp_min->ap->ai_family, sp_min->ap->ai_socktype, sp_min->ap->ai_protocol)) == -1) {
-            fprintf(stderr, "ERROR: Could not open socket to server %s", str);
+        if ((sockfd = socket(sp_min->ap->ai_family, sp_min->ap->ai_socktype, sp_min->ap->ai_protocol)) == -1)
+            log_error("ERROR: Could not open socket to server %s\r\n", str);
+        else {
+            log_info("Connecting to server %s (%ld usec)\n", str, sp_min->delay);
+            /* connect to server */
+            if (connect_timeout(sockfd, sp_min->ap->ai_addr, sp_min->ap->ai_addrlen, SUBSCRIBE_TIMEOUT) == -1) {
+                log_error("ERROR: Could not connect to server %s (%s)\r\n", str, strerror(errno));
+                close(sockfd);
+                sockfd = -1;
+            }
         }
-        else
-            fprintf(stderr, "Connecting to server %s (%ld usec)\n", str, sp_min->delay);
-        /* connect to server */
-        if (connect(sockfd, sp_min->ap->ai_addr, sp_min->ap->ai_addrlen) == -1) {
-            fprintf(stderr, "ERROR: Could not connect to server %s", str);
-            sockfd = -1;
-        }   
     }
     
     freeaddrinfo(result);
-    /* free list  */
-    while (servers.tqh_first != NULL)
-        TAILQ_REMOVE(&servers, servers.tqh_first, next);
     
 	/* return the socket */
     return sockfd;
-#endif
-
 }   /* ensemble_connect */
 
+#ifndef COMETA_NO_APP_AUTH
 /*
- * Initialize the application to use the library.  
+ * Find or create the connection pool for the application server @name at @port.
  *
- * @param device_id	- the id of the device to connect
- * @param device_key - the device key
- * @param platform - an (optional) platform description  
+ * @result the application server pool or NULL in case of error
+ *
+ */
+static struct app_server *
+app_server_get(const char *name, const char *port) {
+    struct app_server *srv;
+
+    pthread_mutex_lock(&app_servers_lock);
+    for (srv = TAILQ_FIRST(&app_servers); srv; srv = srv->next.tqe_next) {
+        if (strcmp(srv->name, name) == 0 && strcmp(srv->port, port) == 0)
+            break;
+    }
+    if (srv == NULL && (srv = cometa_calloc(1, sizeof(struct app_server))) != NULL) {
+        srv->name = cometa_strdup(name);
+        srv->port = cometa_strdup(port);
+        if (srv->name == NULL || srv->port == NULL) {
+            cometa_free(srv->name);
+            cometa_free(srv->port);
+            cometa_free(srv);
+            pthread_mutex_unlock(&app_servers_lock);
+            return NULL;
+        }
+        pthread_mutex_init(&srv->lock, NULL);
+        pthread_cond_init(&srv->cond, NULL);
+        TAILQ_INSERT_TAIL(&app_servers, srv, next);
+    }
+    pthread_mutex_unlock(&app_servers_lock);
+    return srv;
+}   /* app_server_get */
+
+/*
+ * Open a new connection to the application server. The DNS lookup is done only the first
+ * time and it is repeated only if connecting to the cached addresses fails.
+ *
+ * @result the connection socket or -1
+ *
+ */
+static int
+app_server_open(struct app_server *srv) {
+	struct addrinfo hints;
+	struct addrinfo *result, *rp;
+    int sockfd, n, retry;
+
+    for (retry = 0; retry < 2; retry++) {
+        pthread_mutex_lock(&srv->lock);
+        result = srv->addr;
+        srv->addr = NULL;
+        pthread_mutex_unlock(&srv->lock);
+
+        if (result == NULL) {
+            /* DNS lookup for application server */
+        	memset(&hints, 0, sizeof hints); // make sure the struct is empty
+        	hints.ai_family = AF_INET;     // don't care IPv4 or IPv6
+        	hints.ai_socktype = SOCK_STREAM; // TCP stream sockets
+        	hints.ai_flags = AI_CANONNAME | AI_ADDRCONFIG;     // fill in IP list
+
+        	if ((n = getaddrinfo(srv->name, srv->port, &hints, &result)) != 0) {
+        		log_error("ERROR : Could not get server name %s resolved. step 2 (%s)\n", srv->name, gai_strerror(n));
+        	    return -1;
+        	}
+            retry++;    /* a fresh lookup is not repeated */
+        }
+
+        sockfd = -1;
+        for (rp = result; rp != NULL; rp = rp->ai_next) {
+    	    sockfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+    	    if (sockfd == -1)
+    	        continue;
+
+    	    if (connect(sockfd, rp->ai_addr, rp->ai_addrlen) != -1)
+    	        break;                  /* Success */
+
+    	    close(sockfd);
+            sockfd = -1;
+        }
+
+        if (sockfd == -1) {
+            /* drop the lookup result, the server may have moved */
+            freeaddrinfo(result);
+            continue;
+        }
+        /* keep the lookup result for the next connection */
+        pthread_mutex_lock(&srv->lock);
+        if (srv->addr == NULL) {
+            srv->addr = result;
+            result = NULL;
+        }
+        pthread_mutex_unlock(&srv->lock);
+        if (result)
+            freeaddrinfo(result);
+        return sockfd;
+    }
+    log_error("ERROR : Application server %s not running. step 2\n", srv->name);
+    return -1;
+}   /* app_server_open */
+
+/*
+ * Thread to open a connection to the application server in background and to add it
+ * to the idle connections of the pool.
+ *
+ * @params  ptr - a pointer to a struct app_server
+ *
+ * @result is NULL.
+ *
+ */
+static void *
+app_server_prefetch_thread(void *ptr) {
+    struct app_server *srv = (struct app_server *)ptr;
+    int sockfd;
+
+    sockfd = app_server_open(srv);
+
+    pthread_mutex_lock(&srv->lock);
+    srv->pending--;
+    if (sockfd != -1) {
+        if (srv->nidle < APP_POOL_LEN)
+            srv->idle[srv->nidle++] = sockfd;
+        else
+            close(sockfd);
+    }
+    pthread_cond_broadcast(&srv->cond);
+    pthread_mutex_unlock(&srv->lock);
+    return NULL;
+}   /* app_server_prefetch_thread */
+
+/*
+ * Start the DNS lookup and the connection to the application server in background,
+ * unless an idle connection is already available in the pool.
+ *
+ */
+static void
+app_server_prefetch(struct app_server *srv) {
+    pthread_t tid;
+
+    pthread_mutex_lock(&srv->lock);
+    if (srv->nidle == 0 && srv->pending == 0) {
+        if (rt_thread_start(&tid, COMETA_THREAD_AUX, 1, app_server_prefetch_thread, (void *)srv) == 0)
+            srv->pending++;
+    }
+    pthread_mutex_unlock(&srv->lock);
+}   /* app_server_prefetch */
+
+/*
+ * Get a connection to the application server. An idle connection from the pool
+ * is used if available, waiting for a connection being opened in background.
+ *
+ * @result the connection socket or -1 - @reused is set if the connection was idle in the pool
+ *
+ */
+static int
+app_server_connect(struct app_server *srv, int *reused) {
+    int sockfd = -1;
+    char ch;
+
+    pthread_mutex_lock(&srv->lock);
+    while (srv->nidle == 0 && srv->pending > 0)
+        pthread_cond_wait(&srv->cond, &srv->lock);
+    while (sockfd == -1 && srv->nidle > 0) {
+        sockfd = srv->idle[--srv->nidle];
+        /* discard connections closed by the server while idle */
+        if (recv(sockfd, &ch, 1, MSG_PEEK | MSG_DONTWAIT) != -1 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            close(sockfd);
+            sockfd = -1;
+        }
+    }
+    pthread_mutex_unlock(&srv->lock);
+
+    *reused = (sockfd != -1);
+    if (sockfd == -1)
+        sockfd = app_server_open(srv);
+    return sockfd;
+}   /* app_server_connect */
+
+/*
+ * Return a connection to the pool of the application server. The connection is closed
+ * if @keep_alive is not set or if the pool is full.
+ *
+ */
+static void
+app_server_release(struct app_server *srv, int sockfd, int keep_alive) {
+    pthread_mutex_lock(&srv->lock);
+    if (keep_alive && srv->nidle < APP_POOL_LEN) {
+        srv->idle[srv->nidle++] = sockfd;
+        sockfd = -1;
+    }
+    pthread_mutex_unlock(&srv->lock);
+    if (sockfd != -1)
+        close(sockfd);
+}   /* app_server_release */
+
+static int
+app_on_body(http_parser *p, const char *at, size_t length) {
+    struct app_response *r = (struct app_response *)p->data;
+
+    /* make the body contiguous in the receive buffer when received in chunks */
+    if (r->body == NULL)
+        r->body = (char *)at;
+    else if (r->body + r->len != at)
+        memmove(r->body + r->len, at, length);
+    r->len += length;
+    return 0;
+}
+
+static int
+app_on_message_complete(http_parser *p) {
+    struct app_response *r = (struct app_response *)p->data;
+
+    r->complete = 1;
+    return 0;
+}
+
+/*
+ * Send the authentication request to the application server and read the response
+ * body in @buf. The connection is returned to the pool if the server keeps it alive.
+ *
+ * @result the length of the response body or -1 in case of error
+ *
+ */
+static int
+app_server_request(struct app_server *srv, const char *request, char *buf, size_t size) {
+    http_parser app_parser;
+    http_parser_settings app_settings;
+    struct app_response resp;
+    int sockfd, reused, retry;
+    ssize_t n;
+    size_t len;
+
+    memset(&app_settings, 0, sizeof(app_settings));
+    app_settings.on_body = app_on_body;
+    app_settings.on_message_complete = app_on_message_complete;
+
+    for (retry = 0; retry < 2; retry++) {
+        if ((sockfd = app_server_connect(srv, &reused)) == -1)
+            return -1;
+
+        memset(&resp, 0, sizeof(resp));
+        http_parser_init(&app_parser, HTTP_RESPONSE);
+        app_parser.data = &resp;
+
+        if (write(sockfd, request, strlen(request)) <= 0) {
+            close(sockfd);
+            /* a pooled connection may have been closed by the server in the meantime */
+            if (reused)
+                continue;
+            log_error("ERROR: writing to application server socket.\r\n");
+            return -1;
+        }
+        /* read the response */
+        len = 0;
+        while (!resp.complete && len < size - 1) {
+            n = read(sockfd, buf + len, size - 1 - len);
+            if (n <= 0)
+                break;
+            if (http_parser_execute(&app_parser, &app_settings, buf + len, n) != (size_t)n)
+                break;
+            len += n;
+        }
+        if (!resp.complete) {
+            close(sockfd);
+            if (reused && len == 0)
+                continue;
+            log_error("ERROR: Read error from application server socket.\r\n");
+            return -1;
+        }
+        app_server_release(srv, sockfd, http_should_keep_alive(&app_parser));
+
+        /* move the body at the beginning of the buffer */
+        memmove(buf, resp.body ? resp.body : buf, resp.len);
+        buf[resp.len] = '\0';
+        return resp.len;
+    }
+    log_error("ERROR : Application server %s not running. step 2\n", srv->name);
+    return -1;
+}   /* app_server_request */
+#endif  /* COMETA_NO_APP_AUTH */
+
+/*
+ * Sign the @challenge locally with the provisioned key as the application server would do:
+ *
+ *    <app_key>:<HMAC SHA256(challenge, key) in hex>
+ *
+ * @result 0 on success or -1 - the signature is returned in @buf
+ *
+ */
+static int
+sign_challenge(const char *challenge, const char *app_key, char *buf, size_t size) {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len, i;
+    size_t n;
+
+    if (HMAC(EVP_sha256(), device.auth_key, device.auth_key_len, (const unsigned char *)challenge,
+                strlen(challenge), md, &md_len) == NULL)
+        return -1;
+    n = strlen(app_key);
+    if (n + 1 + 2 * md_len + 1 > size)
+        return -1;
+    /* the challenge and the buffer may overlap */
+    memmove(buf, app_key, n);
+    buf[n++] = ':';
+    for (i = 0; i < md_len; i++, n += 2)
+        sprintf(buf + n, "%02x", md[i]);
+    OPENSSL_cleanse(md, sizeof(md));
+    return 0;
+}   /* sign_challenge */
+
+/*
+ * Derive a per-device signing key from the application secret, for use when provisioning devices:
+ *
+ *    HMAC SHA256(device_id, app_secret)
+ *
+ * @param app_secret - the application secret
+ * @param device_id - the device id
+ * @param key - the buffer for the derived key (COMETA_KEY_LEN bytes)
+ *
+ */
+cometa_reply
+cometa_derive_device_key(const char *app_secret, const char *device_id, unsigned char *key) {
+    unsigned int len;
+
+    if (app_secret == NULL || device_id == NULL || key == NULL)
+        return COMETAR_PAR_ERROR;
+    if (HMAC(EVP_sha256(), app_secret, strlen(app_secret), (const unsigned char *)device_id,
+                strlen(device_id), key, &len) == NULL)
+        return COMETAR_ERROR;
+    return COMEATAR_OK;
+}   /* cometa_derive_device_key */
+
+/*
+ * Provision the key used to sign the authentication challenge locally.
+ *
+ * @param key - the key (the application secret or a derived device key)
+ * @param key_len - the key length
+ *
+ */
+cometa_reply
+cometa_set_auth_key(const void *key, int key_len) {
+    unsigned char *k = NULL;
+
+    if (key_len < 0 || (key == NULL && key_len > 0))
+        return COMETAR_PAR_ERROR;
+    if (key != NULL && key_len > 0) {
+        if ((k = cometa_malloc(key_len)) == NULL)
+            return COMETAR_ERROR;
+        memcpy(k, key, key_len);
+    }
+    /* wipe the previous key */
+    if (device.auth_key) {
+        OPENSSL_cleanse(device.auth_key, device.auth_key_len);
+        cometa_free(device.auth_key);
+    }
+    device.auth_key = k;
+    device.auth_key_len = k ? key_len : 0;
+    return COMEATAR_OK;
+}   /* cometa_set_auth_key */
+
+/*
+ * Load the key used to sign the authentication challenge locally from the credential
+ * file in @path. The file contains the key on the first line.
+ *
+ */
+cometa_reply
+cometa_load_auth_key(const char *path) {
+    char line[256];
+    struct stat st;
+    FILE *fp;
+    size_t n;
+    cometa_reply ret;
+
+    if (path == NULL)
+        return COMETAR_PAR_ERROR;
+    if ((fp = fopen(path, "r")) == NULL) {
+        log_error("ERROR: cannot open the credential file %s (%s).\r\n", path, strerror(errno));
+        return COMETAR_PAR_ERROR;
+    }
+    if (fstat(fileno(fp), &st) == 0 && (st.st_mode & (S_IRWXG | S_IRWXO)))
+        log_warn("WARNING: the credential file %s is accessible by other users.\r\n", path);
+    if (fgets(line, sizeof(line), fp) == NULL) {
+        fclose(fp);
+        return COMETAR_PAR_ERROR;
+    }
+    fclose(fp);
+    /* strip the line terminator */
+    n = strcspn(line, "\r\n");
+    line[n] = '\0';
+    ret = (n > 0) ? cometa_set_auth_key(line, n) : COMETAR_PAR_ERROR;
+    OPENSSL_cleanse(line, sizeof(line));
+    return ret;
+}   /* cometa_load_auth_key */
+
+/*
+ * Initialize the application to use the library.  
+ *
+ * @param device_id	- the id of the device to connect
+ * @param device_key - the device key
+ * @param platform - an (optional) platform description  
  *
  */
 cometa_reply
 cometa_init(const char *device_id,  const char *platform, const char *device_key) {
      
-	if (device_id && (strlen(device_id) <= DEVICE_ID_LEN))
-		device.id = strdup(device_id);
-	else
+	if (device_id == NULL || strlen(device_id) > DEVICE_ID_LEN)
 		return COMETAR_PAR_ERROR;
-	if (device_key && (strlen(device_key) <= DEVICE_KEY_LEN)) 
-		device.key = strdup(device_key);
-	else
+	if (device_key == NULL || strlen(device_key) > DEVICE_KEY_LEN)
 		return COMETAR_PAR_ERROR;
-	if (platform)
-		device.info = strdup(platform);
-	else
-		device.info = NULL;
+	/* release the credentials of a previous initialization */
+	cometa_free(device.id);
+	cometa_free(device.key);
+	cometa_free(device.info);
+	device.id = cometa_strdup(device_id);
+	device.key = cometa_strdup(device_key);
+	device.info = platform ? cometa_strdup(platform) : NULL;
+	if (device.id == NULL || device.key == NULL || (platform && device.info == NULL))
+		return COMETAR_ERROR;
         
 #ifdef USE_SSL
     if (!SSL_library_init()) {
-        fprintf(stderr, "** OpenSSL initialization failed!\n");
+        log_error("** OpenSSL initialization failed!\n");
         exit(-1);
     }
     SSL_load_error_strings();
@@ -660,255 +1630,314 @@ cometa_init(const char *device_id,  const char *platform, const char *device_key
 
     /* setup the http parser for the responses */
     memset(&settings, 0, sizeof(settings));
-    settings.on_headers_complete = on_headers_complete;
     settings.on_body = on_body;
     settings.on_message_complete = on_message_complete;
-    
-    http_parser_init(&parser, HTTP_RESPONSE);
+    settings.on_chunk_header = on_chunk_header;
+    settings.on_chunk_complete = on_chunk_complete;
   
 	return COMEATAR_OK;
 }	/* cometa_init */
 
 
-/* 
- * Subscribe the initialized device to a registered application. 
- * 
- * @param app_name - the application name
- * @param app_key - the application key
- * @param app_server_name - the application server name
- * @param app_server_port - the application server port
- * @param auth_endpoint - the application server authorization endpoint
+/*
+ * Override the Cometa server to connect to, for instance a local server for testing.
  *
- * @info if app_server_name, app_server_port and auth_endpoint are NULL
- * do not perform the server authentication step. Authentication will be
- * only done using the app_key (one-way authentication).
+ * @param name - the server FQ name or IP address
+ * @param port - the server port
+ * @param verify_name - the name in the server certificate (SSL only)
+ * @param ca_file - the file with the CA certificates to verify the server certificate (SSL only)
  *
- * @return	- the connection handle
+ * @info a NULL parameter leaves the setting unchanged. The CA file is loaded once, at the first subscription
+ * after it is set.
  *
  */
-struct cometa *
-cometa_subscribe(const char *app_name, const char *app_key, const char *app_server_name, const char *app_server_port, const char *auth_endpoint) {
+cometa_reply
+cometa_set_server(const char *name, const char *port, const char *verify_name, const char *ca_file) {
+	if ((name && strlen(name) >= sizeof(server.name)) || (port && strlen(port) >= sizeof(server.port)) ||
+			(verify_name && strlen(verify_name) >= sizeof(server.verify_name)) ||
+			(ca_file && strlen(ca_file) >= sizeof(server.ca_file)))
+		return COMETAR_PAR_ERROR;
+	if (name)
+		strcpy(server.name, name);
+	if (port)
+		strcpy(server.port, port);
+	if (verify_name)
+		strcpy(server.verify_name, verify_name);
+	if (ca_file) {
+		strcpy(server.ca_file, ca_file);
+#ifdef USE_SSL
+		tls_reset();
+#endif
+	}
+	return COMEATAR_OK;
+}	/* cometa_set_server */
+
+/*
+ * Set the maximum fragment length requested to the server in the TLS handshake.
+ *
+ * @param len - 512, 1024, 2048 or 4096 bytes, or 0 for the default of 16 KB
+ *
+ * @info it applies to the next subscription. A server without support for the extension ignores it.
+ *
+ */
+cometa_reply
+cometa_set_tls_fragment(int len) {
+	if (len != 0 && len != 512 && len != 1024 && len != 2048 && len != 4096)
+		return COMETAR_PAR_ERROR;
+#ifdef USE_SSL
+	pthread_mutex_lock(&tls_lock);
+	tls_fragment = len;
+	pthread_mutex_unlock(&tls_lock);
+	tls_reset();
+#endif
+	return COMEATAR_OK;
+}	/* cometa_set_tls_fragment */
+
+/* 
+ * Subscribe the initialized device to a registered application, see cometa_subscribe(). The phases of
+ * the subscription are timed in @st.
+ *
+ */
+static struct cometa *
+subscribe(const char *app_name, const char *app_key, const char *app_server_name, const char *app_server_port, const char *auth_endpoint, struct sub_timer *st) {
 	struct cometa *conn;
-	struct addrinfo hints;
-	struct addrinfo *result, *rp; 
-   	int data_p, data_s;
     char challenge[128];
-	pthread_attr_t attr;
-	int n, i, ret;
-    int ch, len;
+    cometa_json_tok tokens[16];
+    int ntok;
+	int n, i;
+    int len;
     int auth_server;
+    int reconnect = 0;
 #ifdef USE_SSL
     long err;
-	char server_name[INET_ADDRSTRLEN + 12];
+    int fd;
 #endif
 	
     /* check when called for reconnecting */
     if (conn_save != NULL) {
         /* it is a reconnection */
         conn = conn_save;
-        conn->flag = 0;
-        /* cancel the receive loop thread */
-        pthread_cancel(conn->tloop);
-        /* wait for the thread to complete */
-        pthread_join(conn->tloop, NULL);
+        reconnect = 1;
+        st->conn = conn;
+        /* stop the receive loop thread, blocked reading the socket unless already terminated */
+        if (conn->tloop) {
+#ifdef USE_SSL
+            if (conn->ssl)
+                shutdown(SSL_get_fd(conn->ssl), SHUT_RDWR);
+#else
+            shutdown(conn->sockfd, SHUT_RDWR);
+#endif
+            /* wait for the thread to complete */
+            pthread_join(conn->tloop, NULL);
+            conn->tloop = 0;
+        }
+        /* close the old connection, a concurrent cometa_send() fails until the new one is open */
+        pthread_rwlock_wrlock(&conn->hlock);
+#ifdef USE_SSL
+        if (conn->ssl) {
+            /* the BIO and the socket are released with the SSL object */
+            SSL_free(conn->ssl);
+            conn->ssl = NULL;
+        } else if (conn->bconn)
+            BIO_free_all(conn->bconn);
+        conn->bconn = NULL;
+        conn->sockfd = -1;
+#else
+        if (conn->sockfd != -1)
+            close(conn->sockfd);
+        conn->sockfd = -1;
+#endif
+        pthread_rwlock_unlock(&conn->hlock);
     } else {
         /* allocate data structure when called the first time */
-        conn = calloc(1, sizeof(struct cometa));
+        if ((conn = cometa_calloc(1, sizeof(struct cometa))) == NULL) {
+            log_error("ERROR : Out of memory allocating the connection.\r\n");
+            return NULL;
+        }
+        rt_lock(conn, sizeof(struct cometa));
         conn->flag = 0;
+        conn->sockfd = -1;
+        conn->recvBuff = conn->rinline;
+    	pthread_rwlock_init(&(conn->hlock),NULL);
+        pthread_mutex_init(&conn->rlock, NULL);
+        pthread_cond_init(&conn->rcond, NULL);
+        STAILQ_INIT(&conn->sendq);
+        pthread_mutex_init(&conn->qlock, NULL);
+        pthread_cond_init(&conn->qcond, NULL);
+        pthread_mutex_init(&conn->shaper.lock, NULL);
         /* save the global connection pointer for re-connecting */
         conn_save = conn;
+        st->conn = conn;
     
         /* save the parameters */
-        if (app_name)
-            conn->app_name = strdup(app_name);
-        else {
-        	fprintf(stderr, "ERROR : Parameter error (app_name)\r\n");
+        if (app_name == NULL) {
+        	log_error("ERROR : Parameter error (app_name)\r\n");
         	conn->reply = COMETAR_PAR_ERROR;
             return NULL;		
         }
-        if (app_key)
-        	conn->app_key = strdup(app_key);
-        else {
-        	fprintf(stderr, "ERROR : Parameter error (app_key)\r\n");
+        if (app_key == NULL) {
+        	log_error("ERROR : Parameter error (app_key)\r\n");
         	conn->reply = COMETAR_PAR_ERROR;
             return NULL;		
         }
-#ifdef USE_SSL
-        conn->ctx = setup_client_ctx();
-#endif
-        /* initialize the server list */
-        TAILQ_INIT(&servers);
+        if ((conn->app_name = cometa_strdup(app_name)) == NULL || (conn->app_key = cometa_strdup(app_key)) == NULL) {
+        	conn->reply = COMETAR_ERROR;
+            return NULL;
+        }
     }
     
     /* if all the server parameters are NULL do not perform the server authentication step */
     if (app_server_name == NULL && app_server_port == NULL && auth_endpoint == NULL) {
-        auth_server = 0;
+        /* two-way authentication with the challenge signed locally if a key is provisioned */
+        auth_server = (device.auth_key != NULL) ? 2 : 0;
     } else {
+#ifdef COMETA_NO_APP_AUTH
+        log_error("ERROR : Authentication with an application server not supported.\r\n");
+        conn->reply = COMETAR_PAR_ERROR;
+        return NULL;
+#else
         auth_server = 1;
-        if (app_server_name)
-            conn->app_server_name = strdup(app_server_name);
-        else {
-            fprintf(stderr, "ERROR : Parameter error (app_server_name).\r\n");
-        	conn->reply = COMETAR_PAR_ERROR;
-            return NULL;		
+        /* the parameters are saved by the first subscription and reused when reconnecting */
+        if (conn->app_srv == NULL) {
+            if (app_server_name == NULL || app_server_port == NULL || auth_endpoint == NULL) {
+                log_error("ERROR : Parameter error (%s).\r\n", app_server_name == NULL ? "app_server_name" :
+                        (app_server_port == NULL ? "app_server_port" : "auth_endpoint"));
+                conn->reply = COMETAR_PAR_ERROR;
+                return NULL;
+            }
+            cometa_free(conn->app_server_name);
+            cometa_free(conn->app_server_port);
+            cometa_free(conn->auth_endpoint);
+            if ((conn->app_server_name = cometa_strdup(app_server_name)) == NULL ||
+                    (conn->app_server_port = cometa_strdup(app_server_port)) == NULL ||
+                    (conn->auth_endpoint = cometa_strdup(auth_endpoint)) == NULL) {
+                conn->reply = COMETAR_ERROR;
+                return NULL;
+            }
+            /* start connecting to the application server while authenticating with Cometa (step 1) */
+            if ((conn->app_srv = app_server_get(conn->app_server_name, conn->app_server_port)) == NULL) {
+                conn->reply = COMETAR_ERROR;
+                return NULL;
+            }
         }
-        if (app_server_port)
-        	conn->app_server_port = strdup(app_server_port);
-        else {
-        	fprintf(stderr, "ERROR : Parameter error (app_server_port)\r\n");
-        	conn->reply = COMETAR_PAR_ERROR;
-            return NULL;		
-        }	
-        if (auth_endpoint)
-        	conn->auth_endpoint = strdup(auth_endpoint);
-        else {
-        	fprintf(stderr, "ERROR : Parameter error (auth_endpoint)\r\n");
-        	conn->reply = COMETAR_PAR_ERROR;
-            return NULL;		
-        }            
+        app_server_prefetch(conn->app_srv);
+#endif
     }
     
 #ifdef USE_SSL
-    /* call ensemble_connect() to get the server name */
-	sprintf(server_name, "%s:%s", ensemble_connect(), SERVERPORT);
-    conn->bconn = BIO_new_connect(server_name);
+    /* select and connect to a server from the ensemble */
+	if ((fd = ensemble_connect(st)) == -1) {
+		log_error("ERROR : Could not get server name %s resolved. Is the Cometa server running?\r\n", server.name);
+		conn->reply = COMETAR_ERROR;
+	  	return NULL;
+	}
+    conn->bconn = BIO_new_socket(fd, BIO_CLOSE);
     if (!conn->bconn) {
-        fprintf(stderr, "Error creating connection BIO.\n");
+        log_error("Error creating connection BIO.\n");
+        close(fd);
         conn->reply = COMETAR_ERROR;
       	return NULL;
     }
- 
-    /* set connection blocking */
-    if (BIO_set_nbio(conn->bconn, 0) != 1) {
-        fprintf(stderr, "Unable to set BIO to blocking mode.\n");
-        conn->reply = COMETAR_ERROR;
-        return NULL;     
-    }
-    
-    if (BIO_do_connect(conn->bconn) <= 0) {
-        fprintf(stderr, "Error connecting to remote machine.\n");
+    phase_next(st, COMETA_PHASE_TLS);
+     
+    /* a stalled handshake fails after the timeout */
+    set_timeout(conn, fd, SUBSCRIBE_TIMEOUT);
+     
+    if ((conn->ssl = tls_session()) == NULL) {
+        log_error("Error creating SSL object.\n");
         conn->reply = COMETAR_ERROR;
-	  	return NULL;
+        return NULL;
     }
-     
-    conn->ssl = SSL_new(conn->ctx);
-    SSL_set_mode(conn->ssl, SSL_MODE_AUTO_RETRY);
-
     SSL_set_bio(conn->ssl, conn->bconn, conn->bconn);
+    /* the BIO is owned by the SSL object, keep the socket for the statistics */
+    conn->bconn = NULL;
+    conn->sockfd = SSL_get_fd(conn->ssl);
+    rt_socket(conn->sockfd);
+    conn->busy_poll = (rt_flags() & COMETA_LL_BUSY_POLL) != 0;
     
-    if (SSL_connect(conn->ssl) <= 0) {
-        fprintf(stderr, "Error connecting SSL object.\n");
+    if ((n = SSL_connect(conn->ssl)) <= 0) {
+        tls_error(conn, n, 0);
+        log_error("Error connecting SSL object.\n");
         conn->reply = COMETAR_ERROR;
       	return NULL;        
     }
-	if ((err = post_connection_check(conn->ssl, VERIFY_SERVERNAME)) != X509_V_OK) {
-        fprintf(stderr, "-Error: peer certificate: %s\n", X509_verify_cert_error_string(err));
-        fprintf(stderr, "Error checking SSL object after connection.\n");
+	if ((err = post_connection_check(conn->ssl, server.verify_name)) != X509_V_OK) {
+        flight_record(&conn->flight, COMETA_FR_TLS_ERROR, -1, (int)err, 0, 0);
+        log_error("-Error: peer certificate: %s\n", X509_verify_cert_error_string(err));
+        log_error("Error checking SSL object after connection.\n");
         conn->reply = COMETAR_ERROR;
         return NULL;
     }
-    fprintf(stderr, "DEBUG: SSL Connection opened\n");
+    debug_print("DEBUG: SSL Connection opened\n");
 #else
     /* select and connect to a server from the ensemble */
-    conn->sockfd = ensemble_connect();
+    conn->sockfd = ensemble_connect(st);
     if (conn->sockfd == -1) {               /* No address succeeded */
-		fprintf(stderr, "ERROR : Could not get server name %s resolved. Is the Cometa server running?\r\n", SERVERNAME);
+		log_error("ERROR : Could not get server name %s resolved. Is the Cometa server running?\r\n", server.name);
 		conn->reply = COMETAR_ERROR;
 	  	return NULL;
 	}
+    set_timeout(conn, conn->sockfd, SUBSCRIBE_TIMEOUT);
+    rt_socket(conn->sockfd);
+    conn->busy_poll = (rt_flags() & COMETA_LL_BUSY_POLL) != 0;
 #endif
+    phase_next(st, COMETA_PHASE_CHALLENGE);
 
     /*
      * ---------------------- step 1 of cometa authentication: send initial subscribe request to cometa
      *   GET /subscribe?<app_name>&<app_key>&<device_id>[&<platform]
      *
      */
-    if (auth_server == 1) {
+    if ((conn->sendBuff = pool_get(REQUEST_LEN)) == NULL) {
+        log_error("ERROR : Out of memory allocating the request.\r\n");
+        conn->reply = COMETAR_ERROR;
+        return NULL;
+    }
+    if (auth_server != 0) {
         if (device.info)
-            sprintf(conn->sendBuff, "GET /subscribe?app_name=%s&app_key=%s&device_id=%s&platform=%s HTTP/1.1\r\nHost: api.cometa.io\r\nCometa-Authentication: YES\r\n\r\n\r\n", app_name, app_key, device.id, device.info);
+            snprintf(conn->sendBuff, REQUEST_LEN, "GET /subscribe?app_name=%s&app_key=%s&device_id=%s&platform=%s HTTP/1.1\r\nHost: api.cometa.io\r\nCometa-Authentication: YES\r\n\r\n\r\n", app_name, app_key, device.id, device.info);
     	else
-    		sprintf(conn->sendBuff, "GET /subscribe?app_name=%s&app_key=%s&device_id=%s HTTP/1.1\r\nHost: api.cometa.io\r\nCometa-Authentication: YES\r\n\r\n\r\n", app_name, app_key, device.id);
+    		snprintf(conn->sendBuff, REQUEST_LEN, "GET /subscribe?app_name=%s&app_key=%s&device_id=%s HTTP/1.1\r\nHost: api.cometa.io\r\nCometa-Authentication: YES\r\n\r\n\r\n", app_name, app_key, device.id);
     } else {
         if (device.info)
-            sprintf(conn->sendBuff, "GET /subscribe?app_name=%s&app_key=%s&device_id=%s&platform=%s HTTP/1.1\r\nHost: api.cometa.io\r\nCometa-Authentication: NO\r\n\r\n\r\n", app_name, app_key, device.id, device.info);
+            snprintf(conn->sendBuff, REQUEST_LEN, "GET /subscribe?app_name=%s&app_key=%s&device_id=%s&platform=%s HTTP/1.1\r\nHost: api.cometa.io\r\nCometa-Authentication: NO\r\n\r\n\r\n", app_name, app_key, device.id, device.info);
     	else
-    		sprintf(conn->sendBuff, "GET /subscribe?app_name=%s&app_key=%s&device_id=%s HTTP/1.1\r\nHost: api.cometa.io\r\nCometa-Authentication: NO\r\n\r\n\r\n", app_name, app_key, device.id);
+    		snprintf(conn->sendBuff, REQUEST_LEN, "GET /subscribe?app_name=%s&app_key=%s&device_id=%s HTTP/1.1\r\nHost: api.cometa.io\r\nCometa-Authentication: NO\r\n\r\n\r\n", app_name, app_key, device.id);
     }
    debug_print("DEBUG: sending URL:\r\n%s", conn->sendBuff);
 
+    /* the response is parsed from the beginning of the stream */
+    stream_reset(conn);
+
 #ifdef USE_SSL
     n = SSL_write(conn->ssl, conn->sendBuff, strlen(conn->sendBuff));
 #else
     n = write(conn->sockfd, conn->sendBuff, strlen(conn->sendBuff));
 #endif
     if (n <= 0)  {
-        fprintf(stderr, "ERROR: writing to cometa server socket.\r\n");
+        log_error("ERROR: writing to cometa server socket.\r\n");
 		conn->reply = COMEATAR_NET_ERROR;
         return NULL;
     }
     /* jump to receiving the authentication confirmation if server authentication is not needed */
-    if (auth_server == 0)
+    if (auth_server == 0) {
+        phase_next(st, COMETA_PHASE_STATUS);
         goto end_auth;
+    }
         
     /* read response with challenge */
-    header_complete = 0;
-    body_complete = 0;
-    n = 0;
-    do {
-#ifdef USE_SSL
-        ret = SSL_read(conn->ssl, conn->recvBuff + n, sizeof(conn->recvBuff) -  1);
-#else
-        ret = read(conn->sockfd, conn->recvBuff + n, sizeof(conn->recvBuff) -  1);
-#endif
-        n += ret;
-        
-        http_parser_execute(&parser, &settings, conn->recvBuff, n);
-    } while (!header_complete);
-    
-    n = 0;
-    while (!body_complete) {
-#ifdef USE_SSL
-        ret = SSL_read(conn->ssl, conn->recvBuff + n, sizeof(conn->recvBuff) -  1);
-#else
-        ret = read(conn->sockfd, conn->recvBuff + n, sizeof(conn->recvBuff) -  1);
-#endif
-        n += ret;
-        
-        http_parser_execute(&parser, &settings, conn->recvBuff, n);
-    }// while (!body_complete);
-    
-    if(n < 0) {
-        fprintf(stderr, "ERROR: Read error from cometa socket.\r\n");
+    if ((n = read_chunk(conn)) < 0) {
+        log_error("ERROR: Read error from cometa socket.\r\n");
+		conn->reply = COMEATAR_NET_ERROR;
+        return NULL;
     }
-    
-    // strcpy(challenge, conn->recvBuff);
-    debug_print("\nDEBUG: received (%zd):\r\n%s", strlen(body_at), body_at);
-    strcpy(challenge, body_at);
-    goto skip;
-    
-    data_p = strlen(conn->recvBuff);
-    /* copy the last line into challenge buffer */
-    while (((conn->recvBuff[data_p] == 10) || (conn->recvBuff[data_p] == 13) || (conn->recvBuff[data_p] == 0)) && (data_p >= 0))
-        data_p--;	/* skip last NULL, CR or LF */
-    /* get the beggining of the line with the JSON object returned */
-    while ((conn->recvBuff[data_p] != 13) && (conn->recvBuff[data_p] != 10) && (data_p >= 0)) {
-    	data_p--;	/* get to the beginning of the last line */
-    }
-    while (((conn->recvBuff[data_p] == 10) || (conn->recvBuff[data_p] == 13)) && (data_p >= 0))
-    	data_p++;	/* skip last CR or LF */
-
-    if (data_p < 0) {
-        fprintf(stderr, "ERROR: Error in buffer from cometa during authentication.\r\n" );
+    if (n >= (int)sizeof(challenge)) {
+        log_error("ERROR: Error in buffer from cometa during authentication.\r\n" );
 		conn->reply = COMETAR_AUTH_ERROR;
         return NULL;
     }
-    /* copy buffer into challenge with the JSON object */
-    i = 0;
-    while (conn->recvBuff[data_p] != 10 && conn->recvBuff[data_p] != 13 && data_p < MESSAGE_LEN) {
-    	challenge[i++] = conn->recvBuff[data_p++];
-    }
-    challenge[i] = '\0'; /* overwrite CR or LF */
-skip:
+    strcpy(challenge, conn->recvBuff);
+    phase_next(st, COMETA_PHASE_AUTH);
     debug_print("DEBUG: challenge:\r\n%s\n", challenge);
 
     /*
@@ -916,94 +1945,68 @@ skip:
      *    GET /authenticate?<device_id>&<device_key>&<app_key>&<challenge>
      *
      */
+    if (auth_server == 2) {
+        /* sign the challenge with the provisioned key and skip the application server round trip */
+        if (sign_challenge(challenge, conn->app_key, challenge, sizeof(challenge)) != 0) {
+            log_error("ERROR: signing the challenge.\r\n");
+            conn->reply = COMETAR_AUTH_ERROR;
+            return NULL;
+        }
+        goto send_signature;
+    }
 
-	/* DNS lookup for application server */	
-	memset(&hints, 0, sizeof hints); // make sure the struct is empty
-	hints.ai_family = AF_INET;     // don't care IPv4 or IPv6
-	hints.ai_socktype = SOCK_STREAM; // TCP stream sockets
-	hints.ai_flags = AI_CANONNAME | AI_ADDRCONFIG;     // fill in IP list
-
-	if ((n = getaddrinfo(app_server_name, app_server_port, &hints, &result)) != 0) {
-		fprintf(stderr, "ERROR : Could not get server name %s resolved. step 2 (%s)\n", app_server_name, gai_strerror(n));
-		conn->reply = COMETAR_ERROR;
-	    return NULL;
-	}	
-		
-	for (rp = result; rp != NULL; rp = rp->ai_next) {
-	     conn->app_sockfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-	     if (conn->app_sockfd == -1)
-	         continue;
-
-	    if (connect(conn->app_sockfd, rp->ai_addr, rp->ai_addrlen) != -1)
-	         break;                  /* Success */
-
-	    close(conn->app_sockfd);
-	}
-	if (rp == NULL) {               /* No address succeeded */
-		fprintf(stderr, "ERROR : Application server %s not running. step 2\n", app_server_name);
-		conn->reply = COMETAR_ERROR;
-	  	return NULL;
-	}
-	freeaddrinfo(result);           /* No longer needed */
-
-    /* send HTTP GET /authenticate request to app server */
-    sprintf(conn->sendBuff,"GET /%s?device_id=%s&device_key=%s&app_key=%s&challenge=%s HTTP/1.1\r\nHost: api.cometa.io\r\n\r\n\r\n",
-            conn->auth_endpoint, device.id, device.key, conn->app_key, challenge);
+#ifndef COMETA_NO_APP_AUTH
+    /* send HTTP GET /authenticate request to app server using a pooled keep-alive connection */
+    snprintf(conn->sendBuff, REQUEST_LEN, "GET /%s?device_id=%s&device_key=%s&app_key=%s&challenge=%s HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n\r\n",
+            conn->auth_endpoint, device.id, device.key, conn->app_key, challenge, conn->app_server_name);
     debug_print("DEBUG: sending URL to app server:\r\n%s", conn->sendBuff);
 
-    n = write(conn->app_sockfd, conn->sendBuff, strlen(conn->sendBuff));
-    if (n < 0)  {
-        fprintf(stderr, "ERROR: writing to application server socket.\r\n");
-		conn->reply = COMEATAR_NET_ERROR;
+    /* read response with challenge */
+    recv_release(conn);
+    if ((conn->recvBuff = pool_get(APP_RESPONSE_LEN)) == NULL) {
+        conn->recvBuff = conn->rinline;
+        conn->reply = COMETAR_ERROR;
         return NULL;
     }
-    
-    /* read response with challenge */
-    n = read(conn->app_sockfd, conn->recvBuff, sizeof(conn->recvBuff) -  1);
-    conn->recvBuff[n] = 0; 
-
-    if(n < 0) {
-        fprintf(stderr, "ERROR: Read error from application server socket.\r\n");
+    n = app_server_request(conn->app_srv, conn->sendBuff, conn->recvBuff, APP_RESPONSE_LEN);
+    if (n < 0) {
+		conn->reply = COMEATAR_NET_ERROR;
+        return NULL;
     }
     debug_print("DEBUG: received from app server (%zd):\r\n%s\n", strlen(conn->recvBuff), conn->recvBuff);
 	/*  
 	 *  {"response":200,"signature":"946604ed1d981eca2879:babc3d687335043f55878b3f1eef94815327d6ad533e7c7f51fb30b8ca4683a1"}
+	 *
+	 *  or in case of error, for instance for a key mismatch:
+	 *
+	 *  {"response":400,"error":"Application key mismatch."}
 	 */
-	
-    close(conn->app_sockfd);
-
-	/* TODO: check for response 403 Forbidden device */
-    
-    data_p = strlen(conn->recvBuff);
-     /* extract signature from last line received in buffer */
-    while(conn->recvBuff[data_p] != 34 && data_p >= 0)
-         data_p--;    /* find the first quote \" */
-    data_p--;	/* skip quote */
-    data_s = data_p;
-    while(conn->recvBuff[data_s] != 34 && data_s >= 0)
-    	 data_s--;
-    data_s++;	/* skip quote */
-    /* the signature is between data_s and data_p */
-    for (i = 0; i < (data_p - data_s + 1); i++)
-    	 challenge[i] = conn->recvBuff[i + data_s];
-    challenge[i] = '\0';
-    
-    /* check for key mistmach
-     *
-     * {"response":400,"error":"Application key mismatch."}
-     */
-     if (strcmp(challenge, "Application key mismatch.") == 0) {
-         /* return error */
-        debug_print("DEBUG: key mismatch error authenticationg with application server.\r\n");
+    ntok = cometa_json_parse(conn->recvBuff, n, tokens, sizeof(tokens) / sizeof(tokens[0]));
+    if (ntok <= 0 || (i = cometa_json_get(conn->recvBuff, tokens, ntok, 0, "response")) == -1) {
+        log_error("ERROR: Invalid response from the application server.\r\n");
+        conn->reply = COMETAR_AUTH_ERROR;
+        return NULL;
+    }
+    if (cometa_json_long(conn->recvBuff, &tokens[i], 0) != 200 ||
+            (i = cometa_json_get(conn->recvBuff, tokens, ntok, 0, "signature")) == -1 ||
+            tokens[i].end - tokens[i].start >= (int)sizeof(challenge)) {
+        if ((i = cometa_json_get(conn->recvBuff, tokens, ntok, 0, "error")) != -1)
+            debug_print("DEBUG: error authenticating with application server: %.*s\r\n", tokens[i].end - tokens[i].start, conn->recvBuff + tokens[i].start);
         conn->reply = COMETAR_AUTH_ERROR;
 		return NULL;
-     }
+    }
+    /* copy the signature */
+    memcpy(challenge, conn->recvBuff + tokens[i].start, tokens[i].end - tokens[i].start);
+    challenge[tokens[i].end - tokens[i].start] = '\0';
+#endif
      
+send_signature:
+    phase_next(st, COMETA_PHASE_STATUS);
     /*
      *  ---------------------- step 3 of cometa authentication: send signature back to cometa server
      *
      */
-    sprintf(conn->sendBuff, "%x\r\n%s\r\n", (int)strlen(challenge) + 2, challenge);
+    snprintf(conn->sendBuff, REQUEST_LEN, "%x\r\n%s\r\n", (int)strlen(challenge) + 2, challenge);
     debug_print("DEBUG: sending CHUNK to server:\r\n%s", conn->sendBuff);
 
 #ifdef USE_SSL
@@ -1012,122 +2015,256 @@ skip:
     n = write(conn->sockfd, conn->sendBuff, strlen(conn->sendBuff));
 #endif
     if (n < 0)  {
-        fprintf(stderr, "ERROR: writing to cometa socket.\r\n");
+        log_error("ERROR: writing to cometa socket.\r\n");
 		conn->reply = COMEATAR_NET_ERROR;
     	return NULL;
 	}
 	
 end_auth:    
     /* read response with JSON object result */
-    n = 0;
-    do {
-#ifdef USE_SSL
-        ret = SSL_read(conn->ssl, conn->recvBuff + n, 1);
-#else
-        ret = read(conn->sockfd, conn->recvBuff + n, 1);
-#endif
-        ch = *(conn->recvBuff + n);
-        // printf("--- %d %d\n", n, ch);
-        n++;    
-    } while (ch != 10);
-    
-    /* read the first line of the chuck containing the body length */
-    n = 0;
-    do {
-#ifdef USE_SSL
-        ret = SSL_read(conn->ssl, conn->recvBuff + n, 1);
-#else
-        ret = read(conn->sockfd, conn->recvBuff + n, 1);
-#endif
-        ch = *(conn->recvBuff + n);
-        n++;
-    } while (ch != 10);
-    conn->recvBuff[n] = '\0';
-    
-    /* convert from hex string to int */
-    len = (int)strtol(conn->recvBuff, NULL, 16);
-    debug_print("DEBUG: first line:\r\n%s", conn->recvBuff);
-    
-    n = 0;
-    while (n < len) {
-#ifdef USE_SSL
-        ret = SSL_read(conn->ssl, conn->recvBuff + n, sizeof(conn->recvBuff) -  1);
-#else
-        ret = read(conn->sockfd, conn->recvBuff + n, sizeof(conn->recvBuff) -  1);
-#endif
-        n += ret;
-    }
-    conn->recvBuff[n] = '\0';
-
-    if(n < 0) {
-        fprintf(stderr, "ERROR: Read error from cometa socket.\r\n");
+    if ((n = read_chunk(conn)) < 0) {
+        log_error("ERROR: Read error from cometa socket.\r\n");
+		conn->reply = COMEATAR_NET_ERROR;
+        return NULL;
     }
-    debug_print("DEBUG: received (%zd):\r\n%s\n", strlen(conn->recvBuff), conn->recvBuff);
+    debug_print("DEBUG: received (%d):\r\n%s\n", n, conn->recvBuff);
 
-#ifdef USE_SSL    
-    /* read another line */
-    do {
-        ret = SSL_read(conn->ssl, conn->recvBuff + n, 1);
-        ch = *(conn->recvBuff + n);
-        n++;    
-    } while (ch != 10);
-    
-    conn->recvBuff[n] = '\0';
-    debug_print("DEBUG: received (%zd):\r\n%s\n", strlen(conn->recvBuff), conn->recvBuff);
-#endif
     /* 
 	 * A JSON object is returned by the Cometa server:
 	 * 	 success:{ "status": "200", "heartbeat": "60" } 
 	 * 	 failed: { "status": "403" }
 	 */
      
-    /* simple check if the response contains the 403 status */
-	if (strstr(conn->recvBuff, "403")) {
-	    debug_print("DEBUG: Error Status 403 returned from Cometa server.\r\n");
+    ntok = cometa_json_parse(conn->recvBuff, n, tokens, sizeof(tokens) / sizeof(tokens[0]));
+    if (ntok <= 0 || (i = cometa_json_get(conn->recvBuff, tokens, ntok, 0, "status")) == -1 ||
+            cometa_json_long(conn->recvBuff, &tokens[i], 0) != 200) {
+	    debug_print("DEBUG: Error Status returned from Cometa server.\r\n");
 		conn->reply = COMETAR_AUTH_ERROR;
 		return NULL;
 	} 
 
-	/* TODO: extract heartbeat from response */
-	conn->hz = 60;	/* default to 1 min */
+	/* use the heartbeat hint from the server, default to 1 min */
+	conn->hz = 60;
+    if ((i = cometa_json_get(conn->recvBuff, tokens, ntok, 0, "heartbeat")) != -1 &&
+            (len = (int)cometa_json_long(conn->recvBuff, &tokens[i], 0)) > 0)
+        conn->hz = len;
+    /* server time */
+    if ((i = cometa_json_get(conn->recvBuff, tokens, ntok, 0, "epoch")) != -1)
+        conn->epoch = cometa_json_long(conn->recvBuff, &tokens[i], 0);
 	
     /* device authentication handshake complete */
     /* ----------------------------------------------------------------------------------------------- */
 	
     debug_print("DEBUG: authentication handshake complete.\r\n");
+#ifdef USE_SSL
+    set_timeout(conn, SSL_get_fd(conn->ssl), 0);
+#else
+    set_timeout(conn, conn->sockfd, 0);
+#endif
     
-    /* initialize and set thread detached attribute */ 
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    STAT_SET(conn, connected_at, (int64_t)time(NULL));
+    if (reconnect)
+        STAT_ADD(conn, reconnects, 1);
+    conn->flag = 0;
+    /* the receive loop starts without the buffers of the handshake */
+    recv_release(conn);
     /* 
-	 * start the receive and heartbeat threads if it is not a reconnection
+	 * start the receive loop thread, joined at the next reconnection
 	 */    
-    if ((conn->tloop == 0) && (conn->tbeat == 0))  {
-    	pthread_rwlock_init(&(conn->hlock),NULL);
-    	/* start the receive loop */
-    	if (pthread_create(&conn->tloop, &attr, recv_loop, (void *)conn)) {
-    		fprintf(stderr, "ERROR: Failed to create main loop thread. Exiting.\r\n");
-    		exit(-1);
-    	}
-    	/* start the heartbeat loop */
-    	if (pthread_create(&conn->tbeat, &attr, send_heartbeat, (void *)conn)) {
-    		fprintf(stderr, "ERROR: Failed to create heartbeat thread. Exiting.\r\n");
+    if (rt_thread_start(&conn->tloop, COMETA_THREAD_RECV, 0, recv_loop, (void *)conn)) {
+		log_error("ERROR: Failed to create main loop thread. Exiting.\r\n");
+		flight_dump(&conn->flight, COMETA_FR_DUMP_FATAL);
+		exit(-1);
+	}
+    /* 
+	 * start the heartbeat thread if it is not a reconnection
+	 */    
+    if (conn->tbeat == 0)  {
+    	/* start the heartbeat loop, detached */
+    	if (rt_thread_start(&conn->tbeat, COMETA_THREAD_HEARTBEAT, 1, send_heartbeat, (void *)conn)) {
+    		log_error("ERROR: Failed to create heartbeat thread. Exiting.\r\n");
+    		flight_dump(&conn->flight, COMETA_FR_DUMP_FATAL);
     		exit(-1);
     	}
     } else {
-        /* start a new receive loop thread: needed because it is now a new server and a new socket */
-        if (pthread_create(&conn->tloop, &attr, recv_loop, (void *)conn)) {
-    		fprintf(stderr, "ERROR: Failed to create main loop thread. Exiting.\r\n");
-    		exit(-1);
-    	} else
-            debug_print("DEBUG: Restarted receive loop.\r");
+        debug_print("DEBUG: Restarted receive loop.\r\n");
     }
-    pthread_attr_destroy(&attr);
     
 	conn->reply = COMEATAR_OK;
 	return conn;
+}	/* subscribe */
+
+/* 
+ * Subscribe the initialized device to a registered application. 
+ * 
+ * @param app_name - the application name
+ * @param app_key - the application key
+ * @param app_server_name - the application server name
+ * @param app_server_port - the application server port
+ * @param auth_endpoint - the application server authorization endpoint
+ *
+ * @info if app_server_name, app_server_port and auth_endpoint are NULL
+ * do not perform the server authentication step. Authentication will be
+ * only done using the app_key (one-way authentication).
+ * The timing of the attempt is saved in the connection and passed to the subscribe callback.
+ *
+ * @return	- the connection handle
+ *
+ */
+struct cometa *
+cometa_subscribe(const char *app_name, const char *app_key, const char *app_server_name, const char *app_server_port, const char *auth_endpoint) {
+	struct cometa *conn;
+	struct sub_timer st;
+
+	memset(&st, 0, sizeof(st));
+	st.t.reconnect = (conn_save != NULL);
+	st.t.start = st.mark = now_ns();
+	st.phase = COMETA_PHASE_SETUP;
+
+	conn = subscribe(app_name, app_key, app_server_name, app_server_port, auth_endpoint, &st);
+
+	/* the buffers of the handshake go back to the pool, the stream buffers too if it failed */
+	if (conn_save) {
+		pool_put(conn_save->sendBuff);
+		conn_save->sendBuff = NULL;
+		if (conn == NULL) {
+			recv_release(conn_save);
+			stream_reset(conn_save);
+		}
+	}
+
+	/* end the last phase, or the phase that failed */
+	phase_next(&st, st.phase);
+	st.t.total = st.mark - st.t.start;
+	st.t.failed_phase = conn ? -1 : st.phase;
+	st.t.result = conn_save ? conn_save->reply : COMETAR_ERROR;
+	if (conn_save) {
+		pthread_mutex_lock(&conn_save->rlock);
+		conn_save->sub_timing = st.t;
+		pthread_mutex_unlock(&conn_save->rlock);
+		flight_record(&conn_save->flight, COMETA_FR_SUBSCRIBE, st.t.result, st.t.failed_phase, (int)(st.t.total / 1000000), st.t.reconnect);
+		if (conn)
+			flight_record(&conn->flight, COMETA_FR_STATE, 1, 0, 0, 0);
+	}
+	COMETA_PROBE3(subscribe__done, conn_save, st.t.result, st.t.total);
+	if (subscribe_cb)
+		subscribe_cb(&st.t, subscribe_ctx);
+	return conn;
 }	/* cometa_subscribe */
 
+/*
+ * The thread of a subscription started by cometa_subscribe_async().
+ */
+static void *
+subscribe_thread(void *r) {
+	struct subscribe_req *req = (struct subscribe_req *)r;
+	struct cometa *conn;
+
+	conn = cometa_subscribe(req->app_name, req->app_key, req->app_server_name, req->app_server_port, req->auth_endpoint);
+	req->cb(req->ctx, conn, conn ? COMEATAR_OK : conn_save ? conn_save->reply : COMETAR_ERROR);
+	pool_put((char *)req);
+	return NULL;
+}	/* subscribe_thread */
+
+/*
+ * Subscribe in a thread of the library, see cometa.h.
+ *
+ */
+cometa_reply
+cometa_subscribe_async(const char *app_name, const char *app_key, const char *app_server_name, const char *app_server_port, const char *auth_endpoint,
+		cometa_subscribed_cb cb, void *ctx) {
+	struct subscribe_req *req;
+	pthread_t t;
+
+	if (cb == NULL)
+		return COMETAR_PAR_ERROR;
+	if ((req = (struct subscribe_req *)pool_get(sizeof(*req))) == NULL)
+		return COMETAR_ERROR;
+	req->app_name = app_name;
+	req->app_key = app_key;
+	req->app_server_name = app_server_name;
+	req->app_server_port = app_server_port;
+	req->auth_endpoint = auth_endpoint;
+	req->cb = cb;
+	req->ctx = ctx;
+
+	if (rt_thread_start(&t, COMETA_THREAD_AUX, 1, subscribe_thread, (void *)req) != 0) {
+		pool_put((char *)req);
+		return COMETAR_ERROR;
+	}
+	return COMEATAR_OK;
+}	/* cometa_subscribe_async */
+
+/*
+ * Getter method for the timing of the last subscription attempt.
+ *
+ */
+cometa_reply
+cometa_get_subscribe_timing(struct cometa *handle, struct cometa_subscribe_timing *timing) {
+	if (handle == NULL)
+		handle = conn_save;
+	if (handle == NULL || timing == NULL)
+		return COMETAR_PAR_ERROR;
+	pthread_mutex_lock(&handle->rlock);
+	*timing = handle->sub_timing;
+	pthread_mutex_unlock(&handle->rlock);
+	return COMEATAR_OK;
+}	/* cometa_get_subscribe_timing */
+
+/*
+ * Set the callback at the end of the subscription attempts.
+ *
+ */
+cometa_reply
+cometa_set_subscribe_cb(cometa_subscribe_cb cb, void *ctx) {
+	subscribe_ctx = ctx;
+	subscribe_cb = cb;
+	return COMEATAR_OK;
+}	/* cometa_set_subscribe_cb */
+
+/*
+ * Take the tokens of a message of @size bytes and wait for the rate limit if short of tokens.
+ *
+ */
+static void
+shape_wait(struct cometa *handle, int size) {
+    struct shaper *s = &handle->shaper;
+    double cost[2] = { 1, size };
+    double wait = 0, w;
+    uint64_t now, until;
+    struct timespec ts;
+    int i;
+
+    if (!__atomic_load_n(&s->on, __ATOMIC_RELAXED))
+        return;
+    pthread_mutex_lock(&s->lock);
+    now = now_ns();
+    for (i = 0; i < 2; i++) {
+        if (s->rate[i] <= 0)
+            continue;
+        s->tokens[i] += s->rate[i] * (now - s->last) / 1e9;
+        if (s->tokens[i] > s->burst[i])
+            s->tokens[i] = s->burst[i];
+        s->tokens[i] -= cost[i];
+        if (s->tokens[i] < 0 && (w = -s->tokens[i] / s->rate[i]) > wait)
+            wait = w;
+    }
+    s->last = now;
+    pthread_mutex_unlock(&s->lock);
+    if (wait <= 0)
+        return;
+
+    until = now + (uint64_t)(wait * 1e9);
+    ts.tv_sec = until / 1000000000ULL;
+    ts.tv_nsec = until % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+    now = now_ns() - now;
+    STAT_ADD(handle, shaped, 1);
+    STAT_ADD(handle, shape_delay_ns, now);
+    STAT_MAX(handle, shape_max_ns, now);
+}   /* shape_wait */
+
 /*
  * Send a message upstream to the Cometa server. 
  * 
@@ -1138,39 +2275,78 @@ end_auth:
  *
  */
 cometa_reply cometa_send(struct cometa *handle, const char *buf, const int size) {
-    int ret;
-    ssize_t n;
+    int ret, len;
+    ssize_t n, total;
+    char hdr[16];
+    const char *data;
+    char *zbuf = NULL;
     
+    COMETA_PROBE2(upstream__enqueue, handle, size);
     if (MESSAGE_LEN - 12 < size) {
         /* message too large */
         return COMETAR_PAR_ERROR;
     }
+    /* wait for the rate limit before taking the lock */
+    shape_wait(handle, size);
     if ((ret = pthread_rwlock_wrlock(&handle->hlock)) != 0) {
-        fprintf(stderr, "ERROR: in send_heartbeat. Failed to get wrlock. ret = %d. Exiting.\r\n", ret);
+        log_error("ERROR: in send_heartbeat. Failed to get wrlock. ret = %d. Exiting.\r\n", ret);
+        flight_dump(&handle->flight, COMETA_FR_DUMP_FATAL);
         exit (-1);
     }
 	debug_print("DEBUG: sending message upstream.\r\n");
+    if (handle->flag == 1) {
+        /* disconnected or reconnecting: do not write in the middle of the subscription */
+        pthread_rwlock_unlock(&(handle->hlock));
+        STAT_ADD(handle, send_errors, 1);
+        flight_record(&handle->flight, COMETA_FR_SEND, size, -1, ENOTCONN, 0);
+        return COMEATAR_NET_ERROR;
+    }
+
+    /* compress the message in a pooled buffer if enabled and if it gets smaller, else send it as is */
+    data = buf;
+    len = size;
+    if (handle->codec && size >= handle->zmin && (zbuf = pool_get(size)) != NULL) {
+        ret = cometa_compress(handle->codec, handle->dict, buf, size, zbuf, size - 1);
+        if (ret > 0) {
+            data = zbuf;
+            len = ret;
+        }
+    }
 	
 	/* The device uses the MSG_UPSTREAM message marker in the first character to indicate  */
     /* an upstream message that is not a response to a publish request. */
     
     /* send the data-chunk length in hex */
-    sprintf(handle->sendBuff, "%x\r\n%c", size + 3, MSG_UPSTREAM);
+    sprintf(hdr, "%x\r\n%c", len + 3, MSG_UPSTREAM);
 #ifdef USE_SSL
-    n = SSL_write(handle->ssl, handle->sendBuff, strlen(handle->sendBuff));
+    total = n = SSL_write(handle->ssl, hdr, strlen(hdr));
     /* send the data-chunk which can be binary */
-    n = SSL_write(handle->ssl, buf, size);
+    total += (n = SSL_write(handle->ssl, data, len));
     /* send a CR-LF */
-    n = SSL_write(handle->ssl, "\r\n", 2);
+    total += (n = SSL_write(handle->ssl, "\r\n", 2));
+    if (n <= 0)
+        tls_error(handle, (int)n, 2);
 #else
-    n = write(handle->sockfd, handle->sendBuff, strlen(handle->sendBuff));
+    total = n = write(handle->sockfd, hdr, strlen(hdr));
     /* send the data-chunk which can be binary */
-    n = write(handle->sockfd, buf, size);
+    total += (n = write(handle->sockfd, data, len));
     /* send a CR-LF */
-    n = write(handle->sockfd, "\r\n", 2);
+    total += (n = write(handle->sockfd, "\r\n", 2));
 #endif
     
     pthread_rwlock_unlock(&(handle->hlock));
+    pool_put(zbuf);
+    COMETA_PROBE3(upstream__write, handle, size, (int)n);
+    flight_record(&handle->flight, COMETA_FR_SEND, size, (int)n, n <= 0 ? errno : 0, 0);
+
+    if (n <= 0) {
+        STAT_ADD(handle, send_errors, 1);
+        STAT_SET(handle, last_errno, errno);
+        STAT_SET(handle, last_error, COMEATAR_NET_ERROR);
+    } else {
+        STAT_ADD(handle, messages_up, 1);
+        STAT_ADD(handle, bytes_up, total);
+    }
 
     /* check for SIGPIPE broken pipe */
     if ((n < 0) && (errno == EPIPE)) {
@@ -1189,6 +2365,113 @@ cometa_reply cometa_send(struct cometa *handle, const char *buf, const int size)
 	return COMEATAR_OK;
 }   /* cometa_send */
 
+/*
+ * Set the rate limit of the upstream messages, see cometa.h.
+ *
+ */
+cometa_reply
+cometa_set_rate_limit(struct cometa *handle, double msgs_per_sec, int msg_burst, double bytes_per_sec, int byte_burst) {
+    struct shaper *s;
+
+    if (handle == NULL || msgs_per_sec < 0 || msg_burst < 0 || bytes_per_sec < 0 || byte_burst < 0)
+        return COMETAR_PAR_ERROR;
+    s = &handle->shaper;
+    pthread_mutex_lock(&s->lock);
+    s->rate[SHAPE_MSGS] = msgs_per_sec;
+    s->rate[SHAPE_BYTES] = bytes_per_sec;
+    /* a message is always allowed */
+    s->burst[SHAPE_MSGS] = msg_burst > 0 ? msg_burst : 1;
+    s->burst[SHAPE_BYTES] = byte_burst;
+    s->tokens[SHAPE_MSGS] = s->burst[SHAPE_MSGS];
+    s->tokens[SHAPE_BYTES] = s->burst[SHAPE_BYTES];
+    s->last = now_ns();
+    __atomic_store_n(&s->on, msgs_per_sec > 0 || bytes_per_sec > 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&s->lock);
+    return COMEATAR_OK;
+}   /* cometa_set_rate_limit */
+
+/*
+ * The send queue thread, writing the messages of cometa_send_async() in order.
+ */
+static void *
+send_loop(void *h) {
+    struct cometa *handle = (struct cometa *)h;
+    struct send_req *req;
+    cometa_reply ret;
+
+    while (1) {
+        pthread_mutex_lock(&handle->qlock);
+        while ((req = STAILQ_FIRST(&handle->sendq)) == NULL)
+            pthread_cond_wait(&handle->qcond, &handle->qlock);
+        STAILQ_REMOVE_HEAD(&handle->sendq, next);
+        pthread_mutex_unlock(&handle->qlock);
+
+        ret = cometa_send(handle, req->buf, req->size);
+        if (req->cb)
+            req->cb(req->ctx, ret);
+        pool_put((char *)req);
+    }
+    return NULL;
+}   /* send_loop */
+
+/*
+ * Queue a message to send upstream without waiting, see cometa.h.
+ *
+ */
+cometa_reply
+cometa_send_async(struct cometa *handle, const char *buf, int size, cometa_send_cb cb, void *ctx) {
+    struct send_req *req;
+    int ret = 0;
+
+    if (handle == NULL || buf == NULL || size < 0 || MESSAGE_LEN - 12 < size)
+        return COMETAR_PAR_ERROR;
+    if ((req = (struct send_req *)pool_get(sizeof(*req))) == NULL)
+        return COMETAR_ERROR;
+    req->buf = buf;
+    req->size = size;
+    req->cb = cb;
+    req->ctx = ctx;
+
+    pthread_mutex_lock(&handle->qlock);
+    if (handle->tsend == 0) {
+        ret = rt_thread_start(&handle->tsend, COMETA_THREAD_SEND, 1, send_loop, (void *)handle);
+        if (ret != 0)
+            handle->tsend = 0;
+    }
+    if (ret == 0) {
+        STAILQ_INSERT_TAIL(&handle->sendq, req, next);
+        pthread_cond_signal(&handle->qcond);
+    }
+    pthread_mutex_unlock(&handle->qlock);
+    if (ret != 0) {
+        log_error("ERROR: Failed to create the send queue thread.\r\n");
+        pool_put((char *)req);
+        return COMETAR_ERROR;
+    }
+    return COMEATAR_OK;
+}   /* cometa_send_async */
+
+/*
+ * Enable the compression of upstream messages.
+ *
+ */
+cometa_reply
+cometa_set_compression(struct cometa *handle, int codec_id, int dict_id, int min_size) {
+    char probe[COMETA_COMPRESS_HDR + 16];
+
+    if (handle == NULL || codec_id < 0 || codec_id > 255 || dict_id < 0 || dict_id > 255)
+        return COMETAR_PAR_ERROR;
+    /* check that the codec and the dictionary are available */
+    if (codec_id && cometa_compress(codec_id, dict_id, "", 0, probe, sizeof(probe)) < 0)
+        return COMETAR_PAR_ERROR;
+    pthread_rwlock_wrlock(&handle->hlock);
+    handle->codec = codec_id;
+    handle->dict = dict_id;
+    handle->zmin = min_size;
+    pthread_rwlock_unlock(&handle->hlock);
+    return COMEATAR_OK;
+}
+
 /*
  * Bind the @cb callback to the receive loop.
  *
@@ -1200,6 +2483,29 @@ cometa_bind_cb(struct cometa *handle, cometa_message_cb cb) {
 	return COMEATAR_OK;
 }
 
+/*
+ * Bind the @cb callback with the context @ctx to the receive loop. It waits for a callback in
+ * progress in the receive loop, unless called by the callback itself.
+ *
+ */
+cometa_reply
+cometa_bind_cb_ctx(struct cometa *handle, cometa_message_ctx_cb cb, void *ctx) {
+	int ret;
+
+	if (handle == NULL)
+		return COMETAR_PAR_ERROR;
+	/* EDEADLK from the receive loop thread, which holds the lock during the callback */
+	ret = pthread_rwlock_wrlock(&handle->hlock);
+	if (ret != 0 && ret != EDEADLK)
+		return COMETAR_ERROR;
+	handle->user_cb = NULL;
+	handle->ctx_cb = cb;
+	handle->cb_ctx = ctx;
+	if (ret == 0)
+		pthread_rwlock_unlock(&handle->hlock);
+	return COMEATAR_OK;
+}	/* cometa_bind_cb_ctx */
+
 /*
  * Getter method for the error code.
  */
@@ -1207,3 +2513,148 @@ cometa_reply
 cometa_error(struct cometa *handle) {
 	return handle->reply;
 }
+
+/*
+ * Getter method for the server epoch time.
+ */
+long
+cometa_epoch(struct cometa *handle) {
+	return handle->epoch;
+}
+
+/*
+ * Getter method for the device ID.
+ */
+const char *
+cometa_device_id(void) {
+	return device.id;
+}
+
+/*
+ * Arena size for the credentials and one connection, with a slab of each class of pooled buffers
+ * held at the same time and an allowance for the parameters and the alignment of the blocks.
+ */
+size_t
+cometa_arena_size(void) {
+	size_t size;
+
+	size = sizeof(struct cometa);
+	/* read, request and reply buffers, and the message, decompression and upstream buffers */
+	size += pool_slab_size(READ_LEN) + pool_slab_size(APP_RESPONSE_LEN) + pool_slab_size(RECV_INLINE);
+	size += 3 * pool_slab_size(MESSAGE_LEN);
+	size += DEVICE_ID_LEN + DEVICE_KEY_LEN + DEVICE_INFO_LEN + APP_NAME_LEN + APP_KEY_LEN + 256;
+#ifndef COMETA_NO_APP_AUTH
+	size += sizeof(struct app_server) + 512;
+#endif
+	return size + 16 * 16;
+}	/* cometa_arena_size */
+
+#ifndef COMETA_NO_STATS
+/*
+ * Copy the connection statistics. The queue depths are read from the kernel socket buffers,
+ * plus the data read from the socket and not yet parsed.
+ *
+ */
+cometa_reply
+cometa_get_stats(struct cometa *handle, struct cometa_stats *stats) {
+	int fd, v;
+
+	if (handle == NULL || stats == NULL)
+		return COMETAR_PAR_ERROR;
+	stats->messages_up = STAT_GET(handle, messages_up);
+	stats->bytes_up = STAT_GET(handle, bytes_up);
+	stats->messages_down = STAT_GET(handle, messages_down);
+	stats->bytes_down = STAT_GET(handle, bytes_down);
+	stats->replies = STAT_GET(handle, replies);
+	stats->heartbeats = STAT_GET(handle, heartbeats);
+	stats->send_errors = STAT_GET(handle, send_errors);
+	stats->recv_errors = STAT_GET(handle, recv_errors);
+	stats->reconnects = STAT_GET(handle, reconnects);
+	stats->reconnect_failures = STAT_GET(handle, reconnect_failures);
+	stats->last_disconnect = STAT_GET(handle, last_disconnect);
+	stats->connected_at = STAT_GET(handle, connected_at);
+	stats->last_error = STAT_GET(handle, last_error);
+	stats->last_errno = STAT_GET(handle, last_errno);
+	stats->shaped = STAT_GET(handle, shaped);
+	stats->shape_delay_ns = STAT_GET(handle, shape_delay_ns);
+	stats->shape_max_ns = STAT_GET(handle, shape_max_ns);
+	stats->connected = (__atomic_load_n(&handle->flag, __ATOMIC_RELAXED) == 0 && stats->connected_at != 0);
+	stats->uptime = stats->connected ? (int64_t)time(NULL) - stats->connected_at : 0;
+
+	stats->send_queue = stats->recv_queue = -1;
+	fd = __atomic_load_n(&handle->sockfd, __ATOMIC_RELAXED);
+	if (stats->connected && fd != -1) {
+#ifdef SIOCOUTQ
+		if (ioctl(fd, SIOCOUTQ, &v) == 0)
+			stats->send_queue = v;
+#endif
+		if (ioctl(fd, FIONREAD, &v) == 0)
+			stats->recv_queue = v + (handle->rlen - handle->rpos);
+	}
+	return COMEATAR_OK;
+}	/* cometa_get_stats */
+
+/*
+ * Copy a latency histogram of the connection.
+ *
+ */
+cometa_reply
+cometa_get_latency(struct cometa *handle, int which, struct cometa_hist *hist) {
+	if (handle == NULL || hist == NULL || which < 0 || which >= COMETA_LAT_NUM)
+		return COMETAR_PAR_ERROR;
+	cometa_hist_snapshot(&handle->lat[which], hist);
+	return COMEATAR_OK;
+}	/* cometa_get_latency */
+
+/*
+ * Clear the latency histograms of the connection.
+ *
+ */
+cometa_reply
+cometa_reset_latency(struct cometa *handle) {
+	int i;
+
+	if (handle == NULL)
+		return COMETAR_PAR_ERROR;
+	for (i = 0; i < COMETA_LAT_NUM; i++)
+		cometa_hist_reset(&handle->lat[i]);
+	return COMEATAR_OK;
+}	/* cometa_reset_latency */
+
+/*
+ * Dump the flight recorder of the connection on request.
+ *
+ */
+cometa_reply
+cometa_flight_dump(struct cometa *handle) {
+	if (handle == NULL)
+		handle = conn_save;
+	if (handle == NULL)
+		return COMETAR_PAR_ERROR;
+	flight_dump(&handle->flight, COMETA_FR_DUMP_REQUEST);
+	return COMEATAR_OK;
+}	/* cometa_flight_dump */
+#else
+/*
+ * Without statistics.
+ */
+cometa_reply
+cometa_get_stats(struct cometa *handle, struct cometa_stats *stats) {
+	return COMETAR_ERROR;
+}
+
+cometa_reply
+cometa_get_latency(struct cometa *handle, int which, struct cometa_hist *hist) {
+	return COMETAR_ERROR;
+}
+
+cometa_reply
+cometa_reset_latency(struct cometa *handle) {
+	return COMETAR_ERROR;
+}
+
+cometa_reply
+cometa_flight_dump(struct cometa *handle) {
+	return COMETAR_ERROR;
+}
+#endif	/* COMETA_NO_STATS */
@@ -22,6 +22,28 @@
  *
  */
 
+#ifndef COMETA_H
+#define COMETA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The library is built with hidden visibility and exports only the functions declared with COMETA_API.
+ */
+#ifndef COMETA_API
+#if defined(__GNUC__) && __GNUC__ >= 4
+#define COMETA_API __attribute__((visibility("default")))
+#else
+#define COMETA_API
+#endif
+#endif
+
 /** Public structures and constants **/
 
 #define DEVICE_ID_LEN   32
@@ -30,6 +52,7 @@
 #define APP_NAME_LEN 32
 #define APP_KEY_LEN 32
 #define MESSAGE_LEN 32768
+#define COMETA_KEY_LEN 32
 
 /* 
  * The opaque data structure cometa holds the context for the library
@@ -68,6 +91,354 @@ typedef enum  {
  */
 typedef char *(*cometa_message_cb)(const int data_size, void *data);
 
+/*
+ * Same as cometa_message_cb with the context @ctx given to cometa_bind_cb_ctx().
+ */
+typedef char *(*cometa_message_ctx_cb)(void *ctx, const int data_size, void *data);
+
+/*
+ * Completion of cometa_send_async() with the @result of the send.
+ */
+typedef void (*cometa_send_cb)(void *ctx, cometa_reply result);
+
+/*
+ * Completion of cometa_subscribe_async() with the connection @handle, NULL if the subscription
+ * failed with @result.
+ */
+typedef void (*cometa_subscribed_cb)(void *ctx, struct cometa *handle, cometa_reply result);
+
+/*
+ * Payload compression. A compressed payload starts with the MSG_COMPRESSED marker
+ * followed by the codec id and the dictionary id (0 for none). The marker is also a valid
+ * first byte of a binary payload: the downstream messages are taken as compressed only in
+ * the connections with the compression enabled by cometa_set_compression().
+ */
+#define MSG_COMPRESSED			0x08
+#define COMETA_COMPRESS_HDR		3
+
+#define COMETA_CODEC_DEFLATE	1	/* raw deflate, built-in with -DUSE_ZLIB */
+#define COMETA_CODEC_LZ4		2	/* LZ4 block, built-in with -DUSE_LZ4 */
+#define COMETA_CODEC_ZSTD		3	/* zstd frame, built-in with -DUSE_ZSTD */
+
+/*
+ * A compression codec. The functions return the length of the output in @dst or -1 if
+ * it does not fit in @dst_cap bytes. @dict is NULL if no dictionary is used.
+ */
+struct cometa_codec {
+	int id;					/* codec id on the wire (1 - 255) */
+	const char *name;
+	int (*compress)(void *ctx, const void *dict, int dict_len, const char *src, int src_len, char *dst, int dst_cap);
+	int (*decompress)(void *ctx, const void *dict, int dict_len, const char *src, int src_len, char *dst, int dst_cap);
+	void *ctx;				/* codec context */
+};
+
+/*
+ * Time series frames built by the telemetry encoder start with the MSG_TIMESERIES marker.
+ */
+#define MSG_TIMESERIES			0x09
+
+#define COMETA_TS_INT			0	/* integer channel, delta encoded */
+#define COMETA_TS_FLOAT			1	/* floating point channel, XOR encoded */
+
+/*
+ * The opaque time series encoder.
+ */
+struct cometa_ts;
+
+/*
+ * Callback of the time series decoder for each sample, with the @timestamp and one value for each channel.
+ */
+typedef void (*cometa_ts_sample_cb)(void *ctx, int64_t timestamp, const double *values, int nchannels);
+
+/*
+ * Statistics of the aggregated channels, and flag to report a channel as soon as it leaves the deadband.
+ */
+#define COMETA_AGG_MIN			0x01
+#define COMETA_AGG_MAX			0x02
+#define COMETA_AGG_MEAN			0x04
+#define COMETA_AGG_LAST			0x08
+#define COMETA_AGG_COUNT		0x10
+#define COMETA_AGG_ON_CHANGE	0x100
+
+/*
+ * The opaque aggregator.
+ */
+struct cometa_agg;
+
+/*
+ * Keys of the handlers of a dispatcher, see cometa_dispatch_new().
+ */
+#define COMETA_DISPATCH_PREFIX	0	/* beginning of the message, the longest registered prefix matches */
+#define COMETA_DISPATCH_JSON	1	/* string value of a member of the JSON object, e.g. {"cmd":"reboot",...} */
+#define COMETA_DISPATCH_BYTE	2	/* first byte of the message */
+
+/* execution lanes of the handlers, 0 is the receive thread */
+#define COMETA_DISPATCH_LANES	8
+
+/*
+ * The opaque message dispatcher.
+ */
+struct cometa_dispatch;
+
+/*
+ * Statistics of a handler of a dispatcher. The times are not measured with the STATS=0 build.
+ */
+struct cometa_handler_stats {
+	uint64_t calls;				/* messages passed to the handler */
+	uint64_t replies;			/* non-empty replies */
+	uint64_t dropped;			/* messages dropped with the lane queue full or out of memory */
+	uint64_t time_ns;			/* total time in the handler */
+	uint64_t max_ns;			/* longest call */
+};
+
+/*
+ * Cause of the last disconnection in struct cometa_stats.
+ */
+#define COMETA_DISC_NONE		0	/* never disconnected */
+#define COMETA_DISC_CLOSED		1	/* connection closed by the server */
+#define COMETA_DISC_READ		2	/* read error, including a connection reset */
+#define COMETA_DISC_WRITE		3	/* write error sending a heartbeat */
+#define COMETA_DISC_PROTOCOL	4	/* invalid stream from the server */
+
+/*
+ * Connection statistics returned by cometa_get_stats(). The counters start at the first subscription
+ * and they are not reset by the reconnections. The byte counters include the chunked encoding
+ * framing, as the bytes_up and bytes_down counters of the server.
+ */
+struct cometa_stats {
+	uint64_t messages_up;		/* upstream messages sent with cometa_send() */
+	uint64_t bytes_up;			/* bytes written to the server */
+	uint64_t messages_down;		/* messages received from the server */
+	uint64_t bytes_down;		/* bytes read from the server */
+	uint64_t replies;			/* replies sent to the messages received */
+	uint64_t heartbeats;		/* heartbeats sent */
+	uint64_t send_errors;		/* cometa_send() failures */
+	uint64_t reconnects;		/* successful reconnections */
+	uint64_t reconnect_failures;	/* failed reconnection attempts */
+	int last_disconnect;		/* COMETA_DISC_* cause of the last disconnection */
+	int connected;				/* the connection is open */
+	int64_t connected_at;		/* epoch time in seconds of the last successful subscription */
+	int64_t uptime;				/* seconds since connected_at, or 0 if disconnected */
+	int send_queue;				/* bytes written and not yet sent by the kernel, or -1 */
+	int recv_queue;				/* bytes received and not yet processed, or -1 */
+	cometa_reply last_error;	/* last error of the connection */
+	int last_errno;				/* errno of the last network error */
+	uint64_t shaped;			/* upstream messages delayed by the rate limit */
+	uint64_t shape_delay_ns;	/* total delay of the shaped messages */
+	uint64_t shape_max_ns;		/* longest delay */
+	uint64_t recv_errors;		/* messages too large, or not decompressed, answered with an empty reply */
+};
+
+/*
+ * Phases of a subscription, in order. A phase is skipped when not needed, for instance the TLS
+ * handshake without SSL or the application server round trip with one-way authentication.
+ */
+#define COMETA_PHASE_SETUP		0	/* setup, or release of the previous connection when reconnecting */
+#define COMETA_PHASE_DNS		1	/* DNS lookup of the Cometa servers */
+#define COMETA_PHASE_PROBE		2	/* connection delay probes of the ensemble servers */
+#define COMETA_PHASE_CONNECT	3	/* TCP connection to the selected server */
+#define COMETA_PHASE_TLS		4	/* TLS handshake and certificate check */
+#define COMETA_PHASE_CHALLENGE	5	/* step 1: subscribe request and challenge */
+#define COMETA_PHASE_AUTH		6	/* step 2: challenge signed by the application server or locally */
+#define COMETA_PHASE_STATUS		7	/* step 3: signature sent and subscription status */
+#define COMETA_PHASE_NUM		8
+
+/*
+ * Timing of a subscription attempt, including the reconnections.
+ */
+struct cometa_subscribe_timing {
+	uint64_t start;					/* CLOCK_MONOTONIC time of the attempt start in nanoseconds */
+	uint64_t phase[COMETA_PHASE_NUM];	/* duration of each phase in nanoseconds, 0 if skipped */
+	uint64_t total;					/* duration of the attempt in nanoseconds */
+	int reconnect;					/* the attempt is a reconnection */
+	int failed_phase;				/* COMETA_PHASE_* where the attempt failed, or -1 */
+	cometa_reply result;			/* result of the attempt */
+	char server[48];				/* address of the selected ensemble server */
+	long probe_rtt;					/* connection delay of the selected server in microseconds */
+};
+
+/*
+ * Callback invoked at the end of every subscription attempt with its @timing.
+ */
+typedef void (*cometa_subscribe_cb)(const struct cometa_subscribe_timing *timing, void *ctx);
+
+/*
+ * Events of the flight recorder, with the meaning of their arguments.
+ */
+#define COMETA_FR_PHASE			1	/* end of a subscription phase: COMETA_PHASE_*, duration in us */
+#define COMETA_FR_SUBSCRIBE		2	/* end of a subscription attempt: result, failed phase, duration in ms, reconnection */
+#define COMETA_FR_STATE			3	/* connection state: connected, COMETA_DISC_* cause */
+#define COMETA_FR_RECV			4	/* message received: size, first byte */
+#define COMETA_FR_CALLBACK		5	/* message callback: duration in us, reply size or -1 */
+#define COMETA_FR_REPLY			6	/* reply written: result, errno */
+#define COMETA_FR_SEND			7	/* upstream message: size, result, errno */
+#define COMETA_FR_HEARTBEAT		8	/* heartbeat: result, errno */
+#define COMETA_FR_READ_ERROR	9	/* read from the server failed: result, errno, COMETA_DISC_* cause */
+#define COMETA_FR_TLS_ERROR		10	/* TLS error: SSL_get_error(), ERR_peek_last_error(), 0 connect 1 read 2 write */
+#define COMETA_FR_RECONNECT		11	/* reconnection attempt: backoff in ms */
+#define COMETA_FR_DUMP			12	/* dump of the recorder: COMETA_FR_DUMP_* reason */
+
+/*
+ * Reasons of a dump of the flight recorder.
+ */
+#define COMETA_FR_DUMP_REQUEST		0	/* cometa_flight_dump() */
+#define COMETA_FR_DUMP_DISCONNECT	1	/* connection lost */
+#define COMETA_FR_DUMP_FATAL		2	/* fatal error, before exiting */
+
+/*
+ * An event of the flight recorder.
+ */
+struct cometa_flight_event {
+	uint64_t time;			/* CLOCK_MONOTONIC time in nanoseconds */
+	uint32_t seq;			/* sequence number */
+	uint16_t type;			/* COMETA_FR_* */
+	uint16_t reserved;
+	int32_t args[4];		/* arguments of the event */
+};
+
+/*
+ * Callback of the flight recorder dumps with the COMETA_FR_DUMP_* @reason and the last @n @events, oldest first.
+ */
+typedef void (*cometa_flight_cb)(void *ctx, int reason, const struct cometa_flight_event *events, int n);
+
+/*
+ * Log levels, each level includes the levels above.
+ */
+#define COMETA_LOG_NONE			0
+#define COMETA_LOG_ERROR		1
+#define COMETA_LOG_WARN			2
+#define COMETA_LOG_INFO			3	/* default */
+#define COMETA_LOG_DEBUG		4	/* protocol details, with the library compiled with DEBUG=1 */
+
+/*
+ * Sink of the log messages, called with the COMETA_LOG_* @level, the @time of the message (NULL for
+ * the messages of the logger) and the zero-terminated @msg without end of line. The sink runs on the
+ * logging thread, or in the thread calling cometa_log_flush() or cometa_set_log_sink(), and must not
+ * call these two. The messages it logs, also from the library functions it calls, are written at the
+ * next drain (dropped with COMETA_LOG_SYNC, where the sink runs in the thread of the message).
+ */
+typedef void (*cometa_log_cb)(void *ctx, int level, const struct timespec *time, const char *msg);
+
+/*
+ * Log-bucketed latency histogram of values in nanoseconds, see latency.c. The layout is fixed so that
+ * histograms can be merged across connections and devices.
+ */
+#define COMETA_HIST_SUB			8		/* buckets for each power of two */
+#define COMETA_HIST_BUCKETS		304		/* 1 ns - 2^40 ns */
+
+struct cometa_hist {
+	uint64_t count;			/* values recorded */
+	uint64_t sum;			/* sum of the values */
+	uint64_t min;
+	uint64_t max;
+	uint64_t buckets[COMETA_HIST_BUCKETS];
+};
+
+/*
+ * Latency histograms of the messages received by a connection.
+ */
+#define COMETA_LAT_DECODE		0	/* parsing and decompressing the message */
+#define COMETA_LAT_CALLBACK		1	/* message callback */
+#define COMETA_LAT_REPLY		2	/* writing the reply */
+#define COMETA_LAT_TURNAROUND	3	/* from the message read from the socket to the reply written */
+#define COMETA_LAT_NUM			4
+
+/*
+ * Statistics page published by cometa_publish_stats() in a shared file, by default
+ * COMETA_STATS_DIR/<device_id>.stats. The page is updated by a single writer with a sequence
+ * lock: @seq is odd while the page is written, a reader copies the page and retries if @seq was
+ * odd or changed. Readers check @magic, @version and @size, new fields are only appended.
+ */
+#define COMETA_STATS_MAGIC		0x54534d43	/* "CMST" */
+#define COMETA_STATS_VERSION	3
+#define COMETA_STATS_DIR		"/run/cometa"
+
+/* percentiles of the latency histograms in the page */
+#define COMETA_PCT_50			0
+#define COMETA_PCT_90			1
+#define COMETA_PCT_99			2
+#define COMETA_PCT_MAX			3
+#define COMETA_PCT_NUM			4
+
+struct cometa_stats_page {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;					/* size of the page */
+	uint32_t seq;					/* sequence lock, odd while the page is written */
+	int32_t pid;					/* process publishing the page */
+	int32_t period;					/* update period in milliseconds */
+	int64_t updated;				/* epoch time of the last update in milliseconds */
+	char device_id[DEVICE_ID_LEN + 8];
+	struct cometa_stats stats;		/* counters since the first subscription */
+	uint64_t latency[COMETA_LAT_NUM][COMETA_PCT_NUM];	/* latency percentiles in the last period in nanoseconds */
+	uint64_t latency_count[COMETA_LAT_NUM];	/* messages in the latency percentiles */
+	struct cometa_subscribe_timing subscribe;	/* last subscription attempt */
+};
+
+/*
+ * Memory allocator of the library, see cometa_set_allocator(). The allocation returns a block of @size
+ * bytes aligned as with malloc() or NULL, the release is not called with NULL.
+ */
+typedef void *(*cometa_alloc_fn)(void *ctx, size_t size);
+typedef void (*cometa_free_fn)(void *ctx, void *ptr);
+
+/*
+ * Classes of the library threads, see cometa_set_thread_attr().
+ */
+#define COMETA_THREAD_RECV		0	/* receive loop and message callback */
+#define COMETA_THREAD_HEARTBEAT	1	/* heartbeat and reconnections */
+#define COMETA_THREAD_SEND		2	/* send queue of cometa_send_async() */
+#define COMETA_THREAD_AUX		3	/* connection probes, application server prefetch, cometa_subscribe_async() */
+#define COMETA_THREAD_LOG		4	/* logging */
+#define COMETA_THREAD_TIMER		5	/* aggregators and stats publisher */
+#define COMETA_THREAD_LANE		6	/* execution lanes of the dispatchers */
+#define COMETA_THREAD_NUM		7
+
+/*
+ * Attributes of a class of threads. The zero values are the defaults.
+ */
+struct cometa_thread_attr {
+	int policy;					/* SCHED_OTHER, SCHED_FIFO or SCHED_RR */
+	int priority;				/* priority with SCHED_FIFO or SCHED_RR */
+	uint64_t cpus;				/* affinity, bit mask of the CPUs 0 - 63, or 0 for all */
+	size_t stack_size;			/* stack size in bytes, or 0 for the default of the C library */
+	char name[16];				/* thread name, or empty for the name of the class ("cometa-recv", ...) */
+};
+
+/*
+ * Flags of the low-latency profile, see cometa_set_low_latency().
+ */
+#define COMETA_LL_MLOCK			0x01	/* lock in memory and prefault the buffers and the top of the thread stacks */
+#define COMETA_LL_BUSY_POLL		0x02	/* busy poll the socket in a blocking read, holding the read buffer */
+#define COMETA_LL_NODELAY		0x04	/* send without delay (TCP_NODELAY) */
+
+/*
+ * JSON token types and tokens returned by cometa_json_parse(). A token holds the offsets
+ * of the element in the parsed buffer: for strings they exclude the quotes.
+ */
+typedef enum {
+	COMETA_JSON_UNDEFINED,
+	COMETA_JSON_OBJECT,		/* { ... } */
+	COMETA_JSON_ARRAY,		/* [ ... ] */
+	COMETA_JSON_STRING,		/* "..." with escapes left in place */
+	COMETA_JSON_PRIMITIVE	/* number, true, false or null */
+} cometa_json_type;
+
+typedef struct {
+	cometa_json_type type;
+	int start;		/* offset of the first character */
+	int end;		/* offset after the last character */
+	int size;		/* number of members for objects, elements for arrays, 1 for keys with a value */
+	int parent;		/* index of the parent token or -1 */
+} cometa_json_tok;
+
+/* 
+ * Error codes returned by cometa_json_parse()
+ */
+#define COMETA_JSON_ERROR_NOMEM	-1	/* not enough tokens */
+#define COMETA_JSON_ERROR_INVAL	-2	/* invalid character */
+#define COMETA_JSON_ERROR_PART	-3	/* incomplete JSON text */
+
 /** Cometa API functions **/
 
 /*
@@ -86,7 +457,23 @@ typedef char *(*cometa_message_cb)(const int data_size, void *data);
  *
  */
 
-cometa_reply cometa_init(const char *device_id, const char *platform, const char *device_key);
+COMETA_API cometa_reply cometa_init(const char *device_id, const char *platform, const char *device_key);
+
+/*
+ * Override the Cometa server @name and @port, and with SSL the @verify_name expected in the server
+ * certificate and the @ca_file with the CA certificates. A NULL parameter leaves the setting unchanged.
+ * It is meant for connecting to a local server for testing and it must be called before cometa_subscribe().
+ *
+ */
+COMETA_API cometa_reply cometa_set_server(const char *name, const char *port, const char *verify_name, const char *ca_file);
+
+/*
+ * Request to the server TLS records of at most @len bytes (512, 1024, 2048 or 4096), for smaller
+ * record buffers in the connection, or the default of 16 KB with 0. It applies to the next
+ * subscription and it has no effect without SSL or with a server not supporting the extension.
+ *
+ */
+COMETA_API cometa_reply cometa_set_tls_fragment(int len);
 
 /* 
  * Subscribe the device to the application @app_name at the application server with FQ name
@@ -103,11 +490,60 @@ cometa_reply cometa_init(const char *device_id, const char *platform, const char
  * If app_server_name, app_server_port and auth_endpoint are NULL do not perform 2-way authentication with the 
  * external server. Authentication will be only done using the app_key (one-way authentication).
  *
+ * The connection to the application server is opened while waiting for the Cometa challenge and it
+ * is kept alive for reuse in later subscriptions and reconnections to the same application server.
+ *
  * @return - the connection handle or NULL in case of error
  *
  */
  
-struct cometa *cometa_subscribe(const char *app_name, const char *app_key, const char *app_server_name, const char *app_server_port, const char *auth_endpoint);
+COMETA_API struct cometa *cometa_subscribe(const char *app_name, const char *app_key, const char *app_server_name, const char *app_server_port, const char *auth_endpoint);
+
+/*
+ * Copy in @timing the timing of the last subscription attempt of the connection in @handle, or of the last
+ * connection with @handle NULL, for instance after a failed cometa_subscribe().
+ */
+COMETA_API cometa_reply cometa_get_subscribe_timing(struct cometa *handle, struct cometa_subscribe_timing *timing);
+
+/*
+ * Set the callback @cb invoked with @ctx at the end of every subscription attempt, including the
+ * reconnections in the background. A @cb NULL removes the callback.
+ */
+COMETA_API cometa_reply cometa_set_subscribe_cb(cometa_subscribe_cb cb, void *ctx);
+
+/*
+ * Same as cometa_subscribe() in a thread of the library, calling @cb with @ctx at the end. The
+ * parameters must stay valid until then.
+ */
+COMETA_API cometa_reply cometa_subscribe_async(const char *app_name, const char *app_key, const char *app_server_name, const char *app_server_port, const char *auth_endpoint,
+        cometa_subscribed_cb cb, void *ctx);
+
+/*
+ * Provision the key used to sign the authentication challenge locally in the device, with the
+ * same HMAC SHA256(challenge, key) computed by the application server authentication endpoint.
+ * The key is the application secret, or a per-device key derived with cometa_derive_device_key()
+ * for applications registered with per-device keys, and it can be taken from any key store.
+ *
+ * When a key is provisioned, cometa_subscribe() called with app_server_name, app_server_port and
+ * auth_endpoint NULL performs a two-way authentication without connecting to the application server.
+ * A @key NULL removes the key.
+ *
+ */
+COMETA_API cometa_reply cometa_set_auth_key(const void *key, int key_len);
+
+/*
+ * Same as cometa_set_auth_key() with the key read from the first line of the credential file in @path.
+ * The file should be readable only by the owner.
+ *
+ */
+COMETA_API cometa_reply cometa_load_auth_key(const char *path);
+
+/*
+ * Derive the per-device key HMAC SHA256(device_id, app_secret) in @key of COMETA_KEY_LEN bytes.
+ * It is meant for provisioning tools, to avoid storing the application secret in the devices.
+ *
+ */
+COMETA_API cometa_reply cometa_derive_device_key(const char *app_secret, const char *device_id, unsigned char *key);
 
 /*
  * Send a message upstream to the Cometa server. 
@@ -118,7 +554,25 @@ struct cometa *cometa_subscribe(const char *app_name, const char *app_key, const
  * (MESSAGE_LEN - 12) is the maximum message size.
  *
  */
-cometa_reply cometa_send(struct cometa *handle, const char *buf, const int size);
+COMETA_API cometa_reply cometa_send(struct cometa *handle, const char *buf, const int size);
+
+/*
+ * Queue a message to send upstream by a thread of the library, in order with the other queued
+ * messages, and call @cb with @ctx and the result of cometa_send() when done. The message in
+ * @buf is not copied and it must stay valid until then. @cb can be NULL.
+ *
+ * It can be called from the message callback, where cometa_send() is not allowed.
+ *
+ */
+COMETA_API cometa_reply cometa_send_async(struct cometa *handle, const char *buf, int size, cometa_send_cb cb, void *ctx);
+
+/*
+ * Shape the upstream messages of the connection in @handle to @msgs_per_sec messages and @bytes_per_sec
+ * bytes per second, with bursts of up to @msg_burst messages and @byte_burst bytes after a pause. A rate
+ * of 0 does not limit. The senders wait for the rate instead of failing and their messages keep the
+ * order of the calls. The bytes are counted before compression.
+ */
+COMETA_API cometa_reply cometa_set_rate_limit(struct cometa *handle, double msgs_per_sec, int msg_burst, double bytes_per_sec, int byte_burst);
 	
 /*
  * Bind the @cb callback to a message received event from the connection with the specified @handle.
@@ -126,10 +580,345 @@ cometa_reply cometa_send(struct cometa *handle, const char *buf, const int size)
  *
  */
 
-cometa_reply cometa_bind_cb(struct cometa *handle, cometa_message_cb cb);
+COMETA_API cometa_reply cometa_bind_cb(struct cometa *handle, cometa_message_cb cb);
+
+/*
+ * Bind the @cb callback with the context @ctx to a message received event, replacing the callback
+ * of cometa_bind_cb(). On return a callback in progress with the previous context has completed,
+ * unless called by the callback itself. A @cb NULL removes the callback.
+ *
+ */
+COMETA_API cometa_reply cometa_bind_cb_ctx(struct cometa *handle, cometa_message_ctx_cb cb, void *ctx);
 
 /*
  * Return the last reply error in a function for the connection in @handle.
  */
-cometa_reply cometa_error(struct cometa *handle);
+COMETA_API cometa_reply cometa_error(struct cometa *handle);
+
+/*
+ * Return the epoch time of the Cometa server at the last subscription of the connection in @handle,
+ * for instance to initialize a system timer. Zero if not provided by the server.
+ */
+COMETA_API long cometa_epoch(struct cometa *handle);
+
+/*
+ * Return the device ID set by cometa_init(), or NULL before cometa_init().
+ */
+COMETA_API const char *cometa_device_id(void);
+
+/*
+ * Copy the statistics of the connection in @handle in @stats. The counters are updated without
+ * locks and the function can be called from any thread, including the message callback.
+ */
+COMETA_API cometa_reply cometa_get_stats(struct cometa *handle, struct cometa_stats *stats);
+
+/*
+ * Copy in @hist the COMETA_LAT_* latency histogram @which of the connection in @handle. The latencies are
+ * recorded for every message received since the first subscription or the last cometa_reset_latency().
+ */
+COMETA_API cometa_reply cometa_get_latency(struct cometa *handle, int which, struct cometa_hist *hist);
+
+/*
+ * Clear the latency histograms of the connection in @handle.
+ */
+COMETA_API cometa_reply cometa_reset_latency(struct cometa *handle);
+
+/*
+ * Publish every @period_ms milliseconds the statistics and the latency percentiles of the connection
+ * in @handle in the shared file @path, or COMETA_STATS_DIR/<device_id>.stats with @path NULL, for
+ * monitoring tools such as cometa-top. The page is written by a thread of its own and the
+ * connection is not slowed down. With @period_ms 0 the publishing is stopped and the file removed.
+ */
+COMETA_API cometa_reply cometa_publish_stats(struct cometa *handle, const char *path, int period_ms);
+
+/** Memory allocation **/
+
+/*
+ * Set the functions @alloc and @free, called with @ctx, used by the library to allocate the device
+ * credentials, the connection and its buffers, the application server pool, the time series and the
+ * aggregators. With @alloc and @free NULL the C library allocator is restored. To be called before cometa_init().
+ * The library allocates for a connection at the first cometa_subscribe() and not when reconnecting.
+ */
+COMETA_API cometa_reply cometa_set_allocator(cometa_alloc_fn alloc, cometa_free_fn free, void *ctx);
+
+/*
+ * Allocate the memory of the library from the arena @mem of @size bytes instead of the heap, for a
+ * deterministic memory use. The memory is not returned to the arena: it is sized once, with
+ * cometa_arena_size() for one connection plus the time series and aggregators of the application.
+ * To be called before cometa_init().
+ */
+COMETA_API cometa_reply cometa_set_arena(void *mem, size_t size);
+
+/*
+ * Return the arena size needed by cometa_init() and one connection, including the buffer for the
+ * compressed messages.
+ */
+COMETA_API size_t cometa_arena_size(void);
+
+/*
+ * Return the bytes taken from the arena.
+ */
+COMETA_API size_t cometa_arena_used(void);
+
+/** Threads and low latency **/
+
+/*
+ * Set the attributes @attr of the threads of the class @which (COMETA_THREAD_*), or the defaults with
+ * @attr NULL. They apply to the threads started afterwards: to be called before cometa_init() for the
+ * logging thread and before cometa_subscribe() for the others. A real-time policy not permitted to the
+ * process is replaced by the default scheduling, with a warning.
+ */
+COMETA_API cometa_reply cometa_set_thread_attr(int which, const struct cometa_thread_attr *attr);
+
+/*
+ * Set the low-latency profile with the COMETA_LL_* @flags, and with COMETA_LL_BUSY_POLL the busy
+ * polling time @busy_poll_us (SO_BUSY_POLL, raising it over net.core.busy_read needs CAP_NET_ADMIN).
+ * It applies to the connections opened afterwards: to be called before cometa_subscribe(). The locked
+ * memory is limited by RLIMIT_MEMLOCK, beyond which the memory is only prefaulted.
+ */
+COMETA_API cometa_reply cometa_set_low_latency(int flags, int busy_poll_us);
+
+/** Flight recorder **/
+
+/*
+ * Every connection records its last events in a fixed ring, without locks nor allocations. The ring is
+ * dumped when the connection is lost, before exiting on a fatal error and on request.
+ */
+
+/*
+ * Dump the flight recorder in the file @path, as text and overwriting the previous dump, and/or to the
+ * callback @cb with @ctx. With @path and @cb NULL the recorder is dumped only on request, on the standard error.
+ */
+COMETA_API cometa_reply cometa_set_flight_recorder(const char *path, cometa_flight_cb cb, void *ctx);
+
+/*
+ * Dump the flight recorder of the connection in @handle, or of the last connection with @handle NULL.
+ */
+COMETA_API cometa_reply cometa_flight_dump(struct cometa *handle);
+
+/** Logging **/
+
+/*
+ * The library logs asynchronously: the messages are recorded without locks by the calling threads
+ * and they are formatted and written by a logging thread. The level can also be set with the
+ * COMETA_LOG_LEVEL environment variable (error, warn, info, debug or 0 - 4).
+ */
+
+/*
+ * Set the COMETA_LOG_* @level of the messages logged.
+ */
+COMETA_API cometa_reply cometa_set_log_level(int level);
+
+/*
+ * Set the sink @cb of the log messages, called with @ctx. A @cb NULL writes on the standard error (default).
+ */
+COMETA_API cometa_reply cometa_set_log_sink(cometa_log_cb cb, void *ctx);
+
+/*
+ * Write the pending log messages. It is also called at exit.
+ */
+COMETA_API void cometa_log_flush(void);
+
+/** JSON tokenizer **/
+
+/*
+ * The tokenizer does not allocate memory nor copy or modify the buffer, so that message callbacks
+ * can use it on the received message. The tokens are stored in the @tokens array of @ntokens elements.
+ *
+ * @return - the number of tokens used or a negative COMETA_JSON_ERROR_* code
+ *
+ */
+COMETA_API int cometa_json_parse(const char *js, int len, cometa_json_tok *tokens, int ntokens);
+
+/*
+ * Return the index of the token with the value of member @key in the object at index @object, or -1.
+ */
+COMETA_API int cometa_json_get(const char *js, const cometa_json_tok *tokens, int ntokens, int object, const char *key);
+
+/*
+ * Return 1 if the string or primitive token @tok is equal to @s.
+ */
+COMETA_API int cometa_json_eq(const char *js, const cometa_json_tok *tok, const char *s);
+
+/*
+ * Return the integer value of the token @tok, a number or a string with a number, or @defval.
+ */
+COMETA_API long cometa_json_long(const char *js, const cometa_json_tok *tok, long defval);
+
+/** Payload compression **/
+
+/*
+ * Compress the messages sent upstream by cometa_send() in the connection @handle with the codec @codec_id
+ * and the dictionary @dict_id (0 for none), when of at least @min_size bytes. A @codec_id 0 disables the
+ * compression. While enabled, the messages received compressed are decompressed before calling the message
+ * callback; otherwise they are delivered as received, including the ones starting with MSG_COMPRESSED.
+ *
+ */
+COMETA_API cometa_reply cometa_set_compression(struct cometa *handle, int codec_id, int dict_id, int min_size);
+
+/*
+ * Register a codec in addition to the built-in ones, or replace a codec with the same id.
+ */
+COMETA_API cometa_reply cometa_register_codec(const struct cometa_codec *codec);
+
+/*
+ * Register the pre-trained dictionary @dict of @len bytes with id @dict_id (1 - 255). The same dictionary
+ * must be used by the application for decompressing.
+ */
+COMETA_API cometa_reply cometa_add_dictionary(int dict_id, const void *dict, int len);
+
+/*
+ * Compress @src with the MSG_COMPRESSED header in @dst and decompress it. Both return the output
+ * length or -1. Exported for applications and servers decoding the payloads.
+ */
+COMETA_API int cometa_compress(int codec_id, int dict_id, const char *src, int src_len, char *dst, int dst_cap);
+COMETA_API int cometa_decompress(const char *src, int src_len, char *dst, int dst_cap);
+
+/** Telemetry encoder **/
+
+/*
+ * Create a time series encoder with @nchannels channels for the connection @handle. Samples are collected
+ * in a columnar frame that is sent with cometa_send() when it contains @max_samples samples or when the next
+ * sample would make it larger than @max_bytes (at most MESSAGE_LEN - 12). An encoder is not thread-safe.
+ *
+ * @return - the encoder or NULL in case of error
+ *
+ */
+COMETA_API struct cometa_ts *cometa_ts_new(struct cometa *handle, int nchannels, int max_samples, int max_bytes);
+
+/*
+ * Set the @name (max 32 chars) and the @type COMETA_TS_INT or COMETA_TS_FLOAT of the channel @ch.
+ * Channels are set before appending the first sample of a frame.
+ */
+COMETA_API cometa_reply cometa_ts_channel(struct cometa_ts *ts, int ch, const char *name, int type);
+
+/*
+ * Append a sample with the @timestamp (e.g. in milliseconds) and one value for each channel in @values.
+ * The frame is sent if full.
+ */
+COMETA_API cometa_reply cometa_ts_append(struct cometa_ts *ts, int64_t timestamp, const double *values);
+
+/*
+ * Send the samples collected so far, if any.
+ */
+COMETA_API cometa_reply cometa_ts_flush(struct cometa_ts *ts);
+
+/*
+ * Release the encoder. Samples not sent are discarded.
+ */
+COMETA_API void cometa_ts_free(struct cometa_ts *ts);
+
+/*
+ * Encode the current frame in @buf of @size bytes without sending it, and decode the frame in @buf of @len
+ * bytes calling @cb for each sample. Both return -1 on error, the frame length and the number of samples otherwise.
+ */
+COMETA_API int cometa_ts_encode(struct cometa_ts *ts, char *buf, int size);
+COMETA_API int cometa_ts_decode(const char *buf, int len, cometa_ts_sample_cb cb, void *ctx);
+
+/** Aggregation **/
+
+/*
+ * Create an aggregator with @nchannels channels for the connection @handle. A scheduler thread sends a
+ * JSON report of the channel windows every @period milliseconds, or earlier when the report would exceed
+ * @max_bytes (at most MESSAGE_LEN - 12). By default a channel reports the last value of each window.
+ *
+ * @return - the aggregator or NULL in case of error
+ *
+ */
+COMETA_API struct cometa_agg *cometa_agg_new(struct cometa *handle, int nchannels, int period, int max_bytes);
+
+/*
+ * Set the @name (max 32 chars), the COMETA_AGG_* @stats and the @deadband of the channel @ch. A channel is
+ * reported only when its last value differs more than @deadband from the last value reported: 0 reports on
+ * any change and a negative @deadband reports every window. With COMETA_AGG_ON_CHANGE a value out of the
+ * deadband is reported without waiting for the end of the period.
+ */
+COMETA_API cometa_reply cometa_agg_channel(struct cometa_agg *agg, int ch, const char *name, int stats, double deadband);
+
+/*
+ * Add the sample @value to the current window of the channel @ch. It does not block on the network.
+ */
+COMETA_API cometa_reply cometa_agg_sample(struct cometa_agg *agg, int ch, double value);
+
+/*
+ * Send the current windows without waiting for the end of the period.
+ */
+COMETA_API cometa_reply cometa_agg_flush(struct cometa_agg *agg);
+
+/*
+ * Send the current windows, stop the scheduler and release the aggregator.
+ */
+COMETA_API void cometa_agg_free(struct cometa_agg *agg);
+
+/** Message dispatch **/
+
+/*
+ * Create a dispatcher of the downstream messages to handlers selected by a key of the message:
+ * COMETA_DISPATCH_PREFIX, COMETA_DISPATCH_JSON with the member @field or COMETA_DISPATCH_BYTE.
+ * The handlers are compiled in a lookup table by cometa_bind_dispatch(), so that the dispatch
+ * time does not depend on their number.
+ *
+ * @return - the dispatcher or NULL in case of error
+ *
+ */
+COMETA_API struct cometa_dispatch *cometa_dispatch_new(int key_type, const char *field);
+
+/*
+ * Register the handler @cb with its @ctx for the messages with the @key, a one-character string
+ * for COMETA_DISPATCH_BYTE, or for the messages without a handler with @key NULL. The handler runs
+ * in the receive thread with @lane 0 and its reply is the reply of the device. With @lane 1 to
+ * COMETA_DISPATCH_LANES - 1 it runs on a thread of the lane, in order with the other messages of the
+ * lane: the device replies at once with an empty reply and the reply of the handler, if any, is sent
+ * upstream. Handlers are registered before binding the dispatcher.
+ */
+COMETA_API cometa_reply cometa_dispatch_add(struct cometa_dispatch *d, const char *key, cometa_message_ctx_cb cb, void *ctx, int lane);
+
+/*
+ * Compile the handlers of the dispatcher @d and bind it as the message callback of @handle, in
+ * place of the callback of cometa_bind_cb().
+ */
+COMETA_API cometa_reply cometa_bind_dispatch(struct cometa *handle, struct cometa_dispatch *d);
+
+/*
+ * Get in @stats the statistics of the handler of @key, or of the messages without a handler with
+ * @key NULL.
+ */
+COMETA_API cometa_reply cometa_dispatch_stats(struct cometa_dispatch *d, const char *key, struct cometa_handler_stats *stats);
+
+/*
+ * Stop the lanes and release the dispatcher, after binding another callback.
+ */
+COMETA_API void cometa_dispatch_free(struct cometa_dispatch *d);
+
+/** Latency histograms **/
+
+/*
+ * Record the value @ns in the histogram @h. Only one thread at a time may record in a histogram.
+ */
+COMETA_API void cometa_hist_record(struct cometa_hist *h, uint64_t ns);
+
+/*
+ * Copy in @dst the histogram @src, which may be updated at the same time.
+ */
+COMETA_API void cometa_hist_snapshot(const struct cometa_hist *src, struct cometa_hist *dst);
+
+/*
+ * Clear the histogram @h.
+ */
+COMETA_API void cometa_hist_reset(struct cometa_hist *h);
+
+/*
+ * Add the values of the histogram @src to @dst.
+ */
+COMETA_API void cometa_hist_merge(struct cometa_hist *dst, const struct cometa_hist *src);
+
+/*
+ * Return the value in nanoseconds at the percentile @p (0 - 100) of the histogram @h, within 1/COMETA_HIST_SUB.
+ */
+COMETA_API uint64_t cometa_hist_percentile(const struct cometa_hist *h, double p);
+
+#ifdef __cplusplus
+}
+#endif
 
+#endif /* COMETA_H */
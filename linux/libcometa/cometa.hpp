@@ -0,0 +1,442 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file    cometa.hpp
+ *
+ * @brief   C++20 interface of the Cometa client library, header only.
+ *
+ * A session owns the binding of the message callback to a connection and it is move-only. The
+ * messages are delivered without copies as views valid while they are processed, to a handler
+ * with its own state or to a coroutine waiting in receive(). The send and subscribe operations are
+ * awaitable and they complete in a thread of the library: the coroutine resumes in that thread
+ * and it can move to an executor of the application by awaiting its scheduling operation.
+ *
+ * The library has one connection for the process, which is never released: closing a session only
+ * unbinds it from the connection. The functions return the cometa_reply codes and do not throw.
+ *
+ */
+
+#ifndef COMETA_HPP
+#define COMETA_HPP
+
+#include <concepts>
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "cometa.h"
+
+namespace cometa_cpp {
+
+using reply = cometa_reply;
+using bytes = std::span<const std::byte>;
+
+inline bytes as_bytes(std::string_view s) noexcept {
+    return std::as_bytes(std::span<const char>(s.data(), s.size()));
+}
+
+inline reply init(const char *device_id, const char *platform, const char *device_key) noexcept {
+    return cometa_init(device_id, platform, device_key);
+}
+
+class session;
+
+namespace detail { struct state; }
+
+/*
+ * A message received from the server. A message delivered to a handler, or to a coroutine resumed
+ * from receive(), is a view of the buffer of the library valid until the handler returns or the
+ * coroutine suspends, and until then reply() sets the response to the message. A message received
+ * while nobody was waiting for it is a copy, and its response was already sent empty.
+ */
+class message {
+public:
+    message() = default;
+    message(message &&) noexcept = default;
+    message &operator=(message &&) noexcept = default;
+
+    bytes data() const noexcept {
+        return copy_ ? as_bytes(*copy_) : view_;
+    }
+    std::string_view text() const noexcept {
+        bytes d = data();
+        return { reinterpret_cast<const char *>(d.data()), d.size() };
+    }
+    size_t size() const noexcept { return data().size(); }
+    bool empty() const noexcept { return data().empty(); }
+
+    /* set the response, sent back to the application server */
+    void reply(std::string_view r) {
+        if (reply_)
+            reply_->assign(r);
+    }
+
+private:
+    friend struct detail::state;
+    friend class receive_op;
+
+    bytes view_;
+    std::optional<std::string> copy_;
+    std::string *reply_ = nullptr;
+};
+
+/*
+ * A handler of the messages: invocable with a message& and returning void, a response convertible
+ * to std::string_view, or an optional response.
+ */
+template <class F>
+concept message_handler = std::invocable<F &, message &> &&
+    (std::is_void_v<std::invoke_result_t<F &, message &>> ||
+     std::convertible_to<std::invoke_result_t<F &, message &>, std::string_view> ||
+     std::same_as<std::invoke_result_t<F &, message &>, std::optional<std::string>>);
+
+namespace detail {
+
+struct handler_base {
+    virtual ~handler_base() = default;
+    virtual void operator()(message &m) = 0;
+};
+
+template <class F>
+struct handler_impl final : handler_base {
+    explicit handler_impl(F &&f) : fn(std::move(f)) {}
+    void operator()(message &m) override {
+        using R = std::invoke_result_t<F &, message &>;
+        if constexpr (std::is_void_v<R>) {
+            fn(m);
+        } else if constexpr (std::same_as<R, std::optional<std::string>>) {
+            if (auto r = fn(m))
+                m.reply(*r);
+        } else {
+            m.reply(std::string_view(fn(m)));
+        }
+    }
+    F fn;
+};
+
+/*
+ * State of a session shared with the message callback of the library.
+ */
+struct state : std::enable_shared_from_this<state> {
+    std::mutex lock;
+    std::shared_ptr<handler_base> handler;  /* takes all the messages if set */
+    std::coroutine_handle<> waiter;         /* coroutine waiting in receive() */
+    message *slot = nullptr;                /* message of the waiting coroutine */
+    std::deque<std::string> backlog;        /* copies of the messages received while nobody waited */
+    size_t backlog_max = 64;
+    uint64_t dropped = 0;                   /* messages dropped with the backlog full */
+    std::string response;                   /* response to the message being processed */
+
+    /*
+     * Message callback of the library, in the receive loop thread.
+     */
+    static char *on_message(void *ctx, const int size, void *data) {
+        std::shared_ptr<state> st = static_cast<state *>(ctx)->shared_from_this();
+        std::unique_lock<std::mutex> l(st->lock);
+        message m;
+
+        m.view_ = bytes(static_cast<const std::byte *>(data), static_cast<size_t>(size));
+        m.reply_ = &st->response;
+        st->response.clear();
+        if (std::shared_ptr<handler_base> h = st->handler) {
+            l.unlock();
+            (*h)(m);
+        } else if (st->waiter) {
+            std::coroutine_handle<> co = std::exchange(st->waiter, nullptr);
+            *std::exchange(st->slot, nullptr) = std::move(m);
+            l.unlock();
+            /* runs until the coroutine suspends */
+            co.resume();
+        } else {
+            if (st->backlog.size() < st->backlog_max)
+                st->backlog.emplace_back(static_cast<const char *>(data), static_cast<size_t>(size));
+            else
+                st->dropped++;
+            return nullptr;
+        }
+        return st->response.empty() ? nullptr : st->response.data();
+    }
+};
+
+}   /* namespace detail */
+
+/*
+ * Awaitable of session::receive(), resuming with the next message or an empty message if the
+ * session is closed. One coroutine at a time can wait for the messages of a session.
+ */
+class receive_op {
+public:
+    explicit receive_op(std::shared_ptr<detail::state> st) noexcept : st_(std::move(st)) {}
+
+    bool await_ready() {
+        if (!st_)
+            return true;
+        std::lock_guard<std::mutex> l(st_->lock);
+        return take();
+    }
+    bool await_suspend(std::coroutine_handle<> co) {
+        std::lock_guard<std::mutex> l(st_->lock);
+        if (take())
+            return false;
+        st_->waiter = co;
+        st_->slot = &msg_;
+        return true;
+    }
+    message await_resume() noexcept { return std::move(msg_); }
+
+private:
+    /* a message of the backlog, with the lock held */
+    bool take() {
+        if (st_->backlog.empty())
+            return false;
+        msg_.copy_ = std::move(st_->backlog.front());
+        st_->backlog.pop_front();
+        return true;
+    }
+
+    std::shared_ptr<detail::state> st_;
+    message msg_;
+};
+
+/*
+ * Awaitable of session::send_async(), resuming with the result of the send. The message must stay
+ * valid until then.
+ */
+class send_op {
+public:
+    send_op(struct cometa *h, bytes b) noexcept : h_(h), b_(b) {}
+
+    bool await_ready() const noexcept { return h_ == nullptr; }
+    bool await_suspend(std::coroutine_handle<> co) noexcept {
+        co_ = co;
+        reply r = cometa_send_async(h_, reinterpret_cast<const char *>(b_.data()), static_cast<int>(b_.size()), &send_op::done, this);
+        if (r != COMEATAR_OK) {
+            /* not queued, no completion */
+            result_ = r;
+            return false;
+        }
+        return true;
+    }
+    reply await_resume() const noexcept { return result_; }
+
+private:
+    static void done(void *ctx, cometa_reply r) {
+        send_op *op = static_cast<send_op *>(ctx);
+        op->result_ = r;
+        op->co_.resume();
+    }
+
+    struct cometa *h_;
+    bytes b_;
+    reply result_ = COMETAR_PAR_ERROR;
+    std::coroutine_handle<> co_;
+};
+
+/*
+ * A session with the connection of the library.
+ */
+class session {
+public:
+    session() noexcept = default;
+    explicit session(struct cometa *h) : h_(h) {
+        if (h_) {
+            st_ = std::make_shared<detail::state>();
+            cometa_bind_cb_ctx(h_, &detail::state::on_message, st_.get());
+        }
+    }
+    session(const session &) = delete;
+    session &operator=(const session &) = delete;
+    session(session &&o) noexcept : h_(std::exchange(o.h_, nullptr)), st_(std::move(o.st_)) {}
+    session &operator=(session &&o) noexcept {
+        if (this != &o) {
+            close();
+            h_ = std::exchange(o.h_, nullptr);
+            st_ = std::move(o.st_);
+        }
+        return *this;
+    }
+    ~session() { close(); }
+
+    /*
+     * Unbind the session from the connection, after the message in progress. A coroutine waiting in
+     * receive() resumes with an empty message.
+     */
+    void close() noexcept {
+        std::coroutine_handle<> co;
+
+        if (h_ == nullptr)
+            return;
+        cometa_bind_cb_ctx(h_, nullptr, nullptr);
+        {
+            std::lock_guard<std::mutex> l(st_->lock);
+            co = std::exchange(st_->waiter, nullptr);
+            st_->slot = nullptr;
+        }
+        h_ = nullptr;
+        st_.reset();
+        if (co)
+            co.resume();
+    }
+
+    explicit operator bool() const noexcept { return h_ != nullptr; }
+    struct cometa *handle() const noexcept { return h_; }
+
+    /*
+     * Handle the messages with @f, which keeps its captured state. A handler replaces the delivery
+     * to receive().
+     */
+    template <message_handler F>
+    void on_message(F &&f) {
+        auto h = std::make_shared<detail::handler_impl<std::decay_t<F>>>(std::decay_t<F>(std::forward<F>(f)));
+        if (st_) {
+            std::lock_guard<std::mutex> l(st_->lock);
+            st_->handler = std::move(h);
+        }
+    }
+
+    /*
+     * Wait for the next message, see receive_op.
+     */
+    receive_op receive() const noexcept { return receive_op(st_); }
+
+    /*
+     * Send a message upstream, waiting for the write. It cannot be called while processing a
+     * message: use send_async() there.
+     */
+    reply send(bytes b) const noexcept {
+        return h_ ? cometa_send(h_, reinterpret_cast<const char *>(b.data()), static_cast<int>(b.size())) : COMETAR_PAR_ERROR;
+    }
+    reply send(std::string_view s) const noexcept { return send(as_bytes(s)); }
+
+    /*
+     * Send a message upstream in order with the other queued messages, see send_op.
+     */
+    send_op send_async(bytes b) const noexcept { return send_op(h_, b); }
+    send_op send_async(std::string_view s) const noexcept { return send_op(h_, as_bytes(s)); }
+
+    /*
+     * Messages kept while nobody waits in receive(), and the messages dropped beyond them.
+     */
+    void set_backlog(size_t n) {
+        if (st_) {
+            std::lock_guard<std::mutex> l(st_->lock);
+            st_->backlog_max = n;
+        }
+    }
+    uint64_t dropped() const {
+        if (!st_)
+            return 0;
+        std::lock_guard<std::mutex> l(st_->lock);
+        return st_->dropped;
+    }
+
+    reply error() const noexcept { return h_ ? cometa_error(h_) : COMETAR_PAR_ERROR; }
+    long epoch() const noexcept { return h_ ? cometa_epoch(h_) : 0; }
+    reply stats(cometa_stats &s) const noexcept { return h_ ? cometa_get_stats(h_, &s) : COMETAR_PAR_ERROR; }
+
+private:
+    struct cometa *h_ = nullptr;
+    std::shared_ptr<detail::state> st_;
+};
+
+/*
+ * Result of a subscription: the session, empty if the subscription failed with @result.
+ */
+struct subscribed {
+    cometa_cpp::session session;
+    reply result;
+};
+
+/*
+ * Subscribe to the application @app_name, see cometa_subscribe(). The application server parameters
+ * are NULL for the authentication without application server.
+ */
+inline subscribed subscribe(const char *app_name, const char *app_key, const char *app_server_name = nullptr,
+        const char *app_server_port = nullptr, const char *auth_endpoint = nullptr) {
+    struct cometa *h = cometa_subscribe(app_name, app_key, app_server_name, app_server_port, auth_endpoint);
+    cometa_subscribe_timing t;
+
+    if (h)
+        return { session(h), COMEATAR_OK };
+    return { session(), cometa_get_subscribe_timing(nullptr, &t) == COMEATAR_OK ? t.result : COMETAR_ERROR };
+}
+
+/*
+ * Awaitable of subscribe_async(), resuming with the result of the subscription. The parameters are
+ * copied.
+ */
+class subscribe_op {
+public:
+    subscribe_op(const char *app_name, const char *app_key, const char *app_server_name, const char *app_server_port,
+            const char *auth_endpoint) : app_name_(opt(app_name)), app_key_(opt(app_key)), app_server_name_(opt(app_server_name)),
+            app_server_port_(opt(app_server_port)), auth_endpoint_(opt(auth_endpoint)) {}
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> co) noexcept {
+        co_ = co;
+        reply r = cometa_subscribe_async(str(app_name_), str(app_key_), str(app_server_name_), str(app_server_port_),
+                str(auth_endpoint_), &subscribe_op::done, this);
+        if (r != COMEATAR_OK) {
+            result_ = r;
+            return false;
+        }
+        return true;
+    }
+    subscribed await_resume() { return { session(h_), result_ }; }
+
+private:
+    static std::optional<std::string> opt(const char *s) {
+        return s ? std::optional<std::string>(s) : std::nullopt;
+    }
+    static const char *str(const std::optional<std::string> &s) noexcept {
+        return s ? s->c_str() : nullptr;
+    }
+    static void done(void *ctx, struct cometa *h, cometa_reply r) {
+        subscribe_op *op = static_cast<subscribe_op *>(ctx);
+        op->h_ = h;
+        op->result_ = r;
+        op->co_.resume();
+    }
+
+    std::optional<std::string> app_name_, app_key_, app_server_name_, app_server_port_, auth_endpoint_;
+    struct cometa *h_ = nullptr;
+    reply result_ = COMETAR_ERROR;
+    std::coroutine_handle<> co_;
+};
+
+/*
+ * Subscribe in a thread of the library, see subscribe_op.
+ */
+inline subscribe_op subscribe_async(const char *app_name, const char *app_key, const char *app_server_name = nullptr,
+        const char *app_server_port = nullptr, const char *auth_endpoint = nullptr) {
+    return subscribe_op(app_name, app_key, app_server_name, app_server_port, auth_endpoint);
+}
+
+}   /* namespace cometa_cpp */
+
+#endif /* COMETA_HPP */
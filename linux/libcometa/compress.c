@@ -0,0 +1,352 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file    compress.c
+ *
+ * @brief   Per-message payload compression with pluggable codecs and pre-trained dictionaries.
+ *
+ * A compressed payload starts with the MSG_COMPRESSED marker followed by the codec id and the
+ * dictionary id (0 for none):
+ *
+ *    <0x08><codec><dictionary><compressed data>
+ *
+ * Compile using -DUSE_ZLIB, -DUSE_LZ4 or -DUSE_ZSTD to register the built-in deflate, LZ4 and
+ * zstd codecs. Other codecs can be registered by the application with cometa_register_codec().
+ *
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "cometa.h"
+#include "alloc.h"
+
+/* maximum number of codecs and dictionaries */
+#define MAX_CODECS  8
+#define MAX_DICTS   8
+
+/* registered codecs */
+static struct cometa_codec codecs[MAX_CODECS];
+static int ncodecs;
+
+/* registered dictionaries */
+static struct {
+    int     id;
+    void    *data;
+    int     len;
+} dicts[MAX_DICTS];
+static int ndicts;
+
+static pthread_mutex_t codecs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t codecs_once = PTHREAD_ONCE_INIT;
+
+#ifdef USE_ZLIB
+/*
+ * Raw deflate with a small window to limit the memory used by the device. The streams are
+ * allocated once and reset for every message.
+ */
+#define DEFLATE_WBITS   12
+#define DEFLATE_MEMLEVEL 5
+
+static z_stream zdef, zinf;
+static int zdef_init, zinf_init;
+static pthread_mutex_t zlib_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+deflate_compress(void *ctx, const void *dict, int dict_len, const char *src, int src_len, char *dst, int dst_cap) {
+    int ret = -1;
+
+    (void)ctx;
+    pthread_mutex_lock(&zlib_lock);
+    if (!zdef_init) {
+        if (deflateInit2(&zdef, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -DEFLATE_WBITS, DEFLATE_MEMLEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+            goto done;
+        zdef_init = 1;
+    } else if (deflateReset(&zdef) != Z_OK)
+        goto done;
+    if (dict && deflateSetDictionary(&zdef, (const Bytef *)dict, dict_len) != Z_OK)
+        goto done;
+    zdef.next_in = (Bytef *)src;
+    zdef.avail_in = src_len;
+    zdef.next_out = (Bytef *)dst;
+    zdef.avail_out = dst_cap;
+    if (deflate(&zdef, Z_FINISH) == Z_STREAM_END)
+        ret = dst_cap - zdef.avail_out;
+done:
+    pthread_mutex_unlock(&zlib_lock);
+    return ret;
+}
+
+static int
+deflate_decompress(void *ctx, const void *dict, int dict_len, const char *src, int src_len, char *dst, int dst_cap) {
+    int ret = -1;
+
+    (void)ctx;
+    pthread_mutex_lock(&zlib_lock);
+    if (!zinf_init) {
+        if (inflateInit2(&zinf, -15) != Z_OK)
+            goto done;
+        zinf_init = 1;
+    } else if (inflateReset(&zinf) != Z_OK)
+        goto done;
+    if (dict && inflateSetDictionary(&zinf, (const Bytef *)dict, dict_len) != Z_OK)
+        goto done;
+    zinf.next_in = (Bytef *)src;
+    zinf.avail_in = src_len;
+    zinf.next_out = (Bytef *)dst;
+    zinf.avail_out = dst_cap;
+    if (inflate(&zinf, Z_FINISH) == Z_STREAM_END)
+        ret = dst_cap - zinf.avail_out;
+done:
+    pthread_mutex_unlock(&zlib_lock);
+    return ret;
+}
+#endif
+
+#ifdef USE_LZ4
+static int
+lz4_compress(void *ctx, const void *dict, int dict_len, const char *src, int src_len, char *dst, int dst_cap) {
+    LZ4_stream_t stream;
+    int n;
+
+    (void)ctx;
+    LZ4_initStream(&stream, sizeof(stream));
+    if (dict)
+        LZ4_loadDict(&stream, (const char *)dict, dict_len);
+    n = LZ4_compress_fast_continue(&stream, src, dst, src_len, dst_cap, 1);
+    return n > 0 ? n : -1;
+}
+
+static int
+lz4_decompress(void *ctx, const void *dict, int dict_len, const char *src, int src_len, char *dst, int dst_cap) {
+    int ret;
+
+    (void)ctx;
+    if (dict)
+        ret = LZ4_decompress_safe_usingDict(src, dst, src_len, dst_cap, (const char *)dict, dict_len);
+    else
+        ret = LZ4_decompress_safe(src, dst, src_len, dst_cap);
+    return ret < 0 ? -1 : ret;
+}
+#endif
+
+#ifdef USE_ZSTD
+static ZSTD_CCtx *zcctx;
+static ZSTD_DCtx *zdctx;
+static pthread_mutex_t zstd_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+zstd_compress(void *ctx, const void *dict, int dict_len, const char *src, int src_len, char *dst, int dst_cap) {
+    size_t ret = 0;
+
+    (void)ctx;
+    pthread_mutex_lock(&zstd_lock);
+    if (zcctx || (zcctx = ZSTD_createCCtx()) != NULL) {
+        ret = ZSTD_compress_usingDict(zcctx, dst, dst_cap, src, src_len, dict, dict ? dict_len : 0, 3);
+    }
+    pthread_mutex_unlock(&zstd_lock);
+    return (zcctx == NULL || ZSTD_isError(ret)) ? -1 : (int)ret;
+}
+
+static int
+zstd_decompress(void *ctx, const void *dict, int dict_len, const char *src, int src_len, char *dst, int dst_cap) {
+    size_t ret = 0;
+
+    (void)ctx;
+    pthread_mutex_lock(&zstd_lock);
+    if (zdctx || (zdctx = ZSTD_createDCtx()) != NULL) {
+        ret = ZSTD_decompress_usingDict(zdctx, dst, dst_cap, src, src_len, dict, dict ? dict_len : 0);
+    }
+    pthread_mutex_unlock(&zstd_lock);
+    return (zdctx == NULL || ZSTD_isError(ret)) ? -1 : (int)ret;
+}
+#endif
+
+/*
+ * Register the built-in codecs.
+ */
+static void
+codecs_setup(void) {
+#ifdef USE_ZLIB
+    struct cometa_codec deflate_codec = { COMETA_CODEC_DEFLATE, "deflate", deflate_compress, deflate_decompress, NULL };
+
+    codecs[ncodecs++] = deflate_codec;
+#endif
+#ifdef USE_LZ4
+    struct cometa_codec lz4_codec = { COMETA_CODEC_LZ4, "lz4", lz4_compress, lz4_decompress, NULL };
+
+    codecs[ncodecs++] = lz4_codec;
+#endif
+#ifdef USE_ZSTD
+    struct cometa_codec zstd_codec = { COMETA_CODEC_ZSTD, "zstd", zstd_compress, zstd_decompress, NULL };
+
+    codecs[ncodecs++] = zstd_codec;
+#endif
+}
+
+/*
+ * Find the codec with id @id and the dictionary with id @dict_id.
+ *
+ * @result 0 if found or -1
+ *
+ */
+static int
+codec_lookup(int id, int dict_id, struct cometa_codec *codec, const void **dict, int *dict_len) {
+    int i, ret = -1;
+
+    pthread_once(&codecs_once, codecs_setup);
+    *dict = NULL;
+    *dict_len = 0;
+    pthread_mutex_lock(&codecs_lock);
+    for (i = 0; i < ncodecs; i++) {
+        if (codecs[i].id == id) {
+            *codec = codecs[i];
+            ret = 0;
+            break;
+        }
+    }
+    if (ret == 0 && dict_id != 0) {
+        ret = -1;
+        for (i = 0; i < ndicts; i++) {
+            if (dicts[i].id == dict_id) {
+                *dict = dicts[i].data;
+                *dict_len = dicts[i].len;
+                ret = 0;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&codecs_lock);
+    return ret;
+}   /* codec_lookup */
+
+/*
+ * Register a compression codec. A codec with the same id replaces the existing one.
+ *
+ */
+cometa_reply
+cometa_register_codec(const struct cometa_codec *codec) {
+    int i;
+
+    if (codec == NULL || codec->id <= 0 || codec->id > 255 || !codec->compress || !codec->decompress)
+        return COMETAR_PAR_ERROR;
+    pthread_once(&codecs_once, codecs_setup);
+    pthread_mutex_lock(&codecs_lock);
+    for (i = 0; i < ncodecs; i++) {
+        if (codecs[i].id == codec->id)
+            break;
+    }
+    if (i == MAX_CODECS) {
+        pthread_mutex_unlock(&codecs_lock);
+        return COMETAR_ERROR;
+    }
+    codecs[i] = *codec;
+    if (i == ncodecs)
+        ncodecs++;
+    pthread_mutex_unlock(&codecs_lock);
+    return COMEATAR_OK;
+}   /* cometa_register_codec */
+
+/*
+ * Register a pre-trained dictionary with id @dict_id. The dictionary is copied.
+ *
+ */
+cometa_reply
+cometa_add_dictionary(int dict_id, const void *dict, int len) {
+    void *data;
+    int i;
+
+    if (dict_id <= 0 || dict_id > 255 || dict == NULL || len <= 0)
+        return COMETAR_PAR_ERROR;
+    if ((data = cometa_malloc(len)) == NULL)
+        return COMETAR_ERROR;
+    memcpy(data, dict, len);
+    pthread_mutex_lock(&codecs_lock);
+    for (i = 0; i < ndicts; i++) {
+        if (dicts[i].id == dict_id)
+            break;
+    }
+    if (i == MAX_DICTS) {
+        pthread_mutex_unlock(&codecs_lock);
+        cometa_free(data);
+        return COMETAR_ERROR;
+    }
+    /* the previous dictionary with the same id is leaked on purpose: it may still be in use */
+    dicts[i].id = dict_id;
+    dicts[i].data = data;
+    dicts[i].len = len;
+    if (i == ndicts)
+        ndicts++;
+    pthread_mutex_unlock(&codecs_lock);
+    return COMEATAR_OK;
+}   /* cometa_add_dictionary */
+
+/*
+ * Compress @src with the codec @codec_id and the dictionary @dict_id into @dst, including the
+ * MSG_COMPRESSED header.
+ *
+ * @result the length of the compressed payload or -1 if the codec is not available or the
+ * payload does not fit in @dst_cap bytes
+ *
+ */
+int
+cometa_compress(int codec_id, int dict_id, const char *src, int src_len, char *dst, int dst_cap) {
+    struct cometa_codec codec;
+    const void *dict;
+    int dict_len, n;
+
+    if (dst_cap <= COMETA_COMPRESS_HDR || codec_lookup(codec_id, dict_id, &codec, &dict, &dict_len) != 0)
+        return -1;
+    n = codec.compress(codec.ctx, dict, dict_len, src, src_len, dst + COMETA_COMPRESS_HDR, dst_cap - COMETA_COMPRESS_HDR);
+    if (n < 0)
+        return -1;
+    dst[0] = MSG_COMPRESSED;
+    dst[1] = (char)codec_id;
+    dst[2] = (char)dict_id;
+    return n + COMETA_COMPRESS_HDR;
+}   /* cometa_compress */
+
+/*
+ * Decompress the payload in @src starting with the MSG_COMPRESSED header into @dst.
+ *
+ * @result the length of the decompressed payload or -1
+ *
+ */
+int
+cometa_decompress(const char *src, int src_len, char *dst, int dst_cap) {
+    struct cometa_codec codec;
+    const void *dict;
+    int dict_len;
+
+    if (src_len < COMETA_COMPRESS_HDR || src[0] != MSG_COMPRESSED ||
+            codec_lookup((unsigned char)src[1], (unsigned char)src[2], &codec, &dict, &dict_len) != 0)
+        return -1;
+    return codec.decompress(codec.ctx, dict, dict_len, src + COMETA_COMPRESS_HDR, src_len - COMETA_COMPRESS_HDR, dst, dst_cap);
+}   /* cometa_decompress */
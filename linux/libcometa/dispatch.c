@@ -0,0 +1,709 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file    dispatch.c
+ *
+ * @brief   Dispatch of the downstream messages to handlers selected by a key of the message.
+ *
+ * The handlers are registered in a list and compiled, when the dispatcher is bound, in a lookup
+ * table for the kind of key: a trie for the message prefixes, with the edges of a node sorted
+ * for a binary search, a hash table for the JSON values, with the hash seed chosen to avoid
+ * collisions when possible, or a table indexed by the first byte. The cost of a dispatch depends
+ * on the length of the key, not on the number of handlers.
+ *
+ * A handler runs in the receive thread, or on the thread of its lane with the message copied in
+ * a pooled buffer, so that a slow handler delays only the messages of its lane.
+ *
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+#include "cometa.h"
+#include "logger.h"
+#include "alloc.h"
+#include "pool.h"
+#include "realtime.h"
+
+/* longest key of a handler */
+#define DISPATCH_KEY_LEN    64
+/* messages waiting in a lane, dropped beyond */
+#define LANE_QUEUE_MAX      256
+/* seeds tried for a hash table without collisions, for each table size */
+#define HASH_SEEDS          32
+
+/*
+ * A registered handler.
+ */
+struct handler {
+    char *key;
+    int key_len;
+    cometa_message_ctx_cb cb;
+    void *ctx;
+    int lane;
+    struct cometa_handler_stats stats;  /* updated with atomic operations */
+};
+
+/*
+ * A node of the prefix trie, with its edges in [first, first + nedges) sorted by byte.
+ */
+struct tnode {
+    int handler;                /* handler of the prefix ending here or -1 */
+    int first;
+    int nedges;
+};
+
+struct tedge {
+    unsigned char byte;
+    int node;
+};
+
+/*
+ * A message queued in a lane, in a pooled buffer.
+ */
+struct lane_msg {
+    STAILQ_ENTRY(lane_msg) next;
+    struct handler *h;
+    int size;
+    char data[];
+};
+
+struct lane {
+    struct cometa_dispatch *d;
+    pthread_t tid;
+    int started;
+    int stop;
+    int queued;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    STAILQ_HEAD(, lane_msg) queue;
+};
+
+struct cometa_dispatch {
+    int key_type;               /* COMETA_DISPATCH_* */
+    char *field;                /* JSON member of the key, NULL for the name of the first member */
+    int field_len;
+    struct cometa *handle;
+    struct handler *handlers;
+    int nhandlers;
+    int cap;
+    struct handler fallback;    /* messages without a handler, cb NULL if none */
+    int compiled;
+
+    /* COMETA_DISPATCH_PREFIX */
+    struct tnode *nodes;
+    struct tedge *edges;
+    int nnodes;
+    int nedges;
+    /* COMETA_DISPATCH_JSON, slots with the handler index or -1 */
+    int *slots;
+    uint32_t mask;
+    uint32_t seed;
+    /* COMETA_DISPATCH_BYTE */
+    short bytes[256];
+
+    struct lane lanes[COMETA_DISPATCH_LANES];
+};
+
+#ifndef COMETA_NO_STATS
+static uint64_t
+mono_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+/*
+ * FNV-1a hash of @len bytes of @s with a @seed.
+ */
+static uint32_t
+key_hash(const char *s, int len, uint32_t seed) {
+    uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+
+    while (len-- > 0) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}   /* key_hash */
+
+static int
+skip_ws(const char *js, int i, int len) {
+    while (i < len && (js[i] == ' ' || js[i] == '\t' || js[i] == '\r' || js[i] == '\n'))
+        i++;
+    return i;
+}
+
+/*
+ * Skip the string starting after the quote at @i.
+ *
+ * @return the position after the closing quote or -1
+ *
+ */
+static int
+skip_string(const char *js, int i, int len) {
+    for (; i < len; i++) {
+        if (js[i] == '\\')
+            i++;
+        else if (js[i] == '"')
+            return i + 1;
+    }
+    return -1;
+}   /* skip_string */
+
+/*
+ * Find the key of the message @js of @len bytes: the value of the member @field of the JSON object,
+ * a string or a primitive, or the name of its first member with @field NULL. The members before it
+ * are skipped without tokenizing them.
+ *
+ * @return the offset of the key, with its length in @klen, or -1 if not found
+ *
+ */
+static int
+json_key(const char *js, int len, const char *field, int flen, int *klen) {
+    int i, k, end, depth, match;
+
+    i = skip_ws(js, 0, len);
+    if (i >= len || js[i] != '{')
+        return -1;
+    for (i++;; i++) {
+        /* the member name */
+        i = skip_ws(js, i, len);
+        if (i >= len || js[i] != '"')
+            return -1;
+        k = i + 1;
+        if ((i = skip_string(js, k, len)) < 0)
+            return -1;
+        if (field == NULL) {
+            *klen = i - 1 - k;
+            return k;
+        }
+        match = (i - 1 - k == flen && memcmp(js + k, field, flen) == 0);
+        i = skip_ws(js, i, len);
+        if (i >= len || js[i] != ':')
+            return -1;
+        i = skip_ws(js, i + 1, len);
+        if (i >= len)
+            return -1;
+
+        /* the value */
+        k = i;
+        if (js[i] == '"') {
+            if ((i = skip_string(js, i + 1, len)) < 0)
+                return -1;
+            if (match) {
+                *klen = i - k - 2;
+                return k + 1;
+            }
+        } else {
+            for (depth = 0; i < len; i++) {
+                if (js[i] == '"') {
+                    if ((i = skip_string(js, i + 1, len)) < 0)
+                        return -1;
+                    i--;
+                } else if (js[i] == '{' || js[i] == '[')
+                    depth++;
+                else if (js[i] == '}' || js[i] == ']') {
+                    if (depth-- == 0)
+                        break;
+                } else if (js[i] == ',' && depth == 0)
+                    break;
+            }
+            if (match) {
+                if (js[k] == '{' || js[k] == '[')
+                    return -1;
+                for (end = i; end > k && (js[end - 1] == ' ' || js[end - 1] == '\t' || js[end - 1] == '\r' || js[end - 1] == '\n'); end--)
+                    ;
+                *klen = end - k;
+                return k;
+            }
+        }
+        i = skip_ws(js, i, len);
+        if (i >= len || js[i] != ',')
+            return -1;
+    }
+}   /* json_key */
+
+/*
+ * Build the trie node of depth @depth for the sorted handlers @sorted[lo, hi) sharing the prefix
+ * of @depth bytes.
+ *
+ * @return the index of the node
+ *
+ */
+static int
+trie_build(struct cometa_dispatch *d, struct handler **sorted, int lo, int hi, int depth) {
+    int node = d->nnodes++;
+    int i, j, e, n = 0;
+
+    d->nodes[node].handler = -1;
+    /* the key ending at this node sorts first */
+    if (lo < hi && sorted[lo]->key_len == depth)
+        d->nodes[node].handler = sorted[lo++] - d->handlers;
+    for (i = lo; i < hi; i = j) {
+        for (j = i + 1; j < hi && sorted[j]->key[depth] == sorted[i]->key[depth]; j++)
+            ;
+        n++;
+    }
+    e = d->nedges;
+    d->nedges += n;
+    d->nodes[node].first = e;
+    d->nodes[node].nedges = n;
+    for (i = lo; i < hi; i = j) {
+        for (j = i + 1; j < hi && sorted[j]->key[depth] == sorted[i]->key[depth]; j++)
+            ;
+        d->edges[e].byte = (unsigned char)sorted[i]->key[depth];
+        d->edges[e++].node = trie_build(d, sorted, i, j, depth + 1);
+    }
+    return node;
+}   /* trie_build */
+
+/*
+ * Return the handler of the longest prefix of @s matching a key or -1.
+ */
+static int
+trie_lookup(const struct cometa_dispatch *d, const unsigned char *s, int len) {
+    const struct tnode *n = &d->nodes[0];
+    int best = n->handler;
+    int i, lo, hi, mid;
+
+    for (i = 0; i < len && n->nedges > 0; i++) {
+        lo = n->first;
+        hi = n->first + n->nedges;
+        while (lo < hi) {
+            mid = (lo + hi) / 2;
+            if (d->edges[mid].byte < s[i])
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo == n->first + n->nedges || d->edges[lo].byte != s[i])
+            break;
+        n = &d->nodes[d->edges[lo].node];
+        if (n->handler >= 0)
+            best = n->handler;
+    }
+    return best;
+}   /* trie_lookup */
+
+/*
+ * Fill the hash table of @size slots with the @seed.
+ *
+ * @return the number of keys not in their first slot
+ *
+ */
+static int
+hash_fill(struct cometa_dispatch *d, int *slots, uint32_t size, uint32_t seed) {
+    uint32_t i;
+    int n, collisions = 0;
+
+    for (i = 0; i < size; i++)
+        slots[i] = -1;
+    for (n = 0; n < d->nhandlers; n++) {
+        i = key_hash(d->handlers[n].key, d->handlers[n].key_len, seed) & (size - 1);
+        if (slots[i] >= 0)
+            collisions++;
+        while (slots[i] >= 0)
+            i = (i + 1) & (size - 1);
+        slots[i] = n;
+    }
+    return collisions;
+}   /* hash_fill */
+
+/*
+ * Return the handler of the key @s of @len bytes or -1.
+ */
+static int
+hash_lookup(const struct cometa_dispatch *d, const char *s, int len) {
+    uint32_t i = key_hash(s, len, d->seed) & d->mask;
+    const struct handler *h;
+
+    for (; d->slots[i] >= 0; i = (i + 1) & d->mask) {
+        h = &d->handlers[d->slots[i]];
+        if (h->key_len == len && memcmp(h->key, s, len) == 0)
+            return d->slots[i];
+    }
+    return -1;
+}   /* hash_lookup */
+
+static int
+key_cmp(const void *a, const void *b) {
+    const struct handler *x = *(struct handler *const *)a;
+    const struct handler *y = *(struct handler *const *)b;
+    int r = memcmp(x->key, y->key, x->key_len < y->key_len ? x->key_len : y->key_len);
+
+    return r ? r : x->key_len - y->key_len;
+}
+
+/*
+ * Compile the lookup table of the handlers.
+ *
+ * @return 0 or -1 if out of memory
+ *
+ */
+static int
+dispatch_compile(struct cometa_dispatch *d) {
+    struct handler **sorted;
+    uint32_t size, base, seed, best_seed = 0;
+    int i, total = 0, collisions, best = -1;
+
+    switch (d->key_type) {
+    case COMETA_DISPATCH_PREFIX:
+        for (i = 0; i < d->nhandlers; i++)
+            total += d->handlers[i].key_len;
+        sorted = cometa_malloc((d->nhandlers + 1) * sizeof(struct handler *));
+        d->nodes = cometa_malloc((total + 1) * sizeof(struct tnode));
+        d->edges = cometa_malloc((total + 1) * sizeof(struct tedge));
+        if (sorted == NULL || d->nodes == NULL || d->edges == NULL) {
+            cometa_free(sorted);
+            return -1;
+        }
+        for (i = 0; i < d->nhandlers; i++)
+            sorted[i] = &d->handlers[i];
+        qsort(sorted, d->nhandlers, sizeof(struct handler *), key_cmp);
+        trie_build(d, sorted, 0, d->nhandlers, 0);
+        cometa_free(sorted);
+        break;
+
+    case COMETA_DISPATCH_JSON:
+        for (base = 4; base < 2 * (uint32_t)d->nhandlers; base <<= 1)
+            ;
+        if ((d->slots = cometa_malloc(4 * base * sizeof(int))) == NULL)
+            return -1;
+        /* the smallest table and seed without collisions, or the seed with the fewest */
+        for (size = base; size <= 4 * base && best != 0; size <<= 1) {
+            for (seed = 0; seed < HASH_SEEDS; seed++) {
+                collisions = hash_fill(d, d->slots, size, seed);
+                if (best < 0 || collisions < best) {
+                    best = collisions;
+                    best_seed = seed;
+                    d->mask = size - 1;
+                }
+                if (collisions == 0)
+                    break;
+            }
+        }
+        d->seed = best_seed;
+        hash_fill(d, d->slots, d->mask + 1, d->seed);
+        debug_print("DEBUG: dispatch table of %d handlers in %u slots, %d collisions.\r\n", d->nhandlers, d->mask + 1, best);
+        break;
+
+    case COMETA_DISPATCH_BYTE:
+        for (i = 0; i < 256; i++)
+            d->bytes[i] = -1;
+        for (i = 0; i < d->nhandlers; i++)
+            d->bytes[(unsigned char)d->handlers[i].key[0]] = i;
+        break;
+    }
+    return 0;
+}   /* dispatch_compile */
+
+/*
+ * Run the handler @h on the message and update its statistics.
+ */
+static char *
+handler_run(struct handler *h, int size, char *data) {
+    char *response;
+#ifndef COMETA_NO_STATS
+    uint64_t t0 = mono_ns(), t, max;
+#endif
+
+    __atomic_fetch_add(&h->stats.calls, 1, __ATOMIC_RELAXED);
+    if (h->cb == NULL)
+        return NULL;
+    response = h->cb(h->ctx, size, data);
+    if (response && *response)
+        __atomic_fetch_add(&h->stats.replies, 1, __ATOMIC_RELAXED);
+#ifndef COMETA_NO_STATS
+    t = mono_ns() - t0;
+    __atomic_fetch_add(&h->stats.time_ns, t, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&h->stats.max_ns, __ATOMIC_RELAXED);
+    while (t > max && !__atomic_compare_exchange_n(&h->stats.max_ns, &max, t, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+#endif
+    return response;
+}   /* handler_run */
+
+/*
+ * Thread of a lane: run the handlers of the queued messages in order and send their replies.
+ */
+static void *
+lane_loop(void *arg) {
+    struct lane *l = (struct lane *)arg;
+    struct lane_msg *m;
+    char *response;
+
+    for (;;) {
+        pthread_mutex_lock(&l->lock);
+        while (STAILQ_EMPTY(&l->queue) && !l->stop)
+            pthread_cond_wait(&l->cond, &l->lock);
+        if ((m = STAILQ_FIRST(&l->queue)) == NULL) {
+            pthread_mutex_unlock(&l->lock);
+            break;
+        }
+        STAILQ_REMOVE_HEAD(&l->queue, next);
+        l->queued--;
+        pthread_mutex_unlock(&l->lock);
+
+        response = handler_run(m->h, m->size, m->data);
+        if (response && *response && cometa_send(l->d->handle, response, strlen(response)) != COMEATAR_OK)
+            log_warn("WARNING: in dispatch lane. Failed to send the reply of a handler.\r\n");
+        pool_put((char *)m);
+    }
+    return NULL;
+}   /* lane_loop */
+
+/*
+ * Queue a copy of the message for the lane of the handler @h.
+ */
+static void
+lane_push(struct cometa_dispatch *d, struct handler *h, int size, const char *data) {
+    struct lane *l = &d->lanes[h->lane];
+    struct lane_msg *m;
+
+    if ((m = (struct lane_msg *)pool_get(sizeof(struct lane_msg) + size + 1)) == NULL)
+        goto drop;
+    m->h = h;
+    m->size = size;
+    memcpy(m->data, data, size);
+    m->data[size] = '\0';
+    pthread_mutex_lock(&l->lock);
+    if (l->queued >= LANE_QUEUE_MAX) {
+        pthread_mutex_unlock(&l->lock);
+        pool_put((char *)m);
+        goto drop;
+    }
+    STAILQ_INSERT_TAIL(&l->queue, m, next);
+    l->queued++;
+    pthread_cond_signal(&l->cond);
+    pthread_mutex_unlock(&l->lock);
+    return;
+
+drop:
+    __atomic_fetch_add(&h->stats.dropped, 1, __ATOMIC_RELAXED);
+    log_warn("WARNING: in dispatch. Message dropped from lane %d.\r\n", h->lane);
+}   /* lane_push */
+
+/*
+ * Message callback of a bound dispatcher.
+ */
+static char *
+dispatch_cb(void *ctx, const int size, void *data) {
+    struct cometa_dispatch *d = (struct cometa_dispatch *)ctx;
+    struct handler *h = &d->fallback;
+    int i = -1, k, klen;
+
+    switch (d->key_type) {
+    case COMETA_DISPATCH_PREFIX:
+        i = trie_lookup(d, (const unsigned char *)data, size);
+        break;
+    case COMETA_DISPATCH_JSON:
+        if ((k = json_key((const char *)data, size, d->field, d->field_len, &klen)) >= 0)
+            i = hash_lookup(d, (const char *)data + k, klen);
+        break;
+    case COMETA_DISPATCH_BYTE:
+        if (size > 0)
+            i = d->bytes[*(unsigned char *)data];
+        break;
+    }
+    if (i >= 0)
+        h = &d->handlers[i];
+    if (h->lane == 0)
+        return handler_run(h, size, (char *)data);
+    lane_push(d, h, size, (const char *)data);
+    return NULL;
+}   /* dispatch_cb */
+
+/*
+ * Create a dispatcher on the key @key_type.
+ *
+ */
+struct cometa_dispatch *
+cometa_dispatch_new(int key_type, const char *field) {
+    struct cometa_dispatch *d;
+    int i;
+
+    if (key_type < COMETA_DISPATCH_PREFIX || key_type > COMETA_DISPATCH_BYTE ||
+            (field && strlen(field) > DISPATCH_KEY_LEN))
+        return NULL;
+    if ((d = cometa_calloc(1, sizeof(struct cometa_dispatch))) == NULL)
+        return NULL;
+    d->key_type = key_type;
+    if (key_type == COMETA_DISPATCH_JSON && field) {
+        if ((d->field = cometa_strdup(field)) == NULL) {
+            cometa_free(d);
+            return NULL;
+        }
+        d->field_len = strlen(field);
+    }
+    for (i = 0; i < COMETA_DISPATCH_LANES; i++) {
+        d->lanes[i].d = d;
+        pthread_mutex_init(&d->lanes[i].lock, NULL);
+        pthread_cond_init(&d->lanes[i].cond, NULL);
+        STAILQ_INIT(&d->lanes[i].queue);
+    }
+    return d;
+}   /* cometa_dispatch_new */
+
+/*
+ * Register the handler @cb of @key on the @lane, or the handler of the messages without one with
+ * @key NULL.
+ *
+ */
+cometa_reply
+cometa_dispatch_add(struct cometa_dispatch *d, const char *key, cometa_message_ctx_cb cb, void *ctx, int lane) {
+    struct handler *h;
+    int i, len;
+
+    if (d == NULL || cb == NULL || lane < 0 || lane >= COMETA_DISPATCH_LANES)
+        return COMETAR_PAR_ERROR;
+    if (d->compiled)
+        return COMETAR_ERROR;
+    if (key == NULL) {
+        d->fallback.cb = cb;
+        d->fallback.ctx = ctx;
+        d->fallback.lane = lane;
+        return COMEATAR_OK;
+    }
+    len = strlen(key);
+    if (len == 0 || len > DISPATCH_KEY_LEN || (d->key_type == COMETA_DISPATCH_BYTE && len != 1))
+        return COMETAR_PAR_ERROR;
+    for (i = 0; i < d->nhandlers; i++)
+        if (d->handlers[i].key_len == len && memcmp(d->handlers[i].key, key, len) == 0)
+            return COMETAR_PAR_ERROR;
+
+    if (d->nhandlers == d->cap) {
+        h = cometa_malloc((d->cap ? 2 * d->cap : 8) * sizeof(struct handler));
+        if (h == NULL)
+            return COMETAR_ERROR;
+        if (d->handlers)
+            memcpy(h, d->handlers, d->nhandlers * sizeof(struct handler));
+        cometa_free(d->handlers);
+        d->handlers = h;
+        d->cap = d->cap ? 2 * d->cap : 8;
+    }
+    h = &d->handlers[d->nhandlers];
+    memset(h, 0, sizeof(struct handler));
+    if ((h->key = cometa_strdup(key)) == NULL)
+        return COMETAR_ERROR;
+    h->key_len = len;
+    h->cb = cb;
+    h->ctx = ctx;
+    h->lane = lane;
+    d->nhandlers++;
+    return COMEATAR_OK;
+}   /* cometa_dispatch_add */
+
+/*
+ * Compile the handlers, start the lanes in use and bind the dispatcher to @handle.
+ *
+ */
+cometa_reply
+cometa_bind_dispatch(struct cometa *handle, struct cometa_dispatch *d) {
+    struct lane *l;
+    int i;
+
+    if (handle == NULL || d == NULL)
+        return COMETAR_PAR_ERROR;
+    if (!d->compiled) {
+        if (dispatch_compile(d) < 0) {
+            log_error("ERROR: in cometa_bind_dispatch. Out of memory.\r\n");
+            return COMETAR_ERROR;
+        }
+        d->compiled = 1;
+    }
+    d->handle = handle;
+    for (i = -1; i < d->nhandlers; i++) {
+        l = &d->lanes[i < 0 ? d->fallback.lane : d->handlers[i].lane];
+        if (l == &d->lanes[0] || l->started)
+            continue;
+        if (rt_thread_start(&l->tid, COMETA_THREAD_LANE, 0, lane_loop, (void *)l) != 0) {
+            log_error("ERROR: in cometa_bind_dispatch. Failed to create the thread of a lane.\r\n");
+            return COMETAR_ERROR;
+        }
+        l->started = 1;
+    }
+    return cometa_bind_cb_ctx(handle, dispatch_cb, d);
+}   /* cometa_bind_dispatch */
+
+/*
+ * Get the statistics of the handler of @key, or of the messages without a handler with @key NULL.
+ *
+ */
+cometa_reply
+cometa_dispatch_stats(struct cometa_dispatch *d, const char *key, struct cometa_handler_stats *stats) {
+    struct handler *h = NULL;
+    int i;
+
+    if (d == NULL || stats == NULL)
+        return COMETAR_PAR_ERROR;
+    if (key == NULL)
+        h = &d->fallback;
+    for (i = 0; h == NULL && i < d->nhandlers; i++)
+        if (strcmp(d->handlers[i].key, key) == 0)
+            h = &d->handlers[i];
+    if (h == NULL)
+        return COMETAR_PAR_ERROR;
+    stats->calls = __atomic_load_n(&h->stats.calls, __ATOMIC_RELAXED);
+    stats->replies = __atomic_load_n(&h->stats.replies, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&h->stats.dropped, __ATOMIC_RELAXED);
+    stats->time_ns = __atomic_load_n(&h->stats.time_ns, __ATOMIC_RELAXED);
+    stats->max_ns = __atomic_load_n(&h->stats.max_ns, __ATOMIC_RELAXED);
+    return COMEATAR_OK;
+}   /* cometa_dispatch_stats */
+
+/*
+ * Run the messages queued in the lanes, stop them and release the dispatcher.
+ *
+ */
+void
+cometa_dispatch_free(struct cometa_dispatch *d) {
+    struct lane *l;
+    int i;
+
+    if (d == NULL)
+        return;
+    for (i = 0; i < COMETA_DISPATCH_LANES; i++) {
+        l = &d->lanes[i];
+        if (l->started) {
+            pthread_mutex_lock(&l->lock);
+            l->stop = 1;
+            pthread_cond_signal(&l->cond);
+            pthread_mutex_unlock(&l->lock);
+            pthread_join(l->tid, NULL);
+        }
+        pthread_cond_destroy(&l->cond);
+        pthread_mutex_destroy(&l->lock);
+    }
+    for (i = 0; i < d->nhandlers; i++)
+        cometa_free(d->handlers[i].key);
+    cometa_free(d->handlers);
+    cometa_free(d->nodes);
+    cometa_free(d->edges);
+    cometa_free(d->slots);
+    cometa_free(d->field);
+    cometa_free(d);
+}   /* cometa_dispatch_free */
@@ -0,0 +1,197 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file    flight.c
+ *
+ * @brief   Flight recorder of the connections.
+ *
+ * Each connection records its last FLIGHT_LEN events (frames, sizes, timings, errors and state
+ * changes) in a ring of fixed size written without locks, see flight.h. The ring is dumped to a
+ * file and/or a callback when the connection is lost, before exiting on a fatal error and on
+ * request. A dump in a file is text, one event for each line with its time relative to the dump:
+ *
+ *    cometa flight recorder: disconnect at 1379030944.123456 (monotonic 81.234567890)
+ *       -1503.112 ms  send        size 64 result 2 errno 0
+ *          -0.071 ms  read_error  result 0 errno 0 cause 1
+ *          -0.070 ms  state       connected 0 cause 1
+ *
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "cometa.h"
+#include "flight.h"
+#include "logger.h"
+#include "alloc.h"
+
+#ifndef COMETA_NO_STATS
+
+/* dump configuration */
+static char *flight_path;
+static cometa_flight_cb flight_cb;
+static void *flight_ctx;
+static pthread_mutex_t flight_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *reason_names[] = { "request", "disconnect", "fatal" };
+
+/*
+ * Names of the events and of their arguments.
+ */
+static const struct {
+    const char *name;
+    const char *args[4];
+} event_names[] = {
+    { "?",          { "a", "b", "c", "d" } },
+    { "phase",      { "phase", "us", NULL, NULL } },
+    { "subscribe",  { "result", "failed_phase", "ms", "reconnect" } },
+    { "state",      { "connected", "cause", NULL, NULL } },
+    { "recv",       { "size", "type", NULL, NULL } },
+    { "callback",   { "us", "reply", NULL, NULL } },
+    { "reply",      { "result", "errno", NULL, NULL } },
+    { "send",       { "size", "result", "errno", NULL } },
+    { "heartbeat",  { "result", "errno", NULL, NULL } },
+    { "read_error", { "result", "errno", "cause", NULL } },
+    { "tls_error",  { "ssl_error", "err", "op", NULL } },
+    { "reconnect",  { "backoff_ms", NULL, NULL, NULL } },
+    { "dump",       { "reason", NULL, NULL, NULL } },
+};
+
+/*
+ * Copy the valid events of the ring @f in @ev, oldest first.
+ *
+ * @return the number of events
+ *
+ */
+static int
+flight_copy(struct flight *f, struct cometa_flight_event *ev) {
+    struct cometa_flight_event *e;
+    uint32_t end, seq, i;
+    int n = 0;
+
+    end = __atomic_load_n(&f->next, __ATOMIC_ACQUIRE);
+    for (i = (end > FLIGHT_LEN) ? end - FLIGHT_LEN : 0; i != end; i++) {
+        e = &f->ev[i % FLIGHT_LEN];
+        seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        ev[n] = *e;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        /* skip the events being written or overwritten during the copy */
+        if (seq != i + 1 || __atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq)
+            continue;
+        n++;
+    }
+    return n;
+}   /* flight_copy */
+
+/*
+ * Write the @n events in @ev as text in the file @fd.
+ *
+ */
+static void
+flight_write(int fd, int reason, const struct cometa_flight_event *ev, int n) {
+    struct timespec now, mono;
+    uint64_t t;
+    char line[160];
+    int i, j, len, type;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    t = (uint64_t)mono.tv_sec * 1000000000ULL + mono.tv_nsec;
+    dprintf(fd, "cometa flight recorder: %s at %ld.%06ld (monotonic %ld.%09ld)\n", reason_names[reason],
+            (long)now.tv_sec, now.tv_nsec / 1000, (long)mono.tv_sec, mono.tv_nsec);
+    for (i = 0; i < n; i++) {
+        type = ev[i].type < sizeof(event_names) / sizeof(event_names[0]) ? ev[i].type : 0;
+        len = snprintf(line, sizeof(line), "%14.3f ms  %-10s", -(double)(t - ev[i].time) / 1e6, event_names[type].name);
+        for (j = 0; j < 4 && event_names[type].args[j]; j++) {
+            if (type == COMETA_FR_TLS_ERROR && j == 1)
+                len += snprintf(line + len, sizeof(line) - len, " %s 0x%x", event_names[type].args[j], (unsigned)ev[i].args[j]);
+            else
+                len += snprintf(line + len, sizeof(line) - len, " %s %d", event_names[type].args[j], ev[i].args[j]);
+        }
+        dprintf(fd, "%s\n", line);
+    }
+}   /* flight_write */
+
+/*
+ * Dump the ring @f for the COMETA_FR_DUMP_* @reason.
+ *
+ */
+void
+flight_dump(struct flight *f, int reason) {
+    struct cometa_flight_event ev[FLIGHT_LEN];
+    int n, fd;
+
+    pthread_mutex_lock(&flight_lock);
+    if (reason != COMETA_FR_DUMP_REQUEST && flight_path == NULL && flight_cb == NULL) {
+        pthread_mutex_unlock(&flight_lock);
+        return;
+    }
+    flight_record(f, COMETA_FR_DUMP, reason, 0, 0, 0);
+    n = flight_copy(f, ev);
+    if (flight_cb)
+        flight_cb(flight_ctx, reason, ev, n);
+    if (flight_path) {
+        if ((fd = open(flight_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+            log_error("ERROR: cannot write the flight recorder in %s (%s).\r\n", flight_path, strerror(errno));
+        else {
+            flight_write(fd, reason, ev, n);
+            close(fd);
+        }
+    }
+    if (flight_path == NULL && flight_cb == NULL)
+        flight_write(2, reason, ev, n);
+    pthread_mutex_unlock(&flight_lock);
+}   /* flight_dump */
+
+/*
+ * Set the destinations of the dumps.
+ *
+ */
+cometa_reply
+cometa_set_flight_recorder(const char *path, cometa_flight_cb cb, void *ctx) {
+    char *p = NULL;
+
+    if (path && (p = cometa_strdup(path)) == NULL)
+        return COMETAR_ERROR;
+    pthread_mutex_lock(&flight_lock);
+    cometa_free(flight_path);
+    flight_path = p;
+    flight_cb = cb;
+    flight_ctx = ctx;
+    pthread_mutex_unlock(&flight_lock);
+    return COMEATAR_OK;
+}   /* cometa_set_flight_recorder */
+
+#else
+/*
+ * Without statistics.
+ */
+cometa_reply
+cometa_set_flight_recorder(const char *path, cometa_flight_cb cb, void *ctx) {
+    return COMETAR_ERROR;
+}
+#endif  /* COMETA_NO_STATS */
@@ -0,0 +1,70 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file    flight.h
+ *
+ * @brief   Internal flight recorder of the connections, see flight.c.
+ *
+ */
+
+#ifndef COMETA_NO_STATS
+
+/* events in the ring of a connection, a power of two */
+#define FLIGHT_LEN      256
+
+/*
+ * The ring of the events of a connection.
+ */
+struct flight {
+    struct cometa_flight_event ev[FLIGHT_LEN];
+    uint32_t next;              /* sequence number of the next event */
+};
+
+/*
+ * Record an event in the ring @f. Any thread can record without locking: a slot is claimed with an
+ * atomic increment and its sequence number is written last, so that a dump skips the slots being written.
+ */
+static inline void
+flight_record(struct flight *f, int type, int a, int b, int c, int d) {
+    struct cometa_flight_event *e;
+    struct timespec ts;
+    uint32_t seq;
+
+    seq = __atomic_fetch_add(&f->next, 1, __ATOMIC_RELAXED);
+    e = &f->ev[seq % FLIGHT_LEN];
+    __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    e->time = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    e->type = type;
+    e->args[0] = a;
+    e->args[1] = b;
+    e->args[2] = c;
+    e->args[3] = d;
+    __atomic_store_n(&e->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+void flight_dump(struct flight *f, int reason);
+
+#else
+/* compiled out with the statistics */
+#define flight_record(f, type, a, b, c, d)  ((void)0)
+#define flight_dump(f, reason)              ((void)0)
+#endif
@@ -29,6 +29,12 @@
 #include <string.h>
 #include <limits.h>
 
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+# include <arm_neon.h>
+#endif
+
 #ifndef ULLONG_MAX
 # define ULLONG_MAX ((uint64_t) -1) /* 2^64-1 */
 #endif
@@ -569,6 +575,48 @@ parse_url_char(enum state s, const char ch)
   return s_dead;
 }
 
+/* Return a pointer to the first CR or LF in [p, end), or end if there is none.
+ * Used to skip over header values and chunk extensions 16 bytes at a time.
+ */
+static const char *
+find_crlf(const char *p, const char *end)
+{
+#if defined(__SSE2__)
+  const __m128i cr = _mm_set1_epi8(CR);
+  const __m128i lf = _mm_set1_epi8(LF);
+
+  while (end - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr),
+                                              _mm_cmpeq_epi8(v, lf)));
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 16;
+  }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  const uint8x16_t cr = vdupq_n_u8(CR);
+  const uint8x16_t lf = vdupq_n_u8(LF);
+
+  while (end - p >= 16) {
+    uint8x16_t v = vld1q_u8((const uint8_t *) p);
+    uint8x16_t m = vorrq_u8(vceqq_u8(v, cr), vceqq_u8(v, lf));
+    uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+          vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+    if (mask != 0) {
+      return p + (__builtin_ctzll(mask) >> 2);
+    }
+    p += 16;
+  }
+#endif
+  for (; p != end; p++) {
+    if (*p == CR || *p == LF) {
+      break;
+    }
+  }
+  return p;
+}
+
 size_t http_parser_execute (http_parser *parser,
                             const http_parser_settings *settings,
                             const char *data,
@@ -1437,7 +1485,20 @@ size_t http_parser_execute (http_parser *parser,
 
         switch (parser->header_state) {
           case h_general:
+          {
+            /* Fast path: skip to the end of the line, leaving the CR or LF
+             * to be processed by the next iteration.
+             */
+            const char *q = find_crlf(p + 1, data + len);
+
+            parser->nread += q - (p + 1);
+            if (parser->nread > HTTP_MAX_HEADER_SIZE) {
+              SET_ERRNO(HPE_HEADER_OVERFLOW);
+              goto error;
+            }
+            p = q - 1;
             break;
+          }
 
           case h_connection:
           case h_transfer_encoding:
@@ -1750,6 +1811,8 @@ size_t http_parser_execute (http_parser *parser,
           parser->state = s_chunk_size_almost_done;
           break;
         }
+        /* skip the rest of the chunk extensions up to the next CR or LF */
+        p = find_crlf(p + 1, data + len) - 1;
         break;
       }
 
@@ -1766,6 +1829,7 @@ size_t http_parser_execute (http_parser *parser,
         } else {
           parser->state = s_chunk_data;
         }
+        CALLBACK_NOTIFY(chunk_header);
         break;
       }
 
@@ -1805,6 +1869,7 @@ size_t http_parser_execute (http_parser *parser,
         STRICT_CHECK(ch != LF);
         parser->nread = 0;
         parser->state = s_chunk_size_start;
+        CALLBACK_NOTIFY(chunk_complete);
         break;
 
       default:
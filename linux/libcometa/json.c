@@ -0,0 +1,266 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file    json.c
+ *
+ * @brief   Non-allocating JSON tokenizer for the server responses and the message payloads.
+ *
+ * The tokenizer does a single pass on the buffer and fills an array of tokens provided by
+ * the caller with the offsets of objects, arrays, strings and primitives. Nothing is copied
+ * and the buffer is not modified. Strings are scanned 16 bytes at a time with SSE2 or NEON
+ * when available.
+ *
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "cometa.h"
+
+/*
+ * Find the first quote, backslash or control character in @js from @pos to @len.
+ *
+ * @result the position found or @len
+ *
+ */
+static int
+scan_string(const char *js, int pos, int len) {
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    const __m128i ctrl = _mm_set1_epi8(0x1f);
+    __m128i v, m;
+    int mask;
+
+    while (pos + 16 <= len) {
+        v = _mm_loadu_si128((const __m128i *)(js + pos));
+        m = _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash));
+        /* unsigned v <= 0x1f */
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(v, ctrl), v));
+        if ((mask = _mm_movemask_epi8(m)) != 0)
+            return pos + __builtin_ctz(mask);
+        pos += 16;
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    const uint8x16_t quote = vdupq_n_u8('"');
+    const uint8x16_t bslash = vdupq_n_u8('\\');
+    const uint8x16_t ctrl = vdupq_n_u8(0x20);
+    uint8x16_t v, m;
+    uint64_t mask;
+
+    while (pos + 16 <= len) {
+        v = vld1q_u8((const uint8_t *)(js + pos));
+        m = vorrq_u8(vceqq_u8(v, quote), vceqq_u8(v, bslash));
+        m = vorrq_u8(m, vcltq_u8(v, ctrl));
+        /* narrow the 16 bytes mask to 4 bits per byte */
+        mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+        if (mask != 0)
+            return pos + (__builtin_ctzll(mask) >> 2);
+        pos += 16;
+    }
+#endif
+    while (pos < len) {
+        unsigned char c = (unsigned char)js[pos];
+
+        if (c == '"' || c == '\\' || c < 0x20)
+            break;
+        pos++;
+    }
+    return pos;
+}   /* scan_string */
+
+/*
+ * Allocate the next token and link it to the parent token.
+ *
+ */
+static cometa_json_tok *
+alloc_token(cometa_json_tok *tokens, int ntokens, int *next, int parent, cometa_json_type type, int start, int end) {
+    cometa_json_tok *tok;
+
+    if (*next >= ntokens)
+        return NULL;
+    tok = &tokens[(*next)++];
+    tok->type = type;
+    tok->start = start;
+    tok->end = end;
+    tok->size = 0;
+    tok->parent = parent;
+    if (parent != -1)
+        tokens[parent].size++;
+    return tok;
+}   /* alloc_token */
+
+/*
+ * Tokenize the JSON text in @js of @len bytes in the @tokens array.
+ *
+ * @result the number of tokens or a negative COMETA_JSON_ERROR_* code
+ *
+ */
+int
+cometa_json_parse(const char *js, int len, cometa_json_tok *tokens, int ntokens) {
+    int pos, next = 0, super = -1, i;
+    cometa_json_type type;
+    char c;
+
+    for (pos = 0; pos < len && js[pos] != '\0'; pos++) {
+        c = js[pos];
+        switch (c) {
+        case '{':
+        case '[':
+            if (alloc_token(tokens, ntokens, &next, super, c == '{' ? COMETA_JSON_OBJECT : COMETA_JSON_ARRAY, pos, -1) == NULL)
+                return COMETA_JSON_ERROR_NOMEM;
+            super = next - 1;
+            break;
+
+        case '}':
+        case ']':
+            type = (c == '}') ? COMETA_JSON_OBJECT : COMETA_JSON_ARRAY;
+            /* find the innermost open container */
+            for (i = super; i != -1; i = tokens[i].parent) {
+                if ((tokens[i].type == COMETA_JSON_OBJECT || tokens[i].type == COMETA_JSON_ARRAY) && tokens[i].end == -1)
+                    break;
+            }
+            if (i == -1 || tokens[i].type != type)
+                return COMETA_JSON_ERROR_INVAL;
+            tokens[i].end = pos + 1;
+            super = tokens[i].parent;
+            break;
+
+        case '"':
+            i = pos + 1;
+            while (1) {
+                i = scan_string(js, i, len);
+                if (i >= len || js[i] == '\0')
+                    return COMETA_JSON_ERROR_PART;
+                if (js[i] == '"')
+                    break;
+                if (js[i] != '\\')
+                    return COMETA_JSON_ERROR_INVAL;
+                /* skip the escaped character, \uXXXX is scanned as plain text */
+                i += 2;
+            }
+            if (alloc_token(tokens, ntokens, &next, super, COMETA_JSON_STRING, pos + 1, i) == NULL)
+                return COMETA_JSON_ERROR_NOMEM;
+            pos = i;
+            break;
+
+        case ':':
+            /* the value is a child of the key */
+            super = next - 1;
+            break;
+
+        case ',':
+            if (super != -1 && tokens[super].type != COMETA_JSON_OBJECT && tokens[super].type != COMETA_JSON_ARRAY)
+                super = tokens[super].parent;
+            break;
+
+        case ' ':
+        case '\t':
+        case '\r':
+        case '\n':
+            break;
+
+        default:
+            /* numbers, true, false and null */
+            if (!(c == '-' || (c >= '0' && c <= '9') || c == 't' || c == 'f' || c == 'n'))
+                return COMETA_JSON_ERROR_INVAL;
+            for (i = pos; i < len; i++) {
+                c = js[i];
+                if (c == ',' || c == ']' || c == '}' || c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\0')
+                    break;
+                if ((unsigned char)c < 0x20 || c == '"' || c == ':')
+                    return COMETA_JSON_ERROR_INVAL;
+            }
+            if (alloc_token(tokens, ntokens, &next, super, COMETA_JSON_PRIMITIVE, pos, i) == NULL)
+                return COMETA_JSON_ERROR_NOMEM;
+            pos = i - 1;
+            break;
+        }
+    }
+
+    /* check for unterminated objects and arrays */
+    for (i = 0; i < next; i++) {
+        if (tokens[i].end == -1)
+            return COMETA_JSON_ERROR_PART;
+    }
+    return next;
+}   /* cometa_json_parse */
+
+/*
+ * Compare the string or primitive token @tok with the zero-terminated string @s.
+ *
+ * @result 1 if equal, 0 otherwise
+ *
+ */
+int
+cometa_json_eq(const char *js, const cometa_json_tok *tok, const char *s) {
+    int len = tok->end - tok->start;
+
+    if (tok->type != COMETA_JSON_STRING && tok->type != COMETA_JSON_PRIMITIVE)
+        return 0;
+    return (int)strlen(s) == len && memcmp(js + tok->start, s, len) == 0;
+}   /* cometa_json_eq */
+
+/*
+ * Find the member @key of the object token at index @object.
+ *
+ * @result the index of the value token or -1 if not found
+ *
+ */
+int
+cometa_json_get(const char *js, const cometa_json_tok *tokens, int ntokens, int object, const char *key) {
+    int i;
+
+    if (object < 0 || object >= ntokens || tokens[object].type != COMETA_JSON_OBJECT)
+        return -1;
+    for (i = object + 1; i < ntokens - 1 && tokens[i].start < tokens[object].end; i++) {
+        if (tokens[i].parent == object && cometa_json_eq(js, &tokens[i], key))
+            return i + 1;
+    }
+    return -1;
+}   /* cometa_json_get */
+
+/*
+ * Convert the number in the token @tok, also when it is quoted as a string.
+ *
+ * @result the number or @defval if the token is not a number
+ *
+ */
+long
+cometa_json_long(const char *js, const cometa_json_tok *tok, long defval) {
+    char buf[24];
+    char *end;
+    long val;
+    int len = tok->end - tok->start;
+
+    if ((tok->type != COMETA_JSON_STRING && tok->type != COMETA_JSON_PRIMITIVE) || len <= 0 || len >= (int)sizeof(buf))
+        return defval;
+    /* the buffer is not zero-terminated */
+    memcpy(buf, js + tok->start, len);
+    buf[len] = '\0';
+    val = strtol(buf, &end, 10);
+    return (*end == '\0') ? val : defval;
+}   /* cometa_json_long */
@@ -0,0 +1,165 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file    latency.c
+ *
+ * @brief   Log-bucketed latency histograms.
+ *
+ * A histogram counts the values in nanoseconds in buckets of fixed relative width: the values below
+ * COMETA_HIST_SUB have a bucket each, and every power of two above is split in COMETA_HIST_SUB buckets,
+ * so that a value is known within 1/COMETA_HIST_SUB of its magnitude from 1 ns up to 2^40 ns (18 min).
+ * The histograms have a fixed size and the same layout everywhere, so that they can be merged across
+ * connections and devices. The counters are updated with relaxed atomics by a single writer, and they
+ * can be read or reset from any thread.
+ *
+ */
+
+#include <string.h>
+
+#include "cometa.h"
+
+#define HIST_SHIFT  3       /* log2(COMETA_HIST_SUB) */
+#define HIST_MAX    ((1ULL << 40) - 1)
+
+/*
+ * Return the bucket of the value @v.
+ */
+static int
+bucket_index(uint64_t v) {
+    int e;
+
+    if (v > HIST_MAX)
+        v = HIST_MAX;
+    if (v < COMETA_HIST_SUB)
+        return (int)v;
+    e = 63 - __builtin_clzll(v);
+    return ((e - HIST_SHIFT + 1) << HIST_SHIFT) + (int)((v >> (e - HIST_SHIFT)) & (COMETA_HIST_SUB - 1));
+}   /* bucket_index */
+
+/*
+ * Return the highest value counted in the bucket @i.
+ */
+static uint64_t
+bucket_high(int i) {
+    int e;
+
+    if (i < COMETA_HIST_SUB)
+        return i;
+    e = (i >> HIST_SHIFT) + HIST_SHIFT - 1;
+    return ((uint64_t)(COMETA_HIST_SUB + (i & (COMETA_HIST_SUB - 1)) + 1) << (e - HIST_SHIFT)) - 1;
+}   /* bucket_high */
+
+/*
+ * Record the value @ns in the histogram @h.
+ *
+ */
+void
+cometa_hist_record(struct cometa_hist *h, uint64_t ns) {
+    __atomic_fetch_add(&h->buckets[bucket_index(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, ns, __ATOMIC_RELAXED);
+    /* a single writer updates the extremes */
+    if (ns > __atomic_load_n(&h->max, __ATOMIC_RELAXED))
+        __atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+    if (ns < __atomic_load_n(&h->min, __ATOMIC_RELAXED) || __atomic_load_n(&h->min, __ATOMIC_RELAXED) == 0)
+        __atomic_store_n(&h->min, ns, __ATOMIC_RELAXED);
+}   /* cometa_hist_record */
+
+/*
+ * Copy the histogram @src in @dst while it is being updated.
+ *
+ */
+void
+cometa_hist_snapshot(const struct cometa_hist *src, struct cometa_hist *dst) {
+    uint64_t count = 0;
+    int i;
+
+    for (i = 0; i < COMETA_HIST_BUCKETS; i++) {
+        dst->buckets[i] = __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+        count += dst->buckets[i];
+    }
+    /* the count is the sum of the buckets copied, consistent with the percentiles */
+    dst->count = count;
+    dst->sum = __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    dst->min = __atomic_load_n(&src->min, __ATOMIC_RELAXED);
+    dst->max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+}   /* cometa_hist_snapshot */
+
+/*
+ * Clear the histogram @h.
+ *
+ */
+void
+cometa_hist_reset(struct cometa_hist *h) {
+    int i;
+
+    for (i = 0; i < COMETA_HIST_BUCKETS; i++)
+        __atomic_store_n(&h->buckets[i], 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->count, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->min, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->max, 0, __ATOMIC_RELAXED);
+}   /* cometa_hist_reset */
+
+/*
+ * Add the histogram @src to @dst.
+ *
+ */
+void
+cometa_hist_merge(struct cometa_hist *dst, const struct cometa_hist *src) {
+    int i;
+
+    if (src->count == 0)
+        return;
+    for (i = 0; i < COMETA_HIST_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+    if (dst->count == 0 || src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+    dst->count += src->count;
+    dst->sum += src->sum;
+}   /* cometa_hist_merge */
+
+/*
+ * Return the value at the percentile @p (0 - 100), that is the highest value of the bucket
+ * where the percentile falls, and not more than the maximum recorded.
+ *
+ */
+uint64_t
+cometa_hist_percentile(const struct cometa_hist *h, double p) {
+    uint64_t rank, seen = 0, v;
+    int i;
+
+    if (h->count == 0)
+        return 0;
+    if (p <= 0)
+        return h->min;
+    rank = (p >= 100) ? h->count : (uint64_t)(p / 100 * h->count + 0.5);
+    if (rank == 0)
+        rank = 1;
+    for (i = 0; i < COMETA_HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank)
+            break;
+    }
+    v = bucket_high(i < COMETA_HIST_BUCKETS ? i : COMETA_HIST_BUCKETS - 1);
+    return v < h->max ? v : h->max;
+}   /* cometa_hist_percentile */
@@ -0,0 +1,585 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file    logger.c
+ *
+ * @brief   Asynchronous logging of the library.
+ *
+ * A message is recorded in a ring of the calling thread with its format and the values of its
+ * arguments, without formatting nor locking: the strings are copied, up to LOG_TEXT bytes in
+ * total, and the integers and floating point values are kept in binary form. A logging thread
+ * formats the records of all the rings in time order and passes the messages to the sink, by
+ * default the standard error. When a ring is full the new records are dropped and counted.
+ *
+ * The level is set with cometa_set_log_level() or with the COMETA_LOG_LEVEL environment
+ * variable (error, warn, info, debug or 0 - 4). The pending records are written at exit
+ * and by cometa_log_flush().
+ *
+ * Compiled with COMETA_LOG_SYNC there are neither rings nor logging thread: the messages are
+ * formatted and written to the sink by the calling thread, under a lock.
+ *
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "cometa.h"
+#include "logger.h"
+#include "realtime.h"
+
+/* records in the ring of a thread */
+#ifndef LOG_RING
+#define LOG_RING    32
+#endif
+/* maximum number of arguments of a message, including the '*' width and precision */
+#define LOG_ARGS    8
+/* space for the string arguments of a message */
+#define LOG_TEXT    192
+/* maximum length of a formatted message */
+#define LOG_LINE    1024
+/* period of the logging thread in milliseconds */
+#define LOG_PERIOD  100
+
+#ifndef COMETA_LOG_SYNC
+/*
+ * A log record.
+ */
+struct log_rec {
+    struct timespec time;
+    const char *fmt;
+    int level;
+    int nargs;              /* arguments captured, -1 if there were too many */
+    uint64_t args[LOG_ARGS];    /* integers and pointers, bits of doubles or offsets in text */
+    int text_len;
+    char text[LOG_TEXT];
+};
+
+/*
+ * The single producer, single consumer ring of a thread.
+ */
+struct log_ring {
+    struct log_rec recs[LOG_RING];
+    unsigned long head;     /* next record written by the thread */
+    unsigned long tail;     /* next record read by the logging thread */
+    unsigned long stop;     /* head at the start of the drain */
+    unsigned long drops;    /* records dropped with the ring full */
+    unsigned long drops_reported;
+    int dead;               /* the thread terminated */
+    struct log_ring *next;
+};
+
+#endif
+
+/* a conversion specification of a format */
+struct spec {
+    char flags[8];
+    int width;              /* -1 if none, -2 for '*' */
+    int prec;               /* -1 if none, -2 for '*' */
+    char len[3];            /* length modifier */
+    char conv;
+};
+
+int cometa_log_level = COMETA_LOG_INFO;
+
+#ifndef COMETA_LOG_SYNC
+static __thread struct log_ring *thread_ring;
+static pthread_key_t ring_key;
+static struct log_ring *rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
+#ifdef COMETA_LOG_SYNC
+static __thread int in_sink;    /* the thread is in the sink */
+#endif
+
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static cometa_log_cb log_sink;
+static void *log_ctx;
+
+static const char *level_names[] = { "none", "error", "warn", "info", "debug" };
+
+/*
+ * Default sink on the standard error.
+ */
+static void
+stderr_sink(void *ctx, int level, const struct timespec *time, const char *msg) {
+    fprintf(stderr, "%s\n", msg);
+}
+
+#ifndef COMETA_LOG_SYNC
+/*
+ * Parse the conversion specification at @f, after the '%'.
+ *
+ * @return the character after the specification
+ *
+ */
+static const char *
+parse_spec(const char *f, struct spec *sp) {
+    int n = 0;
+
+    while (*f && strchr("-+ #0'", *f) && n < (int)sizeof(sp->flags) - 1)
+        sp->flags[n++] = *f++;
+    sp->flags[n] = '\0';
+    sp->width = -1;
+    if (*f == '*') {
+        sp->width = -2;
+        f++;
+    } else if (*f >= '0' && *f <= '9') {
+        for (sp->width = 0; *f >= '0' && *f <= '9'; f++)
+            sp->width = sp->width * 10 + *f - '0';
+    }
+    sp->prec = -1;
+    if (*f == '.') {
+        f++;
+        if (*f == '*') {
+            sp->prec = -2;
+            f++;
+        } else {
+            for (sp->prec = 0; *f >= '0' && *f <= '9'; f++)
+                sp->prec = sp->prec * 10 + *f - '0';
+        }
+    }
+    n = 0;
+    while (*f && strchr("hlLqjzt", *f) && n < (int)sizeof(sp->len) - 1)
+        sp->len[n++] = *f++;
+    sp->len[n] = '\0';
+    sp->conv = *f;
+    return *f ? f + 1 : f;
+}   /* parse_spec */
+
+/*
+ * Capture the integer argument of the conversion @sp, converted as printf() would.
+ */
+static uint64_t
+capture_int(struct spec *sp, va_list *ap) {
+    int is_signed = (sp->conv == 'd' || sp->conv == 'i');
+    uint64_t v;
+
+    if (strcmp(sp->len, "ll") == 0 || strcmp(sp->len, "q") == 0)
+        v = is_signed ? (uint64_t)va_arg(*ap, long long) : va_arg(*ap, unsigned long long);
+    else if (strcmp(sp->len, "l") == 0)
+        v = is_signed ? (uint64_t)(int64_t)va_arg(*ap, long) : va_arg(*ap, unsigned long);
+    else if (strcmp(sp->len, "z") == 0 || strcmp(sp->len, "t") == 0)
+        v = is_signed ? (uint64_t)(int64_t)va_arg(*ap, ssize_t) : va_arg(*ap, size_t);
+    else if (strcmp(sp->len, "j") == 0)
+        v = is_signed ? (uint64_t)va_arg(*ap, intmax_t) : va_arg(*ap, uintmax_t);
+    else if (strcmp(sp->len, "hh") == 0)
+        v = is_signed ? (uint64_t)(int64_t)(signed char)va_arg(*ap, int) : (unsigned char)va_arg(*ap, unsigned int);
+    else if (strcmp(sp->len, "h") == 0)
+        v = is_signed ? (uint64_t)(int64_t)(short)va_arg(*ap, int) : (unsigned short)va_arg(*ap, unsigned int);
+    else
+        v = is_signed ? (uint64_t)(int64_t)va_arg(*ap, int) : va_arg(*ap, unsigned int);
+    return v;
+}   /* capture_int */
+
+/*
+ * Capture the arguments of the format @fmt in the record @rec.
+ *
+ */
+static void
+capture(struct log_rec *rec, const char *fmt, va_list *ap) {
+    struct spec sp;
+    const char *f = fmt, *s;
+    double d;
+    int n, len, off;
+
+    rec->nargs = 0;
+    rec->text_len = 0;
+    while ((f = strchr(f, '%')) != NULL) {
+        memset(&sp, 0, sizeof(sp));
+        f = parse_spec(f + 1, &sp);
+        if (sp.conv == '%')
+            continue;
+        n = (sp.width == -2) + (sp.prec == -2) + 1;
+        if (rec->nargs + n > LOG_ARGS || sp.conv == 'n' || sp.conv == '\0') {
+            rec->nargs = -1;
+            return;
+        }
+        if (sp.width == -2)
+            rec->args[rec->nargs++] = (uint64_t)(int64_t)va_arg(*ap, int);
+        if (sp.prec == -2) {
+            rec->args[rec->nargs++] = (uint64_t)(int64_t)va_arg(*ap, int);
+            sp.prec = (int)rec->args[rec->nargs - 1];
+        }
+        switch (sp.conv) {
+        case 's':
+            /* copy the string, it may not be terminated beyond the precision */
+            s = va_arg(*ap, const char *);
+            if (s == NULL)
+                s = "(null)";
+            len = (sp.prec >= 0) ? (int)strnlen(s, sp.prec) : (int)strlen(s);
+            /* with the text full the string is the empty one at its end */
+            off = rec->text_len < LOG_TEXT - 1 ? rec->text_len : LOG_TEXT - 1;
+            if (len > LOG_TEXT - 1 - off)
+                len = LOG_TEXT - 1 - off;
+            rec->args[rec->nargs++] = off;
+            memcpy(rec->text + off, s, len);
+            rec->text[off + len] = '\0';
+            rec->text_len = off + len + 1;
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            d = (strcmp(sp.len, "L") == 0) ? (double)va_arg(*ap, long double) : va_arg(*ap, double);
+            memcpy(&rec->args[rec->nargs++], &d, sizeof(d));
+            break;
+        case 'p':
+            rec->args[rec->nargs++] = (uintptr_t)va_arg(*ap, void *);
+            break;
+        case 'c':
+            rec->args[rec->nargs++] = (uint64_t)va_arg(*ap, int);
+            break;
+        default:
+            rec->args[rec->nargs++] = capture_int(&sp, ap);
+            break;
+        }
+    }
+}   /* capture */
+
+/*
+ * Format the record @rec in @out of @cap bytes.
+ *
+ */
+static void
+render(const struct log_rec *rec, char *out, int cap) {
+    struct spec sp;
+    const char *f = rec->fmt, *p;
+    char fs[48], *q;
+    double d;
+    int pos = 0, arg = 0, n;
+
+    while (*f && pos < cap - 1) {
+        if (*f != '%') {
+            out[pos++] = *f++;
+            continue;
+        }
+        memset(&sp, 0, sizeof(sp));
+        p = parse_spec(f + 1, &sp);
+        if (sp.conv == '%') {
+            out[pos++] = '%';
+            f = p;
+            continue;
+        }
+        if (rec->nargs < 0) {
+            /* the arguments could not be captured: write the format as it is */
+            out[pos++] = *f++;
+            continue;
+        }
+        /* rebuild the specification with the '*' values and the largest length modifier */
+        if (sp.width == -2)
+            sp.width = (int)rec->args[arg++];
+        if (sp.prec == -2)
+            sp.prec = (int)rec->args[arg++];
+        q = fs;
+        q += sprintf(q, "%%%s", sp.flags);
+        if (sp.width >= 0)
+            q += sprintf(q, "%d", sp.width);
+        if (sp.prec >= 0)
+            q += sprintf(q, ".%d", sp.prec);
+        switch (sp.conv) {
+        case 's':
+            sprintf(q, "s");
+            n = snprintf(out + pos, cap - pos, fs, rec->text + rec->args[arg++]);
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            sprintf(q, "%c", sp.conv);
+            memcpy(&d, &rec->args[arg++], sizeof(d));
+            n = snprintf(out + pos, cap - pos, fs, d);
+            break;
+        case 'p':
+            sprintf(q, "p");
+            n = snprintf(out + pos, cap - pos, fs, (void *)(uintptr_t)rec->args[arg++]);
+            break;
+        case 'c':
+            sprintf(q, "c");
+            n = snprintf(out + pos, cap - pos, fs, (int)rec->args[arg++]);
+            break;
+        case 'd': case 'i':
+            sprintf(q, "ll%c", sp.conv);
+            n = snprintf(out + pos, cap - pos, fs, (long long)rec->args[arg++]);
+            break;
+        default:
+            sprintf(q, "ll%c", sp.conv);
+            n = snprintf(out + pos, cap - pos, fs, (unsigned long long)rec->args[arg++]);
+            break;
+        }
+        pos += (n < 0) ? 0 : (n < cap - pos ? n : cap - 1 - pos);
+        f = p;
+    }
+    /* the sink adds the end of line */
+    while (pos > 0 && (out[pos - 1] == '\n' || out[pos - 1] == '\r'))
+        pos--;
+    out[pos] = '\0';
+}   /* render */
+
+/*
+ * Write the records of all the rings in time order. Called with drain_lock held.
+ *
+ * The sink is called without rings_lock: it may log, or call the library, and the messages
+ * are written at the next drain. The threads add their rings at the head of the list and
+ * only the drain removes them, so the list taken at the start does not change.
+ *
+ */
+static void
+drain(void) {
+    struct log_ring *r, *min, *list, **pr;
+    const struct log_rec *rec, *first;
+    char line[LOG_LINE];
+    unsigned long drops;
+    cometa_log_cb sink = log_sink ? log_sink : stderr_sink;
+
+    pthread_mutex_lock(&rings_lock);
+    list = rings;
+    pthread_mutex_unlock(&rings_lock);
+    for (r = list; r; r = r->next)
+        r->stop = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+    while (1) {
+        /* the oldest record at the tail of the rings */
+        min = NULL;
+        first = NULL;
+        for (r = list; r; r = r->next) {
+            if (r->tail == r->stop)
+                continue;
+            rec = &r->recs[r->tail % LOG_RING];
+            if (first == NULL || rec->time.tv_sec < first->time.tv_sec ||
+                    (rec->time.tv_sec == first->time.tv_sec && rec->time.tv_nsec < first->time.tv_nsec)) {
+                first = rec;
+                min = r;
+            }
+        }
+        if (min == NULL)
+            break;
+        render(first, line, sizeof(line));
+        sink(log_ctx, first->level, &first->time, line);
+        __atomic_store_n(&min->tail, min->tail + 1, __ATOMIC_RELEASE);
+    }
+    for (r = list; r; r = r->next) {
+        drops = __atomic_load_n(&r->drops, __ATOMIC_RELAXED);
+        if (drops != r->drops_reported) {
+            snprintf(line, sizeof(line), "WARNING: %lu log messages dropped.", drops - r->drops_reported);
+            sink(log_ctx, COMETA_LOG_WARN, NULL, line);
+            r->drops_reported = drops;
+        }
+    }
+
+    /* release the rings of the terminated threads */
+    pthread_mutex_lock(&rings_lock);
+    for (pr = &rings; (r = *pr) != NULL; ) {
+        if (__atomic_load_n(&r->dead, __ATOMIC_ACQUIRE) && r->tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+            *pr = r->next;
+            free(r);
+        } else
+            pr = &r->next;
+    }
+    pthread_mutex_unlock(&rings_lock);
+}   /* drain */
+
+/*
+ * The logging thread.
+ */
+static void *
+log_loop(void *arg) {
+    struct timespec ts;
+
+    while (1) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += LOG_PERIOD * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&wake_lock);
+        pthread_cond_timedwait(&wake_cond, &wake_lock, &ts);
+        pthread_mutex_unlock(&wake_lock);
+
+        pthread_mutex_lock(&drain_lock);
+        drain();
+        pthread_mutex_unlock(&drain_lock);
+    }
+    return NULL;
+}   /* log_loop */
+
+/*
+ * Mark the ring of a terminating thread, it is released when empty.
+ */
+static void
+ring_release(void *arg) {
+    struct log_ring *r = (struct log_ring *)arg;
+
+    __atomic_store_n(&r->dead, 1, __ATOMIC_RELEASE);
+}
+
+#endif
+
+static void
+log_init(void) {
+    const char *env;
+    int i;
+
+#ifndef COMETA_LOG_SYNC
+    pthread_t tid;
+
+    pthread_key_create(&ring_key, ring_release);
+    atexit(cometa_log_flush);
+    if (rt_thread_start(&tid, COMETA_THREAD_LOG, 1, log_loop, NULL) != 0)
+        fprintf(stderr, "ERROR: in log_init. Failed to create the logging thread.\r\n");
+#endif
+
+    if ((env = getenv("COMETA_LOG_LEVEL")) != NULL) {
+        for (i = 0; i <= COMETA_LOG_DEBUG && strcmp(env, level_names[i]) != 0; i++)
+            ;
+        if (i > COMETA_LOG_DEBUG)
+            i = atoi(env);
+        cometa_set_log_level(i);
+    }
+}   /* log_init */
+
+#ifdef COMETA_LOG_SYNC
+/*
+ * Format and write a message in the calling thread.
+ *
+ */
+void
+cometa_log_write(int level, const char *fmt, ...) {
+    cometa_log_cb sink;
+    struct timespec ts;
+    char line[LOG_LINE];
+    va_list ap;
+    int pos;
+
+    /* the messages logged by the sink are dropped */
+    if (in_sink)
+        return;
+    pthread_once(&log_once, log_init);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    va_start(ap, fmt);
+    pos = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (pos < 0)
+        return;
+    if (pos >= (int)sizeof(line))
+        pos = sizeof(line) - 1;
+    /* the sink adds the end of line */
+    while (pos > 0 && (line[pos - 1] == '\n' || line[pos - 1] == '\r'))
+        pos--;
+    line[pos] = '\0';
+
+    pthread_mutex_lock(&drain_lock);
+    sink = log_sink ? log_sink : stderr_sink;
+    in_sink = 1;
+    sink(log_ctx, level, &ts, line);
+    in_sink = 0;
+    pthread_mutex_unlock(&drain_lock);
+}   /* cometa_log_write */
+#else
+/*
+ * Record a message in the ring of the calling thread.
+ *
+ */
+void
+cometa_log_write(int level, const char *fmt, ...) {
+    struct log_ring *r = thread_ring;
+    struct log_rec *rec;
+    unsigned long head;
+    va_list ap;
+
+    if (r == NULL) {
+        /* first message of the thread */
+        pthread_once(&log_once, log_init);
+        if ((r = calloc(1, sizeof(struct log_ring))) == NULL)
+            return;
+        pthread_setspecific(ring_key, r);
+        pthread_mutex_lock(&rings_lock);
+        r->next = rings;
+        rings = r;
+        pthread_mutex_unlock(&rings_lock);
+        thread_ring = r;
+    }
+    head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= LOG_RING) {
+        __atomic_fetch_add(&r->drops, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    rec = &r->recs[head % LOG_RING];
+    clock_gettime(CLOCK_REALTIME, &rec->time);
+    rec->level = level;
+    rec->fmt = fmt;
+    va_start(ap, fmt);
+    capture(rec, fmt, &ap);
+    va_end(ap);
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+    /* wake up the logging thread early on errors or when the ring fills up */
+    if (level == COMETA_LOG_ERROR || head + 1 - __atomic_load_n(&r->tail, __ATOMIC_RELAXED) >= LOG_RING / 2)
+        pthread_cond_signal(&wake_cond);
+}   /* cometa_log_write */
+#endif
+
+/*
+ * Set the log level.
+ *
+ */
+cometa_reply
+cometa_set_log_level(int level) {
+    if (level < COMETA_LOG_NONE || level > COMETA_LOG_DEBUG)
+        return COMETAR_PAR_ERROR;
+    __atomic_store_n(&cometa_log_level, level, __ATOMIC_RELAXED);
+    return COMEATAR_OK;
+}   /* cometa_set_log_level */
+
+/*
+ * Set the sink of the log messages.
+ *
+ */
+cometa_reply
+cometa_set_log_sink(cometa_log_cb cb, void *ctx) {
+    pthread_mutex_lock(&drain_lock);
+#ifndef COMETA_LOG_SYNC
+    /* the pending messages go to the previous sink */
+    drain();
+#endif
+    log_sink = cb;
+    log_ctx = ctx;
+    pthread_mutex_unlock(&drain_lock);
+    return COMEATAR_OK;
+}   /* cometa_set_log_sink */
+
+/*
+ * Write the pending log messages.
+ *
+ */
+void
+cometa_log_flush(void) {
+#ifndef COMETA_LOG_SYNC
+    pthread_mutex_lock(&drain_lock);
+    drain();
+    pthread_mutex_unlock(&drain_lock);
+#endif
+}   /* cometa_log_flush */
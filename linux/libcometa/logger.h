@@ -0,0 +1,54 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file    logger.h
+ *
+ * @brief   Internal logging macros of the library, see logger.c.
+ *
+ * The arguments of a message are evaluated only if its level is enabled. The format must be
+ * a string literal: it is formatted later by the logging thread.
+ *
+ */
+
+#ifndef DEBUG
+#define DEBUG 0
+#endif
+
+/* current log level, COMETA_LOG_* */
+extern int cometa_log_level;
+
+void cometa_log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/* messages above this COMETA_LOG_* level are compiled out, with their format strings */
+#ifndef COMETA_LOG_MAX
+#define COMETA_LOG_MAX  COMETA_LOG_DEBUG
+#endif
+
+#define cometa_log(level, ...) \
+            do { if ((level) <= COMETA_LOG_MAX && (level) <= __atomic_load_n(&cometa_log_level, __ATOMIC_RELAXED)) \
+                    cometa_log_write(level, ##__VA_ARGS__); } while (0)
+
+#define log_error(...)  cometa_log(COMETA_LOG_ERROR, ##__VA_ARGS__)
+#define log_warn(...)   cometa_log(COMETA_LOG_WARN, ##__VA_ARGS__)
+#define log_info(...)   cometa_log(COMETA_LOG_INFO, ##__VA_ARGS__)
+
+/* debugging details, compiled in with DEBUG=1 and logged at COMETA_LOG_DEBUG */
+#define debug_print(...) \
+            do { if (DEBUG) cometa_log(COMETA_LOG_DEBUG, ##__VA_ARGS__); } while (0)
@@ -0,0 +1,263 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file    pool.c
+ *
+ * @brief   Slab pool of the I/O buffers.
+ *
+ * The connections do not own their message buffers: a buffer is taken from the pool while a
+ * message is read, processed or written and it is returned when done, so that an idle connection
+ * holds none. The buffers are in size classes up to POOL_MAX and they are carved from slabs of
+ * about SLAB_BYTES, allocated with the allocator of the library. A slab with all its buffers
+ * returned is kept as spare, up to POOL_SPARE for each class, and released otherwise. With an
+ * arena the slabs are never released and the pool grows to the largest number of buffers in use.
+ *
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "cometa.h"
+#include "alloc.h"
+#include "pool.h"
+#include "realtime.h"
+
+/* size of a slab of the smaller classes */
+#define SLAB_BYTES      8192
+/* fully free slabs kept for each class */
+#define POOL_SPARE      1
+
+struct slab;
+
+/*
+ * Header of a buffer, the buffer follows.
+ */
+struct pbuf {
+    struct slab *slab;
+    struct pbuf *next;          /* next free buffer of the slab */
+} __attribute__((aligned(16)));
+
+/*
+ * A slab of buffers of a class, the buffers follow.
+ */
+struct slab {
+    struct slab *next;          /* slabs of the class with free buffers */
+    struct slab *prev;
+    struct pbuf *free;          /* free buffers */
+    int nfree;
+    int cls;
+} __attribute__((aligned(16)));
+
+static struct pool_class {
+    size_t size;                /* size of the buffers */
+    int per_slab;               /* buffers in a slab */
+    int spare;                  /* slabs with all the buffers free */
+    struct slab *avail;         /* slabs with free buffers, the partially used first */
+    pthread_mutex_t lock;
+} classes[] = {
+    { 512, SLAB_BYTES / 512, 0, NULL, PTHREAD_MUTEX_INITIALIZER },
+    { 2048, SLAB_BYTES / 2048, 0, NULL, PTHREAD_MUTEX_INITIALIZER },
+    { 8192, 1, 0, NULL, PTHREAD_MUTEX_INITIALIZER },
+    { POOL_MAX, 1, 0, NULL, PTHREAD_MUTEX_INITIALIZER },
+};
+
+#define NCLASSES    (int)(sizeof(classes) / sizeof(classes[0]))
+
+/* slabs locked in memory and never released, with the low-latency profile */
+static int locked = 0;
+
+/*
+ * Return the class of the buffers of @size bytes or -1.
+ */
+static int
+class_of(size_t size) {
+    int i;
+
+    for (i = 0; i < NCLASSES; i++)
+        if (size <= classes[i].size)
+            return i;
+    return -1;
+}
+
+static void
+avail_unlink(struct pool_class *c, struct slab *s) {
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        c->avail = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    s->next = s->prev = NULL;
+}
+
+static void
+avail_push(struct pool_class *c, struct slab *s, int tail) {
+    struct slab *t;
+
+    s->next = s->prev = NULL;
+    if (!tail || c->avail == NULL) {
+        s->next = c->avail;
+        if (c->avail)
+            c->avail->prev = s;
+        c->avail = s;
+        return;
+    }
+    for (t = c->avail; t->next; t = t->next)
+        ;
+    t->next = s;
+    s->prev = t;
+}
+
+/*
+ * Allocate a slab of the class @cls.
+ */
+static struct slab *
+slab_new(int cls) {
+    struct pool_class *c = &classes[cls];
+    size_t stride = sizeof(struct pbuf) + c->size;
+    struct slab *s;
+    struct pbuf *b;
+    int i;
+
+    if ((s = cometa_malloc(sizeof(struct slab) + c->per_slab * stride)) == NULL)
+        return NULL;
+    if (locked)
+        rt_lock(s, sizeof(struct slab) + c->per_slab * stride);
+    s->free = NULL;
+    s->nfree = c->per_slab;
+    s->cls = cls;
+    for (i = c->per_slab - 1; i >= 0; i--) {
+        b = (struct pbuf *)((char *)(s + 1) + i * stride);
+        b->slab = s;
+        b->next = s->free;
+        s->free = b;
+    }
+    return s;
+}   /* slab_new */
+
+/*
+ * Take a buffer of at least @size bytes.
+ *
+ * @result the buffer or NULL if too large or out of memory
+ *
+ */
+char *
+pool_get(size_t size) {
+    struct pool_class *c;
+    struct slab *s;
+    struct pbuf *b;
+    int cls;
+
+    if ((cls = class_of(size)) < 0)
+        return NULL;
+    c = &classes[cls];
+    pthread_mutex_lock(&c->lock);
+    if ((s = c->avail) == NULL) {
+        if ((s = slab_new(cls)) == NULL) {
+            pthread_mutex_unlock(&c->lock);
+            return NULL;
+        }
+        avail_push(c, s, 0);
+    } else if (s->nfree == c->per_slab)
+        c->spare--;
+    b = s->free;
+    s->free = b->next;
+    if (--s->nfree == 0)
+        avail_unlink(c, s);
+    pthread_mutex_unlock(&c->lock);
+    return (char *)(b + 1);
+}   /* pool_get */
+
+/*
+ * Return the buffer @buf to the pool, nothing with NULL.
+ *
+ */
+void
+pool_put(char *buf) {
+    struct pbuf *b;
+    struct slab *s;
+    struct pool_class *c;
+
+    if (buf == NULL)
+        return;
+    b = (struct pbuf *)buf - 1;
+    s = b->slab;
+    c = &classes[s->cls];
+    pthread_mutex_lock(&c->lock);
+    b->next = s->free;
+    s->free = b;
+    if (s->nfree++ == 0)
+        avail_push(c, s, 0);
+    if (s->nfree == c->per_slab) {
+        if (c->spare >= POOL_SPARE && !locked && cometa_alloc_reclaims()) {
+            /* release the idle slab */
+            avail_unlink(c, s);
+            cometa_free(s);
+        } else {
+            /* the spare slabs are taken last */
+            avail_unlink(c, s);
+            avail_push(c, s, 1);
+            c->spare++;
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+}   /* pool_put */
+
+/*
+ * Lock in memory the slabs allocated from now on and keep them, with a spare slab of each class
+ * ready, or release the slabs as usual with @on 0.
+ *
+ */
+void
+pool_lock(int on) {
+    struct pool_class *c;
+    struct slab *s;
+    int i;
+
+    locked = on;
+    if (!on)
+        return;
+    for (i = 0; i < NCLASSES; i++) {
+        c = &classes[i];
+        pthread_mutex_lock(&c->lock);
+        for (s = c->avail; s; s = s->next)
+            rt_lock(s, pool_slab_size(c->size));
+        if (c->spare == 0 && (s = slab_new(i)) != NULL) {
+            avail_push(c, s, 1);
+            c->spare++;
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+}   /* pool_lock */
+
+/*
+ * Return the size of the slab holding a buffer of @size bytes, to size an arena.
+ *
+ */
+size_t
+pool_slab_size(size_t size) {
+    int cls = class_of(size);
+
+    if (cls < 0)
+        return 0;
+    return sizeof(struct slab) + classes[cls].per_slab * (sizeof(struct pbuf) + classes[cls].size);
+}   /* pool_slab_size */
@@ -0,0 +1,33 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file    pool.h
+ *
+ * @brief   Internal pool of the I/O buffers shared by the connections, see pool.c.
+ *
+ */
+
+/* largest buffer, a message with its chunk framing */
+#define POOL_MAX        (MESSAGE_LEN + 64)
+
+char *pool_get(size_t size);
+void pool_put(char *buf);
+size_t pool_slab_size(size_t size);
+void pool_lock(int on);
@@ -0,0 +1,60 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file    probes.h
+ *
+ * @brief   USDT probes of the library.
+ *
+ * The probes are static tracepoints for perf, bpftrace or SystemTap, with stable names across builds
+ * and a nop instruction in the code when not traced. They are compiled in on linux when <sys/sdt.h> is
+ * found (systemtap-sdt-dev), unless built with -DCOMETA_NO_USDT. The probes of the provider "cometa" are:
+ *
+ *    frame__receive(handle, size)                   message received from the server
+ *    callback__entry(handle, size)                  message callback invoked
+ *    callback__return(handle, reply)                message callback returned the reply string or NULL
+ *    reply__write(handle, result)                   reply written, bytes written or < 0 on error
+ *    upstream__enqueue(handle, size)                cometa_send() called
+ *    upstream__write(handle, size, result)          upstream message written, result < 0 on error
+ *    heartbeat(handle, result)                      heartbeat written, result < 0 on error
+ *    subscribe__phase(handle, phase, ns)            end of a COMETA_PHASE_* phase and its duration
+ *    subscribe__done(handle, result, ns)            end of a subscription attempt and its duration
+ *    reconnect(handle, cause, backoff_ms)           reconnection attempt after a disconnection
+ *
+ * For instance, with bpftrace:
+ *
+ *    bpftrace -e 'usdt:./libcometa.so.0.1:cometa:callback__entry { @t[tid] = nsecs; }
+ *        usdt:./libcometa.so.0.1:cometa:callback__return /@t[tid]/ { @us = hist((nsecs - @t[tid]) / 1000); delete(@t[tid]); }'
+ *
+ */
+
+#if defined(__linux__) && defined(__has_include) && !defined(COMETA_NO_USDT)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define COMETA_USDT 1
+#endif
+#endif
+
+#ifdef COMETA_USDT
+#define COMETA_PROBE2(name, a, b)       DTRACE_PROBE2(cometa, name, a, b)
+#define COMETA_PROBE3(name, a, b, c)    DTRACE_PROBE3(cometa, name, a, b, c)
+#else
+#define COMETA_PROBE2(name, a, b)       do { } while (0)
+#define COMETA_PROBE3(name, a, b, c)    do { } while (0)
+#endif
@@ -0,0 +1,298 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file    publish.c
+ *
+ * @brief   Statistics page of a connection in a shared file.
+ *
+ * A publisher thread copies periodically the counters, the latency percentiles and the last
+ * subscription timing of a connection in a struct cometa_stats_page mapped from a file, by default
+ * in COMETA_STATS_DIR. The page is protected by a sequence lock: the publisher is the only writer
+ * and the readers, such as cometa-top, map the file read-only and retry their copy when the
+ * sequence was odd or changed. The connection threads are not involved: the publisher reads the
+ * counters and the histograms with the public getters.
+ *
+ * The latency percentiles are of the messages received in the last period, from the difference
+ * between two snapshots of the histograms.
+ *
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "cometa.h"
+#include "logger.h"
+#include "alloc.h"
+#include "realtime.h"
+
+#ifndef COMETA_NO_STATS
+
+static const double percentiles[COMETA_PCT_NUM] = { 50, 90, 99, 100 };
+
+struct publisher {
+    struct publisher *next;
+    struct cometa *handle;
+    char *path;
+    struct cometa_stats_page *page;
+    int period;
+    int stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct cometa_hist last[COMETA_LAT_NUM];   /* histograms at the previous update */
+    struct cometa_hist hist;                    /* scratch snapshot */
+};
+
+/* publishers of the connections */
+static struct publisher *publishers;
+static pthread_mutex_t publishers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Copy in @p->page the statistics of the connection, under the sequence lock.
+ */
+static void
+publish(struct publisher *p) {
+    struct cometa_stats_page *page = p->page;
+    struct cometa_stats stats;
+    struct cometa_subscribe_timing timing;
+    uint64_t lat[COMETA_LAT_NUM][COMETA_PCT_NUM], count[COMETA_LAT_NUM];
+    struct timeval tv;
+    uint32_t seq;
+    int i, j, k;
+
+    /* collect outside of the write section to keep it short */
+    memset(&stats, 0, sizeof(stats));
+    memset(&timing, 0, sizeof(timing));
+    cometa_get_stats(p->handle, &stats);
+    cometa_get_subscribe_timing(p->handle, &timing);
+    for (i = 0; i < COMETA_LAT_NUM; i++) {
+        struct cometa_hist *h = &p->hist, *last = &p->last[i];
+
+        cometa_get_latency(p->handle, i, h);
+        if (h->count < last->count)
+            memset(last, 0, sizeof(*last));     /* cometa_reset_latency() */
+        /* the histogram of the period replaces the last one in the scratch */
+        for (k = 0; k < COMETA_HIST_BUCKETS; k++) {
+            uint64_t b = h->buckets[k];
+
+            h->buckets[k] = b >= last->buckets[k] ? b - last->buckets[k] : 0;
+            last->buckets[k] = b;
+        }
+        count[i] = h->count - last->count;
+        last->count = h->count;
+        h->count = count[i];
+        h->min = 0;
+        h->max = UINT64_MAX;
+        for (j = 0; j < COMETA_PCT_NUM; j++)
+            lat[i][j] = cometa_hist_percentile(h, percentiles[j]);
+    }
+    gettimeofday(&tv, NULL);
+
+    seq = page->seq;
+    __atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    page->period = p->period;
+    page->updated = (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    page->stats = stats;
+    memcpy(page->latency, lat, sizeof(lat));
+    memcpy(page->latency_count, count, sizeof(count));
+    page->subscribe = timing;
+    __atomic_store_n(&page->seq, seq + 2, __ATOMIC_RELEASE);
+}   /* publish */
+
+/*
+ * Publisher thread.
+ */
+static void *
+publish_loop(void *arg) {
+    struct publisher *p = arg;
+    struct timespec ts;
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->stop) {
+        pthread_mutex_unlock(&p->lock);
+        publish(p);
+        pthread_mutex_lock(&p->lock);
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += p->period / 1000;
+        ts.tv_nsec += (long)(p->period % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        while (!p->stop && pthread_cond_timedwait(&p->cond, &p->lock, &ts) != ETIMEDOUT)
+            ;
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}   /* publish_loop */
+
+/*
+ * Stop the publisher @p, remove its file and release it.
+ */
+static void
+publisher_free(struct publisher *p) {
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->thread, NULL);
+
+    munmap(p->page, sizeof(*p->page));
+    unlink(p->path);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond);
+    cometa_free(p->path);
+    cometa_free(p);
+}   /* publisher_free */
+
+/*
+ * Create and map the page file @path.
+ */
+static struct cometa_stats_page *
+page_create(const char *path) {
+    struct cometa_stats_page *page;
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        log_error("ERROR: cannot create the stats page %s: %s\r\n", path, strerror(errno));
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(*page)) < 0) {
+        log_error("ERROR: cannot size the stats page %s: %s\r\n", path, strerror(errno));
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+    page = mmap(NULL, sizeof(*page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        log_error("ERROR: cannot map the stats page %s: %s\r\n", path, strerror(errno));
+        unlink(path);
+        return NULL;
+    }
+    /* the file is zero filled: readers ignore it until the magic is set */
+    page->version = COMETA_STATS_VERSION;
+    page->size = sizeof(*page);
+    page->pid = getpid();
+    __atomic_store_n(&page->magic, COMETA_STATS_MAGIC, __ATOMIC_RELEASE);
+    return page;
+}   /* page_create */
+
+/*
+ * Start, move or stop the publishing of the statistics of the connection in @handle.
+ */
+cometa_reply
+cometa_publish_stats(struct cometa *handle, const char *path, int period_ms) {
+    struct publisher *p, **pp;
+    const char *id = cometa_device_id();
+    char buf[256];
+
+    if (handle == NULL || period_ms < 0)
+        return COMETAR_PAR_ERROR;
+
+    pthread_mutex_lock(&publishers_lock);
+    /* stop the current publisher of the connection */
+    for (pp = &publishers; *pp != NULL; pp = &(*pp)->next) {
+        if ((*pp)->handle == handle) {
+            p = *pp;
+            *pp = p->next;
+            publisher_free(p);
+            break;
+        }
+    }
+    if (period_ms == 0) {
+        pthread_mutex_unlock(&publishers_lock);
+        return COMEATAR_OK;
+    }
+
+    if (path == NULL) {
+        if (id == NULL || id[0] == '\0') {
+            pthread_mutex_unlock(&publishers_lock);
+            return COMETAR_PAR_ERROR;
+        }
+        if (mkdir(COMETA_STATS_DIR, 0755) < 0 && errno != EEXIST) {
+            log_error("ERROR: cannot create %s: %s\r\n", COMETA_STATS_DIR, strerror(errno));
+            pthread_mutex_unlock(&publishers_lock);
+            return COMETAR_ERROR;
+        }
+        snprintf(buf, sizeof(buf), "%s/%s.stats", COMETA_STATS_DIR, id);
+        path = buf;
+    }
+
+    p = cometa_calloc(1, sizeof(*p));
+    if (p == NULL || (p->path = cometa_strdup(path)) == NULL) {
+        cometa_free(p);
+        pthread_mutex_unlock(&publishers_lock);
+        return COMETAR_ERROR;
+    }
+    p->page = page_create(path);
+    if (p->page == NULL) {
+        cometa_free(p->path);
+        cometa_free(p);
+        pthread_mutex_unlock(&publishers_lock);
+        return COMETAR_ERROR;
+    }
+    if (id != NULL)
+        strncpy(p->page->device_id, id, sizeof(p->page->device_id) - 1);
+    p->handle = handle;
+    p->period = period_ms;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    if (rt_thread_start(&p->thread, COMETA_THREAD_TIMER, 0, publish_loop, p) != 0) {
+        log_error("ERROR: cannot create the stats publisher thread.\r\n");
+        munmap(p->page, sizeof(*p->page));
+        unlink(p->path);
+        pthread_mutex_destroy(&p->lock);
+        pthread_cond_destroy(&p->cond);
+        cometa_free(p->path);
+        cometa_free(p);
+        pthread_mutex_unlock(&publishers_lock);
+        return COMETAR_ERROR;
+    }
+    p->next = publishers;
+    publishers = p;
+    pthread_mutex_unlock(&publishers_lock);
+
+    log_info("publishing the statistics in %s every %d ms\r\n", path, period_ms);
+    return COMEATAR_OK;
+}   /* cometa_publish_stats */
+
+#else
+/*
+ * Without statistics.
+ */
+cometa_reply
+cometa_publish_stats(struct cometa *handle, const char *path, int period_ms) {
+    return COMETAR_ERROR;
+}
+#endif  /* COMETA_NO_STATS */
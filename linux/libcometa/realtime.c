@@ -0,0 +1,270 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file    realtime.c
+ *
+ * @brief   Attributes of the library threads and low-latency profile.
+ *
+ * The threads of the library are started with the attributes of their class: scheduling policy
+ * and priority, CPU affinity, stack size and name. A real-time policy needs the privilege to use
+ * it: without, the thread is started with the default scheduling and a warning.
+ *
+ * The low-latency profile locks in memory and prefaults the buffers and the top of the thread
+ * stacks, to avoid the page faults at the first touch, and it sets the socket options for the
+ * lowest latency of the receive path. It applies to the connections opened afterwards.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "cometa.h"
+#include "logger.h"
+#include "pool.h"
+#include "realtime.h"
+
+/* stack prefaulted by a thread at its start */
+#define RT_STACK_PREFAULT   (32 * 1024)
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL        46
+#endif
+
+static const char *thread_names[COMETA_THREAD_NUM] = {
+    "cometa-recv", "cometa-beat", "cometa-send", "cometa-aux", "cometa-log", "cometa-timer",
+    "cometa-lane"
+};
+
+static struct cometa_thread_attr thread_attr[COMETA_THREAD_NUM];
+static pthread_mutex_t rt_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* low-latency profile */
+static int rt_flags_set = 0;
+static int rt_busy_poll = 0;
+
+/*
+ * A thread to start with its name and the profile applied.
+ */
+struct rt_start {
+    void *(*fn)(void *);
+    void *arg;
+    char name[16];          /* name of the thread */
+    int prefault;           /* prefault and lock the top of the stack */
+};
+
+/*
+ * Set the attributes of the threads of the class @which, see cometa.h.
+ *
+ */
+cometa_reply
+cometa_set_thread_attr(int which, const struct cometa_thread_attr *attr) {
+    if (which < 0 || which >= COMETA_THREAD_NUM)
+        return COMETAR_PAR_ERROR;
+    if (attr) {
+        if (attr->policy != SCHED_OTHER && attr->policy != SCHED_FIFO && attr->policy != SCHED_RR)
+            return COMETAR_PAR_ERROR;
+        if (attr->policy != SCHED_OTHER && (attr->priority < sched_get_priority_min(attr->policy) ||
+                attr->priority > sched_get_priority_max(attr->policy)))
+            return COMETAR_PAR_ERROR;
+        if (attr->stack_size != 0 && attr->stack_size < PTHREAD_STACK_MIN)
+            return COMETAR_PAR_ERROR;
+    }
+    pthread_mutex_lock(&rt_mutex);
+    if (attr)
+        thread_attr[which] = *attr;
+    else
+        memset(&thread_attr[which], 0, sizeof(thread_attr[which]));
+    thread_attr[which].name[sizeof(thread_attr[which].name) - 1] = '\0';
+    pthread_mutex_unlock(&rt_mutex);
+    return COMEATAR_OK;
+}   /* cometa_set_thread_attr */
+
+/*
+ * Set the low-latency profile, see cometa.h.
+ *
+ */
+cometa_reply
+cometa_set_low_latency(int flags, int busy_poll_us) {
+    if ((flags & ~(COMETA_LL_MLOCK | COMETA_LL_BUSY_POLL | COMETA_LL_NODELAY)) != 0 ||
+            ((flags & COMETA_LL_BUSY_POLL) && busy_poll_us <= 0))
+        return COMETAR_PAR_ERROR;
+    pthread_mutex_lock(&rt_mutex);
+    rt_flags_set = flags;
+    rt_busy_poll = busy_poll_us;
+    pthread_mutex_unlock(&rt_mutex);
+    /* the pool keeps its slabs prefaulted and locked */
+    pool_lock((flags & COMETA_LL_MLOCK) != 0);
+    return COMEATAR_OK;
+}   /* cometa_set_low_latency */
+
+/*
+ * The COMETA_LL_* flags of the low-latency profile.
+ *
+ */
+int
+rt_flags(void) {
+    return rt_flags_set;
+}   /* rt_flags */
+
+/*
+ * Lock in memory and prefault @size bytes at @mem with COMETA_LL_MLOCK, or only prefault them
+ * if the memory lock limit is exceeded.
+ *
+ */
+void
+rt_lock(void *mem, size_t size) {
+    volatile char *p;
+    size_t i;
+
+    if (!(rt_flags_set & COMETA_LL_MLOCK) || mem == NULL)
+        return;
+    if (mlock(mem, size) == 0)
+        return;
+    /* touch a byte in every page */
+    for (p = mem, i = 0; i < size; i += 4096)
+        p[i] = p[i];
+    p[size - 1] = p[size - 1];
+}   /* rt_lock */
+
+/*
+ * Set the socket options of the low-latency profile on the connection socket @fd.
+ *
+ */
+void
+rt_socket(int fd) {
+    int v;
+
+    if (rt_flags_set & COMETA_LL_NODELAY) {
+        v = 1;
+        if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &v, sizeof(v)) != 0)
+            log_warn("WARNING: cannot set TCP_NODELAY, errno %d.\r\n", errno);
+    }
+    if (rt_flags_set & COMETA_LL_BUSY_POLL) {
+        v = rt_busy_poll;
+        if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &v, sizeof(v)) != 0)
+            log_warn("WARNING: cannot set SO_BUSY_POLL, errno %d.\r\n", errno);
+    }
+}   /* rt_socket */
+
+/*
+ * Run @start with COMETA_LL_MLOCK: the top of the stack is prefaulted and locked.
+ */
+static __attribute__((noinline)) void *
+rt_prefault(const struct rt_start *start) {
+    char stack[RT_STACK_PREFAULT];
+
+    memset(stack, 0, sizeof(stack));
+    mlock(stack, sizeof(stack));
+    /* keep the stack alive across the call */
+    __asm__ __volatile__("" : : "r"(stack) : "memory");
+    return start->fn(start->arg);
+}   /* rt_prefault */
+
+/*
+ * Start of a thread: the thread names itself before running its function.
+ */
+static void *
+rt_thread(void *s) {
+    struct rt_start start = *(struct rt_start *)s;
+
+    pool_put(s);
+#ifdef __linux__
+    pthread_setname_np(pthread_self(), start.name);
+#endif
+    if (start.prefault)
+        return rt_prefault(&start);
+    return start.fn(start.arg);
+}   /* rt_thread */
+
+/*
+ * Start a thread of the class @which, detached or joinable, running @fn with @arg.
+ *
+ * @return 0, ENOMEM or the error of pthread_create()
+ *
+ */
+int
+rt_thread_start(pthread_t *tid, int which, int detached, void *(*fn)(void *), void *arg) {
+    struct cometa_thread_attr ta;
+    struct sched_param param;
+    struct rt_start *start;
+    pthread_attr_t attr;
+    int ret;
+#ifdef __linux__
+    cpu_set_t cpus;
+    int i;
+#endif
+
+    pthread_mutex_lock(&rt_mutex);
+    ta = thread_attr[which];
+    pthread_mutex_unlock(&rt_mutex);
+
+    if ((start = (struct rt_start *)pool_get(sizeof(*start))) == NULL)
+        return ENOMEM;
+    start->fn = fn;
+    start->arg = arg;
+    snprintf(start->name, sizeof(start->name), "%s", ta.name[0] ? ta.name : thread_names[which]);
+    /* the stack is prefaulted by the thread itself */
+    start->prefault = (rt_flags_set & COMETA_LL_MLOCK) && (ta.stack_size == 0 || ta.stack_size > 2 * RT_STACK_PREFAULT);
+
+    pthread_attr_init(&attr);
+    if (detached)
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (ta.stack_size)
+        pthread_attr_setstacksize(&attr, ta.stack_size);
+#ifdef __linux__
+    if (ta.cpus) {
+        CPU_ZERO(&cpus);
+        for (i = 0; i < 64; i++)
+            if (ta.cpus & ((uint64_t)1 << i))
+                CPU_SET(i, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+#endif
+    if (ta.policy != SCHED_OTHER) {
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, ta.policy);
+        param.sched_priority = ta.priority;
+        pthread_attr_setschedparam(&attr, &param);
+    }
+    ret = pthread_create(tid, &attr, rt_thread, start);
+    if (ret == EPERM && ta.policy != SCHED_OTHER) {
+        /* not allowed to use the real-time policy */
+        if (which != COMETA_THREAD_LOG)
+            log_warn("WARNING: real-time scheduling of %s not permitted, using the default.\r\n", thread_names[which]);
+        pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+        ret = pthread_create(tid, &attr, rt_thread, start);
+    }
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        pool_put((char *)start);
+        return ret;
+    }
+    return 0;
+}   /* rt_thread_start */
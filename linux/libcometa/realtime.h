@@ -0,0 +1,30 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file    realtime.h
+ *
+ * @brief   Internal interface of the library threads and of the low-latency profile, see realtime.c.
+ *
+ */
+
+int rt_thread_start(pthread_t *tid, int which, int detached, void *(*fn)(void *), void *arg);
+int rt_flags(void);
+void rt_lock(void *mem, size_t size);
+void rt_socket(int fd);
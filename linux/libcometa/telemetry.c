@@ -0,0 +1,553 @@
+/*
+ * Cometa is a cloud infrastructure for embedded systems and connected
+ * devices developed by Visible Energy, Inc.
+ *
+ * Copyright (C) 2013, 2014 Visible Energy, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * @file    telemetry.c
+ *
+ * @brief   Compact binary encoder for numeric time series sent upstream.
+ *
+ * Samples are collected in a columnar frame that is sent with cometa_send() when full:
+ *
+ *    <0x09><version>
+ *    <nchannels varint><nsamples varint>
+ *    channel table: <type><name length><name> for each channel
+ *    column lengths: <length varint> for the timestamps and for each channel
+ *    timestamps: first timestamp, first delta, then delta-of-delta, as zig-zag varints
+ *    integer channels: first value, then deltas, as zig-zag varints
+ *    float channels: first value as 64 bits, then XOR with the previous value (Gorilla encoding)
+ *
+ * Columns are padded to a byte boundary. All the multi-byte fixed fields are big-endian.
+ *
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "cometa.h"
+#include "alloc.h"
+
+#define TS_VERSION      1
+#define TS_NAME_LEN     32
+#define TS_CHANNELS     255     /* channels of a series, one byte on the wire */
+
+/*
+ * Bit buffer for encoding the columns, MSB first. With @buf NULL only the bits are counted.
+ */
+struct bitbuf {
+    unsigned char *buf;
+    long bits;
+};
+
+/*
+ * Encoding state of a column.
+ */
+struct column {
+    int64_t prev;           /* previous value (or bits of the previous double) */
+    int64_t prev_delta;     /* previous delta of timestamps */
+    int lead;               /* leading zeros of the previous XOR, -1 if none */
+    int trail;              /* trailing zeros of the previous XOR */
+    int n;                  /* number of values */
+};
+
+struct cometa_ts {
+    struct cometa *handle;
+    int nchannels;
+    int max_samples;
+    int max_bytes;
+    int nsamples;
+    unsigned char *types;   /* channel types */
+    char (*names)[TS_NAME_LEN + 1];
+    int64_t *times;         /* timestamps */
+    double *values;         /* values, nchannels per sample */
+    struct column *cols;    /* size estimate state: timestamps and channels */
+    long *bits;             /* size estimate in bits: timestamps and channels */
+    char *frame;            /* encoded frame */
+};
+
+static void
+put_bits(struct bitbuf *b, uint64_t v, int n) {
+    int i;
+
+    if (b->buf) {
+        for (i = n - 1; i >= 0; i--, b->bits++) {
+            if ((v >> i) & 1)
+                b->buf[b->bits >> 3] |= 0x80 >> (b->bits & 7);
+        }
+    } else
+        b->bits += n;
+}
+
+static void
+put_varint(struct bitbuf *b, uint64_t v) {
+    while (v >= 0x80) {
+        put_bits(b, (v & 0x7f) | 0x80, 8);
+        v >>= 7;
+    }
+    put_bits(b, v, 8);
+}
+
+static uint64_t
+zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t
+unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static void
+encode_time(struct bitbuf *b, struct column *c, int64_t t) {
+    int64_t delta;
+
+    if (c->n == 0)
+        put_varint(b, zigzag(t));
+    else {
+        delta = t - c->prev;
+        put_varint(b, zigzag(delta - c->prev_delta));
+        c->prev_delta = delta;
+    }
+    c->prev = t;
+    c->n++;
+}
+
+static void
+encode_int(struct bitbuf *b, struct column *c, int64_t v) {
+    put_varint(b, zigzag(c->n == 0 ? v : v - c->prev));
+    c->prev = v;
+    c->n++;
+}
+
+static void
+encode_float(struct bitbuf *b, struct column *c, double d) {
+    uint64_t bits, x;
+    int lead, trail, sig;
+
+    memcpy(&bits, &d, sizeof(bits));
+    if (c->n == 0) {
+        put_bits(b, bits, 64);
+        c->lead = -1;
+    } else if ((x = bits ^ (uint64_t)c->prev) == 0) {
+        put_bits(b, 0, 1);
+    } else {
+        lead = __builtin_clzll(x);
+        trail = __builtin_ctzll(x);
+        if (lead > 31)
+            lead = 31;
+        put_bits(b, 1, 1);
+        if (c->lead != -1 && lead >= c->lead && trail >= c->trail) {
+            /* the meaningful bits fit in the previous window */
+            put_bits(b, 0, 1);
+            put_bits(b, x >> c->trail, 64 - c->lead - c->trail);
+        } else {
+            sig = 64 - lead - trail;
+            put_bits(b, 1, 1);
+            put_bits(b, lead, 5);
+            put_bits(b, sig - 1, 6);
+            put_bits(b, x >> trail, sig);
+            c->lead = lead;
+            c->trail = trail;
+        }
+    }
+    c->prev = (int64_t)bits;
+    c->n++;
+}
+
+static void
+encode_value(struct bitbuf *b, struct column *c, int type, double v) {
+    if (type == COMETA_TS_FLOAT)
+        encode_float(b, c, v);
+    else
+        encode_int(b, c, (int64_t)(v < 0 ? v - 0.5 : v + 0.5));
+}
+
+static int
+varint_len(uint64_t v) {
+    int n = 1;
+
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+/*
+ * Size of the frame with the current samples.
+ */
+static long
+frame_size(struct cometa_ts *ts, long *bits) {
+    long size;
+    int i;
+
+    size = 2 + varint_len(ts->nchannels) + varint_len(ts->nsamples);
+    for (i = 0; i < ts->nchannels; i++)
+        size += 2 + strlen(ts->names[i]);
+    for (i = 0; i <= ts->nchannels; i++)
+        size += varint_len((bits[i] + 7) / 8) + (bits[i] + 7) / 8;
+    return size;
+}
+
+/*
+ * Create a time series encoder for the connection @handle with @nchannels channels. The frame
+ * is sent upstream when it contains @max_samples samples or when it would exceed @max_bytes.
+ *
+ */
+struct cometa_ts *
+cometa_ts_new(struct cometa *handle, int nchannels, int max_samples, int max_bytes) {
+    struct cometa_ts *ts;
+
+    if (nchannels <= 0 || nchannels > TS_CHANNELS || max_samples <= 0 || max_bytes <= 0 || max_bytes > MESSAGE_LEN - 12)
+        return NULL;
+    if ((ts = cometa_calloc(1, sizeof(struct cometa_ts))) == NULL)
+        return NULL;
+    ts->handle = handle;
+    ts->nchannels = nchannels;
+    ts->max_samples = max_samples;
+    ts->max_bytes = max_bytes;
+    ts->types = cometa_calloc(nchannels, 1);
+    ts->names = cometa_calloc(nchannels, sizeof(*ts->names));
+    ts->times = cometa_calloc(max_samples, sizeof(int64_t));
+    ts->values = cometa_calloc((size_t)max_samples * nchannels, sizeof(double));
+    ts->cols = cometa_calloc(nchannels + 1, sizeof(struct column));
+    ts->bits = cometa_calloc(nchannels + 1, sizeof(long));
+    ts->frame = cometa_malloc(max_bytes);
+    if (!ts->types || !ts->names || !ts->times || !ts->values || !ts->cols || !ts->bits || !ts->frame) {
+        cometa_ts_free(ts);
+        return NULL;
+    }
+    return ts;
+}   /* cometa_ts_new */
+
+/*
+ * Release the encoder. Samples not flushed are discarded.
+ *
+ */
+void
+cometa_ts_free(struct cometa_ts *ts) {
+    if (ts == NULL)
+        return;
+    cometa_free(ts->types);
+    cometa_free(ts->names);
+    cometa_free(ts->times);
+    cometa_free(ts->values);
+    cometa_free(ts->cols);
+    cometa_free(ts->bits);
+    cometa_free(ts->frame);
+    cometa_free(ts);
+}   /* cometa_ts_free */
+
+/*
+ * Set the name and the type of the channel @ch.
+ *
+ */
+cometa_reply
+cometa_ts_channel(struct cometa_ts *ts, int ch, const char *name, int type) {
+    if (ts == NULL || ch < 0 || ch >= ts->nchannels || name == NULL || strlen(name) > TS_NAME_LEN ||
+            (type != COMETA_TS_INT && type != COMETA_TS_FLOAT))
+        return COMETAR_PAR_ERROR;
+    /* the channel table cannot change in the middle of a frame */
+    if (ts->nsamples > 0)
+        return COMETAR_ERROR;
+    strcpy(ts->names[ch], name);
+    ts->types[ch] = type;
+    return COMEATAR_OK;
+}   /* cometa_ts_channel */
+
+/*
+ * Encode the frame in @buf of @size bytes.
+ *
+ * @result the frame length or -1
+ *
+ */
+int
+cometa_ts_encode(struct cometa_ts *ts, char *buf, int size) {
+    struct bitbuf b;
+    struct column c;
+    long len;
+    int i, ch;
+
+    if (frame_size(ts, ts->bits) > size)
+        return -1;
+    memset(buf, 0, size);
+    b.buf = (unsigned char *)buf;
+    b.bits = 0;
+    put_bits(&b, MSG_TIMESERIES, 8);
+    put_bits(&b, TS_VERSION, 8);
+    put_varint(&b, ts->nchannels);
+    put_varint(&b, ts->nsamples);
+    for (ch = 0; ch < ts->nchannels; ch++) {
+        len = strlen(ts->names[ch]);
+        put_bits(&b, ts->types[ch], 8);
+        put_bits(&b, len, 8);
+        for (i = 0; i < len; i++)
+            put_bits(&b, (unsigned char)ts->names[ch][i], 8);
+    }
+    for (ch = 0; ch <= ts->nchannels; ch++)
+        put_varint(&b, (ts->bits[ch] + 7) / 8);
+
+    /* timestamps column */
+    memset(&c, 0, sizeof(c));
+    for (i = 0; i < ts->nsamples; i++)
+        encode_time(&b, &c, ts->times[i]);
+    b.bits = (b.bits + 7) & ~7L;
+    /* channel columns */
+    for (ch = 0; ch < ts->nchannels; ch++) {
+        memset(&c, 0, sizeof(c));
+        for (i = 0; i < ts->nsamples; i++)
+            encode_value(&b, &c, ts->types[ch], ts->values[(size_t)i * ts->nchannels + ch]);
+        b.bits = (b.bits + 7) & ~7L;
+    }
+    return b.bits / 8;
+}   /* cometa_ts_encode */
+
+/*
+ * Send the frame upstream and start a new one.
+ *
+ */
+cometa_reply
+cometa_ts_flush(struct cometa_ts *ts) {
+    cometa_reply ret = COMEATAR_OK;
+    int n;
+
+    if (ts == NULL)
+        return COMETAR_PAR_ERROR;
+    if (ts->nsamples == 0)
+        return COMEATAR_OK;
+    if ((n = cometa_ts_encode(ts, ts->frame, ts->max_bytes)) < 0)
+        ret = COMETAR_ERROR;
+    else if (ts->handle)
+        ret = cometa_send(ts->handle, ts->frame, n);
+    ts->nsamples = 0;
+    memset(ts->cols, 0, (ts->nchannels + 1) * sizeof(struct column));
+    memset(ts->bits, 0, (ts->nchannels + 1) * sizeof(long));
+    return ret;
+}   /* cometa_ts_flush */
+
+/*
+ * Append a sample to the valid encoder @ts, with the saved columns sized by its channels.
+ */
+static cometa_reply
+ts_append(struct cometa_ts *ts, int64_t timestamp, const double *values) {
+    struct bitbuf b;
+    struct column save[ts->nchannels + 1];
+    long bits[ts->nchannels + 1];
+    cometa_reply ret = COMEATAR_OK;
+    int ch;
+
+    /* compute the size of the frame with the new sample */
+    memcpy(save, ts->cols, sizeof(save));
+    memcpy(bits, ts->bits, sizeof(bits));
+    b.buf = NULL;
+    b.bits = 0;
+    encode_time(&b, &ts->cols[0], timestamp);
+    bits[0] += b.bits;
+    for (ch = 0; ch < ts->nchannels; ch++) {
+        b.bits = 0;
+        encode_value(&b, &ts->cols[ch + 1], ts->types[ch], values[ch]);
+        bits[ch + 1] += b.bits;
+    }
+    ts->nsamples++;
+    if (frame_size(ts, bits) > ts->max_bytes) {
+        /* the sample does not fit: send the frame and start a new one with the sample */
+        ts->nsamples--;
+        memcpy(ts->cols, save, sizeof(save));
+        if (ts->nsamples == 0)
+            return COMETAR_PAR_ERROR;
+        ret = cometa_ts_flush(ts);
+        return (cometa_ts_append(ts, timestamp, values) == COMEATAR_OK) ? ret : COMETAR_ERROR;
+    }
+    memcpy(ts->bits, bits, sizeof(bits));
+    ts->times[ts->nsamples - 1] = timestamp;
+    memcpy(&ts->values[(size_t)(ts->nsamples - 1) * ts->nchannels], values, ts->nchannels * sizeof(double));
+
+    if (ts->nsamples == ts->max_samples)
+        ret = cometa_ts_flush(ts);
+    return ret;
+}   /* ts_append */
+
+/*
+ * Append a sample with the @timestamp and one value for each channel in @values.
+ * Values of integer channels are rounded.
+ *
+ */
+cometa_reply
+cometa_ts_append(struct cometa_ts *ts, int64_t timestamp, const double *values) {
+    if (ts == NULL || values == NULL)
+        return COMETAR_PAR_ERROR;
+    return ts_append(ts, timestamp, values);
+}   /* cometa_ts_append */
+
+/** Decoder **/
+
+/*
+ * Bit reader for decoding the columns.
+ */
+struct bitreader {
+    const unsigned char *buf;
+    long bits;
+    long end;
+};
+
+static int
+get_bits(struct bitreader *r, int n, uint64_t *v) {
+    int i;
+
+    if (r->bits + n > r->end)
+        return -1;
+    *v = 0;
+    for (i = 0; i < n; i++, r->bits++)
+        *v = (*v << 1) | ((r->buf[r->bits >> 3] >> (7 - (r->bits & 7))) & 1);
+    return 0;
+}
+
+static int
+get_varint(struct bitreader *r, uint64_t *v) {
+    uint64_t byte;
+    int shift;
+
+    *v = 0;
+    for (shift = 0; shift < 64; shift += 7) {
+        if (get_bits(r, 8, &byte) != 0)
+            return -1;
+        *v |= (byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return 0;
+    }
+    return -1;
+}
+
+static int
+decode_float(struct bitreader *r, struct column *c, double *d) {
+    uint64_t bit, x, lead, sig, bits;
+
+    if (c->n == 0) {
+        if (get_bits(r, 64, &bits) != 0)
+            return -1;
+        c->lead = -1;
+    } else {
+        if (get_bits(r, 1, &bit) != 0)
+            return -1;
+        if (bit == 0)
+            bits = (uint64_t)c->prev;
+        else {
+            if (get_bits(r, 1, &bit) != 0)
+                return -1;
+            if (bit == 0) {
+                if (c->lead == -1 || get_bits(r, 64 - c->lead - c->trail, &x) != 0)
+                    return -1;
+                x <<= c->trail;
+            } else {
+                if (get_bits(r, 5, &lead) != 0 || get_bits(r, 6, &sig) != 0)
+                    return -1;
+                sig++;
+                if (lead + sig > 64 || get_bits(r, sig, &x) != 0)
+                    return -1;
+                c->lead = lead;
+                c->trail = 64 - lead - sig;
+                x <<= c->trail;
+            }
+            bits = (uint64_t)c->prev ^ x;
+        }
+    }
+    c->prev = (int64_t)bits;
+    c->n++;
+    memcpy(d, &bits, sizeof(*d));
+    return 0;
+}
+
+/*
+ * Decode the frame in @buf of @len bytes and call @cb for each sample.
+ *
+ * @result the number of samples or -1 if the frame is not valid
+ *
+ */
+int
+cometa_ts_decode(const char *buf, int len, cometa_ts_sample_cb cb, void *ctx) {
+    struct bitreader h, cr[TS_CHANNELS + 1];
+    struct column cols[TS_CHANNELS + 1];
+    unsigned char types[TS_CHANNELS];
+    double values[TS_CHANNELS];
+    uint64_t nch, ns, v, name_len, col_len;
+    long pos;
+    int i, ch, ret = -1;
+
+    h.buf = (const unsigned char *)buf;
+    h.bits = 0;
+    h.end = (long)len * 8;
+    if (get_bits(&h, 8, &v) != 0 || v != MSG_TIMESERIES || get_bits(&h, 8, &v) != 0 || v != TS_VERSION)
+        return -1;
+    if (get_varint(&h, &nch) != 0 || get_varint(&h, &ns) != 0 || nch == 0 || nch > TS_CHANNELS)
+        return -1;
+    memset(cols, 0, (nch + 1) * sizeof(struct column));
+    /* channel table, names are skipped */
+    for (ch = 0; ch < (int)nch; ch++) {
+        if (get_bits(&h, 8, &v) != 0 || get_bits(&h, 8, &name_len) != 0)
+            goto done;
+        types[ch] = v;
+        h.bits += name_len * 8;
+    }
+    /* a reader for each column */
+    pos = 0;
+    for (ch = 0; ch <= (int)nch; ch++) {
+        if (get_varint(&h, &col_len) != 0)
+            goto done;
+        cr[ch].buf = h.buf;
+        cr[ch].bits = pos;
+        cr[ch].end = pos + col_len * 8;
+        pos = cr[ch].end;
+    }
+    for (ch = 0; ch <= (int)nch; ch++) {
+        cr[ch].bits += h.bits;
+        cr[ch].end += h.bits;
+        if (cr[ch].end > (long)len * 8)
+            goto done;
+    }
+
+    for (i = 0; i < (int)ns; i++) {
+        /* timestamp */
+        if (get_varint(&cr[0], &v) != 0)
+            goto done;
+        if (cols[0].n == 0)
+            cols[0].prev = unzigzag(v);
+        else {
+            cols[0].prev_delta += unzigzag(v);
+            cols[0].prev += cols[0].prev_delta;
+        }
+        cols[0].n++;
+        /* values */
+        for (ch = 0; ch < (int)nch; ch++) {
+            if (types[ch] == COMETA_TS_FLOAT) {
+                if (decode_float(&cr[ch + 1], &cols[ch + 1], &values[ch]) != 0)
+                    goto done;
+            } else {
+                if (get_varint(&cr[ch + 1], &v) != 0)
+                    goto done;
+                cols[ch + 1].prev = (cols[ch + 1].n++ == 0) ? unzigzag(v) : cols[ch + 1].prev + unzigzag(v);
+                values[ch] = (double)cols[ch + 1].prev;
+            }
+        }
+        if (cb)
+            cb(ctx, cols[0].prev, values, nch);
+    }
+    ret = ns;
+done:
+    return ret;
+}   /* cometa_ts_decode */